@@ -122,13 +122,13 @@ static cc_asm_register_t cc_asm_find_used(cc_asm_state_t *as, cc_ssa_argument_t
 static void cc_asm_write_raw_data(cc_asm_state_t *as, cc_raw_data_view_t raw) {
     size_t i = 0;
     for (; i + sizeof(uint64_t) <= raw.len; i += sizeof(uint64_t))
-        cc_asm_write(as, "\t.quad %016" PRIx64 "\n", *(uint64_t const *)(as->state->raw_data + raw.pos + i));
+        cc_asm_write(as, "\t.quad 0x%016" PRIx64 "\n", *(uint64_t const *)(as->state->raw_data + raw.pos + i));
     for (; i + sizeof(uint32_t) <= raw.len; i += sizeof(uint32_t))
-        cc_asm_write(as, "\t.long %08" PRIx32 "\n", *(uint32_t const *)(as->state->raw_data + raw.pos + i));
+        cc_asm_write(as, "\t.long 0x%08" PRIx32 "\n", *(uint32_t const *)(as->state->raw_data + raw.pos + i));
     for (; i + sizeof(uint16_t) <= raw.len; i += sizeof(uint16_t))
-        cc_asm_write(as, "\t.word %04" PRIx16 "\n", *(uint16_t const *)(as->state->raw_data + raw.pos + i));
+        cc_asm_write(as, "\t.word 0x%04" PRIx16 "\n", *(uint16_t const *)(as->state->raw_data + raw.pos + i));
     for (; i + sizeof(uint8_t) <= raw.len; i += sizeof(uint8_t))
-        cc_asm_write(as, "\t.byte %02" PRIx8 "\n", *(uint8_t const *)(as->state->raw_data + raw.pos + i));
+        cc_asm_write(as, "\t.byte 0x%02" PRIx8 "\n", *(uint8_t const *)(as->state->raw_data + raw.pos + i));
 }
 
 static void cc_asm_generic_binop(cc_asm_state_t *as, cc_ssa_function_t *func, size_t offset, const char *insn) {
@@ -1,4 +1,3 @@
-#include <ctype.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <stdint.h>
@@ -10,17 +9,52 @@
 #include <fcntl.h>
 #include <sys/mman.h>
 #include <sys/stat.h>
+#include <pthread.h>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
 #include "isa.h"
+#include "xmsim.h"
+#include "xmobj.h"
+#include "xmmap.h"
 
 #define OUT_MAX_SIZE (INT32_MAX)
-#define LIST_MAX_SIZE (65536)
+/* Input that can't be mapped, a pipe, is read into a reservation this big */
+#define IN_MAX_SIZE (INT32_MAX)
+#define IN_CHUNK_SIZE (1 << 16)
+/* Mapped input this big is split at line boundaries, chunks of at least
+    PARALLEL_CHUNK_SIZE get encoded by their own thread */
+#define PARALLEL_MIN_SIZE (1 << 20)
+#define PARALLEL_CHUNK_SIZE (1 << 18)
+#define PARALLEL_MAX_JOBS 64
+/* Reserved up front, only what's used gets committed */
+#define LIST_MAX_SIZE (1 << 30)
+#define NAMES_MAX_SIZE (1 << 30)
 
-#define LABEL_NAME_SIZE 16
+/* Mnemonic hash, a power of two at least twice XM_INST_TABLE_COUNT */
+#define INST_HASH_SIZE 256
+/* A literal pool is placed after the next unconditional jump or return,
+    or jumped over once the first load using it is this far back */
+#define POOL_REACH 1024
+#define POOL_MAX_SIZE 256
+
+enum asm_section_id {
+    SECTION_TEXT,
+    SECTION_DATA,
+    SECTION_COUNT
+};
+
+static const char *const asm_section_names[SECTION_COUNT] = {".text", ".data"};
+
+struct asm_name {
+    const char *p;
+    size_t len;
+};
 
 struct asm_operand {
     union {
         long long i;
-        char name[LABEL_NAME_SIZE];
+        struct asm_name name; /* Into the line */
     } data;
     enum {
         OP_INVALID,
@@ -32,34 +66,100 @@ struct asm_operand {
         OP_IMM,
         OP_LABEL,
         OP_COND,
+        OP_LITERAL, /* =value, from a literal pool */
     } type;
 };
 
 typedef struct asm_state {
     char *in;
     size_t in_len;
+    size_t in_done; /* Lines before this are assembled */
+    uint32_t line; /* Of the one being assembled, from 1 */
+    size_t in_map_len;
+    bool in_stream;
+    /* Of the current section, the others wait in sections */
     char *out;
     size_t out_len;
+    struct asm_section {
+        char *out;
+        size_t out_len;
+        uint32_t pc;
+        uint32_t align;
+        /* Source line of what's emitted from each pc on, for the map */
+        struct asm_line {
+            uint32_t pc;
+            uint32_t line; /* 0 for none */
+            bool data;
+        } *lines;
+        size_t n_lines;
+        size_t cap_lines;
+    } sections[SECTION_COUNT];
+    enum asm_section_id section;
 
+    /* Labels get interned when defined or first referenced, a fixup holds
+        the index of its label */
     struct asm_label {
-        char name[LABEL_NAME_SIZE];
+        const char *name; /* Into names */
+        uint32_t len;
+        uint32_t hash;
         uint32_t pc;
+        bool defined;
+        bool global;
+        uint8_t section;
     } *labels;
     size_t n_labels;
+    char *names;
+    size_t names_len;
+    /* Open addressing, label index + 1, 0 for a free slot */
+    uint32_t *label_hash;
+    size_t label_hash_size;
 
     struct asm_fixup {
-        char name[LABEL_NAME_SIZE];
+        uint32_t label;
         enum asm_fixup_type {
             FIXUP_NONE,
             /* Relative offset 16, size 8 */
             FIXUP_REL_O16S8,
+            /* Relative offset 8, size 16, big endian */
+            FIXUP_REL_O8S16,
+            /* Absolute offset 8, size 16, big endian */
+            FIXUP_ABS_O8S16,
+            /* Absolute offset 0, size 32, big endian */
+            FIXUP_ABS_O0S32,
+            /* The address load of asm_load_address */
+            FIXUP_ADDR,
         } type;
         uint32_t pc;
         uint32_t offset;
+        uint8_t section;
     } *fixups;
     size_t n_fixups;
 
     uint32_t pc;
+    unsigned jobs;
+    bool object; /* Write a relocatable object instead of an image */
+    bool chunk; /* One of several assembled in parallel */
+    bool positional; /* Saw what depends on the code before it, the chunk is void */
+    uint32_t text_align; /* Largest .align in .text */
+    bool optimise; /* -O, the peephole pass */
+    const char *profile; /* -profile, for the block layout */
+    const char *source; /* Input path as the map names it */
+    char *map; /* Path of the map written next to an image, NULL for none */
+    /* Data put in .text, which -O and -profile leave alone */
+    struct asm_range {
+        uint32_t pc;
+        uint32_t len;
+    } *raw;
+    size_t n_raw;
+    size_t cap_raw;
+
+    /* Literals waiting to be placed, each with its label */
+    struct asm_literal {
+        uint32_t value;
+        uint32_t label;
+    } pool[POOL_MAX_SIZE];
+    size_t n_pool;
+    uint32_t pool_pc; /* Of the first load from it */
 
     int fd_in;
     int fd_out;
@@ -70,286 +170,1874 @@ typedef struct asm_state {
         (void)fprintf(stderr, __FILE__ ": " #c " " __VA_ARGS__), (void)fprintf(stderr, "\n"); \
     while (0);
 
-static struct asm_operand asm_parse_asm_operand(const char *p) {
+static bool asm_is_space(char c) {
+    return c == ' ' || c == '\t' || c == '\v' || c == '\f';
+}
+
+/* atoll over [p, end), 0x for hex */
+static long long asm_parse_int(const char *p, const char *end) {
+    unsigned long long v = 0;
+    bool neg = false;
+    while (p < end && asm_is_space(*p)) ++p;
+    if (p < end && (*p == '-' || *p == '+'))
+        neg = *p++ == '-';
+    if (end - p > 2 && p[0] == '0' && (p[1] == 'x' || p[1] == 'X')) {
+        for (p += 2; p < end; ++p) {
+            if (*p >= '0' && *p <= '9')
+                v = v * 16 + (unsigned)(*p - '0');
+            else if ((*p | 0x20) >= 'a' && (*p | 0x20) <= 'f')
+                v = v * 16 + (unsigned)((*p | 0x20) - 'a' + 10);
+            else
+                break;
+        }
+    } else
+        for (; p < end && *p >= '0' && *p <= '9'; ++p)
+            v = v * 10 + (unsigned)(*p - '0');
+    return neg ? -(long long)v : (long long)v;
+}
+
+/* Whether [p, end) starts with the len characters of s */
+static bool asm_prefix(const char *p, const char *end, const char *s, size_t len) {
+    return (size_t)(end - p) >= len && memcmp(p, s, len) == 0;
+}
+
+static struct asm_operand asm_parse_asm_operand(const char *p, const char *end) {
     struct asm_operand op = {0};
-    if (*p == '$' && p[1] == 'c' && p[2] == 'r') {
+    if (asm_prefix(p, end, "$cr", 3)) {
         op.type = OP_CONTROL_REG;
-        op.data.i = atoll(p + 3);
-    } else if (*p == '$' && p[1] == 't' && p[2] == 'm') {
+        op.data.i = asm_parse_int(p + 3, end);
+    } else if (asm_prefix(p, end, "$tm", 3)) {
         op.type = OP_TILE_REG;
-        op.data.i = atoll(p + 3);
-    } else if (*p == '?') {
+        op.data.i = asm_parse_int(p + 3, end);
+    } else if (p < end && *p == '?') {
         op.type = OP_COND;
         ++p;
-        if (*p == '!') op.data.i |= 0x01, ++p;
-        if (*p == 'n') op.data.i |= 0x02, ++p;
-        if (*p == 'z') op.data.i |= 0x04, ++p;
-        if (*p == 'c') op.data.i |= 0x08, ++p;
+        if (p < end && *p == '!') op.data.i |= 0x01, ++p;
+        if (p < end && *p == 'n') op.data.i |= 0x02, ++p;
+        if (p < end && *p == 'z') op.data.i |= 0x04, ++p;
+        if (p < end && *p == 'c') op.data.i |= 0x08, ++p;
 
         /* g = !(C | Z) */
-        if (*p == 'g') op.data.i |= 0x08 | 0x04 | 0x01, ++p;
+        if (p < end && *p == 'g') op.data.i |= 0x08 | 0x04 | 0x01, ++p;
         /* l = C */
-        if (*p == 'l') op.data.i |= 0x08, ++p;
+        if (p < end && *p == 'l') op.data.i |= 0x08, ++p;
         /* e = Z */
-        if (*p == 'e') op.data.i |= 0x04, ++p;
+        if (p < end && *p == 'e') op.data.i |= 0x04, ++p;
     /* Stack pointer */
-    } else if (*p == '$' && p[1] == 's' && p[2] == 'p') {
+    } else if (asm_prefix(p, end, "$sp", 3)) {
         op.type = OP_REG;
         op.data.i = XM_ABI_SP;
     /* Base pointer */
-    } else if (*p == '$' && p[1] == 'b' && p[2] == 'p') {
+    } else if (asm_prefix(p, end, "$bp", 3)) {
         op.type = OP_REG;
         op.data.i = XM_ABI_BP;
     /* Thread pointer */
-    } else if (*p == '$' && p[1] == 't' && p[2] == 'p') {
+    } else if (asm_prefix(p, end, "$tp", 3)) {
         op.type = OP_REG;
         op.data.i = XM_ABI_TP;
     /* Return pointer */
-    } else if (*p == '$' && p[1] == 'r' && p[2] == 'a') {
+    } else if (asm_prefix(p, end, "$ra", 3)) {
         op.type = OP_REG;
         op.data.i = XM_ABI_RA;
     /* aliases */
-    } else if (*p == '$' && p[1] == 't') {
+    } else if (asm_prefix(p, end, "$t", 2)) {
         op.type = OP_REG;
-        op.data.i = atoll(p + 2) + XM_ABI_T0;
+        op.data.i = asm_parse_int(p + 2, end) + XM_ABI_T0;
         ASM_ERROR_IF(op.data.i < XM_ABI_T0 || op.data.i > XM_ABI_T7);
-    } else if (*p == '$' && p[1] == 'a') {
+    } else if (asm_prefix(p, end, "$a", 2)) {
         op.type = OP_REG;
-        op.data.i = atoll(p + 2) + XM_ABI_A0;
+        op.data.i = asm_parse_int(p + 2, end) + XM_ABI_A0;
         ASM_ERROR_IF(op.data.i < XM_ABI_A0 || op.data.i > XM_ABI_A3);
     /* Special regs */
-    } else if (*p == '$' && p[1] == 'r') {
+    } else if (asm_prefix(p, end, "$r", 2)) {
         op.type = OP_REG;
-        op.data.i = atoll(p + 2);
-    } else if (*p == '$' && p[1] == 'v') {
+        op.data.i = asm_parse_int(p + 2, end);
+    } else if (asm_prefix(p, end, "$v", 2)) {
         op.type = OP_VECTOR_REG;
-        op.data.i = atoll(p + 2);
-    } else if (*p == '$' && p[1] == 'f') {
+        op.data.i = asm_parse_int(p + 2, end);
+    } else if (asm_prefix(p, end, "$f", 2)) {
         op.type = OP_FLOAT_REG;
-        op.data.i = atoll(p + 2);
-    } else if (isdigit(*p) || *p == '-') {
+        op.data.i = asm_parse_int(p + 2, end);
+    } else if (p < end && ((*p >= '0' && *p <= '9') || *p == '-')) {
         op.type = OP_IMM;
-        op.data.i = atoll(p);
+        op.data.i = asm_parse_int(p, end);
+    } else if (p < end && *p == '=') {
+        op.type = OP_LITERAL;
+        op.data.i = asm_parse_int(p + 1, end);
     } else {
         op.type = OP_LABEL;
-        strcpy(op.data.name, p);
+        op.data.name.p = p;
+        op.data.name.len = (size_t)(end - p);
     }
     return op;
 }
 
-static uint32_t asm_firstpass(asm_state_t* state, char const *name, struct asm_operand const op[]) {
+/* FNV-1a */
+static uint32_t asm_hash(const char *p, size_t len) {
+    uint32_t h = 2166136261u;
+    for (size_t i = 0; i < len; ++i)
+        h = (h ^ (uint8_t)p[i]) * 16777619u;
+    return h;
+}
+
+/* xm_inst_table index + 1 by mnemonic, 0 for a free slot. Built once,
+    C can't hash the names of XM_INST_LIST at compile time. */
+static uint8_t asm_inst_hash[INST_HASH_SIZE];
+
+static void asm_inst_hash_init(void) {
+    _Static_assert(XM_INST_TABLE_COUNT * 2 <= INST_HASH_SIZE, "INST_HASH_SIZE too small");
     for (size_t i = 0; i < XM_INST_TABLE_COUNT; ++i) {
-        bool match = strcmp(name, xm_inst_table[i].name) == 0;
-        uint8_t ob[8] = {0}, oc = 0;
-        if (match && xm_inst_table[i].format == XM_FORMAT_R4R4I8O8_IFHBS) {
-            ASM_ERROR_IF(op[0].type != OP_REG);
-            ASM_ERROR_IF(op[1].type != OP_REG);
-            ob[0] = XM_CB_INTEGER;
-            ob[1] = (op[0].data.i & 0x0f) | ((op[1].data.i & 0x0f) << 4);
-            ob[3] = xm_inst_table[i].op & 0xff;
-            if (op[2].type == OP_IMM) {
-                /* Rd(4) Ra(4) Imm(8) Opcode(8) */
-                ob[2] = op[2].data.i & 0xff;
-                ob[3] |= 0x80;
-            } else {
-                /* Rd(4) Ra(4) Rb(4) Imm(4) Opcode(8) */
-                ASM_ERROR_IF(op[2].type != OP_REG);
-                ob[2] = (op[2].data.i & 0x0f)
-                    | ((op[3].data.i & 0x0f) << 4);
+        uint32_t h = asm_hash(xm_inst_table[i].name, strlen(xm_inst_table[i].name));
+        while (asm_inst_hash[h % INST_HASH_SIZE] != 0)
+            ++h;
+        asm_inst_hash[h % INST_HASH_SIZE] = (uint8_t)(i + 1);
+    }
+}
+
+/* Index into xm_inst_table, XM_INST_TABLE_COUNT if there's no such one */
+static size_t asm_find_inst(struct asm_name name) {
+    for (uint32_t h = asm_hash(name.p, name.len); asm_inst_hash[h % INST_HASH_SIZE] != 0; ++h) {
+        size_t i = asm_inst_hash[h % INST_HASH_SIZE] - 1;
+        if (strncmp(xm_inst_table[i].name, name.p, name.len) == 0 && xm_inst_table[i].name[name.len] == '\0')
+            return i;
+    }
+    return XM_INST_TABLE_COUNT;
+}
+
+/* Index of the label with hash h, added undefined if it's new */
+static uint32_t asm_intern_label_hashed(asm_state_t* state, struct asm_name name, uint32_t h) {
+    uint32_t slot;
+    if ((state->n_labels + 1) * 2 > state->label_hash_size) {
+        size_t size = state->label_hash_size ? state->label_hash_size * 2 : 1024;
+        uint32_t *t = calloc(size, sizeof(*t));
+        ASM_ERROR_IF(t == NULL);
+        for (size_t i = 0; i < state->n_labels; ++i) {
+            for (slot = state->labels[i].hash; t[slot % size] != 0; ++slot)
+                ;
+            t[slot % size] = (uint32_t)i + 1;
+        }
+        free(state->label_hash);
+        state->label_hash = t;
+        state->label_hash_size = size;
+    }
+    for (slot = h; state->label_hash[slot % state->label_hash_size] != 0; ++slot) {
+        struct asm_label *l = &state->labels[state->label_hash[slot % state->label_hash_size] - 1];
+        if (l->hash == h && l->len == name.len && memcmp(l->name, name.p, name.len) == 0)
+            return state->label_hash[slot % state->label_hash_size] - 1;
+    }
+    state->label_hash[slot % state->label_hash_size] = (uint32_t)state->n_labels + 1;
+    memcpy(state->names + state->names_len, name.p, name.len);
+    state->labels[state->n_labels] = (struct asm_label){state->names + state->names_len, (uint32_t)name.len, h, 0,
+        false, false, SECTION_TEXT};
+    state->names_len += name.len;
+    return (uint32_t)state->n_labels++;
+}
+
+static uint32_t asm_intern_label(asm_state_t* state, struct asm_name name) {
+    return asm_intern_label_hashed(state, name, asm_hash(name.p, name.len));
+}
+
+/* A label without a name, for literals and added jumps */
+static uint32_t asm_new_label(asm_state_t* state) {
+    state->labels[state->n_labels] = (struct asm_label){state->names + state->names_len, 0, 0, 0,
+        false, false, SECTION_TEXT};
+    return (uint32_t)state->n_labels++;
+}
+
+static void asm_add_fixup_label(asm_state_t* state, enum asm_fixup_type type, uint32_t label) {
+    state->fixups[state->n_fixups].type = type;
+    state->fixups[state->n_fixups].pc = state->pc;
+    state->fixups[state->n_fixups].offset = state->out_len;
+    state->fixups[state->n_fixups].label = label;
+    state->fixups[state->n_fixups].section = (uint8_t)state->section;
+    ++state->n_fixups;
+}
+
+static void asm_add_fixup(asm_state_t* state, enum asm_fixup_type type, struct asm_name name) {
+    asm_add_fixup_label(state, type, asm_intern_label(state, name));
+}
+
+static bool asm_name_is(struct asm_name name, const char *s) {
+    return name.len == strlen(s) && memcmp(name.p, s, name.len) == 0;
+}
+
+static uint8_t asm_inst_op(const char *name) {
+    return xm_inst_table[asm_find_inst((struct asm_name){name, strlen(name)})].op;
+}
+
+/* Appends to the current section */
+static void asm_emit(asm_state_t* state, const void *p, size_t n) {
+    if ((state->optimise || state->profile != NULL) && state->section == SECTION_TEXT && n != 0) {
+        struct asm_range *last = state->n_raw != 0 ? &state->raw[state->n_raw - 1] : NULL;
+        if (last != NULL && last->pc + last->len == state->pc)
+            last->len += (uint32_t)n;
+        else {
+            if (state->n_raw == state->cap_raw) {
+                size_t cap = state->cap_raw ? state->cap_raw * 2 : 64;
+                struct asm_range *raw = realloc(state->raw, cap * sizeof(*raw));
+                ASM_ERROR_IF(raw == NULL);
+                if (raw == NULL)
+                    abort();
+                state->raw = raw;
+                state->cap_raw = cap;
             }
-            oc = 4;
-        } else if (match && xm_inst_table[i].format == XM_FORMAT_U16O8) {
-            ob[0] = XM_CB_INTEGER;
-            ob[1] = ob[2] = 0;
-            ob[3] = xm_inst_table[i].op;
-            oc = 4;
-        } else if (match && xm_inst_table[i].format == XM_FORMAT_R4U4RA8O8) {
-            ASM_ERROR_IF(op[0].type != OP_REG);
-            ASM_ERROR_IF(op[1].type != OP_IMM && op[1].type != OP_LABEL);
-            ASM_ERROR_IF(op[2].type != OP_COND);
-            ob[0] = XM_CB_INTEGER;
-            ob[1] = op[0].data.i & 0x0f | (op[2].data.i << 4);
-            ob[2] = op[1].data.i & 0xff;
-            ob[3] = xm_inst_table[i].op;
-            oc = 4;
-            if (op[1].type == OP_LABEL) {
-                state->fixups[state->n_fixups].type = FIXUP_REL_O16S8;
-                state->fixups[state->n_fixups].pc = state->pc;
-                state->fixups[state->n_fixups].offset = state->out_len;
-                strcpy(state->fixups[state->n_fixups].name, op[1].data.name);
-                ++state->n_fixups;
+            state->raw[state->n_raw++] = (struct asm_range){state->pc, (uint32_t)n};
+        }
+    }
+    memcpy(state->out + state->out_len, p, n);
+    state->out_len += n;
+    state->pc += (uint32_t)n;
+}
+
+static void asm_add_line(struct asm_section* sec, struct asm_line line) {
+    if (sec->n_lines == sec->cap_lines) {
+        size_t cap = sec->cap_lines ? sec->cap_lines * 2 : 256;
+        struct asm_line *lines = realloc(sec->lines, cap * sizeof(*lines));
+        ASM_ERROR_IF(lines == NULL);
+        if (lines == NULL)
+            abort();
+        sec->lines = lines;
+        sec->cap_lines = cap;
+    }
+    sec->lines[sec->n_lines++] = line;
+}
+
+/* What the current section gets from here on comes from line */
+static void asm_mark_line(asm_state_t* state, uint32_t line, bool data) {
+    struct asm_section *sec = &state->sections[state->section];
+    struct asm_line *last = sec->n_lines != 0 ? &sec->lines[sec->n_lines - 1] : NULL;
+    if (last != NULL && last->pc == state->pc)
+        --sec->n_lines; /* Nothing came of it */
+    last = sec->n_lines != 0 ? &sec->lines[sec->n_lines - 1] : NULL;
+    if (last == NULL || last->line != line || last->data != data)
+        asm_add_line(sec, (struct asm_line){state->pc, line, data});
+}
+
+/* Drops the lines left with nothing after code moved, and repeats */
+static void asm_tidy_lines(struct asm_section* sec) {
+    size_t n = 0;
+    for (size_t i = 0; i < sec->n_lines; ++i) {
+        struct asm_line l = sec->lines[i];
+        if (i + 1 < sec->n_lines && sec->lines[i + 1].pc == l.pc)
+            continue;
+        if (n == 0 || sec->lines[n - 1].line != l.line || sec->lines[n - 1].data != l.data)
+            sec->lines[n++] = l;
+    }
+    sec->n_lines = n;
+}
+
+/* size big endian bytes of value, as loads read them */
+static void asm_emit_int(asm_state_t* state, unsigned long long value, size_t size) {
+    uint8_t b[8];
+    for (size_t i = 0; i < size; ++i)
+        b[i] = (uint8_t)(value >> (8 * (size - 1 - i)));
+    asm_emit(state, b, size);
+}
+
+static void asm_select_section(asm_state_t* state, enum asm_section_id id) {
+    struct asm_section *cur = &state->sections[state->section];
+    cur->out = state->out;
+    cur->out_len = state->out_len;
+    cur->pc = state->pc;
+    state->section = id;
+    state->out = state->sections[id].out;
+    state->out_len = state->sections[id].out_len;
+    state->pc = state->sections[id].pc;
+}
+
+/* Places the pending literals here, behind a jmprel over them unless the
+    code before never falls through */
+static void asm_flush_pool(asm_state_t* state, bool jump) {
+    static const uint8_t zero[4];
+    uint32_t pad = (4 - state->pc % 4) % 4;
+    if (state->n_pool == 0)
+        return;
+    if (jump) {
+        uint32_t rela = 4 + pad + 4 * (uint32_t)state->n_pool;
+        uint8_t ob[4] = {XM_CB_INTEGER, (uint8_t)(rela >> 8), (uint8_t)rela, asm_inst_op("jmprel")};
+        asm_mark_line(state, 0, false);
+        asm_emit(state, ob, sizeof(ob));
+    }
+    asm_mark_line(state, 0, true);
+    asm_emit(state, zero, pad);
+    for (size_t i = 0; i < state->n_pool; ++i) {
+        struct asm_label *l = &state->labels[state->pool[i].label];
+        l->pc = state->pc;
+        l->defined = true;
+        asm_emit_int(state, state->pool[i].value, 4);
+    }
+    state->n_pool = 0;
+}
+
+/* Label of value in the pending pool, identical ones share it */
+static uint32_t asm_pool_add(asm_state_t* state, uint32_t value) {
+    for (size_t i = 0; i < state->n_pool; ++i)
+        if (state->pool[i].value == value)
+            return state->pool[i].label;
+    if (state->n_pool == POOL_MAX_SIZE)
+        asm_flush_pool(state, true);
+    if (state->n_pool == 0)
+        state->pool_pc = state->pc;
+    state->pool[state->n_pool] = (struct asm_literal){value, asm_new_label(state)};
+    return state->pool[state->n_pool++].label;
+}
+
+/* ldb/ldw/ldl/ldq/lea $rD,label or =literal, with no pc relative addressing:
+    xor $rD,$rD,$rD,0 / or $rD,$rD,A >> 10 / shl $rD,$rD,10 / ld $rD,$rD,(A & 0x3ff) / 4
+    for a 4 byte aligned address A below 256K */
+static uint32_t asm_load_address(asm_state_t* state, uint8_t op, struct asm_operand const* rd, struct asm_operand const* src) {
+    uint8_t r = (uint8_t)(rd->data.i & 0x0f);
+    uint8_t ob[16] = {
+        XM_CB_INTEGER, (uint8_t)(r | (r << 4)), r, asm_inst_op("xor"),
+        XM_CB_INTEGER, (uint8_t)(r | (r << 4)), 0, asm_inst_op("or") | 0x80,
+        XM_CB_INTEGER, (uint8_t)(r | (r << 4)), 10, asm_inst_op("shl") | 0x80,
+        XM_CB_INTEGER, (uint8_t)(r | (r << 4)), 0, op | 0x80,
+    };
+    ASM_ERROR_IF(rd->type != OP_REG);
+    ASM_ERROR_IF(state->section != SECTION_TEXT, "loads from labels only in .text");
+    asm_add_fixup_label(state, FIXUP_ADDR, src->type == OP_LITERAL
+        ? asm_pool_add(state, (uint32_t)src->data.i) : asm_intern_label(state, src->data.name));
+    asm_mark_line(state, state->line, false); /* Again if the pool was placed */
+    memcpy(state->out + state->out_len, ob, sizeof(ob));
+    state->out_len += sizeof(ob);
+    return sizeof(ob);
+}
+
+static uint32_t asm_firstpass(asm_state_t* state, struct asm_name name, struct asm_operand const op[]) {
+    size_t i = asm_find_inst(name);
+    uint8_t ob[8] = {0}, oc = 0;
+    if (i == XM_INST_TABLE_COUNT) {
+        ASM_ERROR_IF(true, "unhandled memmonic <%.*s>", (int)name.len, name.p);
+        return 0;
+    }
+    if (xm_inst_table[i].format == XM_FORMAT_R4R4I8O8_IFHBS && (op[1].type == OP_LABEL || op[1].type == OP_LITERAL)) {
+        bool load = asm_name_is(name, "ldb") || asm_name_is(name, "ldw") || asm_name_is(name, "ldl")
+            || asm_name_is(name, "ldq") || asm_name_is(name, "lea");
+        ASM_ERROR_IF(!load, "<%.*s> can't take a label", (int)name.len, name.p);
+        if (load) {
+            if (state->chunk) {
+                state->positional = true;
+                return 0;
             }
-        } else if (match && xm_inst_table[i].format == XM_FORMAT_R4R4R4R4) {
-            ASM_ERROR_IF(op[0].type != OP_REG);
-            ASM_ERROR_IF(op[1].type != OP_REG);
+            return asm_load_address(state, xm_inst_table[i].op, &op[0], &op[1]);
+        }
+    } else if (xm_inst_table[i].format == XM_FORMAT_R4R4I8O8_IFHBS) {
+        ASM_ERROR_IF(op[0].type != OP_REG);
+        ASM_ERROR_IF(op[1].type != OP_REG);
+        ob[0] = XM_CB_INTEGER;
+        ob[1] = (op[0].data.i & 0x0f) | ((op[1].data.i & 0x0f) << 4);
+        ob[3] = xm_inst_table[i].op & 0xff;
+        if (op[2].type == OP_IMM) {
+            /* Rd(4) Ra(4) Imm(8) Opcode(8) */
+            ob[2] = op[2].data.i & 0xff;
+            ob[3] |= 0x80;
+        } else {
+            /* Rd(4) Ra(4) Rb(4) Imm(4) Opcode(8) */
             ASM_ERROR_IF(op[2].type != OP_REG);
-            ASM_ERROR_IF(op[3].type != OP_REG);
-            ob[0] = XM_CB_INTEGER;
-            ob[1] = op[0].data.i & 0x0f | (op[1].data.i << 4);
-            ob[2] = op[2].data.i & 0x0f | (op[3].data.i << 4);
-            ob[3] = xm_inst_table[i].op;
-            oc = 4;
-        } else if (match && xm_inst_table[i].format == XM_FORMAT_F4F4F4F4) {
-            ASM_ERROR_IF(op[0].type != OP_FLOAT_REG);
-            ASM_ERROR_IF(op[1].type != OP_FLOAT_REG);
-            ASM_ERROR_IF(op[2].type != OP_FLOAT_REG);
-            ASM_ERROR_IF(op[3].type != OP_FLOAT_REG);
-            ob[0] = XM_CB_FLOAT;
-            ob[1] = op[0].data.i & 0x0f | (op[1].data.i << 4);
-            ob[2] = op[2].data.i & 0x0f | (op[3].data.i << 4);
-            ob[3] = xm_inst_table[i].op;
-            oc = 4;
-        } else if (match) {
-            ASM_ERROR_IF(true, "unhandled type");
-        }
-        if (match) {
-            ASM_ERROR_IF(oc == 0);
-            memcpy(state->out + state->out_len, ob, oc);
-            state->out_len += oc;
-            return oc;
-        }
-    }
-    ASM_ERROR_IF(true, "unhandled memmonic <%s>", name);
-    return 0;
-}
-
-static void asm_process_line(asm_state_t* state, char line[]) {
-    char *p;
-    /* Remove trailing characters */
-    if ((p = strpbrk(line, "#\r\n")) != NULL) *p = '\0';
-    if (*(p = line) != '\0') {
-        char *lab, *mem;
-        while (isspace(*p)) ++p;
-        if (*p == '\0') return;
-        /* An actual line? skip whitespace... */
-        if ((lab = strchr(p, ':')) != NULL) {
-            /* It's a asm_label, cutoff non-ascii */
-            if ((lab = strpbrk(p, ": \t")) != NULL) *lab = '\0';
-            strcpy(state->labels[state->n_labels].name, p);
-            state->labels[state->n_labels].pc = state->pc;
-            ++state->n_labels;
-            return;
-        }
-        mem = p; /* It's a memmonic */
-        if ((p = strpbrk(p, " \t")) != NULL) {
-            struct asm_operand final_op[4] = {0};
-            char *op[8] = {NULL};
-            *(p++) = '\0';
-            while (isspace(*p)) ++p;
-            /* parse asm_operands (variable length) */
-            for (size_t i = 0; i < sizeof(op) / sizeof(op[0]); ++i) {
-                op[i] = p;
-                if ((p = strchr(p, ',')) != NULL) {
-                    *(p++) = '\0';
-                } else
-                    break;
-            }
-            for (size_t i = 0; i < sizeof(op) / sizeof(op[0]); ++i)
-                if (op[i] != NULL)
-                    final_op[i] = asm_parse_asm_operand(op[i]);
-            state->pc += asm_firstpass(state, mem, final_op);
+            ob[2] = (op[2].data.i & 0x0f)
+                | ((op[3].data.i & 0x0f) << 4);
+        }
+        oc = 4;
+    } else if (xm_inst_table[i].format == XM_FORMAT_U16O8) {
+        ob[0] = XM_CB_INTEGER;
+        ob[1] = ob[2] = 0;
+        ob[3] = xm_inst_table[i].op;
+        oc = 4;
+    } else if (xm_inst_table[i].format == XM_FORMAT_R4U4RA8O8) {
+        ASM_ERROR_IF(op[0].type != OP_REG);
+        ASM_ERROR_IF(op[1].type != OP_IMM && op[1].type != OP_LABEL);
+        ASM_ERROR_IF(op[2].type != OP_COND);
+        ob[0] = XM_CB_INTEGER;
+        ob[1] = op[0].data.i & 0x0f | (op[2].data.i << 4);
+        ob[2] = op[1].type == OP_IMM ? op[1].data.i & 0xff : 0;
+        ob[3] = xm_inst_table[i].op;
+        oc = 4;
+        if (op[1].type == OP_LABEL)
+            asm_add_fixup(state, FIXUP_REL_O16S8, op[1].data.name);
+    } else if (xm_inst_table[i].format == XM_FORMAT_AA16O8 || xm_inst_table[i].format == XM_FORMAT_RA16O8) {
+        /* Addr(16) big endian */
+        ASM_ERROR_IF(op[0].type != OP_IMM && op[0].type != OP_LABEL);
+        ob[0] = XM_CB_INTEGER;
+        if (op[0].type == OP_IMM) {
+            ob[1] = (op[0].data.i >> 8) & 0xff;
+            ob[2] = op[0].data.i & 0xff;
+        }
+        ob[3] = xm_inst_table[i].op;
+        oc = 4;
+        if (op[0].type == OP_LABEL)
+            asm_add_fixup(state, xm_inst_table[i].format == XM_FORMAT_AA16O8 ? FIXUP_ABS_O8S16 : FIXUP_REL_O8S16,
+                op[0].data.name);
+    } else if (xm_inst_table[i].format == XM_FORMAT_R4R4R4R4) {
+        ASM_ERROR_IF(op[0].type != OP_REG);
+        ASM_ERROR_IF(op[1].type != OP_REG);
+        ASM_ERROR_IF(op[2].type != OP_REG);
+        ASM_ERROR_IF(op[3].type != OP_REG);
+        ob[0] = XM_CB_INTEGER;
+        ob[1] = op[0].data.i & 0x0f | (op[1].data.i << 4);
+        ob[2] = op[2].data.i & 0x0f | (op[3].data.i << 4);
+        ob[3] = xm_inst_table[i].op;
+        oc = 4;
+    } else if (xm_inst_table[i].format == XM_FORMAT_R4C4U8O8) {
+        ASM_ERROR_IF(op[0].type != OP_REG);
+        ASM_ERROR_IF(op[1].type != OP_CONTROL_REG);
+        ob[0] = XM_CB_INTEGER;
+        ob[1] = (op[0].data.i & 0x0f) | ((op[1].data.i & 0x0f) << 4);
+        ob[2] = 0;
+        ob[3] = xm_inst_table[i].op;
+        oc = 4;
+    } else if (xm_inst_table[i].format == XM_FORMAT_C4R4U8O8) {
+        ASM_ERROR_IF(op[0].type != OP_CONTROL_REG);
+        ASM_ERROR_IF(op[1].type != OP_REG);
+        ob[0] = XM_CB_INTEGER;
+        ob[1] = (op[0].data.i & 0x0f) | ((op[1].data.i & 0x0f) << 4);
+        ob[2] = 0;
+        ob[3] = xm_inst_table[i].op;
+        oc = 4;
+    } else if (xm_inst_table[i].format == XM_FORMAT_R4R4U8O8) {
+        ASM_ERROR_IF(op[0].type != OP_REG);
+        ASM_ERROR_IF(op[1].type != OP_REG);
+        ob[0] = XM_CB_INTEGER;
+        ob[1] = (op[0].data.i & 0x0f) | ((op[1].data.i & 0x0f) << 4);
+        ob[2] = 0;
+        ob[3] = xm_inst_table[i].op;
+        oc = 4;
+    } else if (xm_inst_table[i].format == XM_FORMAT_F4F4F4F4) {
+        ASM_ERROR_IF(op[0].type != OP_FLOAT_REG);
+        ASM_ERROR_IF(op[1].type != OP_FLOAT_REG);
+        ASM_ERROR_IF(op[2].type != OP_FLOAT_REG);
+        ASM_ERROR_IF(op[3].type != OP_FLOAT_REG);
+        ob[0] = XM_CB_FLOAT;
+        ob[1] = op[0].data.i & 0x0f | (op[1].data.i << 4);
+        ob[2] = op[2].data.i & 0x0f | (op[3].data.i << 4);
+        ob[3] = xm_inst_table[i].op;
+        oc = 4;
+    } else {
+        ASM_ERROR_IF(true, "unhandled type");
+    }
+    ASM_ERROR_IF(oc == 0);
+    memcpy(state->out + state->out_len, ob, oc);
+    state->out_len += oc;
+    return oc;
+}
+
+/* Start of the comment or the line break ending the code in [p, end), end if
+    neither. Lines are short, so this is mostly about long comments. */
+static const char *asm_find_code_end(const char *p, const char *end) {
+#if defined(__SSE2__)
+    const __m128i nl = _mm_set1_epi8('\n'), cr = _mm_set1_epi8('\r'), hash = _mm_set1_epi8('#');
+    for (; end - p >= 16; p += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i*)p);
+        int m = _mm_movemask_epi8(_mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v, nl), _mm_cmpeq_epi8(v, cr)),
+            _mm_cmpeq_epi8(v, hash)));
+        if (m != 0)
+            return p + __builtin_ctz((unsigned)m);
+    }
+#endif
+    while (p < end && *p != '\n' && *p != '\r' && *p != '#')
+        ++p;
+    return p;
+}
+
+/* Next comma separated argument of a directive, trimmed */
+static bool asm_next_arg(const char **p, const char *end, struct asm_name *arg) {
+    const char *q, *e;
+    while (*p < end && asm_is_space(**p)) ++*p;
+    if (*p >= end)
+        return false;
+    if ((q = memchr(*p, ',', (size_t)(end - *p))) == NULL)
+        q = end;
+    for (e = q; e > *p && asm_is_space(e[-1]); --e)
+        ;
+    *arg = (struct asm_name){*p, (size_t)(e - *p)};
+    *p = q + (q < end);
+    return true;
+}
+
+static bool asm_is_number(struct asm_name arg) {
+    return arg.len != 0 && ((*arg.p >= '0' && *arg.p <= '9') || *arg.p == '-' || *arg.p == '+');
+}
+
+/* .byte/.word/.long/.quad, labels only as .long */
+static void asm_data(asm_state_t* state, size_t size, const char *p, const char *end) {
+    struct asm_name arg;
+    asm_mark_line(state, state->line, true);
+    while (asm_next_arg(&p, end, &arg)) {
+        if (asm_is_number(arg)) {
+            asm_emit_int(state, (unsigned long long)asm_parse_int(arg.p, arg.p + arg.len), size);
         } else {
-            struct asm_operand final_op[4] = {0};
-            state->pc += asm_firstpass(state, mem, final_op);
+            ASM_ERROR_IF(size != 4, "label <%.*s> only fits .long", (int)arg.len, arg.p);
+            if (size == 4)
+                asm_add_fixup(state, FIXUP_ABS_O0S32, arg);
+            asm_emit_int(state, 0, size);
         }
     }
 }
 
+/* Directives
+    .global name[,name...]      exports the labels from an object, and
+                                imports them if they aren't defined in it
+    .section .text|.data, .text, .data
+    .byte/.word/.long/.quad v[,v...]
+    .align n                    pads with zeros to a multiple of n bytes
+    .fill repeat[,size[,value]], .space/.zero n[,value]
+    .pool/.ltorg                places the pending literals here */
+static void asm_directive(asm_state_t* state, struct asm_name name, const char *p, const char *end) {
+    struct asm_name arg = {NULL, 0};
+    if (asm_name_is(name, ".global") || asm_name_is(name, ".globl")) {
+        while (asm_next_arg(&p, end, &arg))
+            if (arg.len != 0)
+                state->labels[asm_intern_label(state, arg)].global = true;
+    } else if (state->chunk) {
+        /* Where this lands depends on what came before */
+        state->positional = true;
+    } else if (asm_name_is(name, ".section") || asm_name_is(name, ".text") || asm_name_is(name, ".data")) {
+        enum asm_section_id id = SECTION_COUNT;
+        if (!asm_name_is(name, ".section"))
+            arg = name;
+        else
+            asm_next_arg(&p, end, &arg);
+        for (size_t i = 0; i < SECTION_COUNT; ++i)
+            if (asm_name_is(arg, asm_section_names[i]))
+                id = (enum asm_section_id)i;
+        ASM_ERROR_IF(id == SECTION_COUNT, "unknown section <%.*s>", (int)arg.len, arg.p);
+        if (id != SECTION_COUNT)
+            asm_select_section(state, id);
+    } else if (asm_name_is(name, ".byte")) {
+        asm_data(state, 1, p, end);
+    } else if (asm_name_is(name, ".word")) {
+        asm_data(state, 2, p, end);
+    } else if (asm_name_is(name, ".long")) {
+        asm_data(state, 4, p, end);
+    } else if (asm_name_is(name, ".quad")) {
+        asm_data(state, 8, p, end);
+    } else if (asm_name_is(name, ".align")) {
+        uint32_t n = asm_next_arg(&p, end, &arg) ? (uint32_t)asm_parse_int(arg.p, arg.p + arg.len) : 4;
+        ASM_ERROR_IF(n == 0 || (n & (n - 1)) != 0, "alignment %u isn't a power of two", n);
+        if (n != 0 && (n & (n - 1)) == 0) {
+            asm_mark_line(state, state->line, true);
+            while (state->pc % n != 0)
+                asm_emit_int(state, 0, 1);
+            if (n > state->sections[state->section].align)
+                state->sections[state->section].align = n;
+            if (state->section == SECTION_TEXT && n > state->text_align)
+                state->text_align = n;
+        }
+    } else if (asm_name_is(name, ".fill") || asm_name_is(name, ".space") || asm_name_is(name, ".zero")) {
+        bool fill = asm_name_is(name, ".fill");
+        long long v[3] = {0, 1, 0};
+        for (size_t i = 0; i < (fill ? 3 : 2) && asm_next_arg(&p, end, &arg); ++i)
+            v[i == 1 && !fill ? 2 : i] = asm_parse_int(arg.p, arg.p + arg.len);
+        ASM_ERROR_IF(v[1] != 1 && v[1] != 2 && v[1] != 4 && v[1] != 8, "fill size %lld", v[1]);
+        asm_mark_line(state, state->line, true);
+        for (long long i = 0; i < v[0] && (v[1] == 1 || v[1] == 2 || v[1] == 4 || v[1] == 8); ++i)
+            asm_emit_int(state, (unsigned long long)v[2], (size_t)v[1]);
+    } else if (asm_name_is(name, ".pool") || asm_name_is(name, ".ltorg")) {
+        ASM_ERROR_IF(state->section != SECTION_TEXT, "literal pools only go in .text");
+        if (state->section == SECTION_TEXT)
+            asm_flush_pool(state, false);
+    } else
+        ASM_ERROR_IF(true, "unknown directive <%.*s>", (int)name.len, name.p);
+}
+
+/* Whether the last instruction never falls through */
+static bool asm_ends_flow(asm_state_t const* state) {
+    const uint8_t *ob = (const uint8_t *)state->out + state->out_len - 4;
+    return ob[0] == XM_CB_INTEGER && (ob[3] == asm_inst_op("jmp") || ob[3] == asm_inst_op("jmprel")
+        || ob[3] == asm_inst_op("ret") || (ob[3] == asm_inst_op("b") && (ob[1] >> 4) == 0));
+}
+
+/* [p, end) is the code of one line, nothing in it is written to */
+static void asm_process_line(asm_state_t* state, const char *p, const char *end) {
+    struct asm_operand final_op[4] = {0};
+    struct asm_name mem;
+    const char *q;
+    uint32_t n;
+    while (p < end && asm_is_space(*p)) ++p;
+    while (end > p && asm_is_space(end[-1])) --end;
+    if (p == end)
+        return;
+    if (memchr(p, ':', (size_t)(end - p)) != NULL) {
+        /* It's a asm_label, up to the colon or a blank */
+        struct asm_label *l;
+        for (q = p; *q != ':' && !asm_is_space(*q); ++q)
+            ;
+        l = &state->labels[asm_intern_label(state, (struct asm_name){p, (size_t)(q - p)})];
+        /* The first definition wins */
+        ASM_ERROR_IF(l->defined, "label <%.*s> redefined", (int)(q - p), p);
+        if (!l->defined) {
+            l->pc = state->pc;
+            l->defined = true;
+            l->section = (uint8_t)state->section;
+        }
+        return;
+    }
+    /* It's a memmonic, then comma separated asm_operands */
+    for (q = p; q < end && !asm_is_space(*q); ++q)
+        ;
+    mem = (struct asm_name){p, (size_t)(q - p)};
+    if (*p == '.') {
+        asm_directive(state, mem, q, end);
+        return;
+    }
+    for (size_t i = 0; q < end && i < sizeof(final_op) / sizeof(final_op[0]); ++i) {
+        const char *op = q + (i != 0), *op_end;
+        while (op < end && asm_is_space(*op)) ++op;
+        if (op >= end || (q = memchr(op, ',', (size_t)(end - op))) == NULL)
+            q = end;
+        for (op_end = q; op_end > op && asm_is_space(op_end[-1]); --op_end)
+            ;
+        final_op[i] = asm_parse_asm_operand(op, op_end);
+    }
+    if (state->n_pool != 0 && state->section == SECTION_TEXT && state->pc - state->pool_pc >= POOL_REACH)
+        asm_flush_pool(state, true);
+    asm_mark_line(state, state->line, false);
+    n = asm_firstpass(state, mem, final_op);
+    state->pc += n;
+    if (state->n_pool != 0 && state->section == SECTION_TEXT && n == 4 && asm_ends_flow(state))
+        asm_flush_pool(state, false);
+}
+
+/* Assembles the complete lines that arrived, and the unterminated last one
+    once there's no more input */
+static void asm_scan(asm_state_t* state, bool last) {
+    const char *end = state->in + state->in_len;
+    const char *p = state->in + state->in_done;
+    while (p < end) {
+        const char *code = asm_find_code_end(p, end), *nl = code;
+        if (nl < end && *nl != '\n' && (nl = memchr(nl, '\n', (size_t)(end - nl))) == NULL)
+            nl = end;
+        if ((nl == end && !last) || state->positional)
+            break;
+        ++state->line;
+        asm_process_line(state, p, code);
+        p = nl + (nl < end);
+    }
+    state->in_done = (size_t)(p - state->in);
+}
+
+/* A chunk is assembled like a whole file starting at pc 0, with its own
+    labels and fixups. Nothing in it takes more than 4 bytes of output, a
+    label or a fixup per 2 bytes of input. */
+static bool asm_chunk_init(asm_state_t* c, const char *p, size_t len) {
+    size_t n = len / 2 + 2;
+    memset(c, 0, sizeof(*c));
+    c->in = (char*)p;
+    c->in_len = len;
+    c->chunk = true;
+    c->out = mmap(NULL, n * 4, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANON, -1, 0);
+    c->labels = mmap(NULL, n * sizeof(*c->labels), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANON, -1, 0);
+    c->fixups = mmap(NULL, n * sizeof(*c->fixups), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANON, -1, 0);
+    c->names = mmap(NULL, len + 1, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANON, -1, 0);
+    return c->out != MAP_FAILED && c->labels != MAP_FAILED && c->fixups != MAP_FAILED && c->names != MAP_FAILED;
+}
+
+static void asm_chunk_finish(asm_state_t* c) {
+    size_t n = c->in_len / 2 + 2;
+    if (c->out != MAP_FAILED) munmap(c->out, n * 4);
+    if (c->labels != MAP_FAILED) munmap(c->labels, n * sizeof(*c->labels));
+    if (c->fixups != MAP_FAILED) munmap(c->fixups, n * sizeof(*c->fixups));
+    if (c->names != MAP_FAILED) munmap(c->names, c->in_len + 1);
+    free(c->label_hash);
+    free(c->sections[SECTION_TEXT].lines);
+}
+
+static void *asm_chunk_run(void *arg) {
+    asm_scan(arg, true);
+    return NULL;
+}
+
+/* Appends a chunk the way a serial pass would have gone on with it: the
+    output, label definitions in order with the first one winning, then
+    the fixups, retargeted at the merged labels, and the source lines */
+static void asm_chunk_merge(asm_state_t* state, asm_state_t const* c, uint32_t *map) {
+    struct asm_section const* lines = &c->sections[SECTION_TEXT];
+    uint32_t base = state->pc, out_base = (uint32_t)state->out_len;
+    memcpy(state->out + state->out_len, c->out, c->out_len);
+    state->out_len += c->out_len;
+    state->pc += c->pc;
+    for (size_t i = 0; i < c->n_labels; ++i) {
+        struct asm_label const* cl = &c->labels[i];
+        struct asm_label *l;
+        map[i] = asm_intern_label_hashed(state, (struct asm_name){cl->name, cl->len}, cl->hash);
+        l = &state->labels[map[i]];
+        l->global |= cl->global;
+        if (cl->defined) {
+            ASM_ERROR_IF(l->defined, "label <%.*s> redefined", (int)cl->len, cl->name);
+            if (!l->defined) {
+                l->pc = base + cl->pc;
+                l->defined = true;
+            }
+        }
+    }
+    for (size_t i = 0; i < c->n_fixups; ++i) {
+        struct asm_fixup f = c->fixups[i];
+        f.label = map[f.label];
+        f.pc += base;
+        f.offset += out_base;
+        state->fixups[state->n_fixups++] = f;
+    }
+    for (size_t i = 0; i < lines->n_lines; ++i)
+        asm_add_line(&state->sections[SECTION_TEXT], (struct asm_line){base + lines->lines[i].pc,
+            lines->lines[i].line + state->line, lines->lines[i].data});
+    state->line += c->line;
+}
+
+/* Whether the chunks could be set up, otherwise nothing was assembled */
+static bool asm_assemble_parallel(asm_state_t* state) {
+    static asm_state_t chunks[PARALLEL_MAX_JOBS];
+    pthread_t threads[PARALLEL_MAX_JOBS];
+    size_t n = state->in_len / PARALLEL_CHUNK_SIZE, at = 0, max_labels = 0;
+    uint32_t *map;
+    bool ok = true;
+    n = n > state->jobs ? state->jobs : n;
+    n = n > PARALLEL_MAX_JOBS ? PARALLEL_MAX_JOBS : n;
+    for (size_t i = 0; i < n; ++i) {
+        size_t end = state->in_len * (i + 1) / n;
+        const char *nl;
+        if (end < at)
+            end = at;
+        if (i + 1 < n && (nl = memchr(state->in + end, '\n', state->in_len - end)) != NULL)
+            end = (size_t)(nl + 1 - state->in);
+        else if (i + 1 < n)
+            end = state->in_len;
+        ok &= asm_chunk_init(&chunks[i], state->in + at, end - at);
+        at = end;
+    }
+    for (size_t i = 0; ok && i < n; ++i)
+        if (pthread_create(&threads[i], NULL, asm_chunk_run, &chunks[i]) != 0) {
+            for (size_t j = 0; j < i; ++j)
+                pthread_join(threads[j], NULL);
+            ok = false;
+        }
+    for (size_t i = 0; ok && i < n; ++i) {
+        pthread_join(threads[i], NULL);
+        max_labels = chunks[i].n_labels > max_labels ? chunks[i].n_labels : max_labels;
+    }
+    /* Sections, data and literals go serially */
+    for (size_t i = 0; ok && i < n; ++i)
+        ok = !chunks[i].positional;
+    if (ok && (map = malloc((max_labels + 1) * sizeof(*map))) != NULL) {
+        for (size_t i = 0; i < n; ++i)
+            asm_chunk_merge(state, &chunks[i], map);
+        free(map);
+    } else
+        ok = false;
+    for (size_t i = 0; i < n; ++i)
+        asm_chunk_finish(&chunks[i]);
+    return ok;
+}
+
 #define MIN(A, B) (((A) > (B)) ? (B) : (A))
 void asm_assemble(asm_state_t* state) {
-    for (size_t i = 0; i < state->in_len; ) {
-        const char *p = memchr(state->in + i, '\n', state->in_len - i);
-        if (p != NULL) {
-            char line[BUFSIZ] = {0};
-            ptrdiff_t d = (ptrdiff_t)((p + 1) - (state->in + i));
-            memcpy(line, state->in + i, (size_t)d);
-            asm_process_line(state, line);
-            i += (size_t)d;
+    if (!state->in_stream && state->jobs > 1 && state->in_len >= PARALLEL_MIN_SIZE
+    && asm_assemble_parallel(state))
+        return;
+    if (state->in_stream) {
+        ssize_t n;
+        while (state->in_len < IN_MAX_SIZE
+        && (n = read(state->fd_in, state->in + state->in_len, MIN(IN_CHUNK_SIZE, IN_MAX_SIZE - state->in_len))) > 0) {
+            state->in_len += (size_t)n;
+            asm_scan(state, false);
+        }
+    }
+    asm_scan(state, true);
+    asm_select_section(state, SECTION_TEXT);
+    /* Still pending, so the code before falls through: jump over it */
+    asm_flush_pool(state, true);
+}
+
+/* Branch relaxation
+    A conditional branch to a label out of rel8 reach becomes the inverted
+    branch over a jmprel, or over a jmp if the label is past rel16 but below
+    64K. An unconditional b just turns into the jump. Growing a branch only
+    pushes labels further away, so passes repeat until none grows, which
+    leaves every branch that can be short short. bgpcrela compares against
+    its own offset and labels of other objects are unknown, those stay. */
+
+/* Peephole pass (-O), over .text before relaxing
+    Only rewrites instructions the README defines, where what a rewrite drops
+    is provably dead: the sim's ALU leaves Z and N after every op, so a
+    dropped one also needs them dead. Liveness looks ahead a few
+    instructions, following branches, and gives up at anything else. */
+
+#define PEEP_SCAN 32 /* Instructions looked ahead */
+#define PEEP_DEPTH 4 /* Branches followed meanwhile */
+#define PEEP_HOPS 8 /* Jumps to jumps followed */
+#define PEEP_Z (1u << 16)
+#define PEEP_N (1u << 17)
+#define PEEP_C (1u << 18)
+
+struct asm_peep {
+    enum {
+        PEEP_CODE,
+        PEEP_FIXUP, /* With a branch or jump fixup */
+        PEEP_FIXED, /* Data, address loads, or spanned by a numeric branch */
+        PEEP_DEAD,
+    } *slot;
+    uint32_t *fixup; /* Of PEEP_FIXUP slots */
+    uint8_t *label; /* A label is defined there */
+    size_t n;
+};
+
+/* Registers and flags read and written by the integer op in ob, false for
+    control transfers and anything else */
+static bool asm_peep_effects(const uint8_t *ob, uint32_t *use, uint32_t *def) {
+    uint8_t op = ob[3] & 0x7f, rd = ob[1] & 0x0f, ra = ob[1] >> 4;
+    if (ob[0] != XM_CB_INTEGER)
+        return false;
+    *use = 1u << ra;
+    if ((ob[3] & 0x80) == 0 && op <= 0x21)
+        *use |= 1u << (ob[2] & 0x0f);
+    if (op <= 0x0f) { /* add - ipcnt */
+        *def = 1u << rd | PEEP_Z | PEEP_N;
+    } else if (op <= 0x13) { /* stb - stq */
+        *use |= 1u << rd;
+        *def = 0;
+    } else if (op <= 0x18 || op == 0x21) { /* ldb - ldq, lea, cmpkp */
+        *def = 1u << rd;
+    } else if (op == 0x20) { /* cmp */
+        *def = 1u << rd | PEEP_Z | PEEP_N | PEEP_C;
+    } else if (ob[3] == asm_inst_op("syscall")) {
+        *use = 1u << XM_ABI_T0 | 1u << XM_ABI_A0 | 1u << XM_ABI_A1 | 1u << XM_ABI_A2 | 1u << XM_ABI_A3;
+        *def = 1u << XM_ABI_A0;
+    } else
+        return false;
+    return true;
+}
+
+/* Instruction index of the label of a branch or jump fixup, or n */
+static size_t asm_peep_target(asm_state_t const* state, struct asm_peep const* p, size_t i) {
+    struct asm_label const* l = &state->labels[state->fixups[p->fixup[i]].label];
+    return l->defined && l->section == SECTION_TEXT && l->pc % 4 == 0 && l->pc / 4 < p->n ? l->pc / 4 : p->n;
+}
+
+/* Whether nothing in mask is read from instruction i on before it's written */
+static bool asm_peep_dead(asm_state_t const* state, struct asm_peep const* p, size_t i, uint32_t mask, unsigned depth) {
+    for (unsigned k = 0; k < PEEP_SCAN && mask != 0; ++i) {
+        const uint8_t *ob = (const uint8_t *)state->out + i * 4;
+        uint32_t use, def;
+        uint8_t cc = ob[1] >> 4;
+        if (i >= p->n || p->slot[i] == PEEP_FIXED)
+            return false;
+        if (p->slot[i] == PEEP_DEAD)
             continue;
-        } else {
-            char line[BUFSIZ] = {0};
-            memcpy(line, state->in + i, state->in_len - i);
-            line[state->in_len - i + 1] = '\0';
-            asm_process_line(state, line);
-            break;
+        ++k;
+        if (asm_peep_effects(ob, &use, &def)) {
+            if ((use & mask) != 0)
+                return false;
+            mask &= ~def;
+            continue;
+        }
+        if (p->slot[i] != PEEP_FIXUP || depth == 0)
+            return false;
+        if (ob[3] == asm_inst_op("jmp") || ob[3] == asm_inst_op("jmprel"))
+            return asm_peep_dead(state, p, asm_peep_target(state, p, i), mask, depth - 1);
+        if (ob[3] < 0x50 || ob[3] > 0x5f)
+            return false;
+        /* b, bz... */
+        use = (ob[3] != 0x51 ? 1u << (ob[1] & 0x0f) : 0) | ((cc & 0x02) != 0 ? PEEP_N : 0)
+            | ((cc & 0x04) != 0 ? PEEP_Z : 0) | ((cc & 0x08) != 0 ? PEEP_C : 0);
+        if (ob[3] >= 0x58)
+            use |= 1u << (XM_ABI_T0 + ob[3] - 0x58);
+        if ((use & mask) != 0 || !asm_peep_dead(state, p, asm_peep_target(state, p, i), mask, depth - 1))
+            return false;
+        if (ob[3] == 0x51 && cc == 0)
+            return true;
+    }
+    return mask == 0;
+}
+
+/* Numeric branch and jump offsets hold whatever they span in place */
+static void asm_peep_pin(asm_state_t const* state, struct asm_peep* p) {
+    int32_t *d = calloc(p->n + 1, sizeof(*d)), pinned = 0;
+    ASM_ERROR_IF(d == NULL);
+    for (size_t i = 0; i < p->n && d != NULL; ++i) {
+        const uint8_t *ob = (const uint8_t *)state->out + i * 4;
+        int32_t rela;
+        size_t from, to;
+        if (p->slot[i] != PEEP_CODE || ob[0] != XM_CB_INTEGER)
+            continue;
+        if ((ob[3] >= 0x50 && ob[3] <= 0x5f) || ob[3] == asm_inst_op("call"))
+            rela = (int8_t)ob[2];
+        else if (ob[3] == asm_inst_op("jmprel"))
+            rela = (int16_t)(ob[1] << 8 | ob[2]);
+        else if (ob[3] == asm_inst_op("jmp"))
+            rela = INT32_MIN; /* Absolute, all of it */
+        else
+            continue;
+        from = rela < 0 ? (size_t)((int64_t)i + rela / 4 < 0 ? 0 : (int64_t)i + rela / 4) : i;
+        to = rela == INT32_MIN ? p->n - 1 : rela < 0 ? i : (i + (size_t)rela / 4 < p->n ? i + (size_t)rela / 4 : p->n - 1);
+        ++d[from];
+        --d[to + 1];
+    }
+    for (size_t i = 0; i < p->n && d != NULL; ++i) {
+        pinned += d[i];
+        if (pinned != 0 && p->slot[i] == PEEP_CODE)
+            p->slot[i] = PEEP_FIXED;
+    }
+    free(d);
+}
+
+/* Branches and jumps to an unconditional jump go where it goes */
+static void asm_peep_thread(asm_state_t* state, struct asm_peep const* p) {
+    for (size_t i = 0; i < p->n; ++i) {
+        struct asm_fixup *f = &state->fixups[p->fixup[i]];
+        uint8_t op = (uint8_t)state->out[i * 4 + 3];
+        size_t t = i;
+        uint32_t label = f->label;
+        if (p->slot[i] != PEEP_FIXUP || op == asm_inst_op("bgpcrela"))
+            continue;
+        for (unsigned hop = 0; hop < PEEP_HOPS; ++hop) {
+            const uint8_t *ob;
+            t = asm_peep_target(state, p, t);
+            if (t == p->n || t == i || p->slot[t] != PEEP_FIXUP)
+                break;
+            ob = (const uint8_t *)state->out + t * 4;
+            if (ob[3] != asm_inst_op("jmp") && ob[3] != asm_inst_op("jmprel")
+            && (ob[3] != asm_inst_op("b") || (ob[1] >> 4) != 0))
+                break;
+            label = state->fixups[p->fixup[t]].label;
+        }
+        if (label != f->label && state->labels[label].defined) {
+            /* Only closer after the pass, as it only removes code */
+            int32_t rela = (int32_t)(state->labels[label].pc - f->pc);
+            if (f->type == FIXUP_ABS_O8S16 || (f->type == FIXUP_REL_O8S16 && rela >= INT16_MIN && rela <= INT16_MAX)
+            || (f->type == FIXUP_REL_O16S8 && rela >= INT8_MIN && rela <= INT8_MAX))
+                f->label = label;
+        }
+    }
+}
+
+static void asm_peep_rewrite(asm_state_t* state, struct asm_peep* p) {
+    const uint8_t op_or = asm_inst_op("or"), op_add = asm_inst_op("add"), op_lea = asm_inst_op("lea");
+    const uint8_t op_cmp = asm_inst_op("cmp") | 0x80, op_b = asm_inst_op("b");
+    for (size_t i = 0; i < p->n; ++i) {
+        uint8_t *ob = (uint8_t *)state->out + i * 4;
+        uint8_t rd = ob[1] & 0x0f, ra = ob[1] >> 4, rb = ob[2] & 0x0f, imm4 = ob[2] >> 4;
+        bool reg = (ob[3] & 0x80) == 0;
+        if (p->slot[i] != PEEP_CODE || ob[0] != XM_CB_INTEGER)
+            continue;
+        if ((ob[3] & 0x7f) == op_or && rd == ra && (reg ? rb == rd && imm4 == 0 : ob[2] == 0)
+        && asm_peep_dead(state, p, i + 1, PEEP_Z | PEEP_N, PEEP_DEPTH)) {
+            /* or $x,$x,$x,0 */
+            p->slot[i] = PEEP_DEAD;
+        } else if ((ob[3] & 0x7f) == op_lea && i + 1 < p->n && p->slot[i + 1] == PEEP_CODE
+        && !p->label[i + 1] && memcmp(ob, ob + 4, 4) == 0 && rd != ra && (!reg || rd != rb)) {
+            /* The same lea again. Not loads: one from a device register,
+                say the UART's DATA, has side effects and may differ. */
+            p->slot[i + 1] = PEEP_DEAD;
+        } else if (ob[3] == op_add && rd == ra && rb != rd && imm4 == 0) {
+            /* add $x,$x,$y,0 four times is lea $x,$x,$y,1 */
+            size_t k = 1, m;
+            while (i + k < p->n && k < 60 && p->slot[i + k] == PEEP_CODE && !p->label[i + k]
+            && memcmp(ob, ob + k * 4, 4) == 0)
+                ++k;
+            m = k / 4;
+            /* Adds left after the lea leave the flags as they were */
+            if (m == 0 || (k % 4 == 0 && !asm_peep_dead(state, p, i + k, PEEP_Z | PEEP_N, PEEP_DEPTH)))
+                continue;
+            ob[2] = (uint8_t)(rb | m << 4);
+            ob[3] = op_lea;
+            for (size_t j = 1; j < 4 * m; ++j)
+                p->slot[i + j] = PEEP_DEAD;
+        } else if (ob[3] == op_cmp && ob[2] <= 1 && i + 1 < p->n && p->slot[i + 1] == PEEP_FIXUP
+        && !p->label[i + 1] && ob[7] == op_b && ((ob[5] >> 4) == 0x04 || (ob[5] >> 4) == 0x05)) {
+            /* cmp $d,$a,0 then b ...,?z is bz $a, with 1 bemax $a */
+            uint32_t mask = 1u << rd | PEEP_Z | PEEP_N | PEEP_C;
+            if (!asm_peep_dead(state, p, i + 2, mask, PEEP_DEPTH)
+            || !asm_peep_dead(state, p, asm_peep_target(state, p, i + 1), mask, PEEP_DEPTH))
+                continue;
+            ob[5] = (uint8_t)(ra | (ob[5] >> 4 & 0x01) << 4);
+            ob[7] = ob[2] == 0 ? asm_inst_op("bz") : asm_inst_op("bemax");
+            p->slot[i] = PEEP_DEAD;
+        }
+    }
+}
+
+/* Closes the gaps, moving labels, fixups and lines with the code */
+static void asm_peep_compact(asm_state_t* state, struct asm_peep const* p) {
+    struct asm_section *text = &state->sections[SECTION_TEXT];
+    uint32_t *gone = malloc((p->n + 1) * sizeof(*gone)); /* Removed before each instruction */
+    size_t at = 0;
+    ASM_ERROR_IF(gone == NULL);
+    if (gone == NULL)
+        return;
+    gone[0] = 0;
+    for (size_t i = 0; i < p->n; ++i) {
+        gone[i + 1] = gone[i] + (p->slot[i] == PEEP_DEAD);
+        if (p->slot[i] != PEEP_DEAD) {
+            memmove(state->out + at, state->out + i * 4, 4);
+            at += 4;
+        }
+    }
+    memmove(state->out + at, state->out + p->n * 4, state->out_len - p->n * 4);
+    state->out_len -= 4 * gone[p->n];
+    state->pc -= 4 * gone[p->n];
+    for (size_t i = 0; i < state->n_labels; ++i)
+        if (state->labels[i].defined && state->labels[i].section == SECTION_TEXT)
+            state->labels[i].pc -= 4 * gone[state->labels[i].pc / 4 < p->n ? state->labels[i].pc / 4 : p->n];
+    for (size_t i = 0; i < state->n_fixups; ++i)
+        if (state->fixups[i].section == SECTION_TEXT) {
+            uint32_t shift = 4 * gone[state->fixups[i].offset / 4 < p->n ? state->fixups[i].offset / 4 : p->n];
+            state->fixups[i].pc -= shift;
+            state->fixups[i].offset -= shift;
+        }
+    for (size_t i = 0; i < state->n_raw; ++i)
+        state->raw[i].pc -= 4 * gone[state->raw[i].pc / 4];
+    for (size_t i = 0; i < text->n_lines; ++i)
+        text->lines[i].pc -= 4 * gone[text->lines[i].pc / 4 < p->n ? text->lines[i].pc / 4 : p->n];
+    asm_tidy_lines(text);
+    free(gone);
+}
+
+static void asm_peephole(asm_state_t* state) {
+    struct asm_peep p = {0};
+    bool aligned = state->text_align <= 4;
+    for (size_t i = 0; i < state->n_raw; ++i)
+        aligned &= state->raw[i].pc % 4 == 0 && state->raw[i].len % 4 == 0;
+    /* Removing code would move an .align, or code after odd sized data */
+    ASM_ERROR_IF(!aligned, "-O skipped, .text has alignment or data it can't move");
+    if (!aligned)
+        return;
+    p.n = state->out_len / 4;
+    p.slot = calloc(p.n + 1, sizeof(*p.slot));
+    p.fixup = malloc((p.n + 1) * sizeof(*p.fixup));
+    p.label = calloc(p.n + 1, sizeof(*p.label));
+    ASM_ERROR_IF(p.slot == NULL || p.fixup == NULL || p.label == NULL);
+    if (p.slot == NULL || p.fixup == NULL || p.label == NULL) {
+        free(p.slot);
+        free(p.fixup);
+        free(p.label);
+        return;
+    }
+    for (size_t i = 0; i < state->n_raw; ++i)
+        for (uint32_t pc = state->raw[i].pc; pc < state->raw[i].pc + state->raw[i].len; pc += 4)
+            p.slot[pc / 4] = PEEP_FIXED;
+    for (size_t i = 0; i < state->n_fixups; ++i) {
+        struct asm_fixup const* f = &state->fixups[i];
+        if (f->section != SECTION_TEXT)
+            continue;
+        if (f->type == FIXUP_ADDR) {
+            for (size_t j = 0; j < 4; ++j)
+                p.slot[f->offset / 4 + j] = PEEP_FIXED;
+        } else if (p.slot[f->offset / 4] == PEEP_CODE) {
+            p.slot[f->offset / 4] = PEEP_FIXUP;
+            p.fixup[f->offset / 4] = (uint32_t)i;
+        }
+    }
+    for (size_t i = 0; i < state->n_labels; ++i)
+        if (state->labels[i].defined && state->labels[i].section == SECTION_TEXT && state->labels[i].pc / 4 < p.n)
+            p.label[state->labels[i].pc / 4] = 1;
+    asm_peep_pin(state, &p);
+    asm_peep_thread(state, &p);
+    asm_peep_rewrite(state, &p);
+    asm_peep_compact(state, &p);
+    free(p.slot);
+    free(p.fixup);
+    free(p.label);
+}
+
+/* Growth before pc, grown being the sorted pcs of the branches that grew */
+static uint32_t asm_relax_shift(uint32_t const* grown, size_t n, uint32_t pc) {
+    size_t lo = 0, hi = n;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (grown[mid] < pc)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return (uint32_t)lo * 4;
+}
+
+/* Decides per fixup in relax: 0 as is, 1 a jump instead, 2 a branch over a
+    jump. Returns how many grow, their pcs sorted in grown. Only the b
+    family (0x50 - 0x5f) has a condition to invert; call, which shares the
+    format, and bgpcrela keep their range error. */
+static size_t asm_relax_plan(asm_state_t const* state, uint8_t *relax, uint32_t *grown) {
+    const uint8_t op_b = asm_inst_op("b"), op_bgpcrela = asm_inst_op("bgpcrela");
+    size_t n_grown = 0;
+    bool again = true;
+    while (again) {
+        again = false;
+        for (size_t i = 0; i < state->n_fixups; ++i) {
+            struct asm_fixup const* f = &state->fixups[i];
+            struct asm_label const* l = &state->labels[f->label];
+            uint8_t op = (uint8_t)state->out[f->offset + 3];
+            int32_t rela;
+            if (relax[i] != 0 || f->type != FIXUP_REL_O16S8 || !l->defined || l->section != SECTION_TEXT
+            || op < 0x50 || op > 0x5f || op == op_bgpcrela)
+                continue;
+            rela = (int32_t)((l->pc + asm_relax_shift(grown, n_grown, l->pc))
+                - (f->pc + asm_relax_shift(grown, n_grown, f->pc)));
+            if (rela >= INT8_MIN && rela <= INT8_MAX)
+                continue;
+            relax[i] = op == op_b && ((uint8_t)state->out[f->offset + 1] >> 4) == 0 ? 1 : 2;
+            again |= relax[i] == 2;
+        }
+        n_grown = 0;
+        for (size_t i = 0; i < state->n_fixups; ++i)
+            if (relax[i] == 2)
+                grown[n_grown++] = state->fixups[i].pc;
+    }
+    return n_grown;
+}
+
+static void asm_relax(asm_state_t* state) {
+    const uint8_t op_jmp = asm_inst_op("jmp"), op_jmprel = asm_inst_op("jmprel");
+    uint8_t *relax;
+    uint32_t *grown;
+    size_t n_grown, end;
+    if (state->n_fixups == 0)
+        return;
+    relax = calloc(state->n_fixups, sizeof(*relax));
+    grown = malloc(state->n_fixups * sizeof(*grown));
+    ASM_ERROR_IF(relax == NULL || grown == NULL);
+    if (relax == NULL || grown == NULL) {
+        free(relax);
+        free(grown);
+        return;
+    }
+    n_grown = asm_relax_plan(state, relax, grown);
+    /* Growing moves code by 4 bytes at a time */
+    ASM_ERROR_IF(n_grown != 0 && state->text_align > 4, "relaxed branches misalign .align %u in .text",
+        state->text_align);
+    /* Open a gap after every grown branch, last first */
+    end = state->out_len;
+    for (size_t k = n_grown; k-- > 0;) {
+        size_t from = grown[k] + 4;
+        memmove(state->out + from + 4 * (k + 1), state->out + from, end - from);
+        end = from;
+    }
+    state->out_len += 4 * n_grown;
+    state->pc += 4 * (uint32_t)n_grown;
+    for (size_t i = 0; i < state->n_labels; ++i)
+        if (state->labels[i].defined && state->labels[i].section == SECTION_TEXT)
+            state->labels[i].pc += asm_relax_shift(grown, n_grown, state->labels[i].pc);
+    /* An added jump goes with the branch it's for */
+    for (size_t i = 0; i < state->sections[SECTION_TEXT].n_lines; ++i)
+        state->sections[SECTION_TEXT].lines[i].pc += asm_relax_shift(grown, n_grown,
+            state->sections[SECTION_TEXT].lines[i].pc);
+    for (size_t i = 0; i < state->n_fixups; ++i) {
+        struct asm_fixup *f = &state->fixups[i];
+        uint32_t shift = asm_relax_shift(grown, n_grown, f->pc);
+        char *ob;
+        if (f->section != SECTION_TEXT)
+            continue;
+        f->pc += shift;
+        f->offset += shift;
+        if (relax[i] == 0)
+            continue;
+        if (relax[i] == 2) {
+            /* Skip the jump unless the branch was taken */
+            state->out[f->offset + 1] ^= 0x10;
+            state->out[f->offset + 2] = 8;
+            f->pc += 4;
+            f->offset += 4;
         }
+        ob = state->out + f->offset;
+        f->type = (int32_t)(state->labels[f->label].pc - f->pc) >= INT16_MIN
+            && (int32_t)(state->labels[f->label].pc - f->pc) <= INT16_MAX ? FIXUP_REL_O8S16 : FIXUP_ABS_O8S16;
+        ob[0] = XM_CB_INTEGER;
+        ob[1] = ob[2] = 0;
+        ob[3] = f->type == FIXUP_REL_O8S16 ? op_jmprel : op_jmp;
     }
+    free(relax);
+    free(grown);
 }
 
-struct asm_label asm_find_label(asm_state_t* state, const char name[]) {
+/* Profile guided block layout (-profile), over .text before relaxing
+    The profile is what xm_sim -exec-profile counted running the image this
+    source gave with the same options. The relaxation plan maps its pcs back
+    to instructions, a branch that grew into one over a jump went its way
+    whenever the jump ran. Within each function, from a global label to the
+    next, blocks are chained so the more frequent way out falls through,
+    inverting branches and adding jumps where a fallthrough moved away, and
+    blocks that never ran go to the end of .text. Relaxing afterwards sorts
+    out whatever got out of reach. Gives up on code whose meaning depends on
+    where it is: numeric offsets, bgpc and bgpcrela. */
+
+#define LAYOUT_END UINT32_MAX /* Past the last block */
+
+struct asm_block {
+    uint32_t start, end; /* Instruction indices, data kept with it included */
+    unsigned long count;
+    unsigned long taken; /* By the branch ending it */
+    uint32_t target; /* Block it branches or jumps to, or LAYOUT_END */
+    uint32_t fixup; /* Of that branch or jump */
+    uint32_t func;
+    uint32_t label; /* For added jumps, UINT32_MAX until one is needed */
+    enum {
+        BLOCK_FALL, /* Into the next */
+        BLOCK_BRANCH, /* To target, or into the next */
+        BLOCK_JUMP,
+        BLOCK_STOP, /* ret, or data */
+    } kind;
+    uint32_t chain; /* Block placed right after it, or LAYOUT_END */
+    bool joined; /* Some block is placed right before it */
+    uint32_t set; /* Union-find of the blocks chained together */
+};
+
+struct asm_layout {
+    struct asm_block *blocks;
+    size_t n_blocks;
+    size_t n; /* Instructions */
+    uint32_t end_label; /* For added jumps, UINT32_MAX until one is needed */
+    /* Per instruction */
+    uint32_t *block_of;
+    uint32_t *fixup_at; /* Branch or jump fixup + 1, 0 for none */
+    uint8_t *raw; /* 0 code, 1 data, 2 the jump over a literal pool */
+    uint8_t *lead; /* Starts a block, 2 a function too */
+    unsigned long *count;
+    unsigned long *taken;
+};
+
+/* Fills count and taken from the profile, false unless it's one of the
+    image this source assembles to */
+static bool asm_layout_profile(asm_state_t const* state, struct asm_layout* l, const char *path) {
+    struct asm_section const* data = &state->sections[SECTION_DATA];
+    uint8_t *relax = calloc(state->n_fixups + 1, sizeof(*relax));
+    uint32_t *grown = malloc((state->n_fixups + 1) * sizeof(*grown));
+    unsigned long *count = NULL, *taken = NULL, len, c, t;
+    size_t n_grown = 0, image = 0;
+    unsigned pc;
+    char line[128];
+    bool ok = false;
+    FILE *f = fopen(path, "r");
+    if (f != NULL && relax != NULL && grown != NULL) {
+        n_grown = asm_relax_plan(state, relax, grown);
+        image = state->out_len + 4 * n_grown;
+        if (data->out_len != 0)
+            image = ((image + data->align - 1) & ~(size_t)(data->align - 1)) + data->out_len;
+        count = calloc(image / 4 + 1, sizeof(*count));
+        taken = calloc(image / 4 + 1, sizeof(*taken));
+        ok = count != NULL && taken != NULL && fgets(line, sizeof(line), f) != NULL
+            && sscanf(line, "# xm_sim exec profile: image %lu", &len) == 1 && len == image;
+    }
+    while (ok && fgets(line, sizeof(line), f) != NULL) {
+        /* Past the image is ROM fill, halt */
+        ok = sscanf(line, "%x %lu %lu", &pc, &c, &t) == 3 && pc >= XM_SIM_ROM_BASE && pc % 4 == 0;
+        if (ok && pc - XM_SIM_ROM_BASE < image) {
+            count[(pc - XM_SIM_ROM_BASE) / 4] = c;
+            taken[(pc - XM_SIM_ROM_BASE) / 4] = t;
+        }
+    }
+    for (size_t i = 0; ok && i < l->n; ++i) {
+        uint32_t p = (uint32_t)i * 4, w = (p + asm_relax_shift(grown, n_grown, p)) / 4;
+        uint8_t mode = l->fixup_at[i] != 0 ? relax[l->fixup_at[i] - 1] : 0;
+        l->count[i] = count[w];
+        /* A grown branch was taken when the jump after it ran */
+        l->taken[i] = mode == 2 ? count[w + 1] : mode == 1 ? count[w] : taken[w];
+    }
+    if (f != NULL)
+        fclose(f);
+    free(relax);
+    free(grown);
+    free(count);
+    free(taken);
+    return ok;
+}
+
+static bool asm_layout_ends_flow(const uint8_t *ob) {
+    return ob[0] == XM_CB_INTEGER && (ob[3] == asm_inst_op("jmp") || ob[3] == asm_inst_op("jmprel")
+        || ob[3] == asm_inst_op("ret") || (ob[3] == asm_inst_op("b") && (ob[1] >> 4) == 0));
+}
+
+/* Marks where blocks start, false if some code depends on where it is */
+static bool asm_layout_leaders(asm_state_t const* state, struct asm_layout* l) {
+    const uint8_t op_jmp = asm_inst_op("jmp"), op_jmprel = asm_inst_op("jmprel"), op_ret = asm_inst_op("ret");
+    const uint8_t op_call = asm_inst_op("call"), op_bgpc = asm_inst_op("bgpc"), op_bgpcrela = asm_inst_op("bgpcrela");
+    l->lead[0] = 1;
+    for (size_t i = 0; i < state->n_raw; ++i) {
+        uint32_t a = state->raw[i].pc / 4, e = (state->raw[i].pc + state->raw[i].len) / 4;
+        const uint8_t *ob = (const uint8_t *)state->out + a * 4;
+        memset(l->raw + a, 1, e - a);
+        if (ob[0] == XM_CB_INTEGER && ob[3] == op_jmprel && (int16_t)(ob[1] << 8 | ob[2]) == (int32_t)state->raw[i].len)
+            l->raw[a] = 2;
+    }
     for (size_t i = 0; i < state->n_labels; ++i) {
-        struct asm_label *l = &state->labels[i];
-        if (!strcmp(l->name, name))
-            return *l;
+        struct asm_label const* lb = &state->labels[i];
+        uint32_t w = lb->pc / 4;
+        if (!lb->defined || lb->section != SECTION_TEXT || lb->pc % 4 != 0 || w >= l->n
+        || (w != 0 && l->raw[w] == 1 && l->raw[w - 1] != 0))
+            continue;
+        l->lead[w] |= lb->global ? 3 : 1;
+    }
+    for (size_t i = 0; i < l->n; ++i) {
+        const uint8_t *ob = (const uint8_t *)state->out + i * 4;
+        struct asm_label const* lb;
+        if (l->raw[i] != 0 || ob[0] != XM_CB_INTEGER)
+            continue;
+        if (ob[3] == op_bgpc || ob[3] == op_bgpcrela || (ob[3] == op_call && l->fixup_at[i] != 0))
+            return false;
+        if (ob[3] == op_ret)
+            l->lead[i + 1] = 1;
+        if ((ob[3] < 0x50 || ob[3] > 0x5f) && ob[3] != op_jmp && ob[3] != op_jmprel)
+            continue;
+        if (l->fixup_at[i] == 0)
+            return false;
+        lb = &state->labels[state->fixups[l->fixup_at[i] - 1].label];
+        if (!lb->defined || lb->section != SECTION_TEXT || lb->pc % 4 != 0
+        || (lb->pc != state->out_len && (lb->pc > state->out_len || !l->lead[lb->pc / 4])))
+            return false;
+        l->lead[i + 1] = 1;
+    }
+    return true;
+}
+
+static void asm_layout_blocks(asm_state_t const* state, struct asm_layout* l) {
+    uint32_t func = 0;
+    l->n_blocks = 0;
+    for (size_t i = 0; i < l->n; ++i) {
+        struct asm_block *b = &l->blocks[l->n_blocks];
+        if (l->lead[i] != 0) {
+            func += i != 0 && (l->lead[i] & 2) != 0;
+            *b = (struct asm_block){(uint32_t)i, (uint32_t)i, l->count[i], 0, LAYOUT_END, 0, func, UINT32_MAX,
+                BLOCK_FALL, LAYOUT_END, false, (uint32_t)l->n_blocks};
+            ++l->n_blocks;
+        }
+        l->blocks[l->n_blocks - 1].end = (uint32_t)i + 1;
+        l->block_of[i] = (uint32_t)l->n_blocks - 1;
+    }
+    for (size_t k = 0; k < l->n_blocks; ++k) {
+        struct asm_block *b = &l->blocks[k];
+        uint32_t last = b->end - 1, w = last;
+        const uint8_t *ob = (const uint8_t *)state->out + last * 4;
+        if (l->raw[last] != 0) {
+            /* Data stays with the code before, which may well run into it */
+            while (l->raw[w] == 1 && w != 0 && l->raw[w - 1] != 0)
+                --w;
+            b->kind = l->raw[w] != 2 && w != 0 && l->raw[w - 1] == 0
+                && asm_layout_ends_flow((const uint8_t *)state->out + (w - 1) * 4) ? BLOCK_STOP : BLOCK_FALL;
+            continue;
+        }
+        if (l->fixup_at[last] == 0) {
+            b->kind = asm_layout_ends_flow(ob) ? BLOCK_STOP : BLOCK_FALL;
+            continue;
+        }
+        if ((ob[3] < 0x50 || ob[3] > 0x5f) && !asm_layout_ends_flow(ob))
+            continue; /* call */
+        b->fixup = l->fixup_at[last] - 1;
+        w = state->labels[state->fixups[b->fixup].label].pc / 4;
+        b->target = w < l->n ? l->block_of[w] : LAYOUT_END;
+        b->kind = asm_layout_ends_flow(ob) ? BLOCK_JUMP : BLOCK_BRANCH;
+        b->taken = l->taken[last];
     }
-    fprintf(stderr, "asm_label %s not found\n", name);
-    abort();
 }
 
+struct asm_edge {
+    uint32_t from, to;
+    unsigned long weight;
+};
+
+/* Heaviest first, then the ones that fell through already */
+static int asm_layout_edge_cmp(const void *a, const void *b) {
+    struct asm_edge const* ea = a;
+    struct asm_edge const* eb = b;
+    if (ea->weight != eb->weight)
+        return ea->weight > eb->weight ? -1 : 1;
+    if ((ea->to == ea->from + 1) != (eb->to == eb->from + 1))
+        return ea->to == ea->from + 1 ? -1 : 1;
+    return ea->from < eb->from ? -1 : ea->from > eb->from;
+}
+
+static uint32_t asm_layout_find(struct asm_layout* l, uint32_t k) {
+    while (l->blocks[k].set != k)
+        k = l->blocks[k].set = l->blocks[l->blocks[k].set].set;
+    return k;
+}
+
+/* Chains blocks along the most frequent edges first, each joining the tail
+    of one chain to the head of another within a function, the entry and
+    function starts staying heads. Then come the chains that ran in the order
+    of their heads, and the blocks that didn't, each once. */
+static void asm_layout_order(struct asm_layout* l, uint32_t *order) {
+    struct asm_edge *e = malloc(2 * l->n_blocks * sizeof(*e));
+    size_t n_e = 0, at = 0;
+    for (uint32_t k = 0; k < l->n_blocks && e != NULL; ++k) {
+        struct asm_block const* b = &l->blocks[k];
+        struct asm_edge out[2] = {
+            {k, k + 1, b->kind == BLOCK_FALL ? b->count : b->kind == BLOCK_BRANCH ? b->count - b->taken : 0},
+            {k, b->target, b->kind == BLOCK_JUMP ? b->count : b->kind == BLOCK_BRANCH ? b->taken : 0},
+        };
+        for (size_t i = 0; i < 2; ++i) {
+            uint32_t to = out[i].to;
+            /* A block that ran can fall into one that never did, those stay apart */
+            if (out[i].weight != 0 && to < l->n_blocks && to != k && to != 0 && l->blocks[to].count != 0
+            && l->blocks[to].func == b->func && (l->lead[l->blocks[to].start] & 2) == 0)
+                e[n_e++] = out[i];
+        }
+    }
+    if (e != NULL)
+        qsort(e, n_e, sizeof(*e), asm_layout_edge_cmp);
+    for (size_t i = 0; i < n_e; ++i) {
+        struct asm_block *from = &l->blocks[e[i].from], *to = &l->blocks[e[i].to];
+        if (from->chain != LAYOUT_END || to->joined || asm_layout_find(l, e[i].from) == asm_layout_find(l, e[i].to))
+            continue;
+        from->chain = e[i].to;
+        to->joined = true;
+        l->blocks[asm_layout_find(l, e[i].to)].set = asm_layout_find(l, e[i].from);
+    }
+    free(e);
+    for (uint32_t k = 0; k < l->n_blocks; ++k)
+        if (l->blocks[k].count != 0 && !l->blocks[k].joined)
+            for (uint32_t c = k; c != LAYOUT_END; c = l->blocks[c].chain)
+                order[at++] = c;
+    for (uint32_t k = 0; k < l->n_blocks; ++k)
+        if (l->blocks[k].count == 0 && !l->blocks[k].joined && l->blocks[k].chain == LAYOUT_END)
+            order[at++] = k;
+}
+
+/* Fixups by section and offset, which relaxing relies on */
+static int asm_layout_fixup_cmp(const void *a, const void *b) {
+    struct asm_fixup const* fa = a;
+    struct asm_fixup const* fb = b;
+    if (fa->section != fb->section)
+        return fa->section < fb->section ? -1 : 1;
+    return fa->offset < fb->offset ? -1 : fa->offset > fb->offset;
+}
+
+/* Of block k, or the end of .text for LAYOUT_END */
+static uint32_t asm_layout_label(asm_state_t* state, struct asm_layout* l, uint32_t k) {
+    uint32_t *label = k != LAYOUT_END ? &l->blocks[k].label : &l->end_label;
+    if (*label == UINT32_MAX) {
+        *label = asm_new_label(state);
+        state->labels[*label].pc = k != LAYOUT_END ? l->blocks[k].start * 4 : (uint32_t)state->out_len;
+        state->labels[*label].defined = true;
+    }
+    return *label;
+}
+
+/* Writes the blocks out in order, fixing up how each one leaves, and moves
+    labels, fixups, data ranges and lines along */
+static void asm_layout_emit(asm_state_t* state, struct asm_layout* l, uint32_t const* order) {
+    struct asm_section *text = &state->sections[SECTION_TEXT];
+    uint8_t *out = malloc(state->out_len + 4 * l->n_blocks);
+    uint32_t *pos = malloc((l->n + 1) * sizeof(*pos)); /* New instruction index */
+    uint32_t (*added)[2] = malloc(l->n_blocks * sizeof(*added)); /* Jumps added, pc and label */
+    uint8_t *drop = calloc(state->n_fixups + 1, sizeof(*drop));
+    uint32_t *line_of = malloc((l->n + 1) * sizeof(*line_of)); /* Index into text->lines */
+    struct asm_line *lines = malloc((l->n + l->n_blocks + 1) * sizeof(*lines));
+    size_t at = 0, n_added = 0, n_kept = 0, n_lines = 0, last_line = SIZE_MAX;
+    ASM_ERROR_IF(out == NULL || pos == NULL || added == NULL || drop == NULL || line_of == NULL || lines == NULL);
+    if (out == NULL || pos == NULL || added == NULL || drop == NULL || line_of == NULL || lines == NULL) {
+        free(out);
+        free(pos);
+        free(added);
+        free(drop);
+        free(line_of);
+        free(lines);
+        return;
+    }
+    for (size_t i = 0, j = 0; i < l->n; ++i) {
+        while (j + 1 < text->n_lines && text->lines[j + 1].pc <= 4 * i)
+            ++j;
+        line_of[i] = (uint32_t)j;
+    }
+    for (size_t k = 0; k < l->n_blocks; ++k) {
+        struct asm_block *b = &l->blocks[order[k]];
+        uint32_t next = k + 1 < l->n_blocks ? order[k + 1] : LAYOUT_END;
+        uint32_t fall = order[k] + 1 < l->n_blocks ? order[k] + 1 : LAYOUT_END;
+        for (uint32_t i = b->start; i < b->end; ++i) {
+            pos[i] = (uint32_t)at;
+            /* A jump to what follows anyway */
+            if (i == b->end - 1 && b->kind == BLOCK_JUMP && b->target == next) {
+                drop[b->fixup] = 1;
+                continue;
+            }
+            if (text->n_lines != 0 && line_of[i] != last_line) {
+                last_line = line_of[i];
+                lines[n_lines] = text->lines[last_line];
+                lines[n_lines++].pc = (uint32_t)at * 4;
+            }
+            memcpy(out + 4 * at++, state->out + 4 * i, 4);
+        }
+        if (b->kind == BLOCK_BRANCH && b->target == next && fall != next) {
+            /* Falls through to where it went, branches where it fell */
+            out[4 * (at - 1) + 1] ^= 0x10;
+            state->fixups[b->fixup].label = asm_layout_label(state, l, fall);
+        } else if ((b->kind == BLOCK_BRANCH || b->kind == BLOCK_FALL) && fall != next) {
+            uint8_t ob[4] = {XM_CB_INTEGER, 0, 0, asm_inst_op("b")};
+            added[n_added][0] = (uint32_t)at * 4;
+            added[n_added++][1] = asm_layout_label(state, l, fall);
+            lines[n_lines++] = (struct asm_line){(uint32_t)at * 4, 0, false};
+            last_line = SIZE_MAX;
+            memcpy(out + 4 * at++, ob, 4);
+        }
+    }
+    pos[l->n] = (uint32_t)at;
+    for (size_t i = 0; i < state->n_labels; ++i) {
+        struct asm_label *lb = &state->labels[i];
+        if (lb->defined && lb->section == SECTION_TEXT)
+            lb->pc = pos[lb->pc / 4] * 4 + lb->pc % 4;
+    }
+    for (size_t i = 0; i < state->n_fixups; ++i) {
+        struct asm_fixup f = state->fixups[i];
+        if (drop[i])
+            continue;
+        if (f.section == SECTION_TEXT) {
+            f.pc = pos[f.pc / 4] * 4 + f.pc % 4;
+            f.offset = pos[f.offset / 4] * 4 + f.offset % 4;
+        }
+        state->fixups[n_kept++] = f;
+    }
+    state->n_fixups = n_kept;
+    for (size_t i = 0; i < n_added; ++i)
+        state->fixups[state->n_fixups++] = (struct asm_fixup){added[i][1], FIXUP_REL_O16S8, added[i][0],
+            added[i][0], SECTION_TEXT};
+    qsort(state->fixups, state->n_fixups, sizeof(*state->fixups), asm_layout_fixup_cmp);
+    for (size_t i = 0; i < state->n_raw; ++i)
+        state->raw[i].pc = pos[state->raw[i].pc / 4] * 4;
+    free(text->lines);
+    text->lines = lines;
+    text->n_lines = n_lines;
+    text->cap_lines = l->n + l->n_blocks + 1;
+    asm_tidy_lines(text);
+    memcpy(state->out, out, 4 * at);
+    state->out_len = 4 * at;
+    state->pc = (uint32_t)state->out_len;
+    free(out);
+    free(pos);
+    free(added);
+    free(drop);
+    free(line_of);
+}
+
+static void asm_layout(asm_state_t* state, const char *path) {
+    struct asm_layout l = {0};
+    uint32_t *order = NULL;
+    bool aligned = state->text_align <= 4;
+    for (size_t i = 0; i < state->n_raw; ++i)
+        aligned &= state->raw[i].pc % 4 == 0 && state->raw[i].len % 4 == 0;
+    ASM_ERROR_IF(state->object, "-profile skipped, it's for images");
+    ASM_ERROR_IF(!aligned, "-profile skipped, .text has alignment or data it can't move");
+    if (state->object || !aligned || state->out_len == 0)
+        return;
+    l.n = state->out_len / 4;
+    l.end_label = UINT32_MAX;
+    l.blocks = malloc(l.n * sizeof(*l.blocks));
+    l.block_of = malloc(l.n * sizeof(*l.block_of));
+    l.fixup_at = calloc(l.n + 1, sizeof(*l.fixup_at));
+    l.raw = calloc(l.n + 1, sizeof(*l.raw));
+    l.lead = calloc(l.n + 1, sizeof(*l.lead));
+    l.count = calloc(l.n + 1, sizeof(*l.count));
+    l.taken = calloc(l.n + 1, sizeof(*l.taken));
+    order = malloc(l.n * sizeof(*order));
+    ASM_ERROR_IF(l.blocks == NULL || l.block_of == NULL || l.fixup_at == NULL || l.raw == NULL
+        || l.lead == NULL || l.count == NULL || l.taken == NULL || order == NULL);
+    if (l.blocks != NULL && l.block_of != NULL && l.fixup_at != NULL && l.raw != NULL
+    && l.lead != NULL && l.count != NULL && l.taken != NULL && order != NULL) {
+        bool matched, movable;
+        for (size_t i = 0; i < state->n_fixups; ++i) {
+            struct asm_fixup const* f = &state->fixups[i];
+            if (f->section == SECTION_TEXT && (f->type == FIXUP_REL_O16S8 || f->type == FIXUP_REL_O8S16
+            || f->type == FIXUP_ABS_O8S16))
+                l.fixup_at[f->offset / 4] = (uint32_t)i + 1;
+        }
+        matched = asm_layout_profile(state, &l, path) && l.count[0] != 0;
+        ASM_ERROR_IF(!matched, "-profile skipped, %s isn't one of this image", path);
+        movable = matched && asm_layout_leaders(state, &l);
+        ASM_ERROR_IF(matched && !movable, "-profile skipped, .text has code that depends on where it is");
+        if (movable) {
+            asm_layout_blocks(state, &l);
+            asm_layout_order(&l, order);
+            asm_layout_emit(state, &l, order);
+        }
+    }
+    free(l.blocks);
+    free(l.block_of);
+    free(l.fixup_at);
+    free(l.raw);
+    free(l.lead);
+    free(l.count);
+    free(l.taken);
+    free(order);
+}
+
+/* An image has .data right after .text, both in ROM */
+static void asm_merge_sections(asm_state_t* state) {
+    struct asm_section *data = &state->sections[SECTION_DATA];
+    uint32_t base = (uint32_t)((state->out_len + data->align - 1) & ~(size_t)(data->align - 1));
+    asm_select_section(state, SECTION_TEXT);
+    if (data->out_len == 0)
+        return;
+    if (base != state->out_len)
+        asm_mark_line(state, 0, true);
+    for (size_t i = 0; i < data->n_lines; ++i)
+        asm_add_line(&state->sections[SECTION_TEXT], (struct asm_line){base + data->lines[i].pc,
+            data->lines[i].line, data->lines[i].data});
+    data->n_lines = 0;
+    memset(state->out + state->out_len, 0, base - state->out_len);
+    memcpy(state->out + base, data->out, data->out_len);
+    state->out_len = base + data->out_len;
+    state->pc = (uint32_t)state->out_len;
+    for (size_t i = 0; i < state->n_labels; ++i)
+        if (state->labels[i].section == SECTION_DATA) {
+            state->labels[i].pc += base;
+            state->labels[i].section = SECTION_TEXT;
+        }
+    for (size_t i = 0; i < state->n_fixups; ++i)
+        if (state->fixups[i].section == SECTION_DATA) {
+            state->fixups[i].pc += base;
+            state->fixups[i].offset += base;
+            state->fixups[i].section = SECTION_TEXT;
+        }
+    data->out_len = data->pc = 0;
+}
+
+/* Objects keep the fixups to other objects or sections and the absolute
+    ones, which become relocations */
 static void asm_fixup(asm_state_t* state) {
+    size_t n_kept = 0;
     for (size_t i = 0; i < state->n_fixups; ++i) {
         struct asm_fixup *f = &state->fixups[i];
-        struct asm_label l = asm_find_label(state, f->name);
+        struct asm_label l = state->labels[f->label];
+        char *out = f->section == state->section ? state->out : state->sections[f->section].out;
+        if (state->object && (!l.defined || l.section != f->section || f->type == FIXUP_ABS_O8S16
+        || f->type == FIXUP_ABS_O0S32 || f->type == FIXUP_ADDR)) {
+            state->fixups[n_kept++] = *f;
+            continue;
+        }
+        if (!l.defined) {
+            fprintf(stderr, "asm_label %.*s not found\n", (int)l.len, l.name);
+            abort();
+        }
         char ob[8], oc;
         switch (f->type) {
         case FIXUP_REL_O16S8: {
             int32_t rela = (int32_t)(l.pc - f->pc);
             ASM_ERROR_IF(rela < INT8_MIN || rela > INT8_MAX);
             /* 0<cb> 1<R8> 2<A8> 3<op> */
-            state->out[f->offset + 2] = (int8_t)rela;
+            out[f->offset + 2] = (int8_t)rela;
+            break;
+        }
+        case FIXUP_REL_O8S16: {
+            int32_t rela = (int32_t)(l.pc - f->pc);
+            ASM_ERROR_IF(rela < INT16_MIN || rela > INT16_MAX);
+            /* 0<cb> 1<A16> 3<op> */
+            out[f->offset + 1] = (uint8_t)(rela >> 8);
+            out[f->offset + 2] = (uint8_t)rela;
+            break;
+        }
+        case FIXUP_ABS_O8S16: {
+            uint32_t abs = XM_SIM_ROM_BASE + l.pc;
+            ASM_ERROR_IF(abs > UINT16_MAX);
+            out[f->offset + 1] = (uint8_t)(abs >> 8);
+            out[f->offset + 2] = (uint8_t)abs;
+            break;
+        }
+        case FIXUP_ABS_O0S32: {
+            uint32_t abs = XM_SIM_ROM_BASE + l.pc;
+            for (size_t b = 0; b < 4; ++b)
+                out[f->offset + b] = (uint8_t)(abs >> (8 * (3 - b)));
+            break;
+        }
+        case FIXUP_ADDR: {
+            uint32_t abs = XM_SIM_ROM_BASE + l.pc;
+            ASM_ERROR_IF((abs & 3) != 0 || (abs >> 10) > UINT8_MAX, "can't load from %x", abs);
+            /* or $rD,$rD,A >> 10 then ld $rD,$rD,(A & 0x3ff) / 4 */
+            out[f->offset + 6] = (uint8_t)(abs >> 10);
+            out[f->offset + 14] = (uint8_t)((abs & 0x3ff) / 4);
             break;
         }
         default:
             abort();
         }
     }
+    state->n_fixups = n_kept;
 }
 
 static void asm_initialise(asm_state_t* state) {
     state->out = mmap(NULL, OUT_MAX_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANON, -1, 0);
     state->out_len = 0;
+    state->sections[SECTION_DATA].out = mmap(NULL, OUT_MAX_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANON, -1, 0);
+    for (size_t i = 0; i < SECTION_COUNT; ++i)
+        state->sections[i].align = 4;
+    state->section = SECTION_TEXT;
     state->labels = mmap(NULL, LIST_MAX_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANON, -1, 0);
     state->n_labels = 0;
     state->fixups = mmap(NULL, LIST_MAX_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANON, -1, 0);
     state->n_fixups = 0;
+    state->names = mmap(NULL, NAMES_MAX_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANON, -1, 0);
+    state->names_len = 0;
+    state->label_hash = NULL;
+    state->label_hash_size = 0;
+    asm_inst_hash_init();
 }
 
 static void asm_add_input_file(asm_state_t* state, int fd) {
     struct stat st;
-    fstat(fd, &st);
-    state->in = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE | MAP_PREFAULT_READ, fd, 0);
-    state->in_len = st.st_size;
     state->fd_in = fd;
+    state->in_done = 0;
+    state->in_stream = fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) || st.st_size == 0;
+    if (state->in_stream) {
+        state->in = mmap(NULL, IN_MAX_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANON, -1, 0);
+        state->in_len = 0;
+        state->in_map_len = IN_MAX_SIZE;
+    } else {
+        state->in = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE | MAP_PREFAULT_READ, fd, 0);
+        state->in_len = state->in_map_len = st.st_size;
+    }
 }
 
 static void asm_add_output_file(asm_state_t* state, int fd) {
     state->fd_out = fd;
 }
 
+/* Header, .text and .data, symbols for every label, relocations, then the
+    names the labels already point into as the strings */
+static void asm_write_object(asm_state_t* state) {
+    static const char zero[4];
+    static const uint32_t reloc_types[] = {
+        [FIXUP_REL_O16S8] = XM_RELOC_REL8,
+        [FIXUP_REL_O8S16] = XM_RELOC_REL16,
+        [FIXUP_ABS_O8S16] = XM_RELOC_ABS16,
+        [FIXUP_ABS_O0S32] = XM_RELOC_ABS32,
+        [FIXUP_ADDR] = XM_RELOC_ADDR,
+    };
+    struct xm_obj_header h = {0};
+    struct xm_obj_section sec[SECTION_COUNT];
+    struct xm_obj_symbol *syms = calloc(state->n_labels + 1, sizeof(*syms));
+    struct xm_obj_reloc *relocs = calloc(state->n_fixups + 1, sizeof(*relocs));
+    uint32_t at = (uint32_t)(sizeof(h) + sizeof(sec));
+    ASM_ERROR_IF(syms == NULL || relocs == NULL);
+    if (syms == NULL || relocs == NULL)
+        abort();
+    asm_select_section(state, SECTION_TEXT);
+    h.strings_len = (uint32_t)state->names_len;
+    for (size_t i = 0; i < SECTION_COUNT; ++i) {
+        size_t len = strlen(asm_section_names[i]);
+        memcpy(state->names + h.strings_len, asm_section_names[i], len);
+        sec[i] = (struct xm_obj_section){h.strings_len, (uint32_t)len, at, (uint32_t)state->sections[i].out_len,
+            state->sections[i].align};
+        h.strings_len += (uint32_t)len;
+        at += (sec[i].size + 3) & ~3u;
+    }
+    for (size_t i = 0; i < state->n_labels; ++i) {
+        struct asm_label const* l = &state->labels[i];
+        syms[i] = (struct xm_obj_symbol){(uint32_t)(l->name - state->names), l->len, l->hash,
+            l->defined ? l->section : XM_OBJ_UNDEF, l->defined ? l->pc : 0,
+            l->global || !l->defined ? XM_OBJ_GLOBAL : 0};
+    }
+    for (size_t i = 0; i < state->n_fixups; ++i)
+        relocs[i] = (struct xm_obj_reloc){state->fixups[i].section, state->fixups[i].offset, state->fixups[i].label,
+            reloc_types[state->fixups[i].type], 0};
+    h.magic = XM_OBJ_MAGIC;
+    h.n_sections = SECTION_COUNT;
+    h.sections = sizeof(h);
+    h.n_symbols = (uint32_t)state->n_labels;
+    h.symbols = at;
+    h.n_relocs = (uint32_t)state->n_fixups;
+    h.relocs = h.symbols + h.n_symbols * (uint32_t)sizeof(*syms);
+    h.strings = h.relocs + h.n_relocs * (uint32_t)sizeof(*relocs);
+    write(state->fd_out, &h, sizeof(h));
+    write(state->fd_out, sec, sizeof(sec));
+    for (size_t i = 0; i < SECTION_COUNT; ++i) {
+        write(state->fd_out, state->sections[i].out, sec[i].size);
+        write(state->fd_out, zero, (4 - sec[i].size % 4) % 4);
+    }
+    write(state->fd_out, syms, h.n_symbols * sizeof(*syms));
+    write(state->fd_out, relocs, h.n_relocs * sizeof(*relocs));
+    write(state->fd_out, state->names, h.strings_len);
+    free(syms);
+    free(relocs);
+}
+
+/* Named labels and the source lines of the image, at their ROM addresses */
+static void asm_write_map(asm_state_t* state) {
+    struct asm_section *text = &state->sections[SECTION_TEXT];
+    struct xm_map_symbol *symbols = malloc((state->n_labels + 1) * sizeof(*symbols));
+    struct xm_map_line *lines;
+    struct xm_map_file file = {(uint32_t)state->names_len, (uint32_t)strlen(state->source)};
+    size_t n_symbols = 0, n_lines = 0;
+    asm_tidy_lines(text);
+    lines = malloc((text->n_lines + 1) * sizeof(*lines));
+    ASM_ERROR_IF(symbols == NULL || lines == NULL);
+    if (symbols != NULL && lines != NULL) {
+        for (size_t i = 0; i < state->n_labels; ++i) {
+            struct asm_label const* l = &state->labels[i];
+            if (l->defined && l->len != 0)
+                symbols[n_symbols++] = (struct xm_map_symbol){(uint32_t)(l->name - state->names), l->len,
+                    XM_SIM_ROM_BASE + l->pc, 0, l->global ? XM_MAP_GLOBAL : 0};
+        }
+        for (size_t i = 0; i < text->n_lines && text->lines[i].pc < state->out_len; ++i)
+            lines[n_lines++] = (struct xm_map_line){XM_SIM_ROM_BASE + text->lines[i].pc, 0, text->lines[i].line,
+                text->lines[i].data ? XM_MAP_DATA : 0};
+        memcpy(state->names + state->names_len, state->source, file.name_len);
+        if (xm_map_write(state->map, XM_SIM_ROM_BASE, (uint32_t)state->out_len, symbols, n_symbols,
+            lines, n_lines, &file, 1, state->names, state->names_len + file.name_len) != 0)
+            fprintf(stderr, "can't write %s\n", state->map);
+    }
+    free(symbols);
+    free(lines);
+}
+
 static void asm_finish(asm_state_t* state) {
-    write(state->fd_out, state->out, state->out_len);
+    if (state->object)
+        asm_write_object(state);
+    else
+        write(state->fd_out, state->out, state->out_len);
+    if (!state->object && state->map != NULL)
+        asm_write_map(state);
     close(state->fd_out);
     close(state->fd_in);
 
-    munmap(state->in, state->in_len);
+    munmap(state->in, state->in_map_len);
     munmap(state->out, OUT_MAX_SIZE);
+    munmap(state->sections[SECTION_DATA].out, OUT_MAX_SIZE);
     munmap(state->fixups, LIST_MAX_SIZE);
     munmap(state->labels, LIST_MAX_SIZE);
+    munmap(state->names, NAMES_MAX_SIZE);
+    free(state->label_hash);
+    free(state->raw);
+    for (size_t i = 0; i < SECTION_COUNT; ++i)
+        free(state->sections[i].lines);
+    free(state->map);
 }
 
 int main(int argc, char *argv[]) {
     static struct asm_state state = {0};
     int fd_in = fileno(stdin), fd_out = fileno(stdout);
+    long jobs = sysconf(_SC_NPROCESSORS_ONLN);
     if (argc <= 2) {
-        fprintf(stderr, "%s <in> <out>\n", argv[0]);
+        fprintf(stderr, "%s <in> <out> [-c] [-O] [-profile file] [-jobs n], - for stdin or stdout\n", argv[0]);
         return EXIT_FAILURE;
     }
-    fd_in = open(argv[1], O_RDONLY);
-    fd_out = open(argv[2], O_CREAT | O_TRUNC | O_WRONLY, 0755);
+    for (int i = 3; i < argc; ++i) {
+        if (strcmp(argv[i], "-jobs") == 0 && i + 1 < argc)
+            jobs = atol(argv[++i]);
+        else if (strcmp(argv[i], "-c") == 0)
+            state.object = true;
+        else if (strcmp(argv[i], "-O") == 0)
+            state.optimise = true;
+        else if (strcmp(argv[i], "-profile") == 0 && i + 1 < argc)
+            state.profile = argv[++i];
+        else {
+            fprintf(stderr, "unknown option %s\n", argv[i]);
+            return EXIT_FAILURE;
+        }
+    }
+    state.jobs = jobs > 0 ? (unsigned)jobs : 1;
+    state.source = strcmp(argv[1], "-") != 0 ? argv[1] : "<stdin>";
+    if (strcmp(argv[1], "-") != 0)
+        fd_in = open(argv[1], O_RDONLY);
+    if (strcmp(argv[2], "-") != 0) {
+        fd_out = open(argv[2], O_CREAT | O_TRUNC | O_WRONLY, 0755);
+        /* <out>.map, for xm_sim and xm_dis */
+        if ((state.map = malloc(strlen(argv[2]) + sizeof(".map"))) != NULL)
+            strcat(strcpy(state.map, argv[2]), ".map");
+    }
     asm_initialise(&state);
     asm_add_input_file(&state, fd_in);
     asm_add_output_file(&state, fd_out);
     asm_assemble(&state);
+    if (state.optimise)
+        asm_peephole(&state);
+    if (state.profile != NULL)
+        asm_layout(&state, state.profile);
+    asm_relax(&state);
+    if (!state.object)
+        asm_merge_sections(&state);
     asm_fixup(&state);
     asm_finish(&state);
     return EXIT_SUCCESS;
@@ -0,0 +1,151 @@
+#include <stdbool.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <limits.h>
+
+#include "isa.h"
+#include "xmsim.h"
+#include "xmdev.h"
+#include "sim.h"
+
+static bool bus_range_is_memory(uint32_t base, uint64_t end, size_t ram_size) {
+    return (base < SIM_ROM_BASE + SIM_ROM_SIZE && end > SIM_ROM_BASE)
+        || (base < SIM_RAM_BASE + (uint64_t)ram_size && end > SIM_RAM_BASE);
+}
+
+int xm_dev_map(xm_sim_t *sim, uint32_t base, uint32_t size, const xm_dev_ops_t *ops, void *dev) {
+    uint32_t first = base / PAGE_SIZE;
+    uint64_t end = ((uint64_t)base + size + PAGE_SIZE - 1) / PAGE_SIZE * PAGE_SIZE;
+    struct sim_device *d;
+    if (size == 0 || end > (uint64_t)UINT32_MAX + 1
+    || bus_range_is_memory(first * PAGE_SIZE, end, sim->ram_size)
+    || (d = calloc(1, sizeof(*d))) == NULL)
+        goto fail;
+    for (uint64_t page = first; page < end / PAGE_SIZE; ++page) {
+        if (sim_bus_lookup(sim, page * PAGE_SIZE) != NULL) {
+            free(d);
+            goto fail;
+        }
+    }
+    for (uint64_t page = first; page < end / PAGE_SIZE; ++page) {
+        struct sim_device ***l2 = &sim->mmio[page >> SIM_MMIO_L2_BITS];
+        if (*l2 == NULL && (*l2 = calloc(1 << SIM_MMIO_L2_BITS, sizeof(**l2))) == NULL) {
+            /* Pages mapped so far point at d, leave it mapped but inert */
+            d->base = first * PAGE_SIZE;
+            d->next = sim->devices;
+            sim->devices = d;
+            goto fail;
+        }
+        (*l2)[page & ((1 << SIM_MMIO_L2_BITS) - 1)] = d;
+    }
+    d->base = first * PAGE_SIZE;
+    d->size = end - d->base;
+    d->ops = *ops;
+    d->dev = dev;
+    d->next = sim->devices;
+    sim->devices = d;
+    return 0;
+fail:
+    if (ops->destroy != NULL)
+        ops->destroy(dev);
+    return -1;
+}
+
+uint8_t sim_bus_read(sim_state_t* sim, uint32_t a) {
+    struct sim_device *d = sim_bus_lookup(sim, a);
+    return d->ops.read != NULL ? d->ops.read(sim, d->dev, a - d->base) : 0xff;
+}
+
+void sim_bus_write(sim_state_t* sim, uint32_t a, uint8_t v) {
+    struct sim_device *d = sim_bus_lookup(sim, a);
+    if (d->ops.write != NULL)
+        d->ops.write(sim, d->dev, a - d->base, v);
+}
+
+static bool bus_event_before(struct sim_event const *a, struct sim_event const *b) {
+    return a->tick != b->tick ? a->tick < b->tick : a->seq < b->seq;
+}
+
+int xm_dev_schedule(xm_sim_t *sim, unsigned long tick, xm_dev_event_fn fn, void *dev) {
+    struct sim_event ev;
+    size_t i;
+    if (sim->n_events == sim->cap_events) {
+        size_t cap = sim->cap_events ? sim->cap_events * 2 : 16;
+        struct sim_event *events = realloc(sim->events, cap * sizeof(*events));
+        if (events == NULL)
+            return -1;
+        sim->events = events;
+        sim->cap_events = cap;
+    }
+    ev.tick = tick > sim->perf.ticks ? tick : sim->perf.ticks;
+    ev.seq = sim->event_seq++;
+    ev.fn = fn;
+    ev.dev = dev;
+    for (i = sim->n_events++; i > 0 && bus_event_before(&ev, &sim->events[(i - 1) / 2]); i = (i - 1) / 2)
+        sim->events[i] = sim->events[(i - 1) / 2];
+    sim->events[i] = ev;
+    /* Scheduled from inside xm_sim_run, stop it in time */
+    if (ev.tick < sim->max_ticks)
+        sim->max_ticks = ev.tick;
+    return 0;
+}
+
+unsigned long xm_dev_now(const xm_sim_t *sim) {
+    return sim->perf.ticks;
+}
+
+uint32_t xm_dev_input(xm_sim_t *sim, uint32_t v) {
+    return sim_rr_input(sim, v);
+}
+
+void xm_dev_input_buf(xm_sim_t *sim, void *buf, size_t len) {
+    sim_rr_input_buf(sim, buf, len);
+}
+
+void xm_dev_wait(xm_sim_t *sim) {
+    if ((sim->opt & SIM_OPT_YIELD) == 0)
+        return;
+    sim->wait_hit = true;
+    sim->max_ticks = sim->perf.ticks;
+}
+
+unsigned long sim_bus_next_event(sim_state_t const* sim) {
+    return sim->n_events != 0 ? sim->events[0].tick : ULONG_MAX;
+}
+
+void sim_bus_run_events(sim_state_t* sim) {
+    while (sim->n_events != 0 && sim->events[0].tick <= sim->perf.ticks) {
+        struct sim_event ev = sim->events[0], last = sim->events[--sim->n_events];
+        size_t i = 0;
+        /* Sift the last one down from the root */
+        for (;;) {
+            size_t c = 2 * i + 1;
+            if (c >= sim->n_events)
+                break;
+            if (c + 1 < sim->n_events && bus_event_before(&sim->events[c + 1], &sim->events[c]))
+                ++c;
+            if (!bus_event_before(&sim->events[c], &last))
+                break;
+            sim->events[i] = sim->events[c];
+            i = c;
+        }
+        if (sim->n_events != 0)
+            sim->events[i] = last;
+        ev.fn(sim, ev.dev);
+    }
+}
+
+void sim_bus_destroy(sim_state_t* sim) {
+    while (sim->devices != NULL) {
+        struct sim_device *d = sim->devices;
+        sim->devices = d->next;
+        if (d->size != 0 && d->ops.destroy != NULL)
+            d->ops.destroy(d->dev);
+        free(d);
+    }
+    for (size_t i = 0; i < SIM_MMIO_L1_SIZE; ++i)
+        free(sim->mmio[i]);
+    free(sim->events);
+}
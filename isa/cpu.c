@@ -0,0 +1,1516 @@
+#include <complex.h>
+#include <math.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <assert.h>
+#include <string.h>
+
+#include "isa.h"
+#include "xmsim.h"
+#include "xmdev.h"
+#include "sim.h"
+
+/* Interpreter core
+    Built once per variant by cpu_bare.c, cpu_counters.c and cpu_trace.c,
+    instrumentation a variant goes without is behind a constant false and
+    folds away. bare only keeps the clock (perf.ticks). counters adds the
+    other perf counters, basic block vectors and the profiler's bookkeeping.
+    trace adds the instruction log, memory traces, the heatmap, the execution
+    profile, the timing model, breakpoints and watchpoints. */
+#ifndef CPU_VARIANT
+#error "CPU_VARIANT must be one of SIM_CPU_*"
+#elif CPU_VARIANT == SIM_CPU_BARE
+#define CPU_V(NAME) NAME##_bare
+#define CPU_COUNTERS 0
+#define CPU_TRACE 0
+#elif CPU_VARIANT == SIM_CPU_COUNTERS
+#define CPU_V(NAME) NAME##_counters
+#define CPU_COUNTERS 1
+#define CPU_TRACE 0
+#elif CPU_VARIANT == SIM_CPU_TRACE
+#define CPU_V(NAME) NAME##_trace
+#define CPU_COUNTERS 1
+#define CPU_TRACE 1
+#else
+#error "CPU_VARIANT must be one of SIM_CPU_*"
+#endif
+
+/* Profiler subsystem marks, see prof.c */
+#define CPU_PROF_MARK(SIM, WHERE) do if (CPU_COUNTERS) (SIM)->prof_where = (WHERE); while (0)
+/* Charges the host time spent in STMT to profiler subsystem WHERE */
+#define CPU_PROF(SIM, WHERE, STMT) do { \
+    uint8_t prof_where_ = CPU_COUNTERS ? (SIM)->prof_where : 0; \
+    CPU_PROF_MARK(SIM, WHERE); \
+    STMT; \
+    CPU_PROF_MARK(SIM, prof_where_); \
+} while (0)
+
+/* The store itself goes to the trap page */
+static void cpu_rom_fault(sim_state_t* sim, uint32_t a) {
+    if (sim->fault_hit)
+        return;
+    sim->fault.pc = sim->cpu.pc;
+    sim->fault.addr = a;
+    sim->fault_hit = true;
+    sim->max_ticks = sim->perf.ticks;
+}
+
+static void *cpu_translate(sim_state_t* sim, uint32_t a, int p) {
+    if (CPU_TRACE && sim->heat != NULL)
+        sim_heat_access(sim, a, p);
+    if (CPU_TRACE && (sim->opt & SIM_OPT_TRACE_MEM) != 0) {
+        SIM_LOG(sim, "%8x %c%c%c\n", a,
+            (p & XM_PAGE_R) ? 'R' : '.',
+            (p & XM_PAGE_W) ? 'W' : '.',
+            (p & XM_PAGE_X) ? 'X' : '.');
+    }
+    /* ROM is read-only, writes land in the trap page */
+    if (a >= SIM_ROM_BASE && a < SIM_ROM_BASE + SIM_ROM_SIZE && (p & XM_PAGE_W) == 0)
+        return a - SIM_ROM_BASE < sim->rom_size
+            ? (void*)(sim->rom + a - SIM_ROM_BASE)
+            : (void*)(sim->fill_page + (a % PAGE_SIZE));
+    else if (a >= SIM_RAM_BASE && a - SIM_RAM_BASE < sim->ram_size)
+        return (void*)(sim->ram + a - SIM_RAM_BASE);
+    /* Device registers, the caller goes through the bus */
+    else if (sim_bus_lookup(sim, a) != NULL)
+        return NULL;
+    if (a - SIM_ROM_BASE < SIM_ROM_SIZE)
+        cpu_rom_fault(sim, a);
+    return sim->trap_page + (a % PAGE_SIZE);
+}
+static uint8_t cpu_load8(sim_state_t* sim, uint32_t addr, int perm) {
+    uint8_t const *p = cpu_translate(sim, addr, perm);
+    uint8_t v;
+    if (CPU_COUNTERS)
+        ++sim->perf.reads;
+    if (p != NULL)
+        return *p;
+    CPU_PROF(sim, SIM_PROF_DEVICE, v = sim_bus_read(sim, addr));
+    return v;
+}
+static uint8_t cpu_fetch8(sim_state_t* sim, uint32_t addr) {
+    return cpu_load8(sim, addr, XM_PAGE_R);
+}
+/* Guest loads and stores, only from instruction handlers */
+static uint8_t cpu_read8(sim_state_t* sim, uint32_t addr) {
+    uint8_t v;
+    if (CPU_TRACE && sim_dbg_watched(sim, addr, XM_SIM_WATCH_R))
+        sim_dbg_watch(sim, addr, XM_SIM_WATCH_R);
+    if (CPU_TRACE && sim->timing != NULL)
+        CPU_PROF(sim, SIM_PROF_TIMING, sim_timing_data(sim, addr));
+    CPU_PROF_MARK(sim, SIM_PROF_MEMORY);
+    v = cpu_fetch8(sim, addr);
+    CPU_PROF_MARK(sim, SIM_PROF_EXECUTE);
+    return v;
+}
+static void cpu_store8(sim_state_t* sim, uint32_t addr, uint8_t v) {
+    uint8_t *p = cpu_translate(sim, addr, XM_PAGE_W);
+    if (CPU_COUNTERS)
+        ++sim->perf.writes;
+    if (CPU_TRACE && sim->lock != NULL)
+        sim_lock_store(sim, addr);
+    if (p != NULL)
+        *p = v;
+    else
+        CPU_PROF(sim, SIM_PROF_DEVICE, sim_bus_write(sim, addr, v));
+}
+static void cpu_write8(sim_state_t* sim, uint32_t addr, uint8_t v) {
+    if (CPU_TRACE && sim_dbg_watched(sim, addr, XM_SIM_WATCH_W))
+        sim_dbg_watch(sim, addr, XM_SIM_WATCH_W);
+    if (CPU_TRACE && sim->timing != NULL)
+        CPU_PROF(sim, SIM_PROF_TIMING, sim_timing_data(sim, addr));
+    CPU_PROF_MARK(sim, SIM_PROF_MEMORY);
+    cpu_store8(sim, addr, v);
+    CPU_PROF_MARK(sim, SIM_PROF_EXECUTE);
+}
+
+static uint16_t cpu_read16(sim_state_t* sim, uint32_t addr) {
+    return ((uint16_t)cpu_read8(sim, addr + 0) << 8)
+        | ((uint16_t)cpu_read8(sim, addr + 1) << 0);
+}
+static void cpu_write16(sim_state_t* sim, uint32_t addr, uint16_t v) {
+    cpu_write8(sim, addr + 0, v >> 0);
+    cpu_write8(sim, addr + 1, v >> 8);
+}
+
+static uint32_t cpu_read32(sim_state_t* sim, uint32_t addr) {
+    return ((uint32_t)cpu_read16(sim, addr + 0) << 16)
+        | ((uint32_t)cpu_read16(sim, addr + 2) << 0);
+}
+static void cpu_write32(sim_state_t* sim, uint32_t addr, uint32_t v) {
+    cpu_write16(sim, addr, v >> 0);
+    cpu_write16(sim, addr + 2, v >> 16);
+}
+
+static void cpu_dump_bytes(sim_state_t* sim, uint32_t addr, uint32_t len) {
+    for (uint32_t i = 0; i < len; ++i)
+        SIM_LOG(sim, "%02x%c", cpu_read8(sim, addr + i), (i + 1) % 32 == 0 ? '\n' : ' ');
+}
+
+/* Bit population count */
+static uint32_t cpu_i_popcount(uint32_t v) {
+    uint32_t c = 0;
+    for (uint32_t i = 0; i < 32; ++i)
+        if ((v & (1 << i)) != 0)
+            ++c;
+    return c;
+}
+/* Count leading zeroes */
+static uint32_t cpu_i_clz(uint32_t v) {
+    uint32_t c = 0;
+    for (uint32_t i = 0; i < 32; ++i) {
+        if ((v & (1 << i)) != 0)
+            break;
+        ++c;
+    }
+    return c;
+}
+/* Count leading ones */
+static uint32_t cpu_i_clo(uint32_t v) {
+    uint32_t c = 0;
+    for (uint32_t i = 0; i < 32; ++i) {
+        if ((v & (1 << i)) != 0)
+            break;
+        ++c;
+    }
+    return c;
+}
+static uint32_t cpu_i_bswap(uint32_t v) {
+    return (((v >> 24) & 0xff) << 0)
+        | (((v >> 16) & 0xff) << 8)
+        | (((v >> 8) & 0xff) << 16)
+        | (((v >> 0) & 0xff) << 24);
+}
+
+static uint32_t cpu_i_add32(sim_state_t* sim, uint32_t a, uint32_t b) {
+    uint64_t result = (uint64_t)a + (uint64_t)b;
+    sim->cpu.flags &= ~FLAGS_BIT_C;
+    sim->cpu.flags |= (result & ~UINT32_MAX) != 0 ? FLAGS_BIT_C : 0;
+    return (uint32_t)result;
+}
+static int32_t cpu_i_sub32(sim_state_t* sim, int32_t a, int32_t b) {
+    int64_t result = (int64_t)a - (int64_t)b;
+    sim->cpu.flags &= ~FLAGS_BIT_C;
+    sim->cpu.flags |= (result & ~UINT32_MAX) != 0 ? FLAGS_BIT_C : 0;
+    return (int32_t)result;
+}
+static float cpu_i_maxf(float a, float b) {
+    return a > b ? a : b;
+}
+static float cpu_i_minf(float a, float b) {
+    return a < b ? a : b;
+}
+static float cpu_i_clampf(float a, float low, float upper) {
+    return cpu_i_minf(cpu_i_maxf(a, low), upper);
+}
+
+#define CPU_INSTRUCTION_FN(NAME) static cpu_execute_result_t cpu_exec_##NAME(sim_state_t* sim, uint8_t id[])
+#define CPU_ALU_UPDATE_FLAGS(VALUE) \
+    sim->cpu.flags &= ~(FLAGS_BIT_Z | FLAGS_BIT_N); \
+    sim->cpu.flags |= (VALUE) == 0 ? FLAGS_BIT_Z : 0; \
+    sim->cpu.flags |= (int32_t)(VALUE) < 0 ? FLAGS_BIT_N : 0;
+
+struct cpu_decode_f4x4 {
+    float *dp;
+    float v[3];
+};
+static struct cpu_decode_f4x4 cpu_decode_f4x4(sim_state_t* sim, uint8_t id[]) {
+    struct cpu_decode_f4x4 ds;
+    ds.dp = &sim->cpu.f[id[1] & 0x0f];
+    ds.v[0] = sim->cpu.f[(id[1] >> 4) & 0x0f];
+    ds.v[1] = sim->cpu.f[id[2] & 0x0f];
+    ds.v[2] = sim->cpu.f[(id[2] >> 4) & 0x0f];
+    return ds;
+}
+CPU_INSTRUCTION_FN(fadd3) {
+    struct cpu_decode_f4x4 ds = cpu_decode_f4x4(sim, id);
+    *ds.dp = ds.v[0] + ds.v[1] + ds.v[2];
+    sim->cpu.pc += 4;
+    return CPUE_CONTINUE;
+}
+CPU_INSTRUCTION_FN(fsub3) {
+    struct cpu_decode_f4x4 ds = cpu_decode_f4x4(sim, id);
+    *ds.dp = (ds.v[0] + ds.v[1]) - ds.v[2];
+    sim->cpu.pc += 4;
+    return CPUE_CONTINUE;
+}
+CPU_INSTRUCTION_FN(fdiv3) {
+    struct cpu_decode_f4x4 ds = cpu_decode_f4x4(sim, id);
+    *ds.dp = (ds.v[0] + ds.v[1]) / ds.v[2];
+    sim->cpu.pc += 4;
+    return CPUE_CONTINUE;
+}
+CPU_INSTRUCTION_FN(fmul3) {
+    struct cpu_decode_f4x4 ds = cpu_decode_f4x4(sim, id);
+    *ds.dp = (ds.v[0] + ds.v[1]) / ds.v[2];
+    sim->cpu.pc += 4;
+    return CPUE_CONTINUE;
+}
+CPU_INSTRUCTION_FN(fmod3) {
+    struct cpu_decode_f4x4 ds = cpu_decode_f4x4(sim, id);
+    *ds.dp = fmod(ds.v[0] + ds.v[1], ds.v[2]);
+    sim->cpu.pc += 4;
+    return CPUE_CONTINUE;
+}
+CPU_INSTRUCTION_FN(fmadd) {
+    struct cpu_decode_f4x4 ds = cpu_decode_f4x4(sim, id);
+    *ds.dp = ds.v[0] + ds.v[1] * ds.v[2];
+    sim->cpu.pc += 4;
+    return CPUE_CONTINUE;
+}
+CPU_INSTRUCTION_FN(fmsub) {
+    struct cpu_decode_f4x4 ds = cpu_decode_f4x4(sim, id);
+    *ds.dp = ds.v[0] - ds.v[1] * ds.v[2];
+    sim->cpu.pc += 4;
+    return CPUE_CONTINUE;
+}
+CPU_INSTRUCTION_FN(fsqrt3) {
+    struct cpu_decode_f4x4 ds = cpu_decode_f4x4(sim, id);
+    *ds.dp = sqrtf(ds.v[0] + ds.v[1] + ds.v[2]);
+    sim->cpu.pc += 4;
+    return CPUE_CONTINUE;
+}
+CPU_INSTRUCTION_FN(fhyp) {
+    struct cpu_decode_f4x4 ds = cpu_decode_f4x4(sim, id);
+    *ds.dp = hypotf(ds.v[0] + ds.v[1], ds.v[2]);
+    sim->cpu.pc += 4;
+    return CPUE_CONTINUE;
+}
+CPU_INSTRUCTION_FN(fnorm) {
+    struct cpu_decode_f4x4 ds = cpu_decode_f4x4(sim, id);
+    *ds.dp = sqrtf(ds.v[0] * ds.v[0] + ds.v[1] * ds.v[1] + ds.v[2] * ds.v[2]);
+    sim->cpu.pc += 4;
+    return CPUE_CONTINUE;
+}
+CPU_INSTRUCTION_FN(fabs) {
+    struct cpu_decode_f4x4 ds = cpu_decode_f4x4(sim, id);
+    *ds.dp = fabs(ds.v[0] + ds.v[1] + ds.v[2]);
+    sim->cpu.pc += 4;
+    return CPUE_CONTINUE;
+}
+CPU_INSTRUCTION_FN(fsign) {
+    struct cpu_decode_f4x4 ds = cpu_decode_f4x4(sim, id);
+    *ds.dp = signbit(ds.v[0] + ds.v[1] + ds.v[2]);
+    sim->cpu.pc += 4;
+    return CPUE_CONTINUE;
+}
+CPU_INSTRUCTION_FN(fnabs) {
+    struct cpu_decode_f4x4 ds = cpu_decode_f4x4(sim, id);
+    *ds.dp = -fabs(ds.v[0] + ds.v[1] + ds.v[2]);
+    sim->cpu.pc += 4;
+    return CPUE_CONTINUE;
+}
+CPU_INSTRUCTION_FN(fcos) {
+    struct cpu_decode_f4x4 ds = cpu_decode_f4x4(sim, id);
+    *ds.dp = cosf(ds.v[0] + ds.v[1] + ds.v[2]);
+    sim->cpu.pc += 4;
+    return CPUE_CONTINUE;
+}
+CPU_INSTRUCTION_FN(fsin) {
+    struct cpu_decode_f4x4 ds = cpu_decode_f4x4(sim, id);
+    *ds.dp = sinf(ds.v[0] + ds.v[1] + ds.v[2]);
+    sim->cpu.pc += 4;
+    return CPUE_CONTINUE;
+}
+CPU_INSTRUCTION_FN(ftan) {
+    struct cpu_decode_f4x4 ds = cpu_decode_f4x4(sim, id);
+    *ds.dp = tanf(ds.v[0] + ds.v[1] + ds.v[2]);
+    sim->cpu.pc += 4;
+    return CPUE_CONTINUE;
+}
+CPU_INSTRUCTION_FN(facos) {
+    struct cpu_decode_f4x4 ds = cpu_decode_f4x4(sim, id);
+    *ds.dp = acosf(ds.v[0] + ds.v[1] + ds.v[2]);
+    sim->cpu.pc += 4;
+    return CPUE_CONTINUE;
+}
+CPU_INSTRUCTION_FN(fatan) {
+    struct cpu_decode_f4x4 ds = cpu_decode_f4x4(sim, id);
+    *ds.dp = atanf(ds.v[0] + ds.v[1] + ds.v[2]);
+    sim->cpu.pc += 4;
+    return CPUE_CONTINUE;
+}
+CPU_INSTRUCTION_FN(fasin) {
+    struct cpu_decode_f4x4 ds = cpu_decode_f4x4(sim, id);
+    *ds.dp = asinf(ds.v[0] + ds.v[1] + ds.v[2]);
+    sim->cpu.pc += 4;
+    return CPUE_CONTINUE;
+}
+CPU_INSTRUCTION_FN(fcbrt) {
+    struct cpu_decode_f4x4 ds = cpu_decode_f4x4(sim, id);
+    *ds.dp = cbrtf(ds.v[0] + ds.v[1] + ds.v[2]);
+    sim->cpu.pc += 4;
+    return CPUE_CONTINUE;
+}
+CPU_INSTRUCTION_FN(fy0) {
+    struct cpu_decode_f4x4 ds = cpu_decode_f4x4(sim, id);
+    *ds.dp = y0f(ds.v[0] + ds.v[1] + ds.v[2]);
+    sim->cpu.pc += 4;
+    return CPUE_CONTINUE;
+}
+CPU_INSTRUCTION_FN(fy1) {
+    struct cpu_decode_f4x4 ds = cpu_decode_f4x4(sim, id);
+    *ds.dp = y1f(ds.v[0] + ds.v[1] + ds.v[2]);
+    sim->cpu.pc += 4;
+    return CPUE_CONTINUE;
+}
+CPU_INSTRUCTION_FN(fj0) {
+    struct cpu_decode_f4x4 ds = cpu_decode_f4x4(sim, id);
+    *ds.dp = j0f(ds.v[0] + ds.v[1] + ds.v[2]);
+    sim->cpu.pc += 4;
+    return CPUE_CONTINUE;
+}
+CPU_INSTRUCTION_FN(fj1) {
+    struct cpu_decode_f4x4 ds = cpu_decode_f4x4(sim, id);
+    *ds.dp = j1f(ds.v[0] + ds.v[1] + ds.v[2]);
+    sim->cpu.pc += 4;
+    return CPUE_CONTINUE;
+}
+CPU_INSTRUCTION_FN(fexp) {
+    struct cpu_decode_f4x4 ds = cpu_decode_f4x4(sim, id);
+    *ds.dp = expf(ds.v[0] + ds.v[1] + ds.v[2]);
+    sim->cpu.pc += 4;
+    return CPUE_CONTINUE;
+}
+CPU_INSTRUCTION_FN(frsqrt) {
+    struct cpu_decode_f4x4 ds = cpu_decode_f4x4(sim, id);
+    *ds.dp = 1.f / sqrtf(ds.v[0] + ds.v[1] + ds.v[2]);
+    sim->cpu.pc += 4;
+    return CPUE_CONTINUE;
+}
+CPU_INSTRUCTION_FN(frcbrt) {
+    struct cpu_decode_f4x4 ds = cpu_decode_f4x4(sim, id);
+    *ds.dp = 1.f / cbrtf (ds.v[0] + ds.v[1] + ds.v[2]);
+    sim->cpu.pc += 4;
+    return CPUE_CONTINUE;
+}
+CPU_INSTRUCTION_FN(fpow2) {
+    struct cpu_decode_f4x4 ds = cpu_decode_f4x4(sim, id);
+    *ds.dp = powf(ds.v[0] + ds.v[1], ds.v[2]);
+    sim->cpu.pc += 4;
+    return CPUE_CONTINUE;
+}
+CPU_INSTRUCTION_FN(fpow3) {
+    struct cpu_decode_f4x4 ds = cpu_decode_f4x4(sim, id);
+    *ds.dp = powf(powf(ds.v[0], ds.v[1]), ds.v[2]);
+    sim->cpu.pc += 4;
+    return CPUE_CONTINUE;
+}
+CPU_INSTRUCTION_FN(fmax) {
+    struct cpu_decode_f4x4 ds = cpu_decode_f4x4(sim, id);
+    *ds.dp = cpu_i_maxf(ds.v[0] + ds.v[1], ds.v[2]);
+    sim->cpu.pc += 4;
+    return CPUE_CONTINUE;
+}
+CPU_INSTRUCTION_FN(fmin) {
+    struct cpu_decode_f4x4 ds = cpu_decode_f4x4(sim, id);
+    *ds.dp = cpu_i_minf(ds.v[0] + ds.v[1], ds.v[2]);
+    sim->cpu.pc += 4;
+    return CPUE_CONTINUE;
+}
+CPU_INSTRUCTION_FN(fclamp) {
+    struct cpu_decode_f4x4 ds = cpu_decode_f4x4(sim, id);
+    *ds.dp = cpu_i_clampf(ds.v[0], ds.v[1], ds.v[2]);
+    sim->cpu.pc += 4;
+    return CPUE_CONTINUE;
+}
+CPU_INSTRUCTION_FN(finv) {
+    struct cpu_decode_f4x4 ds = cpu_decode_f4x4(sim, id);
+    *ds.dp = 1.f / (ds.v[0] + ds.v[1] + ds.v[2]);
+    sim->cpu.pc += 4;
+    return CPUE_CONTINUE;
+}
+CPU_INSTRUCTION_FN(fconstpi) {
+    struct cpu_decode_f4x4 ds = cpu_decode_f4x4(sim, id);
+    *ds.dp = M_PI * (ds.v[0] + ds.v[1] + ds.v[2]);
+    sim->cpu.pc += 4;
+    return CPUE_CONTINUE;
+}
+CPU_INSTRUCTION_FN(fconste) {
+    struct cpu_decode_f4x4 ds = cpu_decode_f4x4(sim, id);
+    *ds.dp = M_E * (ds.v[0] + ds.v[1] + ds.v[2]);
+    sim->cpu.pc += 4;
+    return CPUE_CONTINUE;
+}
+CPU_INSTRUCTION_FN(fconstpi2) {
+    struct cpu_decode_f4x4 ds = cpu_decode_f4x4(sim, id);
+    *ds.dp = M_PI_2 * (ds.v[0] + ds.v[1] + ds.v[2]);
+    sim->cpu.pc += 4;
+    return CPUE_CONTINUE;
+}
+CPU_INSTRUCTION_FN(frad) {
+    struct cpu_decode_f4x4 ds = cpu_decode_f4x4(sim, id);
+    *ds.dp = (ds.v[0] + ds.v[1] + ds.v[2]) * M_PI / 180.f;
+    sim->cpu.pc += 4;
+    return CPUE_CONTINUE;
+}
+CPU_INSTRUCTION_FN(fdeg) {
+    struct cpu_decode_f4x4 ds = cpu_decode_f4x4(sim, id);
+    *ds.dp = (ds.v[0] + ds.v[1] + ds.v[2]) * 180.f / M_PI;
+    sim->cpu.pc += 4;
+    return CPUE_CONTINUE;
+}
+CPU_INSTRUCTION_FN(fsel) {
+    struct cpu_decode_f4x4 ds = cpu_decode_f4x4(sim, id);
+    *ds.dp = (ds.v[0] + ds.v[1] + ds.v[2]);
+    sim->cpu.pc += 4;
+    return CPUE_CONTINUE;
+}
+CPU_INSTRUCTION_FN(fsel2) {
+    struct cpu_decode_f4x4 ds = cpu_decode_f4x4(sim, id);
+    *ds.dp = (ds.v[0] + ds.v[1] + ds.v[2]);
+    sim->cpu.pc += 4;
+    return CPUE_CONTINUE;
+}
+CPU_INSTRUCTION_FN(fgamma) {
+    struct cpu_decode_f4x4 ds = cpu_decode_f4x4(sim, id);
+    *ds.dp = gammaf(ds.v[0] + ds.v[1] + ds.v[2]);
+    sim->cpu.pc += 4;
+    return CPUE_CONTINUE;
+}
+CPU_INSTRUCTION_FN(flgamma) {
+    struct cpu_decode_f4x4 ds = cpu_decode_f4x4(sim, id);
+    *ds.dp = lgammaf(ds.v[0] + ds.v[1] + ds.v[2]);
+    sim->cpu.pc += 4;
+    return CPUE_CONTINUE;
+}
+CPU_INSTRUCTION_FN(fround) {
+    struct cpu_decode_f4x4 ds = cpu_decode_f4x4(sim, id);
+    *ds.dp = roundf(ds.v[0] + ds.v[1] + ds.v[2]);
+    sim->cpu.pc += 4;
+    return CPUE_CONTINUE;
+}
+CPU_INSTRUCTION_FN(ffloor) {
+    struct cpu_decode_f4x4 ds = cpu_decode_f4x4(sim, id);
+    *ds.dp = floorf(ds.v[0] + ds.v[1] + ds.v[2]);
+    sim->cpu.pc += 4;
+    return CPUE_CONTINUE;
+}
+CPU_INSTRUCTION_FN(fceil) {
+    struct cpu_decode_f4x4 ds = cpu_decode_f4x4(sim, id);
+    *ds.dp = ceilf(ds.v[0] + ds.v[1] + ds.v[2]);
+    sim->cpu.pc += 4;
+    return CPUE_CONTINUE;
+}
+CPU_INSTRUCTION_FN(faddcrr) {
+    struct cpu_decode_f4x4 ds = cpu_decode_f4x4(sim, id);
+    float complex c = ds.v[0] + ds.v[1] * I;
+    *ds.dp = creal(c + ds.v[2]);
+    sim->cpu.pc += 4;
+    return CPUE_CONTINUE;
+}
+CPU_INSTRUCTION_FN(fsubcrr) {
+    struct cpu_decode_f4x4 ds = cpu_decode_f4x4(sim, id);
+    float complex c = ds.v[0] + ds.v[1] * I;
+    *ds.dp = creal(c - ds.v[2]);
+    sim->cpu.pc += 4;
+    return CPUE_CONTINUE;
+}
+CPU_INSTRUCTION_FN(fdivcrr) {
+    struct cpu_decode_f4x4 ds = cpu_decode_f4x4(sim, id);
+    float complex c = ds.v[0] + ds.v[1] * I;
+    *ds.dp = creal(c / ds.v[2]);
+    sim->cpu.pc += 4;
+    return CPUE_CONTINUE;
+}
+CPU_INSTRUCTION_FN(fmulcrr) {
+    struct cpu_decode_f4x4 ds = cpu_decode_f4x4(sim, id);
+    float complex c = ds.v[0] + ds.v[1] * I;
+    *ds.dp = creal(c * ds.v[2]);
+    sim->cpu.pc += 4;
+    return CPUE_CONTINUE;
+}
+CPU_INSTRUCTION_FN(fsqrtcrr) {
+    struct cpu_decode_f4x4 ds = cpu_decode_f4x4(sim, id);
+    float complex c = ds.v[0] + ds.v[1] * I;
+    *ds.dp = creal(csqrtf(c) * ds.v[2]);
+    sim->cpu.pc += 4;
+    return CPUE_CONTINUE;
+}
+CPU_INSTRUCTION_FN(faddcri) {
+    struct cpu_decode_f4x4 ds = cpu_decode_f4x4(sim, id);
+    float complex c = ds.v[0] + ds.v[1] * I;
+    *ds.dp = cimag(c + ds.v[2]);
+    sim->cpu.pc += 4;
+    return CPUE_CONTINUE;
+}
+CPU_INSTRUCTION_FN(fsubcri) {
+    struct cpu_decode_f4x4 ds = cpu_decode_f4x4(sim, id);
+    float complex c = ds.v[0] + ds.v[1] * I;
+    *ds.dp = cimag(c - ds.v[2]);
+    sim->cpu.pc += 4;
+    return CPUE_CONTINUE;
+}
+CPU_INSTRUCTION_FN(fdivcri) {
+    struct cpu_decode_f4x4 ds = cpu_decode_f4x4(sim, id);
+    float complex c = ds.v[0] + ds.v[1] * I;
+    *ds.dp = cimag(c / ds.v[2]);
+    sim->cpu.pc += 4;
+    return CPUE_CONTINUE;
+}
+CPU_INSTRUCTION_FN(fmulcri) {
+    struct cpu_decode_f4x4 ds = cpu_decode_f4x4(sim, id);
+    float complex c = ds.v[0] + ds.v[1] * I;
+    *ds.dp = cimag(c * ds.v[2]);
+    sim->cpu.pc += 4;
+    return CPUE_CONTINUE;
+}
+CPU_INSTRUCTION_FN(fsqrtcri) {
+    struct cpu_decode_f4x4 ds = cpu_decode_f4x4(sim, id);
+    float complex c = ds.v[0] + ds.v[1] * I;
+    *ds.dp = cimag(csqrtf(c) * ds.v[2]);
+    sim->cpu.pc += 4;
+    return CPUE_CONTINUE;
+}
+struct cpu_decode_r4f4x3 {
+    uint8_t rd, ra, rb, rc;
+};
+static struct cpu_decode_r4f4x3 cpu_decode_r4f4x3(sim_state_t* sim, uint8_t id[]) {
+    struct cpu_decode_r4f4x3 ds;
+    ds.rd = id[1] & 0x0f;
+    ds.ra = (id[1] >> 4) & 0x0f;
+    ds.rb = id[2] & 0x0f;
+    ds.rc = (id[2] >> 4) & 0x0f;
+    return ds;
+}
+CPU_INSTRUCTION_FN(fcvti) {
+    struct cpu_decode_r4f4x3 ds = cpu_decode_r4f4x3(sim, id);
+    *(float*)(&sim->cpu.r[ds.rd]) = sim->cpu.f[ds.ra] + sim->cpu.f[ds.rb] + sim->cpu.f[ds.rc];
+    sim->cpu.pc += 4;
+    return CPUE_CONTINUE;
+}
+CPU_INSTRUCTION_FN(icvtf) {
+    struct cpu_decode_r4f4x3 ds = cpu_decode_r4f4x3(sim, id);
+    *(uint32_t*)(&sim->cpu.f[ds.rd]) = sim->cpu.r[ds.ra] + sim->cpu.r[ds.rb] + sim->cpu.r[ds.rc];
+    sim->cpu.pc += 4;
+    return CPUE_CONTINUE;
+}
+CPU_INSTRUCTION_FN(fcvtri) {
+    struct cpu_decode_r4f4x3 ds = cpu_decode_r4f4x3(sim, id);
+    sim->cpu.r[ds.rd] = sim->cpu.f[ds.ra] + sim->cpu.f[ds.rb] + sim->cpu.f[ds.rc];
+    sim->cpu.pc += 4;
+    return CPUE_CONTINUE;
+}
+CPU_INSTRUCTION_FN(icvtrf) {
+    struct cpu_decode_r4f4x3 ds = cpu_decode_r4f4x3(sim, id);
+    sim->cpu.f[ds.rd] = sim->cpu.r[ds.ra] + sim->cpu.r[ds.rb] + sim->cpu.r[ds.rc];
+    sim->cpu.pc += 4;
+    return CPUE_CONTINUE;
+}
+struct cpu_decode_r4x2i8_ifhbs {
+    uint32_t *dp;
+    uint32_t addr;
+    uint32_t a;
+    uint32_t b;
+};
+static struct cpu_decode_r4x2i8_ifhbs cpu_decode_r4x2i8_ifhbs(sim_state_t* sim, uint8_t id[]) {
+    struct cpu_decode_r4x2i8_ifhbs ds;
+    if ((id[3] & 0x80) != 0) {
+        uint8_t rd = id[1] & 0x0f;
+        uint8_t ra = (id[1] >> 4) & 0x0f;
+        uint8_t imm = id[2];
+        ds.addr = sim->cpu.r[ra] + imm * 4;
+        ds.dp = &sim->cpu.r[rd];
+        ds.a = sim->cpu.r[ra];
+        ds.b = imm;
+    } else {
+        uint8_t rd = id[1] & 0x0f;
+        uint8_t ra = (id[1] >> 4) & 0x0f;
+        uint8_t rb = id[2] & 0x0f;
+        uint8_t imm = (id[2] >> 4) & 0x0f;
+        ds.addr = sim->cpu.r[ra] + sim->cpu.r[rb] * imm * 4;
+        ds.dp = &sim->cpu.r[rd];
+        ds.a = sim->cpu.r[ra];
+        ds.b = sim->cpu.r[rb] + imm;
+    }
+    return ds;
+}
+CPU_INSTRUCTION_FN(add) {
+    struct cpu_decode_r4x2i8_ifhbs ds = cpu_decode_r4x2i8_ifhbs(sim, id);
+    *ds.dp = ds.a + ds.b;
+    CPU_ALU_UPDATE_FLAGS(*ds.dp);
+    sim->cpu.pc += 4;
+    return CPUE_CONTINUE;
+} 
+CPU_INSTRUCTION_FN(sub) {
+    struct cpu_decode_r4x2i8_ifhbs ds = cpu_decode_r4x2i8_ifhbs(sim, id);
+    *ds.dp = ds.a - ds.b;
+    CPU_ALU_UPDATE_FLAGS(*ds.dp);
+    sim->cpu.pc += 4;
+    return CPUE_CONTINUE;
+} 
+CPU_INSTRUCTION_FN(mul) {
+    struct cpu_decode_r4x2i8_ifhbs ds = cpu_decode_r4x2i8_ifhbs(sim, id);
+    *ds.dp = ds.a * ds.b;
+    CPU_ALU_UPDATE_FLAGS(*ds.dp);
+    sim->cpu.pc += 4;
+    return CPUE_CONTINUE;
+} 
+CPU_INSTRUCTION_FN(div) {
+    struct cpu_decode_r4x2i8_ifhbs ds = cpu_decode_r4x2i8_ifhbs(sim, id);
+    *ds.dp = ds.a / ds.b;
+    CPU_ALU_UPDATE_FLAGS(*ds.dp);
+    sim->cpu.pc += 4;
+    return CPUE_CONTINUE;
+} 
+CPU_INSTRUCTION_FN(rem) {
+    struct cpu_decode_r4x2i8_ifhbs ds = cpu_decode_r4x2i8_ifhbs(sim, id);
+    *ds.dp = ds.a % ds.b;
+    CPU_ALU_UPDATE_FLAGS(*ds.dp);
+    sim->cpu.pc += 4;
+    return CPUE_CONTINUE;
+} 
+CPU_INSTRUCTION_FN(imul) {
+    struct cpu_decode_r4x2i8_ifhbs ds = cpu_decode_r4x2i8_ifhbs(sim, id);
+    *ds.dp = (int32_t)ds.a * (int32_t)ds.b;
+    CPU_ALU_UPDATE_FLAGS(*ds.dp);
+    sim->cpu.pc += 4;
+    return CPUE_CONTINUE;
+} 
+CPU_INSTRUCTION_FN(and) {
+    struct cpu_decode_r4x2i8_ifhbs ds = cpu_decode_r4x2i8_ifhbs(sim, id);
+    *ds.dp = ds.a & ds.b;
+    CPU_ALU_UPDATE_FLAGS(*ds.dp);
+    sim->cpu.pc += 4;
+    return CPUE_CONTINUE;
+} 
+CPU_INSTRUCTION_FN(xor) {
+    struct cpu_decode_r4x2i8_ifhbs ds = cpu_decode_r4x2i8_ifhbs(sim, id);
+    *ds.dp = ds.a ^ ds.b;
+    CPU_ALU_UPDATE_FLAGS(*ds.dp);
+    sim->cpu.pc += 4;
+    return CPUE_CONTINUE;
+} 
+CPU_INSTRUCTION_FN(or) {
+    struct cpu_decode_r4x2i8_ifhbs ds = cpu_decode_r4x2i8_ifhbs(sim, id);
+    *ds.dp = ds.a | ds.b;
+    CPU_ALU_UPDATE_FLAGS(*ds.dp);
+    sim->cpu.pc += 4;
+    return CPUE_CONTINUE;
+} 
+CPU_INSTRUCTION_FN(shl) {
+    struct cpu_decode_r4x2i8_ifhbs ds = cpu_decode_r4x2i8_ifhbs(sim, id);
+    *ds.dp = ds.a << ds.b;
+    CPU_ALU_UPDATE_FLAGS(*ds.dp);
+    sim->cpu.pc += 4;
+    return CPUE_CONTINUE;
+} 
+CPU_INSTRUCTION_FN(shr) {
+    struct cpu_decode_r4x2i8_ifhbs ds = cpu_decode_r4x2i8_ifhbs(sim, id);
+    *ds.dp = ds.a >> ds.b;
+    CPU_ALU_UPDATE_FLAGS(*ds.dp);
+    sim->cpu.pc += 4;
+    return CPUE_CONTINUE;
+} 
+CPU_INSTRUCTION_FN(pcnt) {
+    struct cpu_decode_r4x2i8_ifhbs ds = cpu_decode_r4x2i8_ifhbs(sim, id);
+    *ds.dp = cpu_i_popcount(ds.a + ds.b);
+    CPU_ALU_UPDATE_FLAGS(*ds.dp);
+    sim->cpu.pc += 4;
+    return CPUE_CONTINUE;
+} 
+CPU_INSTRUCTION_FN(clz) {
+    struct cpu_decode_r4x2i8_ifhbs ds = cpu_decode_r4x2i8_ifhbs(sim, id);
+    *ds.dp = cpu_i_clz(ds.a + ds.b);
+    CPU_ALU_UPDATE_FLAGS(*ds.dp);
+    sim->cpu.pc += 4;
+    return CPUE_CONTINUE;
+} 
+CPU_INSTRUCTION_FN(clo) {
+    struct cpu_decode_r4x2i8_ifhbs ds = cpu_decode_r4x2i8_ifhbs(sim, id);
+    *ds.dp = cpu_i_clo(ds.a + ds.b);
+    CPU_ALU_UPDATE_FLAGS(*ds.dp);
+    sim->cpu.pc += 4;
+    return CPUE_CONTINUE;
+} 
+CPU_INSTRUCTION_FN(bswap) {
+    struct cpu_decode_r4x2i8_ifhbs ds = cpu_decode_r4x2i8_ifhbs(sim, id);
+    *ds.dp = cpu_i_bswap(ds.a + ds.b);
+    CPU_ALU_UPDATE_FLAGS(*ds.dp);
+    sim->cpu.pc += 4;
+    return CPUE_CONTINUE;
+} 
+CPU_INSTRUCTION_FN(ipcnt) {
+    struct cpu_decode_r4x2i8_ifhbs ds = cpu_decode_r4x2i8_ifhbs(sim, id);
+    *ds.dp = 32 - cpu_i_popcount(ds.a + ds.b);
+    CPU_ALU_UPDATE_FLAGS(*ds.dp);
+    sim->cpu.pc += 4;
+    return CPUE_CONTINUE;
+} 
+CPU_INSTRUCTION_FN(stb) {
+    struct cpu_decode_r4x2i8_ifhbs ds = cpu_decode_r4x2i8_ifhbs(sim, id);
+    cpu_write8(sim, ds.addr, *ds.dp);
+    sim->cpu.pc += 4;
+    return CPUE_CONTINUE;
+} 
+CPU_INSTRUCTION_FN(stw) {
+    struct cpu_decode_r4x2i8_ifhbs ds = cpu_decode_r4x2i8_ifhbs(sim, id);
+    cpu_write16(sim, ds.addr, *ds.dp);
+    sim->cpu.pc += 4;
+    return CPUE_CONTINUE;
+} 
+CPU_INSTRUCTION_FN(stl) {
+    struct cpu_decode_r4x2i8_ifhbs ds = cpu_decode_r4x2i8_ifhbs(sim, id);
+    cpu_write32(sim, ds.addr, *ds.dp);
+    sim->cpu.pc += 4;
+    return CPUE_CONTINUE;
+} 
+CPU_INSTRUCTION_FN(stq) {
+    struct cpu_decode_r4x2i8_ifhbs ds = cpu_decode_r4x2i8_ifhbs(sim, id);
+    cpu_write32(sim, ds.addr, *ds.dp);
+    sim->cpu.pc += 4;
+    return CPUE_CONTINUE;
+} 
+CPU_INSTRUCTION_FN(ldb) {
+    struct cpu_decode_r4x2i8_ifhbs ds = cpu_decode_r4x2i8_ifhbs(sim, id);
+    *ds.dp = cpu_read8(sim, ds.addr);
+    sim->cpu.pc += 4;
+    return CPUE_CONTINUE;
+} 
+CPU_INSTRUCTION_FN(ldw) {
+    struct cpu_decode_r4x2i8_ifhbs ds = cpu_decode_r4x2i8_ifhbs(sim, id);
+    *ds.dp = cpu_read16(sim, ds.addr);
+    sim->cpu.pc += 4;
+    return CPUE_CONTINUE;
+} 
+CPU_INSTRUCTION_FN(ldl) {
+    struct cpu_decode_r4x2i8_ifhbs ds = cpu_decode_r4x2i8_ifhbs(sim, id);
+    *ds.dp = cpu_read32(sim, ds.addr);
+    sim->cpu.pc += 4;
+    return CPUE_CONTINUE;
+} 
+CPU_INSTRUCTION_FN(ldq) {
+    struct cpu_decode_r4x2i8_ifhbs ds = cpu_decode_r4x2i8_ifhbs(sim, id);
+    *ds.dp = cpu_read32(sim, ds.addr);
+    sim->cpu.pc += 4;
+    return CPUE_CONTINUE;
+} 
+CPU_INSTRUCTION_FN(lea) {
+    struct cpu_decode_r4x2i8_ifhbs ds = cpu_decode_r4x2i8_ifhbs(sim, id);
+    *ds.dp = ds.addr;
+    sim->cpu.pc += 4;
+    return CPUE_CONTINUE;
+} 
+CPU_INSTRUCTION_FN(mcopy) {
+    struct cpu_decode_r4x2i8_ifhbs ds = cpu_decode_r4x2i8_ifhbs(sim, id);
+    
+    sim->cpu.pc += 4;
+    return CPUE_CONTINUE;
+} 
+CPU_INSTRUCTION_FN(cmp) {
+    struct cpu_decode_r4x2i8_ifhbs ds = cpu_decode_r4x2i8_ifhbs(sim, id);
+    uint32_t r = cpu_i_add32(sim, ds.a, ds.b);
+    sim->cpu.flags &= ~(FLAGS_BIT_Z | FLAGS_BIT_N);
+    sim->cpu.flags |= r == 0 ? FLAGS_BIT_Z : 0;
+    sim->cpu.flags |= (int32_t)r < 0 ? FLAGS_BIT_N : 0;
+    *ds.dp = sim->cpu.flags;
+    sim->cpu.pc += 4;
+    return CPUE_CONTINUE;
+} 
+CPU_INSTRUCTION_FN(cmpkp) {
+    struct cpu_decode_r4x2i8_ifhbs ds = cpu_decode_r4x2i8_ifhbs(sim, id);
+    uint32_t old_flags = sim->cpu.flags;
+    uint32_t r = cpu_i_add32(sim, ds.a, ds.b);
+    sim->cpu.flags &= ~(FLAGS_BIT_Z | FLAGS_BIT_N);
+    sim->cpu.flags |= r == 0 ? FLAGS_BIT_Z : 0;
+    sim->cpu.flags |= (int32_t)r < 0 ? FLAGS_BIT_N : 0;
+    *ds.dp = sim->cpu.flags;
+    sim->cpu.flags = old_flags; /* restore flags */
+    sim->cpu.pc += 4;
+    return CPUE_CONTINUE;
+}
+/* Host counter behind a guest visible control register */
+static unsigned long cpu_perf_counter(sim_state_t* sim, uint8_t cr) {
+    switch (cr) {
+    case XM_CR_INSTRET: return sim->perf.ticks - sim->perf.stalls;
+    case XM_CR_CYCLES: return CPU_TRACE && sim->timing != NULL ? sim_timing_cycles(sim) : sim->perf.ticks;
+    case XM_CR_BTAKEN: return sim->perf.b_taken;
+    case XM_CR_BMISS: return sim->perf.b_misses;
+    case XM_CR_JUMPS: return sim->perf.jumps;
+    case XM_CR_READS: return sim->perf.reads;
+    case XM_CR_WRITES: return sim->perf.writes;
+    }
+    return 0;
+}
+static uint32_t cpu_cr_read(sim_state_t* sim, uint8_t cr) {
+    bool en = (sim->cpu.cr[XM_CR_PERFCTL] & XM_CR_PERFCTL_EN) != 0;
+    if (cr == XM_CR_PERFCTL || cr >= XM_CR_PERF_COUNT)
+        return sim->cpu.cr[cr];
+    return en ? cpu_perf_counter(sim, cr) - sim->perf_guest[cr] : sim->perf_guest[cr];
+}
+static void cpu_cr_write(sim_state_t* sim, uint8_t cr, uint32_t v) {
+    bool en = (sim->cpu.cr[XM_CR_PERFCTL] & XM_CR_PERFCTL_EN) != 0;
+    if (cr >= XM_CR_PERF_COUNT) {
+        sim->cpu.cr[cr] = v;
+    } else if (cr == XM_CR_PERFCTL) {
+        /* Freeze or resume every counter from where it stands */
+        bool now = (v & XM_CR_PERFCTL_EN) != 0;
+        for (uint8_t i = 1; en != now && i < XM_CR_PERF_COUNT; ++i)
+            sim->perf_guest[i] = cpu_perf_counter(sim, i) - sim->perf_guest[i];
+        sim->cpu.cr[cr] = v;
+    } else {
+        sim->perf_guest[cr] = en ? cpu_perf_counter(sim, cr) - v : v;
+    }
+}
+/* The bare core doesn't count, once the guest uses the counters it's never
+    picked again, whichever core this is: a breakpoint or recording may have
+    it on another one for now. On the bare core stop here so xm_sim_run
+    carries on with one that counts. Guest counters only ever move while
+    enabled, which takes this mtcr, so none of their counts is lost. */
+static void cpu_perf_touch(sim_state_t* sim, uint8_t cr) {
+    if (cr < XM_CR_PERF_COUNT && !sim->perf_used) {
+        sim->perf_used = true;
+        if (!CPU_COUNTERS)
+            sim->max_ticks = sim->perf.ticks;
+    }
+}
+CPU_INSTRUCTION_FN(mfcr) {
+    cpu_perf_touch(sim, (id[1] >> 4) & 0x0f);
+    sim->cpu.r[id[1] & 0x0f] = cpu_cr_read(sim, (id[1] >> 4) & 0x0f);
+    sim->cpu.pc += 4;
+    return CPUE_CONTINUE;
+}
+CPU_INSTRUCTION_FN(mtcr) {
+    cpu_perf_touch(sim, id[1] & 0x0f);
+    cpu_cr_write(sim, id[1] & 0x0f, sim->cpu.r[(id[1] >> 4) & 0x0f]);
+    sim->cpu.pc += 4;
+    return CPUE_CONTINUE;
+}
+struct cpu_decode_r4x4 {
+    uint32_t *dp;
+    uint32_t a;
+    uint32_t b;
+    uint32_t c;
+};
+static struct cpu_decode_r4x4 cpu_decode_r4x4(sim_state_t* sim, uint8_t id[]) {
+    struct cpu_decode_r4x4 ds;
+    uint8_t rd = id[1] & 0x0f;
+    uint8_t ra = (id[1] >> 4) & 0x0f;
+    uint8_t rb = id[2] & 0x0f;
+    uint8_t rc = (id[2] >> 4) & 0x0f;
+    ds.dp = &sim->cpu.r[rd];
+    ds.a = sim->cpu.r[ra];
+    ds.b = sim->cpu.r[rb];
+    ds.c = sim->cpu.r[rc];
+    return ds;
+}
+/* The core moves bytes through its caches, the engine around them */
+static uint8_t cpu_dma_get(sim_state_t* sim, uint32_t addr, bool engine) {
+    return engine ? cpu_fetch8(sim, addr) : cpu_read8(sim, addr);
+}
+static void cpu_dma_put(sim_state_t* sim, uint32_t addr, uint8_t v, bool engine) {
+    if (!engine) {
+        cpu_write8(sim, addr, v);
+        return;
+    }
+    if (CPU_TRACE && sim->timing != NULL)
+        sim_timing_invalidate(sim, addr);
+    cpu_store8(sim, addr, v);
+}
+static void cpu_dma_move(sim_state_t* sim, struct sim_dma_xfer const* x, bool engine) {
+    if (x->op == SIM_DMA_FILL) for (size_t i = 0; i < x->len; ++i)
+        cpu_dma_put(sim, x->dst + i, x->src, engine);
+    else if (x->op == SIM_DMA_COPY || x->dst > x->src) for (size_t i = 0; i < x->len; ++i)
+        cpu_dma_put(sim, x->dst + i, cpu_dma_get(sim, x->src + i, engine), engine);
+    else for (size_t i = 0; i < x->len; ++i)
+        cpu_dma_put(sim, x->dst + x->len - i, cpu_dma_get(sim, x->src + x->len - i, engine), engine);
+}
+void CPU_V(cpu_dma_retire)(sim_state_t* sim) {
+    struct sim_dma *d = &sim->dma;
+    while (d->n != 0 && d->queue[d->head].done <= sim->perf.ticks) {
+        CPU_PROF(sim, SIM_PROF_DMA, cpu_dma_move(sim, &d->queue[d->head], true));
+        d->head = (d->head + 1) % SIM_DMA_QUEUE;
+        --d->n;
+        ++d->retired;
+    }
+}
+/* Idles the core on the instruction id until tick, or until xm_sim_run has
+    to stop, whichever comes first. true once tick is reached, otherwise the
+    instruction stays stalled for the next step to carry on with. */
+static bool cpu_dma_stall(sim_state_t* sim, uint8_t id[], unsigned long tick) {
+    unsigned long to = tick < sim->max_ticks ? tick : sim->max_ticks;
+    if (to > sim->perf.ticks) {
+        if (CPU_TRACE && sim->timing != NULL)
+            sim_timing_stall(sim, to - sim->perf.ticks);
+        sim->perf.stalls += to - sim->perf.ticks;
+        sim->perf.ticks = to;
+    }
+    if ((sim->dma.stalled = sim->perf.ticks < tick))
+        memcpy(sim->dma.stall_id, id, sizeof(sim->dma.stall_id));
+    return !sim->dma.stalled;
+}
+/* Tokens that were never issued count as done, so waits always end */
+static bool cpu_dma_done(sim_state_t* sim, uint32_t token) {
+    return sim->dma.n == 0 || (int32_t)(token - sim->dma.retired) <= 0
+        || (int32_t)(token - sim->dma.issued) > 0;
+}
+static cpu_execute_result_t cpu_dma_issue(sim_state_t* sim, uint8_t id[], enum sim_dma_op op) {
+    struct cpu_decode_r4x4 ds = cpu_decode_r4x4(sim, id);
+    struct sim_dma *d = &sim->dma;
+    struct sim_dma_xfer x = { op, ds.a, ds.b, ds.c, 0 };
+    unsigned long start;
+    if (sim->dma_bandwidth == 0) {
+        cpu_dma_move(sim, &x, false);
+        *ds.dp = ds.a;
+        sim->cpu.pc += 4;
+        return CPUE_CONTINUE;
+    }
+    /* Full queue, wait for the oldest transfer to make room */
+    if (d->n == SIM_DMA_QUEUE) {
+        if (!cpu_dma_stall(sim, id, d->queue[d->head].done))
+            return CPUE_CONTINUE;
+        CPU_V(cpu_dma_retire)(sim);
+    }
+    start = d->idle > sim->perf.ticks ? d->idle : sim->perf.ticks;
+    x.done = d->idle = start + (ds.c + (unsigned long)sim->dma_bandwidth - 1) / sim->dma_bandwidth;
+    d->queue[(d->head + d->n++) % SIM_DMA_QUEUE] = x;
+    /* Stop xm_sim_run in time to complete it */
+    if (d->n == 1 && x.done < sim->max_ticks)
+        sim->max_ticks = x.done;
+    *ds.dp = ++d->issued;
+    sim->cpu.pc += 4;
+    return CPUE_CONTINUE;
+}
+CPU_INSTRUCTION_FN(memcpy) {
+    return cpu_dma_issue(sim, id, SIM_DMA_COPY);
+}
+CPU_INSTRUCTION_FN(memmov) {
+    return cpu_dma_issue(sim, id, SIM_DMA_MOVE);
+}
+CPU_INSTRUCTION_FN(memset) {
+    return cpu_dma_issue(sim, id, SIM_DMA_FILL);
+}
+CPU_INSTRUCTION_FN(dmapoll) {
+    uint32_t done = cpu_dma_done(sim, sim->cpu.r[(id[1] >> 4) & 0x0f]);
+    sim->cpu.r[id[1] & 0x0f] = done;
+    CPU_ALU_UPDATE_FLAGS(done);
+    sim->cpu.pc += 4;
+    return CPUE_CONTINUE;
+}
+/* Stays stalled on the same pc when it has to give xm_sim_run back before
+    the transfer is done */
+CPU_INSTRUCTION_FN(dmawait) {
+    uint32_t token = sim->cpu.r[(id[1] >> 4) & 0x0f];
+    while (!cpu_dma_done(sim, token)) {
+        if (!cpu_dma_stall(sim, id, sim->dma.queue[sim->dma.head].done))
+            return CPUE_CONTINUE;
+        CPU_V(cpu_dma_retire)(sim);
+    }
+    sim->cpu.r[id[1] & 0x0f] = 1;
+    sim->cpu.pc += 4;
+    return CPUE_CONTINUE;
+}
+CPU_INSTRUCTION_FN(memchr) {
+    struct cpu_decode_r4x4 ds = cpu_decode_r4x4(sim, id);
+    *ds.dp = 0; /* Null */
+    for (size_t i = 0; i < ds.c; ++i)
+        if (cpu_read8(sim, ds.a + i) == ds.b) {
+            *ds.dp = ds.a;
+            break;
+        }
+    sim->cpu.pc += 4;
+    return CPUE_CONTINUE;
+}
+CPU_INSTRUCTION_FN(memchrf) {
+    struct cpu_decode_r4x4 ds = cpu_decode_r4x4(sim, id);
+    *ds.dp = 0; /* Null */
+    for (size_t i = 0; i < ds.c; ++i)
+        if (cpu_read8(sim, ds.a + i) == ds.b) {
+            *ds.dp = ds.a;
+            break;
+        }
+    CPU_ALU_UPDATE_FLAGS(*ds.dp);
+    sim->cpu.pc += 4;
+    return CPUE_CONTINUE;
+}
+CPU_INSTRUCTION_FN(strcpy) {
+    struct cpu_decode_r4x4 ds = cpu_decode_r4x4(sim, id);
+    size_t i = 0;
+    char c;
+    do {
+        c = cpu_read8(sim, ds.b + i);
+        cpu_write8(sim, ds.a + i, c);
+        if (c == '\0')
+            break;
+        ++i;
+    } while (c != '\0');
+    *ds.dp = ds.a;
+    sim->cpu.pc += 4;
+    return CPUE_CONTINUE;
+}
+CPU_INSTRUCTION_FN(strcat) {
+    struct cpu_decode_r4x4 ds = cpu_decode_r4x4(sim, id);
+    /* TODO */ abort();
+    *ds.dp = ds.a;
+    sim->cpu.pc += 4;
+    return CPUE_CONTINUE;
+}
+CPU_INSTRUCTION_FN(strpbrk) {
+    struct cpu_decode_r4x4 ds = cpu_decode_r4x4(sim, id);
+    /* TODO */ abort();
+    sim->cpu.pc += 4;
+    return CPUE_CONTINUE;
+}
+CPU_INSTRUCTION_FN(strncpy) {
+    struct cpu_decode_r4x4 ds = cpu_decode_r4x4(sim, id);
+    *ds.dp = ds.a;
+    for (size_t i = 0; i < ds.c; ++i) {
+        char c = cpu_read8(sim, ds.b + i);
+        cpu_write8(sim, ds.a + i, c);
+        if (c == '\0')
+            break;
+    }
+    sim->cpu.pc += 4;
+    return CPUE_CONTINUE;
+}
+CPU_INSTRUCTION_FN(strncat) {
+    struct cpu_decode_r4x4 ds = cpu_decode_r4x4(sim, id);
+    /* TODO */ abort();
+    sim->cpu.pc += 4;
+    return CPUE_CONTINUE;
+}
+CPU_INSTRUCTION_FN(strchr) {
+    struct cpu_decode_r4x4 ds = cpu_decode_r4x4(sim, id);
+    /* TODO */ abort();
+    sim->cpu.pc += 4;
+    return CPUE_CONTINUE;
+}
+CPU_INSTRUCTION_FN(strnchr) {
+    struct cpu_decode_r4x4 ds = cpu_decode_r4x4(sim, id);
+    /* TODO */ abort();
+    sim->cpu.pc += 4;
+    return CPUE_CONTINUE;
+}
+CPU_INSTRUCTION_FN(indtab) {
+    struct cpu_decode_r4x4 ds = cpu_decode_r4x4(sim, id);
+    *ds.dp = cpu_read32(sim, ds.a + (ds.b + ds.c) * sizeof(uint32_t));
+    sim->cpu.pc += 4;
+    return CPUE_CONTINUE;
+}
+CPU_INSTRUCTION_FN(indtab8) {
+    struct cpu_decode_r4x4 ds = cpu_decode_r4x4(sim, id);
+    *ds.dp = cpu_read32(sim, ds.a + (ds.b + ds.c) * sizeof(uint64_t));
+    sim->cpu.pc += 4;
+    return CPUE_CONTINUE;
+}
+CPU_INSTRUCTION_FN(chtree) {
+    struct cpu_decode_r4x4 ds = cpu_decode_r4x4(sim, id);
+    uint32_t counter = ds.c;
+    uint32_t p = ds.a;
+    do p = cpu_read32(sim, p + ds.b); while (p && counter-- > 0);
+    sim->cpu.pc += 4;
+    return CPUE_CONTINUE;
+}
+CPU_INSTRUCTION_FN(chtreeunchk) {
+    struct cpu_decode_r4x4 ds = cpu_decode_r4x4(sim, id);
+    uint32_t counter = ds.c;
+    uint32_t p = ds.a;
+    do p = cpu_read32(sim, p + ds.b); while (counter-- > 0);
+    sim->cpu.pc += 4;
+    return CPUE_CONTINUE;
+}
+CPU_INSTRUCTION_FN(jmp) {
+    sim->cpu.pc = (((uint32_t)id[1]) << 8) | id[2];
+    if (CPU_COUNTERS)
+        ++sim->perf.jumps;
+    return CPUE_CONTINUE;
+}
+CPU_INSTRUCTION_FN(jmprel) {
+    int32_t rela = (int32_t)(int16_t)((((uint16_t)id[1]) << 8) | id[2]);
+    sim->cpu.pc += rela;
+    if (CPU_COUNTERS)
+        ++sim->perf.jumps;
+    return CPUE_CONTINUE;
+}
+CPU_INSTRUCTION_FN(call) {
+    uint8_t ra = id[1];
+    int32_t rela = (int32_t)(int8_t)id[2];
+    sim->cpu.pc = sim->cpu.r[ra] + rela;
+    sim->cpu.r[XM_ABI_RA] = sim->cpu.pc + 4;
+    if (CPU_COUNTERS) {
+        ++sim->perf.jumps;
+        if (sim->prof_depth < SIM_PROF_STACK)
+            sim->prof_stack[sim->prof_depth] = sim->prof_func;
+        ++sim->prof_depth;
+        sim->prof_func = sim->cpu.pc;
+    }
+    return CPUE_CONTINUE;
+}
+CPU_INSTRUCTION_FN(ret) {
+    sim->cpu.pc = sim->cpu.r[XM_ABI_RA];
+    if (CPU_COUNTERS) {
+        ++sim->perf.jumps;
+        /* Unbalanced returns keep the outermost function */
+        if (sim->prof_depth != 0 && --sim->prof_depth < SIM_PROF_STACK)
+            sim->prof_func = sim->prof_stack[sim->prof_depth];
+    }
+    return CPUE_CONTINUE;
+}
+static cpu_execute_result_t cpu_exec_common_b(sim_state_t *sim, uint8_t id[]) {
+    uint8_t ra = id[1] & 0x0f;
+    uint8_t cc = (id[1] >> 4);
+    int32_t rela = (int32_t)(int8_t)id[2];
+    bool cond = 0;
+    switch ((id[3] - 0x50) & 0x0f) {
+    case 0: cond = sim->cpu.r[ra] == 0; break;
+    case 1: cond = true; break;
+    case 2: cond = (int32_t)sim->cpu.r[ra] > 0; break;
+    case 3: cond = sim->cpu.r[ra] > sim->cpu.pc; break;
+    case 4: cond = sim->cpu.r[ra] > sim->cpu.pc + rela; break;
+    case 5: cond = sim->cpu.r[ra] == 1; break;
+    case 6: cond = (int32_t)sim->cpu.r[ra] > 1; break;
+    case 7: cond = sim->cpu.r[ra] == ~0u; break;
+    case 8: cond = sim->cpu.r[ra] == sim->cpu.r[XM_ABI_T0]; break;
+    case 9: cond = sim->cpu.r[ra] == sim->cpu.r[XM_ABI_T1]; break;
+    case 10: cond = sim->cpu.r[ra] == sim->cpu.r[XM_ABI_T2]; break;
+    case 11: cond = sim->cpu.r[ra] == sim->cpu.r[XM_ABI_T3]; break;
+    case 12: cond = sim->cpu.r[ra] == sim->cpu.r[XM_ABI_T4]; break;
+    case 13: cond = sim->cpu.r[ra] == sim->cpu.r[XM_ABI_T5]; break;
+    case 14: cond = sim->cpu.r[ra] == sim->cpu.r[XM_ABI_T6]; break;
+    case 15: cond = sim->cpu.r[ra] == sim->cpu.r[XM_ABI_T7]; break;
+    }
+    /* !, N, Z, C */
+    cond = (cc & 0x02) != 0 ? (cond && (sim->cpu.flags & FLAGS_BIT_N) != 0) : cond;
+    cond = (cc & 0x04) != 0 ? (cond && (sim->cpu.flags & FLAGS_BIT_Z) != 0) : cond;
+    cond = (cc & 0x08) != 0 ? (cond && (sim->cpu.flags & FLAGS_BIT_C) != 0) : cond;
+    cond = (cc & 0x01) != 0 ? !cond : cond; /* Invert condition flag */
+    if (cond && rela < 0 && (-rela) % 4 == 0)
+        sim->idiom_len = (uint32_t)(-rela) / 4 + 1;
+    if (CPU_TRACE && sim->timing != NULL)
+        CPU_PROF(sim, SIM_PROF_TIMING, sim_timing_branch(sim, sim->cpu.pc, cond));
+    sim->cpu.pc += cond ? rela : 4;
+    if (CPU_COUNTERS)
+        cond ? ++sim->perf.b_taken : ++sim->perf.b_misses;
+    return CPUE_CONTINUE;
+}
+CPU_INSTRUCTION_FN(bz) { return cpu_exec_common_b(sim, id); }
+CPU_INSTRUCTION_FN(b) { return cpu_exec_common_b(sim, id); }
+CPU_INSTRUCTION_FN(bgzs) { return cpu_exec_common_b(sim, id); }
+CPU_INSTRUCTION_FN(bgpc) { return cpu_exec_common_b(sim, id); }
+CPU_INSTRUCTION_FN(bgpcrela) { return cpu_exec_common_b(sim, id); }
+CPU_INSTRUCTION_FN(bo) { return cpu_exec_common_b(sim, id); }
+CPU_INSTRUCTION_FN(bgoz) { return cpu_exec_common_b(sim, id); }
+CPU_INSTRUCTION_FN(bemax) { return cpu_exec_common_b(sim, id); }
+CPU_INSTRUCTION_FN(bet0) { return cpu_exec_common_b(sim, id); }
+CPU_INSTRUCTION_FN(bet1) { return cpu_exec_common_b(sim, id); }
+CPU_INSTRUCTION_FN(bet2) { return cpu_exec_common_b(sim, id); }
+CPU_INSTRUCTION_FN(bet3) { return cpu_exec_common_b(sim, id); }
+CPU_INSTRUCTION_FN(bet4) { return cpu_exec_common_b(sim, id); }
+CPU_INSTRUCTION_FN(bet5) { return cpu_exec_common_b(sim, id); }
+CPU_INSTRUCTION_FN(bet6) { return cpu_exec_common_b(sim, id); }
+CPU_INSTRUCTION_FN(bet7) { return cpu_exec_common_b(sim, id); }
+CPU_INSTRUCTION_FN(syscall) {
+    cpu_execute_result_t r = sim_sys_call(sim);
+    if (r == CPUE_CONTINUE)
+        sim->cpu.pc += 4;
+    return r;
+}
+CPU_INSTRUCTION_FN(halt) {
+    SIM_LOG(sim, "halted at %8x\n", sim->cpu.pc);
+    return CPUE_HALT;
+}
+
+/* Instruction indices into xm_inst_table */
+enum cpu_inst {
+#define XM_INST_ELEM(NAME, FORMAT, OP) CPU_INST_##NAME,
+    XM_INST_LIST
+#undef XM_INST_ELEM
+    CPU_INST_NONE,
+};
+
+/* Loop idiom recognition: a loop body made only of
+    ldb $rV,$rS,imm8 / stb $rV|$rX,$rD,imm8 / add,sub $rI,$rI,imm8
+    bz,betN (exit) / bz,betN,b (backwards into the head)
+   with unit stride streams is run as whole iterations with host memmove,
+   memset and memchr. Only iterations where every exit falls through and the
+   backwards branch is taken are batched, the final one is interpreted. */
+static bool cpu_idiom_decode(cpu_idiom_t* e) {
+    int upd_at[16], ld_at = -1, st_at = -1, test_at[SIM_IDIOM_MAX_LEN];
+    for (unsigned i = 0; i < 16; ++i)
+        upd_at[i] = -1;
+    e->written = 0;
+    e->alu = e->val = e->ld_base = e->st_base = e->st_src = -1;
+    e->n_branches = e->n_tests = 0;
+    for (uint32_t i = 0; i < e->n; ++i) {
+        uint8_t const* id = e->code + i * 4;
+        uint8_t rd = id[1] & 0x0f, ra = (id[1] >> 4) & 0x0f;
+        bool last = i + 1 == e->n;
+        /* Classified by the table, the same op byte means something else in
+            the other classes */
+        switch (xm_inst_decode(&sim_decoder, id)) {
+        case CPU_INST_add: /* add $rI,$rI,imm8 */
+        case CPU_INST_sub: /* sub $rI,$rI,imm8 */
+            if (last || (id[3] & 0x80) == 0 || rd != ra || (e->written & (1 << rd)) != 0)
+                return false;
+            e->stride[rd] = (id[3] & 0x7f) == 0x00 ? id[2] : -(uint32_t)id[2];
+            e->written |= 1 << rd;
+            e->alu = rd;
+            upd_at[rd] = i;
+            break;
+        case CPU_INST_ldb: /* ldb $rV,$rS,imm8 */
+            if (last || (id[3] & 0x80) == 0 || e->ld_base >= 0 || (e->written & (1 << rd)) != 0)
+                return false;
+            e->val = rd;
+            e->ld_base = ra;
+            e->ld_off = id[2] * 4;
+            e->written |= 1 << rd;
+            ld_at = i;
+            break;
+        case CPU_INST_stb: /* stb $rV,$rD,imm8 */
+            if (last || (id[3] & 0x80) == 0 || e->st_base >= 0)
+                return false;
+            e->st_src = rd;
+            e->st_base = ra;
+            e->st_off = id[2] * 4;
+            st_at = i;
+            break;
+        case CPU_INST_b: /* Only as an unconditional backwards branch */
+            if (!last || (id[1] >> 4) != 0)
+                return false;
+            ++e->n_branches;
+            break;
+        case CPU_INST_bz:
+        case CPU_INST_bet0: case CPU_INST_bet1: case CPU_INST_bet2: case CPU_INST_bet3:
+        case CPU_INST_bet4: case CPU_INST_bet5: case CPU_INST_bet6: case CPU_INST_bet7:
+            /* Exits must fall through, the backwards branch must be taken,
+                in both cases while $rA != key */
+            if ((id[1] >> 4) != (last ? 0x01 : 0x00))
+                return false;
+            e->test[e->n_tests].reg = rd;
+            e->test[e->n_tests].key = id[3] == 0x50 ? -1 : XM_ABI_T0 + (id[3] - 0x58);
+            test_at[e->n_tests] = i;
+            ++e->n_tests;
+            ++e->n_branches;
+            break;
+        default:
+            return false;
+        }
+    }
+    if (e->ld_base >= 0) {
+        if (e->ld_base == e->val || (e->written & (1 << e->ld_base)) == 0
+        || e->stride[e->ld_base] != 1)
+            return false;
+        e->ld_phase = upd_at[e->ld_base] >= 0 && upd_at[e->ld_base] < ld_at;
+    }
+    if (e->st_base >= 0) {
+        if (e->st_base == e->val || (e->written & (1 << e->st_base)) == 0
+        || e->stride[e->st_base] != 1)
+            return false;
+        /* Either the loaded byte (copy) or an invariant (fill) */
+        if (e->st_src != e->val && (e->written & (1 << e->st_src)) != 0)
+            return false;
+        if (e->ld_base >= 0 && ld_at > st_at)
+            return false;
+        e->st_phase = upd_at[e->st_base] >= 0 && upd_at[e->st_base] < st_at;
+    }
+    for (uint8_t i = 0; i < e->n_tests; ++i) {
+        struct cpu_idiom_test *t = &e->test[i];
+        if (t->key >= 0 && (e->written & (1 << t->key)) != 0)
+            return false;
+        if (t->reg == e->val) {
+            if (test_at[i] < ld_at)
+                return false;
+        } else if ((e->written & (1 << t->reg)) != 0) {
+            if (e->stride[t->reg] != 1 && e->stride[t->reg] != UINT32_MAX)
+                return false;
+            t->phase = upd_at[t->reg] < test_at[i];
+        } else {
+            t->phase = 0;
+        }
+    }
+    return true;
+}
+static uint64_t cpu_idiom_run(sim_state_t* sim, cpu_idiom_t const* e) {
+    uint8_t *src = NULL, *dst = NULL;
+    uint32_t src0 = 0, dst0 = 0;
+    uint64_t k;
+    if (sim->perf.ticks >= sim->max_ticks)
+        return 0;
+    k = (sim->max_ticks - sim->perf.ticks) / e->n;
+    /* Counters: $rI at iteration i is $rI + stride * (i + phase) */
+    for (uint8_t i = 0; i < e->n_tests; ++i) {
+        struct cpu_idiom_test const* t = &e->test[i];
+        uint32_t key = t->key >= 0 ? sim->cpu.r[t->key] : 0;
+        uint32_t v = sim->cpu.r[t->reg], d;
+        if (t->reg == e->val)
+            continue;
+        if ((e->written & (1 << t->reg)) == 0 || e->stride[t->reg] == 0) {
+            if (v == key)
+                return 0;
+            continue;
+        }
+        d = e->stride[t->reg] == 1 ? key - v - t->phase : v - t->phase - key;
+        k = d < k ? d : k;
+    }
+    if (e->ld_base >= 0) {
+        src0 = sim->cpu.r[e->ld_base] + e->ld_phase + e->ld_off;
+        if ((src = cpu_translate_range(sim, src0, &k, XM_PAGE_R)) == NULL)
+            return 0;
+    }
+    if (e->st_base >= 0) {
+        uint32_t code_end = e->head + e->n * 4;
+        dst0 = sim->cpu.r[e->st_base] + e->st_phase + e->st_off;
+        if ((dst = cpu_translate_range(sim, dst0, &k, XM_PAGE_W)) == NULL)
+            return 0;
+        /* Stores ahead of the load stream would be read back */
+        if (src != NULL && dst0 > src0 && dst0 - src0 < k)
+            k = dst0 - src0;
+        /* Nor may they rewrite the loop itself */
+        if (dst0 < code_end && dst0 + k > e->head)
+            k = dst0 >= e->head ? 0 : e->head - dst0;
+    }
+    /* Sentinels on the loaded byte */
+    for (uint8_t i = 0; i < e->n_tests && k > 0; ++i) {
+        struct cpu_idiom_test const* t = &e->test[i];
+        uint32_t key = t->key >= 0 ? sim->cpu.r[t->key] : 0;
+        uint8_t const* p;
+        if (t->reg != e->val || key > 0xff)
+            continue;
+        if ((p = memchr(src, (int)key, k)) != NULL)
+            k = p - src;
+    }
+    if (k == 0)
+        return 0;
+
+    if (src != NULL)
+        sim->cpu.r[e->val] = src[k - 1];
+    if (dst != NULL && e->st_src == e->val)
+        memmove(dst, src, k);
+    else if (dst != NULL)
+        memset(dst, sim->cpu.r[e->st_src] & 0xff, k);
+    for (unsigned i = 0; i < 16; ++i)
+        if ((e->written & (1 << i)) != 0 && (int)i != e->val)
+            sim->cpu.r[i] += e->stride[i] * (uint32_t)k;
+    if (e->alu >= 0) {
+        CPU_ALU_UPDATE_FLAGS(sim->cpu.r[e->alu]);
+    }
+    sim->perf.ticks += k * e->n;
+    if (CPU_COUNTERS) {
+        sim->perf.reads += k * (e->n * 4 + (src != NULL));
+        sim->perf.writes += k * (dst != NULL);
+        sim->perf.b_taken += k;
+        sim->perf.b_misses += k * (e->n_branches - 1);
+    }
+    return k;
+}
+static bool cpu_idiom_exec(sim_state_t* sim, uint32_t n) {
+    cpu_idiom_t *e = &sim->idiom[(sim->cpu.pc / 4) % SIM_IDIOM_CACHE_SIZE];
+    uint64_t len = n * 4, k;
+    uint8_t const* code;
+    if (n > SIM_IDIOM_MAX_LEN
+    || (code = cpu_translate_range(sim, sim->cpu.pc, &len, XM_PAGE_X)) == NULL || len != n * 4)
+        return false;
+    if (e->head != sim->cpu.pc || e->n != n || memcmp(e->code, code, len) != 0) {
+        e->head = sim->cpu.pc;
+        e->n = n;
+        memcpy(e->code, code, len);
+        e->valid = cpu_idiom_decode(e);
+    }
+    if (!e->valid || (k = cpu_idiom_run(sim, e)) == 0)
+        return false;
+    if (CPU_TRACE)
+        SIM_LOG(sim, " --> loop:%s x%lu\n", e->st_base >= 0 ? (e->st_src == e->val ? "copy" : "fill")
+            : e->ld_base >= 0 ? "scan" : "count", (unsigned long)k);
+    return true;
+}
+
+/* Carries on with a DMA instruction stalled past the last xm_sim_run, it was
+    fetched, counted and logged when it started */
+static cpu_execute_result_t cpu_dma_resume(sim_state_t* sim) {
+    uint8_t *id = sim->dma.stall_id;
+    sim->dma.stalled = false;
+    switch (xm_inst_decode(&sim_decoder, id)) {
+    case CPU_INST_memcpy: return cpu_exec_memcpy(sim, id);
+    case CPU_INST_memmov: return cpu_exec_memmov(sim, id);
+    case CPU_INST_memset: return cpu_exec_memset(sim, id);
+    case CPU_INST_dmawait: return cpu_exec_dmawait(sim, id);
+    default: return CPUE_CONTINUE;
+    }
+}
+
+static cpu_execute_result_t cpu_step(sim_state_t* sim) {
+    uint8_t id[8]; /* Instruction ds */
+
+    if (sim->dma.stalled)
+        return cpu_dma_resume(sim);
+
+    if (CPU_TRACE && sim->bp_pages != NULL && sim_dbg_break(sim))
+        return CPUE_BREAK;
+
+    if (sim->idiom_len != 0) {
+        uint32_t n = sim->idiom_len;
+        sim->idiom_len = 0;
+        /* Batches would skip over breakpoints and watched accesses */
+        if ((sim->opt & (SIM_OPT_TRACE_MEM | SIM_OPT_NO_IDIOM | SIM_OPT_DETAILED)) == 0
+        && (!CPU_TRACE || (sim->bp_pages == NULL && sim->wp_pages == NULL && sim->heat == NULL
+            && sim->exec == NULL))) {
+            bool done;
+            CPU_PROF(sim, SIM_PROF_IDIOM, done = cpu_idiom_exec(sim, n));
+            if (done)
+                return CPUE_CONTINUE;
+        }
+    }
+
+    ++sim->perf.ticks;
+
+    if (CPU_TRACE && sim->timing != NULL) {
+        CPU_PROF_MARK(sim, SIM_PROF_TIMING);
+        sim_timing_fetch(sim, sim->cpu.pc);
+    }
+    CPU_PROF_MARK(sim, SIM_PROF_MEMORY);
+    id[0] = cpu_load8(sim, sim->cpu.pc, XM_PAGE_R | XM_PAGE_X);
+    id[1] = cpu_load8(sim, sim->cpu.pc + 1, XM_PAGE_R | XM_PAGE_X);
+    id[2] = cpu_load8(sim, sim->cpu.pc + 2, XM_PAGE_R | XM_PAGE_X);
+    id[3] = cpu_load8(sim, sim->cpu.pc + 3, XM_PAGE_R | XM_PAGE_X);
+    CPU_PROF_MARK(sim, SIM_PROF_DECODE);
+
+    switch (xm_inst_decode(&sim_decoder, id)) {
+#define XM_INST_ELEM(NAME, FORMAT, OP) \
+    case CPU_INST_##NAME: \
+        if (CPU_TRACE && sim->log != NULL) \
+            CPU_PROF(sim, SIM_PROF_RUN, sim_log_inst(sim, #NAME)); \
+        if (CPU_COUNTERS) \
+            sim->prof_inst = CPU_INST_##NAME; \
+        return cpu_exec_##NAME(sim, id);
+    XM_INST_LIST
+#undef XM_INST_ELEM
+    default: /* Nothing is encoded there, stops like halt */
+        return CPUE_HALT;
+    }
+}
+
+static inline cpu_execute_result_t cpu_run_step(sim_state_t* sim) {
+    uint32_t pc = sim->cpu.pc;
+    unsigned long ticks = sim->perf.ticks, stalls = sim->perf.stalls;
+    cpu_execute_result_t cer = cpu_step(sim);
+    if (CPU_COUNTERS) {
+        sim->prof_inst = CPU_INST_NONE;
+        /* Batched loops are charged to their head */
+        if (sim->bbv != NULL)
+            sim->bbv[(uint32_t)((pc >> 2) * 2654435761U) >> (32 - SIM_BBV_BITS)] += sim->perf.ticks - ticks;
+    }
+    if (CPU_TRACE && sim->exec != NULL && sim->perf.ticks - sim->perf.stalls != ticks - stalls)
+        sim_exec_step(sim, pc);
+    if (CPU_TRACE)
+        xm_sim_debug_print(sim);
+    return cer;
+}
+cpu_execute_result_t CPU_V(cpu_run)(sim_state_t* sim) {
+    cpu_execute_result_t cer = CPUE_CONTINUE;
+    while (cer == CPUE_CONTINUE && sim->perf.ticks < sim->max_ticks)
+        cer = cpu_run_step(sim);
+    return cer;
+}
+cpu_execute_result_t CPU_V(cpu_block)(sim_state_t* sim) {
+    cpu_execute_result_t cer = CPUE_CONTINUE;
+    while (cer == CPUE_CONTINUE && sim->perf.ticks < sim->max_ticks) {
+        uint32_t pc = sim->cpu.pc;
+        cer = cpu_run_step(sim);
+        if (sim->cpu.pc != pc + 4)
+            break;
+    }
+    return cer;
+}
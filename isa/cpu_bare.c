@@ -0,0 +1,2 @@
+#define CPU_VARIANT SIM_CPU_BARE
+#include "cpu.c"
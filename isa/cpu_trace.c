@@ -0,0 +1,2 @@
+#define CPU_VARIANT SIM_CPU_TRACE
+#include "cpu.c"
@@ -0,0 +1,144 @@
+#include <stdbool.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+
+#include "isa.h"
+#include "xmsim.h"
+#include "sim.h"
+
+/* Breakpoints and watchpoints
+    Per page maps filter what has to look at the lists: a bit per page with
+    breakpoints, tested before every instruction, and the watched access
+    kinds per page, tested on every load and store. Both maps are freed with
+    the last point so an instance without any runs as before. */
+
+static bool dbg_build_break_pages(sim_state_t* sim) {
+    free(sim->bp_pages);
+    sim->bp_pages = NULL;
+    if (sim->n_bps == 0)
+        return true;
+    if ((sim->bp_pages = calloc(SIM_PAGES / 8, 1)) == NULL)
+        return false;
+    for (size_t i = 0; i < sim->n_bps; ++i)
+        sim->bp_pages[sim->bps[i] / PAGE_SIZE / 8] |= 1 << (sim->bps[i] / PAGE_SIZE % 8);
+    return true;
+}
+
+static bool dbg_build_watch_pages(sim_state_t* sim) {
+    free(sim->wp_pages);
+    sim->wp_pages = NULL;
+    if (sim->n_wps == 0)
+        return true;
+    if ((sim->wp_pages = calloc(SIM_PAGES, 1)) == NULL)
+        return false;
+    for (size_t i = 0; i < sim->n_wps; ++i) {
+        uint64_t end = (uint64_t)sim->wps[i].addr + sim->wps[i].len;
+        end = end < SIM_PAGES * PAGE_SIZE ? end : SIM_PAGES * PAGE_SIZE;
+        for (uint64_t page = sim->wps[i].addr / PAGE_SIZE; page < (end + PAGE_SIZE - 1) / PAGE_SIZE; ++page)
+            sim->wp_pages[page] |= sim->wps[i].access;
+    }
+    return true;
+}
+
+int xm_sim_break_set(xm_sim_t *sim, uint32_t pc) {
+    uint32_t *bps;
+    for (size_t i = 0; i < sim->n_bps; ++i)
+        if (sim->bps[i] == pc)
+            return 0;
+    if ((bps = realloc(sim->bps, (sim->n_bps + 1) * sizeof(*bps))) == NULL)
+        return -1;
+    sim->bps = bps;
+    sim->bps[sim->n_bps++] = pc;
+    if (!dbg_build_break_pages(sim)) {
+        --sim->n_bps;
+        return -1;
+    }
+    return 0;
+}
+
+int xm_sim_break_clear(xm_sim_t *sim, uint32_t pc) {
+    for (size_t i = 0; i < sim->n_bps; ++i) {
+        if (sim->bps[i] == pc) {
+            sim->bps[i] = sim->bps[--sim->n_bps];
+            /* Fewer pages than before, only fails for lack of memory */
+            return dbg_build_break_pages(sim) ? 0 : -1;
+        }
+    }
+    return -1;
+}
+
+int xm_sim_watch_set(xm_sim_t *sim, uint32_t addr, uint32_t len, unsigned access) {
+    struct sim_watch *wps;
+    access &= XM_SIM_WATCH_R | XM_SIM_WATCH_W;
+    if (len == 0 || access == 0)
+        return -1;
+    if ((wps = realloc(sim->wps, (sim->n_wps + 1) * sizeof(*wps))) == NULL)
+        return -1;
+    sim->wps = wps;
+    sim->wps[sim->n_wps].addr = addr;
+    sim->wps[sim->n_wps].len = len;
+    sim->wps[sim->n_wps].access = access;
+    ++sim->n_wps;
+    if (!dbg_build_watch_pages(sim)) {
+        --sim->n_wps;
+        return -1;
+    }
+    return 0;
+}
+
+int xm_sim_watch_clear(xm_sim_t *sim, uint32_t addr, uint32_t len) {
+    for (size_t i = 0; i < sim->n_wps; ++i) {
+        if (sim->wps[i].addr == addr && sim->wps[i].len == len) {
+            sim->wps[i] = sim->wps[--sim->n_wps];
+            return dbg_build_watch_pages(sim) ? 0 : -1;
+        }
+    }
+    return -1;
+}
+
+void xm_sim_get_break(const xm_sim_t *sim, xm_sim_break_t *brk) {
+    *brk = sim->brk;
+}
+
+bool sim_dbg_break(sim_state_t* sim) {
+    uint32_t pc = sim->cpu.pc;
+    bool resume = sim->brk_resume && sim->brk.pc == pc;
+    sim->brk_resume = false;
+    if (resume || (sim->bp_pages[pc / PAGE_SIZE / 8] & (1 << (pc / PAGE_SIZE % 8))) == 0)
+        return false;
+    for (size_t i = 0; i < sim->n_bps; ++i) {
+        if (sim->bps[i] == pc) {
+            sim->brk.pc = pc;
+            sim->brk.addr = 0;
+            sim->brk.access = 0;
+            sim->brk_resume = true;
+            return true;
+        }
+    }
+    return false;
+}
+
+void sim_dbg_watch(sim_state_t* sim, uint32_t addr, unsigned access) {
+    if (sim->brk_hit)
+        return;
+    for (size_t i = 0; i < sim->n_wps; ++i) {
+        if ((sim->wps[i].access & access) != 0 && addr - sim->wps[i].addr < sim->wps[i].len) {
+            sim->brk.pc = sim->cpu.pc;
+            sim->brk.addr = addr;
+            sim->brk.access = access;
+            sim->brk_hit = true;
+            /* Let the instruction finish, xm_sim_run stops right after */
+            sim->max_ticks = sim->perf.ticks;
+            return;
+        }
+    }
+}
+
+void sim_dbg_destroy(sim_state_t* sim) {
+    free(sim->bp_pages);
+    free(sim->bps);
+    free(sim->wp_pages);
+    free(sim->wps);
+}
@@ -0,0 +1,345 @@
+#include <stdbool.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/stat.h>
+
+#include "isa.h"
+#include "xmsim.h"
+#include "xmdev.h"
+#include "sim.h"
+
+/* Built in devices, register maps are in README.md. Registers are 4 bytes
+    apart to match the scaled load/store offsets, byte registers only answer
+    at their first byte. */
+
+#define DEV_UART_TX_TICKS 100
+#define DEV_UART_EMPTY (-2) /* No input yet, unlike EOF */
+#define DEV_BLK_SECTOR 512
+#define DEV_BLK_SEEK_TICKS 1000
+#define DEV_BLK_BYTES_PER_TICK 64
+
+#define DEV_STATUS_BUSY (1 << 0)
+#define DEV_STATUS_ERROR (1 << 1)
+
+/* Byte lane of a 32-bit register */
+static uint8_t dev_reg_read(uint32_t r, uint32_t off) {
+    return (uint8_t)(r >> ((off & 3) * 8));
+}
+static void dev_reg_write(uint32_t *r, uint32_t off, uint8_t v) {
+    *r &= ~(0xffU << ((off & 3) * 8));
+    *r |= (uint32_t)v << ((off & 3) * 8);
+}
+
+/* Host pointer to a whole guest RAM range, NULL if it isn't all RAM */
+static uint8_t *dev_ram(sim_state_t* sim, uint32_t addr, uint64_t len, int p) {
+    uint64_t n = len;
+    uint8_t *h = cpu_translate_range(sim, addr, &n, p);
+    return h != NULL && n == len && addr >= SIM_RAM_BASE ? h : NULL;
+}
+
+/* UART
+    0x00 DATA: writes send a byte, reads take the next one (0 if there's none)
+    0x04 STATUS: bit0 TX busy, bit1 RX ready, bit2 RX at end of input */
+struct dev_uart {
+    FILE *in;
+    FILE *out;
+    unsigned long tx_done;
+    int rx; /* Byte read ahead of the guest, -1 for none */
+    bool rx_eof;
+};
+
+/* Next input byte, EOF or DEV_UART_EMPTY, never blocks: in is polled and
+    read a byte at a time through its descriptor */
+static int dev_uart_peek(xm_sim_t *sim, struct dev_uart *u) {
+    if (u->in == NULL || sim_rr_replaying(sim))
+        return EOF;
+    if (u->rx < 0 && !u->rx_eof) {
+        struct pollfd p = { fileno(u->in), POLLIN, 0 };
+        uint8_t b;
+        ssize_t n;
+        if (poll(&p, 1, 0) > 0) {
+            if ((n = read(p.fd, &b, 1)) == 1)
+                u->rx = b;
+            else if (n == 0 || (errno != EINTR && errno != EAGAIN))
+                u->rx_eof = true;
+        }
+    }
+    return u->rx >= 0 ? u->rx : u->rx_eof ? EOF : DEV_UART_EMPTY;
+}
+static uint8_t dev_uart_read(xm_sim_t *sim, void *dev, uint32_t off) {
+    struct dev_uart *u = dev;
+    int c;
+    switch (off) {
+    case 0x00:
+        if ((c = dev_uart_peek(sim, u)) >= 0)
+            u->rx = -1;
+        return (uint8_t)xm_dev_input(sim, c >= 0 ? (uint32_t)c : 0);
+    case 0x04:
+        if ((c = dev_uart_peek(sim, u)) == DEV_UART_EMPTY)
+            xm_dev_wait(sim);
+        return (uint8_t)((xm_dev_now(sim) < u->tx_done ? 1 : 0)
+            | xm_dev_input(sim, c >= 0 ? 2 : c == EOF ? 4 : 0));
+    default:
+        return 0;
+    }
+}
+static void dev_uart_write(xm_sim_t *sim, void *dev, uint32_t off, uint8_t v) {
+    struct dev_uart *u = dev;
+    if (off != 0x00)
+        return;
+    if (u->out != NULL) {
+        fputc(v, u->out);
+        if (v == '\n')
+            fflush(u->out);
+    }
+    u->tx_done = xm_dev_now(sim) + DEV_UART_TX_TICKS;
+}
+static void dev_uart_destroy(void *dev) {
+    struct dev_uart *u = dev;
+    if (u->out != NULL)
+        fflush(u->out);
+    free(u);
+}
+
+int xm_dev_add_uart(xm_sim_t *sim, uint32_t base, FILE *in, FILE *out) {
+    static const xm_dev_ops_t ops = { dev_uart_read, dev_uart_write, dev_uart_destroy };
+    struct dev_uart *u = calloc(1, sizeof(*u));
+    if (u == NULL)
+        return -1;
+    u->in = in;
+    u->out = out;
+    u->rx = -1;
+    return xm_dev_map(sim, base, PAGE_SIZE, &ops, u);
+}
+
+/* Timer
+    0x00 COUNT: ticks from start to expiry (32-bit)
+    0x04 CTRL: 0 stops, 1 starts once, 2 starts periodic
+    0x08 STATUS: bit0 expired, cleared by any write
+    0x0c NOW: current tick, low 32 bits
+    0x10 FIRED: expiries so far (32-bit) */
+struct dev_timer {
+    uint32_t count;
+    uint8_t ctrl;
+    uint8_t status;
+    uint32_t fired;
+    unsigned long deadline; /* Events for other deadlines are stale */
+};
+
+static void dev_timer_event(xm_sim_t *sim, void *dev) {
+    struct dev_timer *t = dev;
+    if (t->ctrl == 0 || xm_dev_now(sim) != t->deadline)
+        return;
+    t->status |= 1;
+    ++t->fired;
+    if (t->ctrl == 2 && t->count != 0) {
+        t->deadline += t->count;
+        xm_dev_schedule(sim, t->deadline, dev_timer_event, t);
+    } else {
+        t->ctrl = 0;
+    }
+}
+static uint8_t dev_timer_read(xm_sim_t *sim, void *dev, uint32_t off) {
+    struct dev_timer *t = dev;
+    switch (off) {
+    case 0x00: case 0x01: case 0x02: case 0x03: return dev_reg_read(t->count, off);
+    case 0x04: return t->ctrl;
+    case 0x08:
+        if (t->status == 0 && t->ctrl != 0)
+            xm_dev_wait(sim);
+        return t->status;
+    case 0x0c: case 0x0d: case 0x0e: case 0x0f: return dev_reg_read((uint32_t)xm_dev_now(sim), off);
+    case 0x10: case 0x11: case 0x12: case 0x13: return dev_reg_read(t->fired, off);
+    default: return 0;
+    }
+}
+static void dev_timer_write(xm_sim_t *sim, void *dev, uint32_t off, uint8_t v) {
+    struct dev_timer *t = dev;
+    switch (off) {
+    case 0x00: case 0x01: case 0x02: case 0x03:
+        dev_reg_write(&t->count, off, v);
+        break;
+    case 0x04:
+        t->ctrl = v <= 2 ? v : 0;
+        if (t->ctrl != 0) {
+            /* Counts from the instruction after this one */
+            t->deadline = xm_dev_now(sim) + t->count;
+            xm_dev_schedule(sim, t->deadline, dev_timer_event, t);
+        }
+        break;
+    case 0x08:
+        t->status = 0;
+        break;
+    }
+}
+
+int xm_dev_add_timer(xm_sim_t *sim, uint32_t base) {
+    static const xm_dev_ops_t ops = { dev_timer_read, dev_timer_write, free };
+    struct dev_timer *t = calloc(1, sizeof(*t));
+    if (t == NULL)
+        return -1;
+    return xm_dev_map(sim, base, PAGE_SIZE, &ops, t);
+}
+
+/* Block device
+    0x00 SECTOR, 0x04 ADDR (guest RAM), 0x08 COUNT (sectors), all 32-bit
+    0x0c CMD: 1 reads COUNT sectors into ADDR, 2 writes them from ADDR
+    0x10 STATUS: bit0 busy, bit1 error
+    0x14 CAPACITY: sectors (32-bit) */
+struct dev_blk {
+    int fd;
+    uint32_t sector;
+    uint32_t addr;
+    uint32_t count;
+    uint8_t cmd;
+    uint8_t status;
+    uint32_t capacity;
+};
+
+/* The transfer happens all at once when the command completes */
+static void dev_blk_event(xm_sim_t *sim, void *dev) {
+    struct dev_blk *b = dev;
+    size_t len = (size_t)b->count * DEV_BLK_SECTOR;
+    off_t pos = (off_t)b->sector * DEV_BLK_SECTOR;
+    uint8_t *p = b->sector + (uint64_t)b->count <= b->capacity
+        ? dev_ram(sim, b->addr, len, b->cmd == 1 ? XM_PAGE_W : XM_PAGE_R) : NULL;
+    b->status = 0;
+    if (p == NULL) {
+        b->status = DEV_STATUS_ERROR;
+    } else if (b->cmd == 1) {
+        if (!sim_rr_replaying(sim) && pread(b->fd, p, len, pos) != (ssize_t)len)
+            b->status = DEV_STATUS_ERROR;
+        xm_dev_input_buf(sim, p, len);
+    } else if (!sim_rr_replaying(sim) && pwrite(b->fd, p, len, pos) != (ssize_t)len) {
+        b->status = DEV_STATUS_ERROR;
+    }
+}
+static uint8_t dev_blk_read(xm_sim_t *sim, void *dev, uint32_t off) {
+    struct dev_blk *b = dev;
+    switch (off) {
+    case 0x00: case 0x01: case 0x02: case 0x03: return dev_reg_read(b->sector, off);
+    case 0x04: case 0x05: case 0x06: case 0x07: return dev_reg_read(b->addr, off);
+    case 0x08: case 0x09: case 0x0a: case 0x0b: return dev_reg_read(b->count, off);
+    case 0x0c: return b->cmd;
+    case 0x10:
+        if ((b->status & DEV_STATUS_BUSY) != 0)
+            xm_dev_wait(sim);
+        return b->status;
+    case 0x14: case 0x15: case 0x16: case 0x17: return dev_reg_read(b->capacity, off);
+    default: return 0;
+    }
+}
+static void dev_blk_write(xm_sim_t *sim, void *dev, uint32_t off, uint8_t v) {
+    struct dev_blk *b = dev;
+    switch (off) {
+    case 0x00: case 0x01: case 0x02: case 0x03: dev_reg_write(&b->sector, off, v); break;
+    case 0x04: case 0x05: case 0x06: case 0x07: dev_reg_write(&b->addr, off, v); break;
+    case 0x08: case 0x09: case 0x0a: case 0x0b: dev_reg_write(&b->count, off, v); break;
+    case 0x0c:
+        if ((b->status & DEV_STATUS_BUSY) != 0 || (v != 1 && v != 2)) {
+            b->status |= DEV_STATUS_ERROR;
+            break;
+        }
+        b->cmd = v;
+        b->status = DEV_STATUS_BUSY;
+        xm_dev_schedule(sim, xm_dev_now(sim) + DEV_BLK_SEEK_TICKS
+            + (unsigned long)b->count * DEV_BLK_SECTOR / DEV_BLK_BYTES_PER_TICK, dev_blk_event, b);
+        break;
+    }
+}
+static void dev_blk_destroy(void *dev) {
+    struct dev_blk *b = dev;
+    close(b->fd);
+    free(b);
+}
+
+int xm_dev_add_blk(xm_sim_t *sim, uint32_t base, const char *path) {
+    static const xm_dev_ops_t ops = { dev_blk_read, dev_blk_write, dev_blk_destroy };
+    struct dev_blk *b = calloc(1, sizeof(*b));
+    struct stat st;
+    if (b == NULL)
+        return -1;
+    if ((b->fd = open(path, O_RDWR)) < 0 || fstat(b->fd, &st) != 0) {
+        if (b->fd >= 0)
+            close(b->fd);
+        free(b);
+        return -1;
+    }
+    b->capacity = (uint32_t)(st.st_size / DEV_BLK_SECTOR);
+    return xm_dev_map(sim, base, PAGE_SIZE, &ops, b);
+}
+
+/* DMA engine
+    0x00 SRC, 0x04 DST, 0x08 LEN, all 32-bit
+    0x0c CMD: 1 copies LEN bytes from SRC to DST (overlap allowed), 2 fills
+        them with the low byte of SRC
+    0x10 STATUS: bit0 busy, bit1 error */
+struct dev_dma {
+    unsigned bytes_per_tick;
+    uint32_t src;
+    uint32_t dst;
+    uint32_t len;
+    uint8_t cmd;
+    uint8_t status;
+};
+
+static void dev_dma_event(xm_sim_t *sim, void *dev) {
+    struct dev_dma *d = dev;
+    uint8_t *dst = dev_ram(sim, d->dst, d->len, XM_PAGE_W);
+    uint8_t *src = d->cmd == 1 ? dev_ram(sim, d->src, d->len, XM_PAGE_R) : NULL;
+    d->status = 0;
+    if (dst == NULL || (d->cmd == 1 && src == NULL))
+        d->status = DEV_STATUS_ERROR;
+    else if (d->cmd == 1)
+        memmove(dst, src, d->len);
+    else
+        memset(dst, (uint8_t)d->src, d->len);
+}
+static uint8_t dev_dma_read(xm_sim_t *sim, void *dev, uint32_t off) {
+    struct dev_dma *d = dev;
+    switch (off) {
+    case 0x00: case 0x01: case 0x02: case 0x03: return dev_reg_read(d->src, off);
+    case 0x04: case 0x05: case 0x06: case 0x07: return dev_reg_read(d->dst, off);
+    case 0x08: case 0x09: case 0x0a: case 0x0b: return dev_reg_read(d->len, off);
+    case 0x0c: return d->cmd;
+    case 0x10:
+        if ((d->status & DEV_STATUS_BUSY) != 0)
+            xm_dev_wait(sim);
+        return d->status;
+    default: return 0;
+    }
+}
+static void dev_dma_write(xm_sim_t *sim, void *dev, uint32_t off, uint8_t v) {
+    struct dev_dma *d = dev;
+    switch (off) {
+    case 0x00: case 0x01: case 0x02: case 0x03: dev_reg_write(&d->src, off, v); break;
+    case 0x04: case 0x05: case 0x06: case 0x07: dev_reg_write(&d->dst, off, v); break;
+    case 0x08: case 0x09: case 0x0a: case 0x0b: dev_reg_write(&d->len, off, v); break;
+    case 0x0c:
+        if ((d->status & DEV_STATUS_BUSY) != 0 || (v != 1 && v != 2)) {
+            d->status |= DEV_STATUS_ERROR;
+            break;
+        }
+        d->cmd = v;
+        d->status = DEV_STATUS_BUSY;
+        xm_dev_schedule(sim, xm_dev_now(sim)
+            + ((unsigned long)d->len + d->bytes_per_tick - 1) / d->bytes_per_tick, dev_dma_event, d);
+        break;
+    }
+}
+
+int xm_dev_add_dma(xm_sim_t *sim, uint32_t base, unsigned bytes_per_tick) {
+    static const xm_dev_ops_t ops = { dev_dma_read, dev_dma_write, free };
+    struct dev_dma *d = calloc(1, sizeof(*d));
+    if (d == NULL)
+        return -1;
+    d->bytes_per_tick = bytes_per_tick != 0 ? bytes_per_tick : 1;
+    return xm_dev_map(sim, base, PAGE_SIZE, &ops, d);
+}
@@ -1,88 +1,382 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <stdint.h>
+#include <stdbool.h>
 #include <string.h>
 #include <stddef.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include "isa.h"
+#include "xmmap.h"
 
-void dis_print_format(char ob[], const char* name, enum xm_inst_format f, FILE* out) {
-    char buf[BUFSIZ];
-    buf[0] = '\0';
+/* Images at least PARALLEL_MIN_SIZE long are swept in stretches of about
+    PARALLEL_CHUNK_SIZE, up to jobs of them at once, each into its own buffer.
+    The buffers go out in order once the whole batch is done. */
+#define PARALLEL_MIN_SIZE (1 << 20)
+#define PARALLEL_CHUNK_SIZE (1 << 18)
+#define PARALLEL_MAX_JOBS 64
+
+/* The most a line takes besides names and notes */
+#define DIS_LINE_MAX 96
+
+static xm_inst_decoder_t dis_decoder;
+
+/* Text of a stretch of the image */
+struct dis_buf {
+    char *p;
+    size_t len;
+    size_t cap;
+};
+
+struct dis_job {
+    const uint8_t *p; /* The whole image */
+    size_t len;
+    size_t begin, end; /* Offsets of the stretch */
+    xm_map_t const* map;
+    struct dis_buf out;
+};
+
+/* Room for n more bytes, the puts below don't check */
+static void dis_reserve(struct dis_buf* b, size_t n) {
+    if (b->len + n <= b->cap)
+        return;
+    size_t cap = b->cap ? b->cap * 2 : 1 << 16;
+    while (cap < b->len + n)
+        cap *= 2;
+    char *p = realloc(b->p, cap);
+    if (p == NULL) {
+        fprintf(stderr, "out of memory\n");
+        abort();
+    }
+    b->p = p;
+    b->cap = cap;
+}
+
+static void dis_put(struct dis_buf* b, const char *s, size_t n) {
+    memcpy(b->p + b->len, s, n);
+    b->len += n;
+}
+
+static void dis_putc(struct dis_buf* b, char c) {
+    b->p[b->len++] = c;
+}
+
+static void dis_put_dec(struct dis_buf* b, int32_t v) {
+    char t[12];
+    size_t n = 0;
+    uint32_t u = v < 0 ? 0u - (uint32_t)v : (uint32_t)v;
+    do
+        t[n++] = (char)('0' + u % 10);
+    while ((u /= 10) != 0);
+    if (v < 0)
+        dis_putc(b, '-');
+    while (n != 0)
+        dis_putc(b, t[--n]);
+}
+
+/* Like %#x */
+static void dis_put_hex(struct dis_buf* b, uint32_t v) {
+    int shift = 28;
+    if (v == 0) {
+        dis_putc(b, '0');
+        return;
+    }
+    dis_put(b, "0x", 2);
+    while ((v >> shift) == 0)
+        shift -= 4;
+    for (; shift >= 0; shift -= 4)
+        dis_putc(b, "0123456789abcdef"[(v >> shift) & 0x0f]);
+}
+
+static void dis_put_reg(struct dis_buf* b, const char *prefix, unsigned r) {
+    dis_put(b, prefix, strlen(prefix));
+    dis_put_dec(b, (int32_t)r);
+}
+
+/* Tab, then name padded to 8 like %-8s */
+static void dis_put_name(struct dis_buf* b, const char *name) {
+    size_t n = strlen(name);
+    dis_putc(b, '\t');
+    dis_put(b, name, n);
+    for (; n < 8; ++n)
+        dis_putc(b, ' ');
+}
+
+static void dis_put_operands(struct dis_buf* b, uint8_t const ob[], enum xm_inst_format f) {
     switch (f) {
     case XM_FORMAT_R4R4I8O8_IFHBS:
-        if ((ob[3] & 0x80) != 0) {
-            sprintf(buf, "$r%i,$r%i,%i",
-                ob[1] & 0x0f, (ob[1] >> 4) & 0x0f,
-                ob[2]);
-        } else {
-            sprintf(buf, "$r%i,$r%i,$r%i,%i",
-                ob[1] & 0x0f, (ob[1] >> 4) & 0x0f,
-                ob[2] & 0x0f, (ob[2] >> 4) & 0x0f);
+        dis_put_reg(b, "$r", ob[1] & 0x0f);
+        dis_put_reg(b, ",$r", ob[1] >> 4);
+        dis_putc(b, ',');
+        if ((ob[3] & 0x80) != 0)
+            dis_put_dec(b, (int8_t)ob[2]);
+        else {
+            dis_put_reg(b, "$r", ob[2] & 0x0f);
+            dis_putc(b, ',');
+            dis_put_dec(b, ob[2] >> 4);
         }
         break;
     case XM_FORMAT_R4U4RA8O8: {
         uint8_t cc = ob[1] >> 4;
-        sprintf(buf, "$r%i,%i,?%c%c%c%c", ob[1] & 0x0f, (int32_t)(int8_t)ob[2],
-            (cc & 0x01) != 0 ? '!' : ' ',
-            (cc & 0x02) != 0 ? 'n' : ' ',
-            (cc & 0x04) != 0 ? 'z' : ' ',
-            (cc & 0x08) != 0 ? 'c' : ' '
-        );
+        dis_put_reg(b, "$r", ob[1] & 0x0f);
+        dis_putc(b, ',');
+        dis_put_dec(b, (int8_t)ob[2]);
+        dis_put(b, ",?", 2);
+        dis_putc(b, (cc & 0x01) != 0 ? '!' : ' ');
+        dis_putc(b, (cc & 0x02) != 0 ? 'n' : ' ');
+        dis_putc(b, (cc & 0x04) != 0 ? 'z' : ' ');
+        dis_putc(b, (cc & 0x08) != 0 ? 'c' : ' ');
         break;
     }
     case XM_FORMAT_R4R4R4R4:
-        sprintf(buf, "$r%i,$r%i,$r%i,$r%i",
-            ob[1] & 0x0f, (ob[1] >> 4) & 0x0f,
-            ob[2] & 0x0f, (ob[2] >> 4) & 0x0f);
-        break;
     case XM_FORMAT_F4F4F4F4:
-        sprintf(buf, "$f%i,$f%i,$f%i,$f%i",
-            ob[1] & 0x0f, (ob[1] >> 4) & 0x0f,
-            ob[2] & 0x0f, (ob[2] >> 4) & 0x0f);
+    case XM_FORMAT_R4F4F4F4: {
+        const char *r = f == XM_FORMAT_R4R4R4R4 ? "$r" : "$f";
+        dis_put_reg(b, f == XM_FORMAT_F4F4F4F4 ? "$f" : "$r", ob[1] & 0x0f);
+        dis_putc(b, ',');
+        dis_put_reg(b, r, ob[1] >> 4);
+        dis_putc(b, ',');
+        dis_put_reg(b, r, ob[2] & 0x0f);
+        dis_putc(b, ',');
+        dis_put_reg(b, r, ob[2] >> 4);
+        break;
+    }
+    case XM_FORMAT_R4C4U8O8:
+        dis_put_reg(b, "$r", ob[1] & 0x0f);
+        dis_put_reg(b, ",$cr", ob[1] >> 4);
+        break;
+    case XM_FORMAT_C4R4U8O8:
+        dis_put_reg(b, "$cr", ob[1] & 0x0f);
+        dis_put_reg(b, ",$r", ob[1] >> 4);
+        break;
+    case XM_FORMAT_R4R4U8O8:
+        dis_put_reg(b, "$r", ob[1] & 0x0f);
+        dis_put_reg(b, ",$r", ob[1] >> 4);
+        break;
+    case XM_FORMAT_AA16O8:
+        dis_put_hex(b, (uint32_t)ob[1] << 8 | ob[2]);
+        break;
+    case XM_FORMAT_RA16O8:
+        dis_put_dec(b, (int16_t)(ob[1] << 8 | ob[2]));
         break;
     case XM_FORMAT_U16O8:
+    case XM_FORMAT_D8:
         break;
     default:
-        strcpy(buf, "<invalid>");
+        dis_put(b, "<invalid>", 9);
         break;
     }
-    fprintf(out, "\t%-8s%s\n", name, buf);
-}
-
-void dis_disassemble(FILE* fp, FILE* out) {
-    char ob[8];
-    while ((ob[0] = fgetc(fp)) != EOF) { /* control op */
-        switch (ob[0] & 0x0f) {
-        case XM_CB_INTEGER:
-            ob[1] = fgetc(fp); /* d0 */
-            ob[2] = fgetc(fp); /* d1 */
-            ob[3] = fgetc(fp); /* opcode */
-            for (unsigned i = 0; i < XM_INST_TABLE_COUNT; ++i)
-                if (xm_inst_table[i].op == (ob[3] & 0x7f)) {
-                    dis_print_format(ob, xm_inst_table[i].name, xm_inst_table[i].format, out);
-                    break;
-                }
-            break;
-        case XM_CB_FLOAT:
-            break;
-        case XM_CB_VECTOR:
-            break;
-        case XM_CB_TILE:
-            break;
-        default:
-            abort();
+}
+
+/* First of the map's symbols at or after addr */
+static size_t dis_symbol_from(xm_map_t const* map, uint32_t addr) {
+    size_t lo = 0, hi = map->h.n_symbols;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (map->symbols[mid].addr < addr)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+/* First of the map's lines after addr */
+static size_t dis_line_after(xm_map_t const* map, uint32_t addr) {
+    size_t lo = 0, hi = map->h.n_lines;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (map->lines[mid].addr <= addr)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+/* Linear sweep of [begin, end), every stretch the same as it would be in one
+    sweep of the whole image as long as it starts on a 4 byte boundary, or on
+    a line of the map if there are any. With a map, labels go before what
+    they point at, the source line after the first instruction from it and
+    data the map knows of as such. Nothing runs across the start of a line,
+    what's left before it goes as data. */
+static void dis_sweep(struct dis_job* j) {
+    xm_map_t const* map = j->map;
+    uint32_t base = map != NULL ? map->h.base : 0;
+    size_t s = map != NULL ? dis_symbol_from(map, base + (uint32_t)j->begin) : 0;
+    size_t li = map != NULL ? dis_line_after(map, base + (uint32_t)j->begin) : 0;
+    size_t n_symbols = map != NULL ? map->h.n_symbols : 0, n_lines = map != NULL ? map->h.n_lines : 0;
+    struct dis_buf* b = &j->out;
+    for (size_t off = j->begin; off < j->end;) {
+        uint32_t pc = base + (uint32_t)off;
+        uint8_t const* ob = j->p + off;
+        const struct xm_map_line *l;
+        size_t avail = j->len - off, note = 0;
+        size_t i = XM_INST_TABLE_COUNT;
+        for (; s < n_symbols && map->symbols[s].addr <= pc; ++s)
+            if (map->symbols[s].addr == pc && map->symbols[s].size != 0) {
+                dis_reserve(b, map->symbols[s].name_len + 2);
+                dis_put(b, map->strings + map->symbols[s].name, map->symbols[s].name_len);
+                dis_put(b, ":\n", 2);
+            }
+        for (; li < n_lines && map->lines[li].addr <= pc; ++li)
+            ;
+        l = li != 0 && pc - base < map->h.size ? &map->lines[li - 1] : NULL;
+        if (li < n_lines && map->lines[li].addr - pc < avail)
+            avail = map->lines[li].addr - pc;
+        if (l != NULL && l->addr == pc && l->line != 0)
+            note = map->files[l->file].name_len;
+        dis_reserve(b, DIS_LINE_MAX + note);
+        if ((l == NULL || (l->flags & XM_MAP_DATA) == 0) && avail >= 4)
+            i = xm_inst_decode(&dis_decoder, ob);
+        if (i != XM_INST_TABLE_COUNT) {
+            dis_put_name(b, xm_inst_table[i].name);
+            dis_put_operands(b, ob, xm_inst_table[i].format);
+            avail = 4;
+        } else {
+            /* Data, literal pools, vector and tile classes */
+            uint32_t v = 0;
+            avail = avail >= 4 ? 4 : avail >= 2 ? 2 : 1;
+            for (size_t k = 0; k < avail; ++k)
+                v = v << 8 | ob[k];
+            dis_put_name(b, avail == 4 ? ".long" : avail == 2 ? ".word" : ".byte");
+            dis_put_hex(b, v);
+        }
+        if (note != 0) {
+            dis_put(b, "\t# ", 3);
+            dis_put(b, map->strings + map->files[l->file].name, note);
+            dis_putc(b, ':');
+            dis_put_dec(b, (int32_t)l->line);
         }
+        dis_putc(b, '\n');
+        off += avail;
     }
 }
 
+static void *dis_sweep_run(void *arg) {
+    dis_sweep(arg);
+    return NULL;
+}
+
+/* Where the stretch from at on should end, somewhere a sweep lands on */
+static size_t dis_split(xm_map_t const* map, size_t at, size_t len) {
+    size_t end = (at + PARALLEL_CHUNK_SIZE) & ~(size_t)3, li;
+    if (end >= len)
+        return len;
+    if (map == NULL || map->h.n_lines == 0)
+        return end;
+    if ((li = dis_line_after(map, map->h.base + (uint32_t)end - 1)) == map->h.n_lines)
+        return len;
+    end = map->lines[li].addr - map->h.base;
+    return end > at && end < len ? end : len;
+}
+
+void dis_disassemble(const uint8_t *p, size_t len, FILE* out, xm_map_t const* map, unsigned jobs) {
+    static struct dis_job chunks[PARALLEL_MAX_JOBS];
+    pthread_t threads[PARALLEL_MAX_JOBS];
+    size_t at = 0;
+    jobs = len < PARALLEL_MIN_SIZE || jobs == 0 ? 1 : jobs > PARALLEL_MAX_JOBS ? PARALLEL_MAX_JOBS : jobs;
+    while (at < len) {
+        unsigned n = 0;
+        bool started[PARALLEL_MAX_JOBS];
+        for (; n < jobs && at < len; ++n) {
+            size_t end = dis_split(map, at, len);
+            chunks[n].p = p;
+            chunks[n].len = len;
+            chunks[n].begin = at;
+            chunks[n].end = end;
+            chunks[n].map = map;
+            chunks[n].out.len = 0;
+            at = end;
+        }
+        /* Whatever couldn't get a thread goes on this one */
+        for (unsigned i = 0; i < n; ++i)
+            started[i] = n > 1 && pthread_create(&threads[i], NULL, dis_sweep_run, &chunks[i]) == 0;
+        for (unsigned i = 0; i < n; ++i) {
+            if (started[i])
+                pthread_join(threads[i], NULL);
+            else
+                dis_sweep(&chunks[i]);
+            fwrite(chunks[i].out.p, 1, chunks[i].out.len, out);
+        }
+    }
+    for (unsigned i = 0; i < jobs; ++i) {
+        free(chunks[i].out.p);
+        chunks[i].out = (struct dis_buf){0};
+    }
+}
+
+/* All of fd, for pipes */
+static uint8_t *dis_read_all(int fd, size_t *len) {
+    size_t cap = 1 << 16;
+    uint8_t *p = malloc(cap), *q;
+    ssize_t n;
+    *len = 0;
+    while (p != NULL && (n = read(fd, p + *len, cap - *len)) > 0) {
+        *len += (size_t)n;
+        if (*len < cap)
+            continue;
+        if ((q = realloc(p, cap * 2)) == NULL)
+            free(p);
+        p = q;
+        cap *= 2;
+    }
+    return p;
+}
+
 int main(int argc, char *argv[]) {
-    FILE* fp = stdin;
-    if (argc > 1)
-        fp = fopen(argv[1], "rb");
+    const char *path = NULL, *map_path = NULL;
+    char *def = NULL;
+    xm_map_t *map = NULL;
+    long jobs = sysconf(_SC_NPROCESSORS_ONLN);
+    uint8_t *p = NULL;
+    size_t len = 0;
+    bool mapped = false;
+    for (int i = 1; i < argc; ++i) {
+        if (strcmp(argv[i], "-map") == 0 && i + 1 < argc)
+            map_path = argv[++i];
+        else if (strcmp(argv[i], "-jobs") == 0 && i + 1 < argc)
+            jobs = atol(argv[++i]);
+        else
+            path = argv[i];
+    }
+    if (path != NULL) {
+        struct stat st;
+        int fd = open(path, O_RDONLY);
+        if (fd < 0 || fstat(fd, &st) != 0) {
+            fprintf(stderr, "%s: can't read %s\n", argv[0], path);
+            return EXIT_FAILURE;
+        }
+        len = (size_t)st.st_size;
+        if (len != 0 && (p = mmap(NULL, len, PROT_READ, MAP_PRIVATE, fd, 0)) != MAP_FAILED) {
+            madvise(p, len, MADV_SEQUENTIAL);
+            mapped = true;
+        } else
+            p = dis_read_all(fd, &len);
+        close(fd);
+    } else
+        p = dis_read_all(fileno(stdin), &len);
+    if (p == NULL) {
+        fprintf(stderr, "%s: can't read %s\n", argv[0], path != NULL ? path : "<stdin>");
+        return EXIT_FAILURE;
+    }
+    /* The map xm_asm or xm_ld wrote next to the image, if any */
+    if (map_path == NULL && path != NULL && (def = malloc(strlen(path) + sizeof(".map"))) != NULL)
+        map = xm_map_open(strcat(strcpy(def, path), ".map"));
+    else if (map_path != NULL && (map = xm_map_open(map_path)) == NULL)
+        fprintf(stderr, "%s: %s isn't a map\n", argv[0], map_path);
+    xm_inst_decoder_init(&dis_decoder);
     /**/
-    dis_disassemble(fp, stdout);
+    dis_disassemble(p, len, stdout, map, jobs > 0 ? (unsigned)jobs : 1);
     /**/
-    if (fp != stdin)
-        fclose(fp);
+    if (mapped)
+        munmap(p, len);
+    else
+        free(p);
+    xm_map_close(map);
+    free(def);
     return EXIT_SUCCESS;
 }
@@ -0,0 +1,45 @@
+#include <stdbool.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+
+#include "isa.h"
+#include "xmsim.h"
+#include "sim.h"
+
+/* Execution profile
+    How often every ROM word was executed and how often control left it for
+    anything but the next word, counted by the trace core. That's enough for
+    xm_asm -profile to tell hot blocks from cold ones and which way each
+    branch went. */
+
+struct sim_exec {
+    unsigned long count[SIM_ROM_SIZE / 4];
+    unsigned long taken[SIM_ROM_SIZE / 4];
+};
+
+struct sim_exec *sim_exec_create(void) {
+    return calloc(1, sizeof(struct sim_exec));
+}
+
+void sim_exec_step(sim_state_t* sim, uint32_t pc) {
+    uint32_t i = (pc - SIM_ROM_BASE) / 4;
+    if (pc - SIM_ROM_BASE >= SIM_ROM_SIZE)
+        return;
+    ++sim->exec->count[i];
+    if (sim->cpu.pc != pc + 4)
+        ++sim->exec->taken[i];
+}
+
+int xm_sim_exec_profile_write(const xm_sim_t *sim, FILE *out) {
+    struct sim_exec const* e = sim->exec;
+    if (e == NULL)
+        return -1;
+    fprintf(out, "# xm_sim exec profile: image %lu\n", (unsigned long)sim->rom_size);
+    for (uint32_t i = 0; i < SIM_ROM_SIZE / 4; ++i)
+        if (e->count[i] != 0)
+            fprintf(out, "%x %lu %lu\n", SIM_ROM_BASE + i * 4, e->count[i], e->taken[i]);
+    return ferror(out) ? -1 : 0;
+}
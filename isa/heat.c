@@ -0,0 +1,221 @@
+#include <stdbool.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <math.h>
+
+#include "isa.h"
+#include "xmsim.h"
+#include "sim.h"
+
+/* Access heatmap
+    Bytes accessed per page of ROM and RAM by kind, and per line of the
+    timing model's cache size. ROM and RAM share one index space, ROM first.
+    Every page and line remembers the last interval it was touched in, so
+    the working set of each interval is counted as it goes. */
+
+#define HEAT_LINE_BITS 6
+#define HEAT_DEFAULT_INTERVAL 100000
+#define HEAT_ROW 64 /* Pages per row of the map */
+#define HEAT_CURVE_ROWS 32
+#define HEAT_TOP 16
+
+struct heat_epoch {
+    unsigned long tick; /* First tick of the interval */
+    uint32_t pages;
+    uint32_t lines;
+};
+
+struct sim_heat {
+    unsigned long interval;
+    unsigned long start; /* Current interval */
+    uint32_t epoch; /* Number of the current interval, from 1 */
+    uint32_t pages;
+    uint32_t lines;
+    struct heat_epoch *curve;
+    size_t n_curve;
+    size_t cap_curve;
+    size_t n_pages;
+    unsigned long (*page)[3]; /* Bytes read, written, fetched */
+    uint32_t *page_epoch;
+    unsigned long *line;
+    uint32_t *line_epoch;
+};
+
+struct sim_heat *sim_heat_create(sim_state_t const* sim, unsigned long interval) {
+    struct sim_heat *h = calloc(1, sizeof(*h));
+    size_t n_lines;
+    if (h == NULL)
+        return NULL;
+    h->interval = interval != 0 ? interval : HEAT_DEFAULT_INTERVAL;
+    h->start = sim->perf.ticks;
+    h->epoch = 1;
+    h->n_pages = (SIM_ROM_SIZE + sim->ram_size + PAGE_SIZE - 1) / PAGE_SIZE;
+    n_lines = h->n_pages * (PAGE_SIZE >> HEAT_LINE_BITS);
+    h->page = calloc(h->n_pages, sizeof(*h->page));
+    h->page_epoch = calloc(h->n_pages, sizeof(*h->page_epoch));
+    h->line = calloc(n_lines, sizeof(*h->line));
+    h->line_epoch = calloc(n_lines, sizeof(*h->line_epoch));
+    if (h->page == NULL || h->page_epoch == NULL || h->line == NULL || h->line_epoch == NULL) {
+        sim_heat_destroy(h);
+        return NULL;
+    }
+    return h;
+}
+
+void sim_heat_destroy(struct sim_heat *h) {
+    if (h != NULL) {
+        free(h->page);
+        free(h->page_epoch);
+        free(h->line);
+        free(h->line_epoch);
+        free(h->curve);
+    }
+    free(h);
+}
+
+/* Closes the current interval once ticks passed it, skipping idle ones */
+static void heat_advance(struct sim_heat *h, unsigned long ticks) {
+    if (h->pages != 0) {
+        if (h->n_curve == h->cap_curve) {
+            size_t cap = h->cap_curve ? h->cap_curve * 2 : 64;
+            struct heat_epoch *curve = realloc(h->curve, cap * sizeof(*curve));
+            if (curve == NULL)
+                return; /* Keep counting into the current one */
+            h->curve = curve;
+            h->cap_curve = cap;
+        }
+        h->curve[h->n_curve++] = (struct heat_epoch){h->start, h->pages, h->lines};
+    }
+    h->start = ticks - (ticks - h->start) % h->interval;
+    h->pages = h->lines = 0;
+    ++h->epoch;
+}
+
+void sim_heat_access(sim_state_t* sim, uint32_t a, int p) {
+    struct sim_heat *h = sim->heat;
+    size_t i, line;
+    if (a >= SIM_ROM_BASE && a - SIM_ROM_BASE < SIM_ROM_SIZE)
+        i = a - SIM_ROM_BASE;
+    else if (a >= SIM_RAM_BASE && a - SIM_RAM_BASE < sim->ram_size)
+        i = SIM_ROM_SIZE + (a - SIM_RAM_BASE);
+    else
+        return;
+    if (sim->perf.ticks - h->start >= h->interval)
+        heat_advance(h, sim->perf.ticks);
+    line = i >> HEAT_LINE_BITS;
+    ++h->page[i / PAGE_SIZE][(p & XM_PAGE_X) != 0 ? 2 : (p & XM_PAGE_W) != 0 ? 1 : 0];
+    ++h->line[line];
+    if (h->page_epoch[i / PAGE_SIZE] != h->epoch) {
+        h->page_epoch[i / PAGE_SIZE] = h->epoch;
+        ++h->pages;
+    }
+    if (h->line_epoch[line] != h->epoch) {
+        h->line_epoch[line] = h->epoch;
+        ++h->lines;
+    }
+}
+
+/* Guest address of an offset into the index space */
+static uint32_t heat_addr(size_t off) {
+    return off < SIM_ROM_SIZE ? SIM_ROM_BASE + (uint32_t)off : SIM_RAM_BASE + (uint32_t)(off - SIM_ROM_SIZE);
+}
+
+static unsigned long heat_page_total(struct sim_heat const* h, size_t i) {
+    return h->page[i][0] + h->page[i][1] + h->page[i][2];
+}
+
+static void heat_report_map(struct sim_heat const* h, FILE *out) {
+    unsigned long max = 0;
+    for (size_t i = 0; i < h->n_pages; ++i)
+        max = heat_page_total(h, i) > max ? heat_page_total(h, i) : max;
+    fprintf(out, "heatmap: bytes per %d byte page, 1-9 on a log scale up to %lu, . untouched\n", PAGE_SIZE, max);
+    /* Rows start over where RAM does, untouched rows are left out */
+    for (size_t row = 0; row < h->n_pages;) {
+        size_t end = row + HEAT_ROW, n_rom = SIM_ROM_SIZE / PAGE_SIZE;
+        bool any = false;
+        end = row < n_rom && end > n_rom ? n_rom : end;
+        end = end > h->n_pages ? h->n_pages : end;
+        for (size_t i = row; i < end; ++i)
+            any |= heat_page_total(h, i) != 0;
+        if (any) {
+            fprintf(out, "%s %8x ", row < n_rom ? "rom" : "ram", heat_addr(row * PAGE_SIZE));
+            for (size_t i = row; i < end; ++i) {
+                unsigned long n = heat_page_total(h, i);
+                fputc(n == 0 ? '.' : '1' + (int)(max > 1 ? 8. * log((double)n) / log((double)max) : 8.), out);
+            }
+            fputc('\n', out);
+        }
+        row = end;
+    }
+}
+
+static void heat_report_pages(sim_state_t const* sim, struct sim_heat const* h, FILE *out) {
+    size_t kinds[3] = {0}, touched = 0, n_rom = SIM_ROM_SIZE / PAGE_SIZE, ram_top = 0;
+    for (size_t i = 0; i < h->n_pages; ++i) {
+        for (unsigned k = 0; k < 3; ++k)
+            kinds[k] += h->page[i][k] != 0;
+        if (heat_page_total(h, i) != 0) {
+            ++touched;
+            ram_top = i >= n_rom ? i + 1 - n_rom : ram_top;
+        }
+    }
+    fprintf(out, "pages touched: %lu (%lu KB), read %lu, written %lu, executed %lu\n",
+        (unsigned long)touched, (unsigned long)touched * PAGE_SIZE / 1024,
+        (unsigned long)kinds[0], (unsigned long)kinds[1], (unsigned long)kinds[2]);
+    fprintf(out, "ram used up to %8x of %lu KB\n",
+        SIM_RAM_BASE + (uint32_t)(ram_top * PAGE_SIZE), (unsigned long)sim->ram_size / 1024);
+}
+
+/* At most HEAT_CURVE_ROWS rows, each the largest working set of the
+    intervals it stands for */
+static void heat_report_curve(struct sim_heat const* h, FILE *out) {
+    size_t n = h->n_curve + (h->pages != 0), per = (n + HEAT_CURVE_ROWS - 1) / HEAT_CURVE_ROWS;
+    fprintf(out, "working set per %lu ticks\n%12s %8s %8s\n", h->interval, "tick", "pages", "lines");
+    for (size_t row = 0; row < n; row += per) {
+        struct heat_epoch e = {0, 0, 0};
+        for (size_t i = row; i < row + per && i < n; ++i) {
+            struct heat_epoch c = i < h->n_curve ? h->curve[i]
+                : (struct heat_epoch){h->start, h->pages, h->lines};
+            if (i == row)
+                e.tick = c.tick;
+            e.pages = c.pages > e.pages ? c.pages : e.pages;
+            e.lines = c.lines > e.lines ? c.lines : e.lines;
+        }
+        fprintf(out, "%12lu %8u %8u\n", e.tick, e.pages, e.lines);
+    }
+}
+
+/* ROM ones with the code or data they start in */
+static void heat_report_lines(sim_state_t const* sim, struct sim_heat const* h, FILE *out) {
+    char where[128];
+    size_t n_lines = h->n_pages * (PAGE_SIZE >> HEAT_LINE_BITS), top[HEAT_TOP], n_top = 0;
+    /* Insertion into a short sorted list beats sorting every line */
+    for (size_t i = 0; i < n_lines; ++i) {
+        size_t j;
+        if (h->line[i] == 0 || (n_top == HEAT_TOP && h->line[i] <= h->line[top[n_top - 1]]))
+            continue;
+        j = n_top < HEAT_TOP ? n_top++ : HEAT_TOP - 1;
+        for (; j > 0 && h->line[top[j - 1]] < h->line[i]; --j)
+            top[j] = top[j - 1];
+        top[j] = i;
+    }
+    fprintf(out, "hottest %u byte lines\n", 1 << HEAT_LINE_BITS);
+    for (size_t j = 0; j < n_top; ++j) {
+        xm_sim_symbolize(sim, heat_addr(top[j] << HEAT_LINE_BITS), where, sizeof(where));
+        fprintf(out, "%8x %12lu%s%s\n", heat_addr(top[j] << HEAT_LINE_BITS), h->line[top[j]],
+            where[0] != '\0' ? " " : "", where);
+    }
+}
+
+void xm_sim_heat_report(const xm_sim_t *sim, FILE *out) {
+    struct sim_heat const* h = sim->heat;
+    if (h == NULL)
+        return;
+    heat_report_map(h, out);
+    heat_report_pages(sim, h, out);
+    heat_report_curve(h, out);
+    heat_report_lines(sim, h, out);
+}
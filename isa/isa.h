@@ -78,6 +78,12 @@ enum xm_inst_format {
     XM_FORMAT_R8R8RA8O8,
     /* <Integer> Unused(16) Opcode(8) */
     XM_FORMAT_U16O8,
+    /* <Integer> Rd(4) CRa(4) Unused(8) Opcode(8) */
+    XM_FORMAT_R4C4U8O8,
+    /* <Integer> CRd(4) Ra(4) Unused(8) Opcode(8) */
+    XM_FORMAT_C4R4U8O8,
+    /* <Integer> Rd(4) Ra(4) Unused(8) Opcode(8) */
+    XM_FORMAT_R4R4U8O8,
     /* <Float> Fd(4) Fa(4) Fb(4) Fc(4) */
     XM_FORMAT_F4F4F4F4,
     /* <Float> Rd(4) Fa(4) Fb(4) Fc(4) */
@@ -97,6 +103,9 @@ static enum xm_cb0 xm_get_cb0_from_format(enum xm_inst_format f) {
     case XM_FORMAT_R4U4RA8O8:
     case XM_FORMAT_R8R8RA8O8:
     case XM_FORMAT_U16O8:
+    case XM_FORMAT_R4C4U8O8:
+    case XM_FORMAT_C4R4U8O8:
+    case XM_FORMAT_R4R4U8O8:
         return XM_CB_INTEGER;
     case XM_FORMAT_F4F4F4F4:
     case XM_FORMAT_R4F4F4F4:
@@ -136,6 +145,11 @@ static enum xm_cb0 xm_get_cb0_from_format(enum xm_inst_format f) {
     /* 0x19 - 0x1F */ \
     XM_INST_ELEM(cmp, XM_FORMAT_R4R4I8O8_IFHBS, 0x20) \
     XM_INST_ELEM(cmpkp, XM_FORMAT_R4R4I8O8_IFHBS, 0x21) \
+    XM_INST_ELEM(mfcr, XM_FORMAT_R4C4U8O8, 0x22) \
+    XM_INST_ELEM(mtcr, XM_FORMAT_C4R4U8O8, 0x23) \
+    XM_INST_ELEM(dmapoll, XM_FORMAT_R4R4U8O8, 0x24) \
+    XM_INST_ELEM(dmawait, XM_FORMAT_R4R4U8O8, 0x25) \
+    XM_INST_ELEM(syscall, XM_FORMAT_U16O8, 0x26) \
     /**/ \
     XM_INST_ELEM(memcpy, XM_FORMAT_R4R4R4R4, 0x30) \
     XM_INST_ELEM(memmov, XM_FORMAT_R4R4R4R4, 0x31) \
@@ -256,6 +270,44 @@ static struct xm_inst_table_entry {
 };
 #define XM_INST_TABLE_COUNT (sizeof(xm_inst_table) / sizeof(xm_inst_table[0]))
 
+/* Index into xm_inst_table by class and opcode byte, by the high nibble of
+    the control byte for the debug class. XM_INST_TABLE_COUNT where nothing
+    is encoded, the earlier entry where two share an encoding. */
+typedef struct xm_inst_decoder {
+    uint8_t index[16][256];
+} xm_inst_decoder_t;
+_Static_assert(XM_INST_TABLE_COUNT < 256, "xm_inst_decoder_t indices are bytes");
+
+static inline void xm_inst_decoder_init(xm_inst_decoder_t* d) {
+    for (unsigned cb = 0; cb < 16; ++cb)
+        for (unsigned op = 0; op < 256; ++op)
+            d->index[cb][op] = (uint8_t)XM_INST_TABLE_COUNT;
+    for (size_t i = XM_INST_TABLE_COUNT; i-- > 0;) {
+        enum xm_cb0 cb = xm_get_cb0_from_format(xm_inst_table[i].format);
+        d->index[cb][xm_inst_table[i].op & 0xff] = (uint8_t)i;
+        /* The high bit picks the immediate form */
+        if (xm_inst_table[i].format == XM_FORMAT_R4R4I8O8_IFHBS)
+            d->index[cb][(xm_inst_table[i].op | 0x80) & 0xff] = (uint8_t)i;
+    }
+}
+
+static inline size_t xm_inst_decode(xm_inst_decoder_t const* d, uint8_t const id[4]) {
+    return (id[0] & 0x0f) == XM_CB_DEBUG ? d->index[XM_CB_DEBUG][id[0] >> 4] : d->index[id[0] & 0x0f][id[3]];
+}
+
+/* Control registers */
+#define XM_CR_PERFCTL 0 /* Bit 0 enables the counters below */
+#define XM_CR_INSTRET 1 /* Retired instructions */
+#define XM_CR_CYCLES 2 /* Cycles of the timing model with -detailed, ticks without it */
+#define XM_CR_BTAKEN 3 /* Taken branches */
+#define XM_CR_BMISS 4 /* Not taken branches */
+#define XM_CR_JUMPS 5
+#define XM_CR_READS 6 /* Bytes read, including instruction fetch */
+#define XM_CR_WRITES 7 /* Bytes written */
+#define XM_CR_PERF_COUNT 8
+
+#define XM_CR_PERFCTL_EN (1 << 0)
+
 #define XM_PAGE_R 1 /* Read */
 #define XM_PAGE_W 2 /* Write */
 #define XM_PAGE_X 4 /* Execute */
@@ -280,3 +332,37 @@ static struct xm_inst_table_entry {
 #define XM_ABI_BP 13 /* Base pointer */
 #define XM_ABI_SP 14 /* Stack pointer */
 #define XM_ABI_TP 15 /* Thread pointer */
+
+/* Syscall ABI: number in $t0, arguments in $a0..$a3, result in $a0, a
+    negative XM_SYS_E* on failure */
+#define XM_SYS_EXIT 0 /* exit(status) */
+#define XM_SYS_READ 1 /* read(fd, buf, len) */
+#define XM_SYS_WRITE 2 /* write(fd, buf, len) */
+#define XM_SYS_OPEN 3 /* open(path, flags, mode) */
+#define XM_SYS_CLOSE 4 /* close(fd) */
+#define XM_SYS_MMAP 5 /* mmap(len, fd, offset), fd -1 for zeroed memory */
+#define XM_SYS_CLOCK_GETTIME 6 /* clock_gettime(clock, ts), ts is u32 sec, u32 nsec */
+
+#define XM_SYS_O_RDONLY 0x000
+#define XM_SYS_O_WRONLY 0x001
+#define XM_SYS_O_RDWR 0x002
+#define XM_SYS_O_CREAT 0x040
+#define XM_SYS_O_TRUNC 0x200
+#define XM_SYS_O_APPEND 0x400
+
+#define XM_SYS_CLOCK_REALTIME 0
+#define XM_SYS_CLOCK_MONOTONIC 1
+
+#define XM_SYS_EPERM 1
+#define XM_SYS_ENOENT 2
+#define XM_SYS_EIO 5
+#define XM_SYS_EBADF 9
+#define XM_SYS_ENOMEM 12
+#define XM_SYS_EACCES 13
+#define XM_SYS_EFAULT 14
+#define XM_SYS_EEXIST 17
+#define XM_SYS_EISDIR 21
+#define XM_SYS_EINVAL 22
+#define XM_SYS_EMFILE 24
+#define XM_SYS_ENOSPC 28
+#define XM_SYS_ENOSYS 38
@@ -0,0 +1,354 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <stdbool.h>
+#include <sys/types.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "xmsim.h"
+#include "xmobj.h"
+#include "xmmap.h"
+
+/* Links xm_asm -c objects into a ROM image
+    Sections with the same name are laid out together, names in the order
+    they first show up, objects in command line order. Execution starts at
+    the beginning of the image, the first object's .text. */
+
+struct ld_object {
+    const char *path;
+    const uint8_t *p;
+    size_t len;
+    struct xm_obj_header h;
+    const struct xm_obj_section *sections;
+    const struct xm_obj_symbol *symbols;
+    const struct xm_obj_reloc *relocs;
+    const char *strings;
+    uint32_t *base; /* Image offset of every section */
+};
+
+typedef struct ld_state {
+    struct ld_object *objs;
+    size_t n_objs;
+    /* Defined globals by name, open addressing, 0 for a free slot */
+    struct ld_global {
+        uint32_t obj; /* Index + 1 */
+        uint32_t sym;
+    } *globals;
+    size_t globals_size;
+    uint8_t *image;
+    size_t image_len;
+    bool failed;
+} ld_state_t;
+
+#define LD_ERROR(state, ...) \
+    do { \
+        (void)fprintf(stderr, "xm_ld: " __VA_ARGS__), (void)fprintf(stderr, "\n"); \
+        (state)->failed = true; \
+    } while (0)
+
+/* Whether n records of size at off lie within the object */
+static bool ld_in_bounds(struct ld_object const* o, uint32_t off, uint32_t n, size_t size) {
+    return off % 4 == 0 && (uint64_t)off + (uint64_t)n * size <= o->len;
+}
+
+static bool ld_open(ld_state_t* state, struct ld_object* o, const char *path) {
+    struct stat st;
+    int fd = open(path, O_RDONLY);
+    o->path = path;
+    if (fd < 0 || fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(o->h)) {
+        LD_ERROR(state, "%s: can't read an object from it", path);
+        if (fd >= 0)
+            close(fd);
+        return false;
+    }
+    o->len = (size_t)st.st_size;
+    o->p = mmap(NULL, o->len, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (o->p == MAP_FAILED) {
+        o->p = NULL;
+        LD_ERROR(state, "%s: can't map it", path);
+        return false;
+    }
+    memcpy(&o->h, o->p, sizeof(o->h));
+    if (o->h.magic != XM_OBJ_MAGIC
+    || !ld_in_bounds(o, o->h.sections, o->h.n_sections, sizeof(*o->sections))
+    || !ld_in_bounds(o, o->h.symbols, o->h.n_symbols, sizeof(*o->symbols))
+    || !ld_in_bounds(o, o->h.relocs, o->h.n_relocs, sizeof(*o->relocs))
+    || !ld_in_bounds(o, o->h.strings, o->h.strings_len, 1)) {
+        LD_ERROR(state, "%s: not an object", path);
+        return false;
+    }
+    o->sections = (const void *)(o->p + o->h.sections);
+    o->symbols = (const void *)(o->p + o->h.symbols);
+    o->relocs = (const void *)(o->p + o->h.relocs);
+    o->strings = (const char *)(o->p + o->h.strings);
+    for (uint32_t i = 0; i < o->h.n_sections; ++i) {
+        struct xm_obj_section const* s = &o->sections[i];
+        if ((uint64_t)s->offset + s->size > o->len || (uint64_t)s->name + s->name_len > o->h.strings_len
+        || (s->align & (s->align - 1)) != 0) {
+            LD_ERROR(state, "%s: bad section %u", path, i);
+            return false;
+        }
+    }
+    for (uint32_t i = 0; i < o->h.n_symbols; ++i) {
+        struct xm_obj_symbol const* s = &o->symbols[i];
+        if ((uint64_t)s->name + s->name_len > o->h.strings_len
+        || (s->section != XM_OBJ_UNDEF && (s->section >= o->h.n_sections || s->value > o->sections[s->section].size))) {
+            LD_ERROR(state, "%s: bad symbol %u", path, i);
+            return false;
+        }
+    }
+    for (uint32_t i = 0; i < o->h.n_relocs; ++i) {
+        struct xm_obj_reloc const* r = &o->relocs[i];
+        if (r->section >= o->h.n_sections || r->symbol >= o->h.n_symbols || r->type > XM_RELOC_ADDR
+        || (uint64_t)r->offset + (r->type == XM_RELOC_ADDR ? 16 : 4) > o->sections[r->section].size) {
+            LD_ERROR(state, "%s: bad relocation %u", path, i);
+            return false;
+        }
+    }
+    o->base = calloc(o->h.n_sections + 1, sizeof(*o->base));
+    return o->base != NULL;
+}
+
+static bool ld_same_name(struct ld_object const* a, uint32_t a_name, uint32_t a_len,
+    struct ld_object const* b, uint32_t b_name, uint32_t b_len)
+{
+    return a_len == b_len && memcmp(a->strings + a_name, b->strings + b_name, a_len) == 0;
+}
+
+/* Gives every section its image offset and copies it there */
+static void ld_layout(ld_state_t* state) {
+    for (size_t oi = 0; oi < state->n_objs; ++oi)
+        for (uint32_t si = 0; si < state->objs[oi].h.n_sections; ++si) {
+            struct ld_object const* first = &state->objs[oi];
+            struct xm_obj_section const* name = &first->sections[si];
+            bool seen = false;
+            /* Laid out with the first section of that name */
+            for (size_t oj = 0; oj <= oi && !seen; ++oj)
+                for (uint32_t sj = 0; sj < (oj == oi ? si : state->objs[oj].h.n_sections) && !seen; ++sj)
+                    seen = ld_same_name(&state->objs[oj], state->objs[oj].sections[sj].name,
+                        state->objs[oj].sections[sj].name_len, first, name->name, name->name_len);
+            if (seen)
+                continue;
+            for (size_t oj = oi; oj < state->n_objs; ++oj) {
+                struct ld_object *o = &state->objs[oj];
+                for (uint32_t sj = 0; sj < o->h.n_sections; ++sj) {
+                    struct xm_obj_section const* s = &o->sections[sj];
+                    uint32_t align = s->align != 0 ? s->align : 1;
+                    if (!ld_same_name(o, s->name, s->name_len, first, name->name, name->name_len))
+                        continue;
+                    o->base[sj] = (uint32_t)((state->image_len + align - 1) & ~(size_t)(align - 1));
+                    state->image_len = o->base[sj] + (size_t)s->size;
+                }
+            }
+        }
+    state->image = calloc(state->image_len + 1, 1);
+    if (state->image == NULL) {
+        LD_ERROR(state, "out of memory for a %lu byte image", (unsigned long)state->image_len);
+        return;
+    }
+    for (size_t oi = 0; oi < state->n_objs; ++oi)
+        for (uint32_t si = 0; si < state->objs[oi].h.n_sections; ++si)
+            memcpy(state->image + state->objs[oi].base[si], state->objs[oi].p + state->objs[oi].sections[si].offset,
+                state->objs[oi].sections[si].size);
+}
+
+/* Slot of the global with the same name as sym of o, or the free one it'd go in */
+static struct ld_global *ld_find_global(ld_state_t* state, struct ld_object const* o, struct xm_obj_symbol const* sym) {
+    for (size_t slot = sym->hash;; ++slot) {
+        struct ld_global *g = &state->globals[slot & (state->globals_size - 1)];
+        struct ld_object const* go;
+        struct xm_obj_symbol const* gs;
+        if (g->obj == 0)
+            return g;
+        go = &state->objs[g->obj - 1];
+        gs = &go->symbols[g->sym];
+        if (gs->hash == sym->hash && ld_same_name(go, gs->name, gs->name_len, o, sym->name, sym->name_len))
+            return g;
+    }
+}
+
+static void ld_collect_globals(ld_state_t* state) {
+    size_t n = 0;
+    for (size_t oi = 0; oi < state->n_objs; ++oi)
+        n += state->objs[oi].h.n_symbols;
+    for (state->globals_size = 16; state->globals_size < n * 2; state->globals_size *= 2)
+        ;
+    state->globals = calloc(state->globals_size, sizeof(*state->globals));
+    if (state->globals == NULL) {
+        LD_ERROR(state, "out of memory for %lu symbols", (unsigned long)n);
+        return;
+    }
+    for (size_t oi = 0; oi < state->n_objs; ++oi) {
+        struct ld_object const* o = &state->objs[oi];
+        for (uint32_t si = 0; si < o->h.n_symbols; ++si) {
+            struct xm_obj_symbol const* s = &o->symbols[si];
+            struct ld_global *g;
+            if ((s->flags & XM_OBJ_GLOBAL) == 0 || s->section == XM_OBJ_UNDEF)
+                continue;
+            g = ld_find_global(state, o, s);
+            if (g->obj != 0)
+                LD_ERROR(state, "%s: %.*s already defined in %s", o->path, (int)s->name_len, o->strings + s->name,
+                    state->objs[g->obj - 1].path);
+            else
+                *g = (struct ld_global){(uint32_t)oi + 1, si};
+        }
+    }
+}
+
+/* Address of a symbol of o, false if it's defined nowhere */
+static bool ld_symbol_addr(ld_state_t* state, struct ld_object const* o, uint32_t sym, uint32_t *addr) {
+    struct xm_obj_symbol const* s = &o->symbols[sym];
+    if (s->section == XM_OBJ_UNDEF) {
+        struct ld_global const* g = ld_find_global(state, o, s);
+        if (g->obj == 0)
+            return false;
+        o = &state->objs[g->obj - 1];
+        s = &o->symbols[g->sym];
+    }
+    *addr = XM_SIM_ROM_BASE + o->base[s->section] + s->value;
+    return true;
+}
+
+static void ld_relocate(ld_state_t* state) {
+    for (size_t oi = 0; oi < state->n_objs; ++oi) {
+        struct ld_object const* o = &state->objs[oi];
+        for (uint32_t ri = 0; ri < o->h.n_relocs; ++ri) {
+            struct xm_obj_reloc const* r = &o->relocs[ri];
+            struct xm_obj_symbol const* s = &o->symbols[r->symbol];
+            uint8_t *f = state->image + o->base[r->section] + r->offset;
+            uint32_t p = XM_SIM_ROM_BASE + o->base[r->section] + r->offset, a;
+            int32_t rela;
+            if (!ld_symbol_addr(state, o, r->symbol, &a)) {
+                LD_ERROR(state, "%s: undefined %.*s", o->path, (int)s->name_len, o->strings + s->name);
+                continue;
+            }
+            a += (uint32_t)r->addend;
+            rela = (int32_t)(a - p);
+            switch (r->type) {
+            case XM_RELOC_REL8:
+                if (rela < INT8_MIN || rela > INT8_MAX)
+                    LD_ERROR(state, "%s: %.*s out of range of the branch at %x", o->path, (int)s->name_len,
+                        o->strings + s->name, p);
+                f[2] = (uint8_t)rela;
+                break;
+            case XM_RELOC_REL16:
+                if (rela < INT16_MIN || rela > INT16_MAX)
+                    LD_ERROR(state, "%s: %.*s out of range of the jump at %x", o->path, (int)s->name_len,
+                        o->strings + s->name, p);
+                f[1] = (uint8_t)(rela >> 8);
+                f[2] = (uint8_t)rela;
+                break;
+            case XM_RELOC_ABS16:
+                if (a > UINT16_MAX)
+                    LD_ERROR(state, "%s: %.*s at %x is out of reach of the jump at %x", o->path, (int)s->name_len,
+                        o->strings + s->name, a, p);
+                f[1] = (uint8_t)(a >> 8);
+                f[2] = (uint8_t)a;
+                break;
+            case XM_RELOC_ABS32:
+                f[0] = (uint8_t)(a >> 24);
+                f[1] = (uint8_t)(a >> 16);
+                f[2] = (uint8_t)(a >> 8);
+                f[3] = (uint8_t)a;
+                break;
+            case XM_RELOC_ADDR:
+                if (a % 4 != 0 || (a >> 10) > UINT8_MAX)
+                    LD_ERROR(state, "%s: %.*s at %x is out of reach of the load at %x", o->path, (int)s->name_len,
+                        o->strings + s->name, a, p);
+                f[6] = (uint8_t)(a >> 10);
+                f[14] = (uint8_t)((a & 0x3ff) / 4);
+                break;
+            }
+        }
+    }
+}
+
+/* The defined symbols at their addresses, objects carry no source lines */
+static void ld_write_map(ld_state_t* state, const char *path) {
+    size_t n_symbols = 0, strings_len = 0;
+    struct xm_map_symbol *symbols;
+    char *strings;
+    for (size_t oi = 0; oi < state->n_objs; ++oi) {
+        n_symbols += state->objs[oi].h.n_symbols;
+        strings_len += state->objs[oi].h.strings_len;
+    }
+    symbols = malloc((n_symbols + 1) * sizeof(*symbols));
+    strings = malloc(strings_len + 1);
+    n_symbols = strings_len = 0;
+    if (symbols != NULL && strings != NULL) {
+        for (size_t oi = 0; oi < state->n_objs; ++oi) {
+            struct ld_object const* o = &state->objs[oi];
+            for (uint32_t si = 0; si < o->h.n_symbols; ++si) {
+                struct xm_obj_symbol const* s = &o->symbols[si];
+                if (s->section != XM_OBJ_UNDEF && s->name_len != 0)
+                    symbols[n_symbols++] = (struct xm_map_symbol){(uint32_t)strings_len + s->name, s->name_len,
+                        XM_SIM_ROM_BASE + o->base[s->section] + s->value, 0,
+                        (s->flags & XM_OBJ_GLOBAL) != 0 ? XM_MAP_GLOBAL : 0};
+            }
+            memcpy(strings + strings_len, o->strings, o->h.strings_len);
+            strings_len += o->h.strings_len;
+        }
+    }
+    if (symbols == NULL || strings == NULL || xm_map_write(path, XM_SIM_ROM_BASE, (uint32_t)state->image_len,
+        symbols, n_symbols, NULL, 0, NULL, 0, strings, strings_len) != 0)
+        fprintf(stderr, "xm_ld: can't write %s\n", path);
+    free(symbols);
+    free(strings);
+}
+
+static void ld_finish(ld_state_t* state) {
+    for (size_t i = 0; i < state->n_objs; ++i) {
+        if (state->objs[i].p != NULL)
+            munmap((void *)state->objs[i].p, state->objs[i].len);
+        free(state->objs[i].base);
+    }
+    free(state->objs);
+    free(state->globals);
+    free(state->image);
+}
+
+int main(int argc, char *argv[]) {
+    static ld_state_t state = {0};
+    int fd_out;
+    if (argc <= 2) {
+        fprintf(stderr, "%s <out> <in>...\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+    state.n_objs = (size_t)argc - 2;
+    state.objs = calloc(state.n_objs, sizeof(*state.objs));
+    for (size_t i = 0; state.objs != NULL && i < state.n_objs; ++i)
+        ld_open(&state, &state.objs[i], argv[i + 2]);
+    if (state.objs == NULL || state.failed) {
+        ld_finish(&state);
+        return EXIT_FAILURE;
+    }
+    ld_layout(&state);
+    ld_collect_globals(&state);
+    if (!state.failed)
+        ld_relocate(&state);
+    if (state.failed) {
+        ld_finish(&state);
+        return EXIT_FAILURE;
+    }
+    fd_out = strcmp(argv[1], "-") != 0 ? open(argv[1], O_CREAT | O_TRUNC | O_WRONLY, 0755) : fileno(stdout);
+    if (fd_out < 0 || write(fd_out, state.image, state.image_len) != (ssize_t)state.image_len) {
+        fprintf(stderr, "xm_ld: can't write %s\n", argv[1]);
+        ld_finish(&state);
+        return EXIT_FAILURE;
+    }
+    close(fd_out);
+    if (strcmp(argv[1], "-") != 0) {
+        /* <out>.map, for xm_sim and xm_dis */
+        char *map = malloc(strlen(argv[1]) + sizeof(".map"));
+        if (map != NULL)
+            ld_write_map(&state, strcat(strcpy(map, argv[1]), ".map"));
+        free(map);
+    }
+    ld_finish(&state);
+    return EXIT_SUCCESS;
+}
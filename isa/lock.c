@@ -0,0 +1,172 @@
+#include <stdbool.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <limits.h>
+
+#include "isa.h"
+#include "xmsim.h"
+#include "xmlock.h"
+#include "sim.h"
+
+/* Lockstep differential execution
+    The reference is a clone of sim run by the trace core, which reports
+    every RAM page it stores to here. Both sides only stop where device
+    events would, which leaves DMA completions as there are no devices. */
+
+struct sim_lock {
+    uint8_t *marked; /* Bit per RAM page */
+    uint32_t *pages; /* The marked ones */
+    size_t n_pages;
+};
+
+void sim_lock_store(sim_state_t* sim, uint32_t a) {
+    struct sim_lock *l = sim->lock;
+    uint32_t page;
+    if (a - SIM_RAM_BASE >= sim->ram_size)
+        return;
+    page = (a - SIM_RAM_BASE) / PAGE_SIZE;
+    if ((l->marked[page / 8] & (1 << (page % 8))) == 0) {
+        l->marked[page / 8] |= 1 << (page % 8);
+        l->pages[l->n_pages++] = page;
+    }
+}
+
+/* Up to end, stopping for the next DMA completion */
+static unsigned long lock_limit(sim_state_t const* sim, unsigned long end) {
+    if (sim->dma.n != 0 && sim->dma.queue[sim->dma.head].done < end)
+        return sim->dma.queue[sim->dma.head].done;
+    return end;
+}
+
+/* Runs the reference up to tick */
+static cpu_execute_result_t lock_catch_up(sim_state_t* ref, unsigned long tick) {
+    struct sim_cpu const* cpu = &sim_cpus[SIM_CPU_TRACE];
+    cpu_execute_result_t cer = CPUE_CONTINUE;
+    while (cer == CPUE_CONTINUE && ref->perf.ticks < tick && !ref->fault_hit) {
+        ref->max_ticks = lock_limit(ref, tick);
+        cer = cpu->run(ref);
+        cpu->dma_retire(ref);
+    }
+    return cer;
+}
+
+/* Offset of the first RAM byte that differs in the given pages, all of them
+    if pages is NULL, ram_size if none */
+static size_t lock_cmp_ram(sim_state_t const* a, sim_state_t const* b, uint32_t const* pages, size_t n) {
+    size_t n_all = (a->ram_size + PAGE_SIZE - 1) / PAGE_SIZE;
+    for (size_t i = 0; i < (pages != NULL ? n : n_all); ++i) {
+        size_t off = (size_t)(pages != NULL ? pages[i] : i) * PAGE_SIZE;
+        size_t len = a->ram_size - off < PAGE_SIZE ? a->ram_size - off : PAGE_SIZE;
+        if (memcmp(a->ram + off, b->ram + off, len) != 0) {
+            while (a->ram[off] == b->ram[off])
+                ++off;
+            return off;
+        }
+    }
+    return a->ram_size;
+}
+
+static void lock_row(FILE *out, char const* name, uint32_t ref, uint32_t eng) {
+    fprintf(out, "%c %-8s %8x %8x\n", ref != eng ? '*' : ' ', name, ref, eng);
+}
+
+static void lock_report(FILE *out, sim_state_t const* ref, sim_state_t const* eng,
+    uint32_t block, cpu_execute_result_t ref_cer, cpu_execute_result_t eng_cer, size_t off)
+{
+    static char const *const results[] = {"running", "halted", "break", "fault"};
+    char where[128];
+    xm_sim_symbolize(eng, block, where, sizeof(where));
+    fprintf(out, "lockstep: diverged in the block at %8x%s%s\n", block, where[0] != '\0' ? " " : "", where);
+    fprintf(out, "  %-8s %8s %8s\n", "", "ref", "engine");
+    fprintf(out, "%c %-8s %8lu %8lu\n", ref->perf.ticks != eng->perf.ticks ? '*' : ' ', "tick",
+        ref->perf.ticks, eng->perf.ticks);
+    fprintf(out, "%c %-8s %8s %8s\n", ref_cer != eng_cer || ref->fault_hit != eng->fault_hit ? '*' : ' ', "state",
+        ref->fault_hit ? "fault" : results[ref_cer], eng->fault_hit ? "fault" : results[eng_cer]);
+    lock_row(out, "pc", ref->cpu.pc, eng->cpu.pc);
+    lock_row(out, "flags", ref->cpu.flags, eng->cpu.flags);
+    for (unsigned i = 0; i < 16; ++i) {
+        char name[8];
+        snprintf(name, sizeof(name), "$r%u", i);
+        lock_row(out, name, ref->cpu.r[i], eng->cpu.r[i]);
+    }
+    for (unsigned i = 0; i < 16; ++i) {
+        uint32_t a, b;
+        char name[8];
+        memcpy(&a, &ref->cpu.f[i], sizeof(a));
+        memcpy(&b, &eng->cpu.f[i], sizeof(b));
+        snprintf(name, sizeof(name), "$f%u", i);
+        if (a != b)
+            lock_row(out, name, a, b);
+    }
+    if (memcmp(ref->cpu.cr, eng->cpu.cr, sizeof(ref->cpu.cr)) != 0
+    || memcmp(ref->cpu.v, eng->cpu.v, sizeof(ref->cpu.v)) != 0
+    || memcmp(ref->cpu.tile, eng->cpu.tile, sizeof(ref->cpu.tile)) != 0)
+        fprintf(out, "* control, vector or tile registers\n");
+    if (ref->fault_hit || eng->fault_hit) {
+        lock_row(out, "fault pc", ref->fault_hit ? ref->fault.pc : 0, eng->fault_hit ? eng->fault.pc : 0);
+        lock_row(out, "fault at", ref->fault_hit ? ref->fault.addr : 0, eng->fault_hit ? eng->fault.addr : 0);
+    }
+    if (off != ref->ram_size)
+        fprintf(out, "* mem %8x %8x %8x\n", SIM_RAM_BASE + (uint32_t)off, ref->ram[off], eng->ram[off]);
+}
+
+int xm_lock_run(xm_sim_t *sim, unsigned long ticks, FILE *out) {
+    struct sim_cpu const* cpu;
+    struct sim_lock lock;
+    size_t n_pages = (sim->ram_size + PAGE_SIZE - 1) / PAGE_SIZE;
+    unsigned long end = ticks > ULONG_MAX - sim->perf.ticks ? ULONG_MAX : sim->perf.ticks + ticks, n_blocks = 0;
+    sim_state_t* ref;
+    int ret = 0;
+    if (sim->devices != NULL || sim->rr != NULL || sim->bp_pages != NULL || sim->wp_pages != NULL
+    || (sim->opt & SIM_OPT_SYSCALL) != 0)
+        return -1;
+    lock.marked = calloc((n_pages + 7) / 8, 1);
+    lock.pages = malloc(n_pages * sizeof(*lock.pages));
+    lock.n_pages = 0;
+    if (lock.marked == NULL || lock.pages == NULL || (ref = sim_clone(sim, SIM_OPT_QUIET | SIM_OPT_NO_IDIOM)) == NULL) {
+        free(lock.marked);
+        free(lock.pages);
+        return -1;
+    }
+    ref->lock = &lock;
+    sim->brk_hit = false;
+
+    for (;;) {
+        uint32_t block = sim->cpu.pc;
+        cpu_execute_result_t cer = CPUE_CONTINUE, ref_cer;
+        size_t off;
+        bool full;
+        if (sim->perf.ticks < end && !sim->fault_hit) {
+            sim->max_ticks = lock_limit(sim, end);
+            cpu = sim_cpu_select(sim);
+            cer = cpu->block(sim);
+            cpu->dma_retire(sim);
+        }
+        ref_cer = lock_catch_up(ref, sim->perf.ticks);
+        full = ++n_blocks % XM_LOCK_FULL_BLOCKS == 0 || cer != CPUE_CONTINUE
+            || sim->perf.ticks >= end || sim->fault_hit;
+        off = lock_cmp_ram(ref, sim, full ? NULL : lock.pages, lock.n_pages);
+        for (size_t i = 0; i < lock.n_pages; ++i)
+            lock.marked[lock.pages[i] / 8] = 0;
+        lock.n_pages = 0;
+        if (ref_cer != cer || ref->perf.ticks != sim->perf.ticks || ref->fault_hit != sim->fault_hit
+        || memcmp(&ref->cpu, &sim->cpu, sizeof(sim->cpu)) != 0 || off != sim->ram_size
+        || (sim->fault_hit && memcmp(&ref->fault, &sim->fault, sizeof(sim->fault)) != 0)) {
+            lock_report(out, ref, sim, block, ref_cer, cer, off);
+            ret = 1;
+            break;
+        }
+        if (full && (cer != CPUE_CONTINUE || sim->perf.ticks >= end || sim->fault_hit)) {
+            fprintf(out, "lockstep: %lu blocks agree up to tick#%lu\n", n_blocks, sim->perf.ticks);
+            break;
+        }
+    }
+    ref->lock = NULL;
+    xm_sim_destroy(ref);
+    free(lock.marked);
+    free(lock.pages);
+    return ret;
+}
@@ -0,0 +1,176 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "xmmap.h"
+
+/* Symbol and source line maps, shared by the tools and libxmsim */
+
+static int map_symbol_cmp(const void *a, const void *b) {
+    struct xm_map_symbol const *x = a, *y = b;
+    if (x->addr != y->addr)
+        return x->addr < y->addr ? -1 : 1;
+    if ((x->flags & XM_MAP_GLOBAL) != (y->flags & XM_MAP_GLOBAL))
+        return (x->flags & XM_MAP_GLOBAL) != 0 ? -1 : 1;
+    return x->name < y->name ? -1 : x->name > y->name;
+}
+
+int xm_map_write(const char *path, uint32_t base, uint32_t size,
+    struct xm_map_symbol *symbols, size_t n_symbols, struct xm_map_line const* lines, size_t n_lines,
+    struct xm_map_file const* files, size_t n_files, const char *strings, size_t strings_len)
+{
+    static const uint8_t zero[4];
+    struct xm_map_header h = {0};
+    uint32_t end = base + size;
+    bool failed;
+    FILE *f;
+    qsort(symbols, n_symbols, sizeof(*symbols), map_symbol_cmp);
+    for (size_t i = n_symbols; i-- > 0;) {
+        if (i + 1 < n_symbols && symbols[i + 1].addr != symbols[i].addr)
+            end = symbols[i + 1].addr;
+        symbols[i].size = symbols[i].addr < end ? end - symbols[i].addr : 0;
+    }
+    h.magic = XM_MAP_MAGIC;
+    h.base = base;
+    h.size = size;
+    h.n_symbols = (uint32_t)n_symbols;
+    h.symbols = sizeof(h);
+    h.n_lines = (uint32_t)n_lines;
+    h.lines = h.symbols + (uint32_t)(n_symbols * sizeof(*symbols));
+    h.n_files = (uint32_t)n_files;
+    h.files = h.lines + (uint32_t)(n_lines * sizeof(*lines));
+    h.strings = h.files + (uint32_t)(n_files * sizeof(*files));
+    h.strings_len = (uint32_t)strings_len;
+    if ((f = fopen(path, "wb")) == NULL)
+        return -1;
+    fwrite(&h, sizeof(h), 1, f);
+    fwrite(symbols, sizeof(*symbols), n_symbols, f);
+    fwrite(lines, sizeof(*lines), n_lines, f);
+    fwrite(files, sizeof(*files), n_files, f);
+    fwrite(strings, 1, strings_len, f);
+    fwrite(zero, 1, (4 - strings_len % 4) % 4, f);
+    failed = ferror(f) != 0;
+    return fclose(f) != 0 || failed ? -1 : 0;
+}
+
+/* Whether n records of size at off lie within the map */
+static bool map_in_bounds(xm_map_t const* map, uint32_t off, uint32_t n, size_t size) {
+    return off % 4 == 0 && (uint64_t)off + (uint64_t)n * size <= map->len;
+}
+
+static bool map_valid(xm_map_t* map) {
+    memcpy(&map->h, map->p, sizeof(map->h));
+    if (map->h.magic != XM_MAP_MAGIC
+    || !map_in_bounds(map, map->h.symbols, map->h.n_symbols, sizeof(*map->symbols))
+    || !map_in_bounds(map, map->h.lines, map->h.n_lines, sizeof(*map->lines))
+    || !map_in_bounds(map, map->h.files, map->h.n_files, sizeof(*map->files))
+    || !map_in_bounds(map, map->h.strings, map->h.strings_len, 1))
+        return false;
+    map->symbols = (const struct xm_map_symbol *)(map->p + map->h.symbols);
+    map->lines = (const struct xm_map_line *)(map->p + map->h.lines);
+    map->files = (const struct xm_map_file *)(map->p + map->h.files);
+    map->strings = (const char *)map->p + map->h.strings;
+    for (uint32_t i = 0; i < map->h.n_symbols; ++i)
+        if ((uint64_t)map->symbols[i].name + map->symbols[i].name_len > map->h.strings_len
+        || (i != 0 && map->symbols[i].addr < map->symbols[i - 1].addr))
+            return false;
+    for (uint32_t i = 0; i < map->h.n_lines; ++i)
+        if ((map->lines[i].line != 0 && map->lines[i].file >= map->h.n_files)
+        || (i != 0 && map->lines[i].addr < map->lines[i - 1].addr))
+            return false;
+    for (uint32_t i = 0; i < map->h.n_files; ++i)
+        if ((uint64_t)map->files[i].name + map->files[i].name_len > map->h.strings_len)
+            return false;
+    return true;
+}
+
+xm_map_t *xm_map_open(const char *path) {
+    xm_map_t *map;
+    struct stat st;
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return NULL;
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(map->h) || (map = calloc(1, sizeof(*map))) == NULL) {
+        close(fd);
+        return NULL;
+    }
+    map->len = (size_t)st.st_size;
+    map->p = mmap(NULL, map->len, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map->p == MAP_FAILED || !map_valid(map)) {
+        if (map->p != MAP_FAILED)
+            munmap((void *)map->p, map->len);
+        free(map);
+        return NULL;
+    }
+    return map;
+}
+
+void xm_map_close(xm_map_t *map) {
+    if (map == NULL)
+        return;
+    munmap((void *)map->p, map->len);
+    free(map);
+}
+
+const struct xm_map_symbol *xm_map_symbol_at(xm_map_t const* map, uint32_t addr) {
+    size_t lo = 0, hi = map->h.n_symbols;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (map->symbols[mid].addr <= addr)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    if (lo == 0)
+        return NULL;
+    /* The first one there */
+    while (lo > 1 && map->symbols[lo - 2].addr == map->symbols[lo - 1].addr)
+        --lo;
+    return addr - map->symbols[lo - 1].addr < map->symbols[lo - 1].size ? &map->symbols[lo - 1] : NULL;
+}
+
+const struct xm_map_line *xm_map_line_at(xm_map_t const* map, uint32_t addr) {
+    size_t lo = 0, hi = map->h.n_lines;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (map->lines[mid].addr <= addr)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo != 0 && addr - map->h.base < map->h.size ? &map->lines[lo - 1] : NULL;
+}
+
+const struct xm_map_symbol *xm_map_find(xm_map_t const* map, const char *name, size_t len) {
+    for (uint32_t i = 0; i < map->h.n_symbols; ++i)
+        if (map->symbols[i].name_len == len && memcmp(map->strings + map->symbols[i].name, name, len) == 0)
+            return &map->symbols[i];
+    return NULL;
+}
+
+int xm_map_format(xm_map_t const* map, uint32_t addr, char *buf, size_t len) {
+    const struct xm_map_symbol *s = xm_map_symbol_at(map, addr);
+    const struct xm_map_line *l = xm_map_line_at(map, addr);
+    int n = 0, m;
+    if (len != 0)
+        buf[0] = '\0';
+    if (s != NULL) {
+        n = addr != s->addr
+            ? snprintf(buf, len, "%.*s+%#x", (int)s->name_len, map->strings + s->name, addr - s->addr)
+            : snprintf(buf, len, "%.*s", (int)s->name_len, map->strings + s->name);
+    }
+    if (l != NULL && l->line != 0) {
+        struct xm_map_file const* f = &map->files[l->file];
+        m = snprintf(buf + ((size_t)n < len ? (size_t)n : len), (size_t)n < len ? len - (size_t)n : 0,
+            "%s%.*s:%u", n != 0 ? " " : "", (int)f->name_len, map->strings + f->name, l->line);
+        n += m;
+    }
+    return n;
+}
@@ -0,0 +1,267 @@
+#include <stdbool.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <signal.h>
+#include <sys/time.h>
+
+#include "isa.h"
+#include "xmsim.h"
+#include "xmprof.h"
+#include "sim.h"
+
+/* Sampling profiler
+    The SIGPROF handler only copies what sim keeps up to date for it into a
+    preallocated buffer, the attribution is worked out when stopping: blocks
+    from the branches in the image, handlers from their instruction class. */
+
+#define PROF_DEFAULT_HZ 1000
+#define PROF_MAX_SAMPLES (1 << 20)
+#define PROF_TOP 10
+
+struct prof_sample {
+    uint32_t pc;
+    uint32_t func;
+    uint16_t inst;
+    uint8_t where;
+};
+
+struct prof_count {
+    uint32_t key;
+    unsigned long n;
+};
+
+static sim_state_t *volatile prof_sim;
+static struct prof_sample *prof_samples;
+static volatile size_t prof_n;
+static volatile unsigned long prof_dropped;
+static unsigned prof_hz;
+static struct sigaction prof_old_action;
+
+static void prof_signal(int sig) {
+    sim_state_t *sim = prof_sim;
+    struct prof_sample *s;
+    (void)sig;
+    if (sim == NULL)
+        return;
+    if (prof_n == PROF_MAX_SAMPLES) {
+        ++prof_dropped;
+        return;
+    }
+    s = &prof_samples[prof_n];
+    s->pc = sim->cpu.pc;
+    s->func = sim->prof_func;
+    s->inst = sim->prof_inst;
+    s->where = sim->prof_where;
+    ++prof_n;
+}
+
+int xm_prof_start(xm_sim_t *sim, unsigned hz) {
+    struct sigaction sa;
+    struct itimerval it;
+    if (prof_sim != NULL)
+        return -1;
+    if ((prof_samples = malloc(PROF_MAX_SAMPLES * sizeof(*prof_samples))) == NULL)
+        return -1;
+    prof_hz = hz != 0 ? hz : PROF_DEFAULT_HZ;
+    prof_n = 0;
+    prof_dropped = 0;
+    prof_sim = sim;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = prof_signal;
+    sa.sa_flags = SA_RESTART;
+    sigemptyset(&sa.sa_mask);
+    it.it_interval.tv_sec = 0;
+    it.it_interval.tv_usec = prof_hz < 1000000 ? 1000000 / prof_hz : 1;
+    it.it_value = it.it_interval;
+    if (sigaction(SIGPROF, &sa, &prof_old_action) != 0) {
+        prof_sim = NULL;
+        free(prof_samples);
+        return -1;
+    }
+    if (setitimer(ITIMER_PROF, &it, NULL) != 0) {
+        sigaction(SIGPROF, &prof_old_action, NULL);
+        prof_sim = NULL;
+        free(prof_samples);
+        return -1;
+    }
+    return 0;
+}
+
+static int prof_cmp_key(const void *a, const void *b) {
+    uint32_t x = *(uint32_t const*)a, y = *(uint32_t const*)b;
+    return x < y ? -1 : x > y;
+}
+static int prof_cmp_count(const void *a, const void *b) {
+    struct prof_count const *x = a, *y = b;
+    if (x->n != y->n)
+        return x->n < y->n ? 1 : -1;
+    return x->key < y->key ? -1 : x->key > y->key;
+}
+
+/* Distinct keys with how often each occurs, most frequent first, keys gets sorted */
+static size_t prof_tally(uint32_t *keys, size_t n, struct prof_count *out) {
+    size_t m = 0;
+    qsort(keys, n, sizeof(*keys), prof_cmp_key);
+    for (size_t i = 0; i < n; ++i) {
+        if (m == 0 || out[m - 1].key != keys[i])
+            out[m++] = (struct prof_count){keys[i], 0};
+        ++out[m - 1].n;
+    }
+    qsort(out, m, sizeof(*out), prof_cmp_count);
+    return m;
+}
+
+/* Block leaders of the image: the first instruction, branch and jump
+    targets, whatever follows a control transfer, and the functions called.
+    Data in the image may add a few bogus ones, which only splits blocks. */
+static uint32_t *prof_leaders(sim_state_t const* sim, size_t *n_out) {
+    size_t n_words = sim->rom_size / 4, n = 0;
+    uint32_t *l = malloc((n_words * 2 + 1 + prof_n) * sizeof(*l));
+    if (l == NULL)
+        return NULL;
+    l[n++] = SIM_ROM_BASE;
+    for (size_t i = 0; i < n_words; ++i) {
+        uint8_t const *id = sim->rom + i * 4;
+        uint32_t pc = SIM_ROM_BASE + i * 4;
+        if (id[3] >= 0x50 && id[3] <= 0x5f)
+            l[n++] = pc + (int32_t)(int8_t)id[2];
+        else if (id[3] == 0x40)
+            l[n++] = ((uint32_t)id[1] << 8) | id[2];
+        else if (id[3] == 0x41)
+            l[n++] = pc + (int32_t)(int16_t)(((uint16_t)id[1] << 8) | id[2]);
+        else if (id[3] != 0x42 && id[3] != 0x43)
+            continue;
+        l[n++] = pc + 4;
+    }
+    for (size_t i = 0; i < prof_n; ++i)
+        l[n++] = prof_samples[i].func;
+    qsort(l, n, sizeof(*l), prof_cmp_key);
+    *n_out = n;
+    return l;
+}
+/* Index of the last leader at or below pc, n if none */
+static size_t prof_block(uint32_t const *l, size_t n, uint32_t pc) {
+    size_t lo = 0, hi = n;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (l[mid] <= pc)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo != 0 ? lo - 1 : n;
+}
+
+static bool prof_inst_is_dma(char const* name) {
+    return strcmp(name, "memcpy") == 0 || strcmp(name, "memmov") == 0 || strcmp(name, "memset") == 0
+        || strcmp(name, "dmapoll") == 0 || strcmp(name, "dmawait") == 0;
+}
+
+static void prof_report(sim_state_t const* sim, FILE *out) {
+    static char const *const names[SIM_PROF_COUNT + 1] = {
+        [SIM_PROF_RUN] = "run loop",
+        [SIM_PROF_DECODE] = "decode",
+        [SIM_PROF_EXECUTE] = "execute",
+        [SIM_PROF_MEMORY] = "translate/memory",
+        [SIM_PROF_TIMING] = "timing model",
+        [SIM_PROF_IDIOM] = "loop batching",
+        [SIM_PROF_DMA] = "dma",
+        [SIM_PROF_DEVICE] = "devices",
+        [SIM_PROF_COUNT] = "float",
+    };
+    size_t n = prof_n, m, n_leaders = 0, n_handled = 0;
+    uint32_t *keys = malloc((n + 1) * sizeof(*keys)), *leaders = prof_leaders(sim, &n_leaders);
+    struct prof_count *counts = malloc((n + 1) * sizeof(*counts));
+    char where[128];
+    if (keys == NULL || counts == NULL || leaders == NULL) {
+        fprintf(out, "prof: out of memory\n");
+        goto done;
+    }
+    fprintf(out, "prof: %lu samples at %u Hz", (unsigned long)n, prof_hz);
+    if (prof_dropped != 0)
+        fprintf(out, ", %lu dropped", prof_dropped);
+    fprintf(out, "\n");
+    if (n == 0)
+        goto done;
+
+    /* Handler time splits into float math, DMA and the rest by instruction class */
+    for (size_t i = 0; i < n; ++i) {
+        struct prof_sample const *s = &prof_samples[i];
+        keys[i] = s->where;
+        if (s->inst >= XM_INST_TABLE_COUNT)
+            continue;
+        if (s->where == SIM_PROF_DECODE)
+            keys[i] = SIM_PROF_EXECUTE;
+        if (keys[i] != SIM_PROF_EXECUTE)
+            continue;
+        if (xm_get_cb0_from_format(xm_inst_table[s->inst].format) == XM_CB_FLOAT)
+            keys[i] = SIM_PROF_COUNT;
+        else if (prof_inst_is_dma(xm_inst_table[s->inst].name))
+            keys[i] = SIM_PROF_DMA;
+    }
+    m = prof_tally(keys, n, counts);
+    fprintf(out, "subsystem\n");
+    for (size_t i = 0; i < m; ++i)
+        fprintf(out, "%6.2f%%  %s\n", 100. * counts[i].n / n, names[counts[i].key]);
+
+    for (size_t i = 0; i < n; ++i)
+        if (prof_samples[i].inst < XM_INST_TABLE_COUNT)
+            keys[n_handled++] = prof_samples[i].inst;
+    m = prof_tally(keys, n_handled, counts);
+    fprintf(out, "handler\n");
+    for (size_t i = 0; i < m && i < PROF_TOP; ++i)
+        fprintf(out, "%6.2f%%  %s\n", 100. * counts[i].n / n, xm_inst_table[counts[i].key].name);
+
+    for (size_t i = 0; i < n; ++i)
+        keys[i] = prof_samples[i].func;
+    m = prof_tally(keys, n, counts);
+    fprintf(out, "function\n");
+    for (size_t i = 0; i < m && i < PROF_TOP; ++i) {
+        xm_sim_symbolize(sim, counts[i].key, where, sizeof(where));
+        fprintf(out, "%6.2f%%  %8x%s%s\n", 100. * counts[i].n / n, counts[i].key,
+            where[0] != '\0' ? " " : "", where);
+    }
+
+    /* Outside the image (code copied to RAM) every pc stands for itself */
+    for (size_t i = 0; i < n; ++i) {
+        uint32_t pc = prof_samples[i].pc;
+        size_t b = pc - SIM_ROM_BASE < sim->rom_size ? prof_block(leaders, n_leaders, pc) : n_leaders;
+        keys[i] = b != n_leaders ? leaders[b] : pc;
+    }
+    m = prof_tally(keys, n, counts);
+    fprintf(out, "block\n");
+    for (size_t i = 0; i < m && i < PROF_TOP; ++i) {
+        uint32_t start = counts[i].key, end = start + 4;
+        size_t b = prof_block(leaders, n_leaders, start);
+        if (start - SIM_ROM_BASE < sim->rom_size && b != n_leaders) {
+            while (b < n_leaders && leaders[b] <= start)
+                ++b;
+            end = b < n_leaders && leaders[b] - SIM_ROM_BASE <= sim->rom_size
+                ? leaders[b] : SIM_ROM_BASE + (uint32_t)sim->rom_size;
+        }
+        xm_sim_symbolize(sim, start, where, sizeof(where));
+        fprintf(out, "%6.2f%%  %8x-%8x%s%s\n", 100. * counts[i].n / n, start, end,
+            where[0] != '\0' ? " " : "", where);
+    }
+done:
+    free(keys);
+    free(counts);
+    free(leaders);
+}
+
+void xm_prof_stop(xm_sim_t *sim, FILE *out) {
+    struct itimerval it;
+    if (prof_sim != sim || sim == NULL)
+        return;
+    memset(&it, 0, sizeof(it));
+    setitimer(ITIMER_PROF, &it, NULL);
+    sigaction(SIGPROF, &prof_old_action, NULL);
+    prof_sim = NULL;
+    if (out != NULL)
+        prof_report(sim, out);
+    free(prof_samples);
+    prof_samples = NULL;
+}
@@ -0,0 +1,423 @@
+#include <stdbool.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+
+#include "isa.h"
+#include "xmsim.h"
+#include "sim.h"
+
+/* Record/replay log
+    Header, then records made of a type byte and the record itself:
+    snapshots every interval ticks (the first one holds the initial
+    registers), inputs as they happen (values, or byte buffers following
+    their length), and the end of the run. Snapshots
+    only carry the pages that aren't all zero, so any of them can be
+    restored on its own. */
+
+#define RR_MAGIC "XMRR"
+#define RR_VERSION 3
+#define RR_DEFAULT_INTERVAL 1000000
+#define RR_TRAP_PAGE UINT32_MAX
+
+enum rr_record_type {
+    RR_SNAPSHOT = 1,
+    RR_INPUT,
+    RR_END,
+    RR_INPUT_BUF,
+};
+
+struct rr_header {
+    char magic[4];
+    uint32_t version;
+    uint64_t rom_hash;
+    uint64_t ram_size;
+    uint64_t interval;
+    uint64_t dma_bandwidth;
+};
+
+/* Followed by n_pages (uint32_t index, page) pairs */
+struct rr_snapshot {
+    uint64_t tick;
+    uint64_t mem_hash;
+    struct cpu_state cpu;
+    xm_sim_perf_t perf;
+    unsigned long perf_guest[XM_CR_PERF_COUNT];
+    struct sim_dma dma;
+    uint64_t sys_mmap_top;
+    uint32_t n_pages;
+};
+
+struct rr_input {
+    uint64_t tick;
+    uint32_t value;
+};
+
+/* Replay side index of the inputs */
+struct rr_logged_input {
+    uint64_t tick;
+    uint32_t value;
+    bool buf;
+    size_t data; /* Offset of the bytes of a buffer */
+};
+
+struct sim_rr {
+    bool replay;
+    unsigned long interval;
+    unsigned long next; /* Tick of the next snapshot */
+    /* Record */
+    FILE *fp;
+    /* Replay, the log is kept in memory */
+    uint8_t *log;
+    size_t log_len;
+    size_t *snaps; /* Offsets of the snapshots */
+    size_t n_snaps;
+    struct rr_logged_input *inputs;
+    size_t n_inputs;
+    size_t cursor; /* Next input to hand out */
+    bool diverged;
+};
+
+static uint64_t rr_hash(uint64_t h, uint8_t const *p, size_t len) {
+    for (size_t i = 0; i < len; ++i)
+        h = (h ^ p[i]) * 1099511628211ULL;
+    return h;
+}
+static uint64_t rr_rom_hash(sim_state_t* sim) {
+    uint64_t size = sim->rom_size;
+    return rr_hash(rr_hash(14695981039346656037ULL, (uint8_t const*)&size, sizeof(size)), sim->rom, sim->rom_size);
+}
+static uint64_t rr_mem_hash(sim_state_t* sim) {
+    return rr_hash(rr_hash(14695981039346656037ULL, sim->ram, sim->ram_size), sim->trap_page, PAGE_SIZE);
+}
+static size_t rr_page_len(sim_state_t* sim, uint32_t page) {
+    if (page == RR_TRAP_PAGE)
+        return PAGE_SIZE;
+    return sim->ram_size - (size_t)page * PAGE_SIZE < PAGE_SIZE
+        ? sim->ram_size - (size_t)page * PAGE_SIZE : PAGE_SIZE;
+}
+static uint8_t *rr_page(sim_state_t* sim, uint32_t page) {
+    return page == RR_TRAP_PAGE ? sim->trap_page : sim->ram + (size_t)page * PAGE_SIZE;
+}
+static bool rr_page_is_zero(uint8_t const *p, size_t len) {
+    for (size_t i = 0; i < len; ++i)
+        if (p[i] != 0)
+            return false;
+    return true;
+}
+
+static void rr_write_snapshot(sim_state_t* sim) {
+    struct sim_rr *rr = sim->rr;
+    uint32_t n_ram = (sim->ram_size + PAGE_SIZE - 1) / PAGE_SIZE;
+    struct rr_snapshot snap = {0};
+    uint8_t type = RR_SNAPSHOT;
+    snap.tick = sim->perf.ticks;
+    snap.mem_hash = rr_mem_hash(sim);
+    snap.cpu = sim->cpu;
+    snap.perf = sim->perf;
+    memcpy(snap.perf_guest, sim->perf_guest, sizeof(snap.perf_guest));
+    snap.dma = sim->dma;
+    snap.sys_mmap_top = sim->sys_mmap_top;
+    for (uint32_t i = 0; i <= n_ram; ++i) {
+        uint32_t page = i == n_ram ? RR_TRAP_PAGE : i;
+        snap.n_pages += !rr_page_is_zero(rr_page(sim, page), rr_page_len(sim, page));
+    }
+    fwrite(&type, sizeof(type), 1, rr->fp);
+    fwrite(&snap, sizeof(snap), 1, rr->fp);
+    for (uint32_t i = 0; i <= n_ram; ++i) {
+        uint32_t page = i == n_ram ? RR_TRAP_PAGE : i;
+        if (rr_page_is_zero(rr_page(sim, page), rr_page_len(sim, page)))
+            continue;
+        fwrite(&page, sizeof(page), 1, rr->fp);
+        fwrite(rr_page(sim, page), rr_page_len(sim, page), 1, rr->fp);
+    }
+}
+
+static void rr_restore(sim_state_t* sim, size_t off) {
+    struct sim_rr *rr = sim->rr;
+    struct rr_snapshot snap;
+    uint8_t const *p = rr->log + off + 1;
+    memcpy(&snap, p, sizeof(snap));
+    p += sizeof(snap);
+    sim->cpu = snap.cpu;
+    sim->perf = snap.perf;
+    memcpy(sim->perf_guest, snap.perf_guest, sizeof(snap.perf_guest));
+    sim->dma = snap.dma;
+    sim->sys_mmap_top = snap.sys_mmap_top;
+    memset(sim->ram, 0, sim->ram_size);
+    memset(sim->trap_page, 0, PAGE_SIZE);
+    for (uint32_t i = 0; i < snap.n_pages; ++i) {
+        uint32_t page;
+        memcpy(&page, p, sizeof(page));
+        p += sizeof(page);
+        memcpy(rr_page(sim, page), p, rr_page_len(sim, page));
+        p += rr_page_len(sim, page);
+    }
+    sim->idiom_len = 0;
+    rr->next = snap.tick + rr->interval;
+    /* Inputs taken by the instruction after the snapshot onwards */
+    for (rr->cursor = 0; rr->cursor < rr->n_inputs && rr->inputs[rr->cursor].tick <= snap.tick; ++rr->cursor);
+}
+
+static uint64_t rr_snapshot_tick(struct sim_rr *rr, size_t i) {
+    uint64_t tick;
+    memcpy(&tick, rr->log + rr->snaps[i] + 1 + offsetof(struct rr_snapshot, tick), sizeof(tick));
+    return tick;
+}
+
+/* Indexes the snapshots and inputs of an in memory log */
+static bool rr_parse(sim_state_t* sim, struct sim_rr *rr) {
+    size_t off = sizeof(struct rr_header), cap_snaps = 0, cap_inputs = 0;
+    while (off < rr->log_len) {
+        uint8_t type = rr->log[off];
+        if (type == RR_SNAPSHOT) {
+            struct rr_snapshot snap;
+            size_t len = 1 + sizeof(snap);
+            if (off + len > rr->log_len)
+                return false;
+            memcpy(&snap, rr->log + off + 1, sizeof(snap));
+            for (uint32_t i = 0; i < snap.n_pages; ++i) {
+                uint32_t page;
+                if (off + len + sizeof(page) > rr->log_len)
+                    return false;
+                memcpy(&page, rr->log + off + len, sizeof(page));
+                if (page != RR_TRAP_PAGE && (size_t)page * PAGE_SIZE >= sim->ram_size)
+                    return false;
+                len += sizeof(page) + rr_page_len(sim, page);
+            }
+            if (off + len > rr->log_len)
+                return false;
+            if (rr->n_snaps == cap_snaps) {
+                size_t *snaps = realloc(rr->snaps, (cap_snaps = cap_snaps * 2 + 16) * sizeof(*snaps));
+                if (snaps == NULL)
+                    return false;
+                rr->snaps = snaps;
+            }
+            rr->snaps[rr->n_snaps++] = off;
+            off += len;
+        } else if (type == RR_INPUT || type == RR_INPUT_BUF) {
+            struct rr_input in;
+            if (off + 1 + sizeof(in) > rr->log_len)
+                return false;
+            memcpy(&in, rr->log + off + 1, sizeof(in));
+            if (type == RR_INPUT_BUF && off + 1 + sizeof(in) + in.value > rr->log_len)
+                return false;
+            if (rr->n_inputs == cap_inputs) {
+                struct rr_logged_input *inputs = realloc(rr->inputs, (cap_inputs = cap_inputs * 2 + 64) * sizeof(*inputs));
+                if (inputs == NULL)
+                    return false;
+                rr->inputs = inputs;
+            }
+            rr->inputs[rr->n_inputs].tick = in.tick;
+            rr->inputs[rr->n_inputs].value = in.value;
+            rr->inputs[rr->n_inputs].buf = type == RR_INPUT_BUF;
+            rr->inputs[rr->n_inputs].data = off + 1 + sizeof(in);
+            ++rr->n_inputs;
+            off += 1 + sizeof(in) + (type == RR_INPUT_BUF ? in.value : 0);
+        } else if (type == RR_END) {
+            off += 1 + sizeof(uint64_t);
+        } else {
+            return false;
+        }
+    }
+    return rr->n_snaps != 0;
+}
+
+int xm_sim_record(xm_sim_t *sim, const char *path, unsigned long interval) {
+    struct rr_header hdr = {0};
+    struct sim_rr *rr;
+    sim_rr_close(sim);
+    if ((rr = calloc(1, sizeof(*rr))) == NULL)
+        return -1;
+    if ((rr->fp = fopen(path, "wb")) == NULL) {
+        free(rr);
+        return -1;
+    }
+    rr->interval = interval != 0 ? interval : RR_DEFAULT_INTERVAL;
+    rr->next = sim->perf.ticks + rr->interval;
+    memcpy(hdr.magic, RR_MAGIC, sizeof(hdr.magic));
+    hdr.version = RR_VERSION;
+    hdr.rom_hash = rr_rom_hash(sim);
+    hdr.ram_size = sim->ram_size;
+    hdr.interval = rr->interval;
+    hdr.dma_bandwidth = sim->dma_bandwidth;
+    fwrite(&hdr, sizeof(hdr), 1, rr->fp);
+    sim->rr = rr;
+    rr_write_snapshot(sim);
+    return 0;
+}
+
+int xm_sim_replay(xm_sim_t *sim, const char *path) {
+    struct rr_header hdr;
+    struct sim_rr *rr;
+    FILE *fp;
+    long len;
+    sim_rr_close(sim);
+    if ((fp = fopen(path, "rb")) == NULL)
+        return -1;
+    if ((rr = calloc(1, sizeof(*rr))) == NULL
+    || fseek(fp, 0, SEEK_END) != 0 || (len = ftell(fp)) < (long)sizeof(hdr)
+    || fseek(fp, 0, SEEK_SET) != 0
+    || (rr->log = malloc(len)) == NULL
+    || fread(rr->log, 1, len, fp) != (size_t)len)
+        goto fail;
+    fclose(fp);
+    fp = NULL;
+    rr->log_len = len;
+    rr->replay = true;
+    memcpy(&hdr, rr->log, sizeof(hdr));
+    if (memcmp(hdr.magic, RR_MAGIC, sizeof(hdr.magic)) != 0 || hdr.version != RR_VERSION
+    || hdr.ram_size != sim->ram_size || hdr.rom_hash != rr_rom_hash(sim)
+    || hdr.interval == 0 || !rr_parse(sim, rr))
+        goto fail;
+    rr->interval = hdr.interval;
+    /* Timing of the transfers is part of the run */
+    sim->dma_bandwidth = hdr.dma_bandwidth;
+    sim->rr = rr;
+    rr_restore(sim, rr->snaps[0]);
+    return 0;
+fail:
+    if (fp != NULL)
+        fclose(fp);
+    if (rr != NULL) {
+        free(rr->log);
+        free(rr->snaps);
+        free(rr->inputs);
+    }
+    free(rr);
+    return -1;
+}
+
+int xm_sim_seek(xm_sim_t *sim, unsigned long tick) {
+    struct sim_rr *rr = sim->rr;
+    size_t lo = 0, hi;
+    FILE *log = sim->log;
+    if (rr == NULL || !rr->replay)
+        return -1;
+    /* Devices aren't part of the snapshots, only go forward with them */
+    if (sim->devices != NULL) {
+        if (tick < sim->perf.ticks)
+            return -1;
+        sim->log = NULL;
+        xm_sim_run(sim, tick - sim->perf.ticks);
+        sim->log = log;
+        return sim->perf.ticks == tick ? 0 : -1;
+    }
+    /* Last snapshot at or before tick */
+    hi = rr->n_snaps;
+    while (hi - lo > 1) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (rr_snapshot_tick(rr, mid) <= tick)
+            lo = mid;
+        else
+            hi = mid;
+    }
+    if (rr_snapshot_tick(rr, lo) > tick)
+        return -1;
+    rr_restore(sim, rr->snaps[lo]);
+    sim->log = NULL;
+    xm_sim_run(sim, tick - sim->perf.ticks);
+    sim->log = log;
+    return sim->perf.ticks == tick ? 0 : -1;
+}
+
+void xm_sim_rr_stop(xm_sim_t *sim) {
+    sim_rr_close(sim);
+}
+
+unsigned long sim_rr_next_tick(sim_state_t* sim, unsigned long end) {
+    return sim->rr->next < end ? sim->rr->next : end;
+}
+
+void sim_rr_boundary(sim_state_t* sim) {
+    struct sim_rr *rr = sim->rr;
+    if (sim->perf.ticks < rr->next)
+        return;
+    if (!rr->replay) {
+        rr_write_snapshot(sim);
+    } else if (!rr->diverged) {
+        /* Snapshots are in tick order, a binary search isn't worth it */
+        for (size_t i = 0; i < rr->n_snaps; ++i) {
+            struct rr_snapshot snap;
+            if (rr_snapshot_tick(rr, i) != sim->perf.ticks)
+                continue;
+            memcpy(&snap, rr->log + rr->snaps[i] + 1, sizeof(snap));
+            if (memcmp(&snap.cpu, &sim->cpu, sizeof(snap.cpu)) != 0
+            || snap.mem_hash != rr_mem_hash(sim)) {
+                SIM_LOG(sim, "replay: diverged before tick#%lu\n", sim->perf.ticks);
+                rr->diverged = true;
+            }
+            break;
+        }
+    }
+    while (rr->next <= sim->perf.ticks)
+        rr->next += rr->interval;
+}
+
+uint32_t sim_rr_input(sim_state_t* sim, uint32_t v) {
+    struct sim_rr *rr = sim->rr;
+    if (rr == NULL)
+        return v;
+    if (!rr->replay) {
+        struct rr_input in = { sim->perf.ticks, v };
+        uint8_t type = RR_INPUT;
+        fwrite(&type, sizeof(type), 1, rr->fp);
+        fwrite(&in, sizeof(in), 1, rr->fp);
+        return v;
+    }
+    if (rr->cursor < rr->n_inputs && rr->inputs[rr->cursor].tick == sim->perf.ticks
+    && !rr->inputs[rr->cursor].buf)
+        return rr->inputs[rr->cursor++].value;
+    if (!rr->diverged)
+        SIM_LOG(sim, "replay: no input logged for tick#%lu\n", sim->perf.ticks);
+    rr->diverged = true;
+    return v;
+}
+
+void sim_rr_input_buf(sim_state_t* sim, void *buf, size_t len) {
+    struct sim_rr *rr = sim->rr;
+    struct rr_logged_input *in;
+    if (rr == NULL)
+        return;
+    if (!rr->replay) {
+        struct rr_input hdr = { sim->perf.ticks, (uint32_t)len };
+        uint8_t type = RR_INPUT_BUF;
+        fwrite(&type, sizeof(type), 1, rr->fp);
+        fwrite(&hdr, sizeof(hdr), 1, rr->fp);
+        fwrite(buf, len, 1, rr->fp);
+        return;
+    }
+    if (rr->cursor < rr->n_inputs && (in = &rr->inputs[rr->cursor])->tick == sim->perf.ticks
+    && in->buf && in->value == len) {
+        memcpy(buf, rr->log + in->data, len);
+        ++rr->cursor;
+        return;
+    }
+    if (!rr->diverged)
+        SIM_LOG(sim, "replay: no input logged for tick#%lu\n", sim->perf.ticks);
+    rr->diverged = true;
+}
+
+bool sim_rr_replaying(sim_state_t* sim) {
+    return sim->rr != NULL && sim->rr->replay;
+}
+
+void sim_rr_close(sim_state_t* sim) {
+    struct sim_rr *rr = sim->rr;
+    if (rr == NULL)
+        return;
+    if (!rr->replay) {
+        uint64_t tick = sim->perf.ticks;
+        uint8_t type = RR_END;
+        fwrite(&type, sizeof(type), 1, rr->fp);
+        fwrite(&tick, sizeof(tick), 1, rr->fp);
+        fclose(rr->fp);
+    }
+    free(rr->log);
+    free(rr->snaps);
+    free(rr->inputs);
+    free(rr);
+    sim->rr = NULL;
+}
@@ -0,0 +1,278 @@
+#include <stdbool.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <limits.h>
+#include <float.h>
+
+#include "isa.h"
+#include "xmsim.h"
+#include "xmsched.h"
+#include "xmsample.h"
+#include "sim.h"
+
+#define SAMPLE_DEFAULT_INTERVAL 100000
+#define SAMPLE_DEFAULT_SAMPLES 10
+#define SAMPLE_KMEANS_ITERATIONS 50
+
+struct sample_interval {
+    unsigned long ticks;
+    float bbv[SIM_BBV_SIZE]; /* Normalised */
+    unsigned cluster;
+};
+
+/* A representative interval and the share of the run it stands for */
+struct sample_window {
+    size_t interval;
+    double weight;
+    xm_sched_t *sched;
+    unsigned long ticks;
+    bool spawned;
+    bool warm; /* Set by the worker once the warmup is over */
+    xm_sim_timing_t before;
+    xm_sim_timing_t after;
+};
+
+static float sample_distance(float const *a, float const *b) {
+    float d = 0.f;
+    for (unsigned i = 0; i < SIM_BBV_SIZE; ++i)
+        d += (a[i] - b[i]) * (a[i] - b[i]);
+    return d;
+}
+
+/* Evenly sized runs of consecutive intervals */
+static void sample_select_uniform(struct sample_interval *iv, size_t n, unsigned k) {
+    for (size_t i = 0; i < n; ++i)
+        iv[i].cluster = (unsigned)(i * k / n);
+}
+
+/* k-means over the basic block vectors, seeded with evenly spread intervals
+    so the result doesn't depend on anything but the run */
+static bool sample_select_bbv(struct sample_interval *iv, size_t n, unsigned k) {
+    float (*center)[SIM_BBV_SIZE] = malloc(k * sizeof(*center));
+    unsigned *count = malloc(k * sizeof(*count));
+    if (center == NULL || count == NULL) {
+        free(center);
+        free(count);
+        return false;
+    }
+    for (unsigned c = 0; c < k; ++c)
+        memcpy(center[c], iv[c * n / k].bbv, sizeof(center[c]));
+    for (unsigned it = 0; it < SAMPLE_KMEANS_ITERATIONS; ++it) {
+        bool moved = false;
+        for (size_t i = 0; i < n; ++i) {
+            unsigned best = 0;
+            float best_d = FLT_MAX;
+            for (unsigned c = 0; c < k; ++c) {
+                float d = sample_distance(iv[i].bbv, center[c]);
+                if (d < best_d) {
+                    best_d = d;
+                    best = c;
+                }
+            }
+            moved |= it == 0 || iv[i].cluster != best;
+            iv[i].cluster = best;
+        }
+        if (!moved)
+            break;
+        memset(count, 0, k * sizeof(*count));
+        for (size_t i = 0; i < n; ++i)
+            ++count[iv[i].cluster];
+        for (unsigned c = 0; c < k; ++c)
+            if (count[c] != 0)
+                memset(center[c], 0, sizeof(center[c]));
+        for (size_t i = 0; i < n; ++i)
+            for (unsigned j = 0; j < SIM_BBV_SIZE; ++j)
+                center[iv[i].cluster][j] += iv[i].bbv[j] / count[iv[i].cluster];
+    }
+    free(center);
+    free(count);
+    return true;
+}
+
+static void sample_window_done(xm_sim_t *sim, xm_sim_result_t result, void *user) {
+    struct sample_window *w = user;
+    if (!w->warm) {
+        w->warm = true;
+        xm_sim_get_timing(sim, &w->before);
+        /* The scheduler is done with sim, hand it back for the measurement */
+        if (result != XM_SIM_HALT && xm_sched_spawn(w->sched, sim, w->ticks, sample_window_done, w) == 0)
+            return;
+    }
+    xm_sim_get_timing(sim, &w->after);
+    xm_sim_destroy(sim);
+}
+
+/* First pass: runs sim to the end in intervals, BBVs when needed */
+static struct sample_interval *sample_profile(sim_state_t* sim, unsigned long interval,
+    unsigned long max_ticks, bool bbv, size_t *n_out)
+{
+    struct sample_interval *iv = NULL;
+    unsigned long counts[SIM_BBV_SIZE];
+    size_t n = 0, cap = 0;
+    xm_sim_result_t r = XM_SIM_CONTINUE;
+    unsigned long end = max_ticks != 0 ? sim->perf.ticks + max_ticks : ULONG_MAX;
+    while (r != XM_SIM_HALT && sim->perf.ticks < end) {
+        unsigned long start = sim->perf.ticks;
+        if (n == cap) {
+            struct sample_interval *more = realloc(iv, (cap = cap * 2 + 64) * sizeof(*iv));
+            if (more == NULL) {
+                free(iv);
+                return NULL;
+            }
+            iv = more;
+        }
+        memset(counts, 0, sizeof(counts));
+        sim->bbv = bbv ? counts : NULL;
+        r = xm_sim_run(sim, end - start < interval ? end - start : interval);
+        sim->bbv = NULL;
+        if (sim->perf.ticks == start)
+            break;
+        iv[n].ticks = sim->perf.ticks - start;
+        for (unsigned i = 0; i < SIM_BBV_SIZE; ++i)
+            iv[n].bbv[i] = (float)counts[i] / iv[n].ticks;
+        ++n;
+    }
+    *n_out = n;
+    return iv;
+}
+
+int xm_sample_run(xm_sim_t *sim, const xm_sample_config_t *config, xm_sample_result_t *result) {
+    unsigned long interval = config->interval != 0 ? config->interval : SAMPLE_DEFAULT_INTERVAL;
+    unsigned k = config->n_samples != 0 ? config->n_samples : SAMPLE_DEFAULT_SAMPLES;
+    struct sample_interval *iv;
+    struct sample_window *w;
+    sim_state_t *ff;
+    xm_sched_t *sched;
+    unsigned long t0 = sim->perf.ticks, total = 0, at = 0;
+    double cpi = 0., ia = 0., im = 0., da = 0., dm = 0., br = 0., bm = 0.;
+    FILE *log = sim->log;
+    size_t n;
+    unsigned n_samples = 0;
+    int ret = 0;
+
+    /* Second pass starts from here */
+    if ((ff = sim_clone(sim, (sim->opt | SIM_OPT_QUIET) & ~SIM_OPT_DETAILED)) == NULL)
+        return -1;
+    sim->log = NULL;
+    iv = sample_profile(sim, interval, config->max_ticks, config->select == XM_SAMPLE_BBV, &n);
+    sim->log = log;
+    if (iv == NULL || n == 0) {
+        free(iv);
+        xm_sim_destroy(ff);
+        return iv == NULL ? -1 : 0;
+    }
+    if (k > n)
+        k = n;
+    if (config->select == XM_SAMPLE_BBV) {
+        if (!sample_select_bbv(iv, n, k)) {
+            free(iv);
+            xm_sim_destroy(ff);
+            return -1;
+        }
+    } else {
+        sample_select_uniform(iv, n, k);
+    }
+
+    /* Per cluster: weight, then the member closest to the centroid, which
+        for uniform runs is simply the middle one */
+    if ((w = calloc(k, sizeof(*w))) == NULL || (sched = xm_sched_create(config->n_workers, 0)) == NULL) {
+        free(w);
+        free(iv);
+        xm_sim_destroy(ff);
+        return -1;
+    }
+    for (size_t i = 0; i < n; ++i)
+        total += iv[i].ticks;
+    for (unsigned c = 0; c < k; ++c) {
+        float center[SIM_BBV_SIZE] = {0}, best_d = FLT_MAX;
+        size_t first = n, last = 0, members = 0;
+        w[c].interval = n;
+        w[c].sched = sched;
+        for (size_t i = 0; i < n; ++i) {
+            if (iv[i].cluster != c)
+                continue;
+            w[c].weight += (double)iv[i].ticks / total;
+            for (unsigned j = 0; j < SIM_BBV_SIZE; ++j)
+                center[j] += iv[i].bbv[j];
+            first = first < i ? first : i;
+            last = i;
+            ++members;
+        }
+        if (members == 0)
+            continue;
+        if (config->select != XM_SAMPLE_BBV) {
+            w[c].interval = first + (last - first) / 2;
+            continue;
+        }
+        for (unsigned j = 0; j < SIM_BBV_SIZE; ++j)
+            center[j] /= members;
+        for (size_t i = 0; i < n; ++i) {
+            float d;
+            if (iv[i].cluster == c && (d = sample_distance(iv[i].bbv, center)) < best_d) {
+                best_d = d;
+                w[c].interval = i;
+            }
+        }
+    }
+
+    /* Second pass: fast-forward a copy of the initial state, forking a
+        detailed instance at the start of every window's warmup. Clusters
+        aren't in run order, pick the next window each time. */
+    for (;;) {
+        struct sample_window *next = NULL;
+        unsigned long start, warm_start;
+        sim_state_t *d;
+        for (unsigned c = 0; c < k; ++c)
+            if (w[c].interval < n && !w[c].spawned
+            && (next == NULL || w[c].interval < next->interval))
+                next = &w[c];
+        if (next == NULL)
+            break;
+        next->spawned = true;
+        start = (unsigned long)next->interval * interval;
+        warm_start = start > config->warmup ? start - config->warmup : 0;
+        if (warm_start > at) {
+            xm_sim_run(ff, warm_start - at);
+            at = warm_start;
+        }
+        next->ticks = iv[next->interval].ticks;
+        next->warm = start == warm_start;
+        if ((d = sim_clone(ff, ff->opt | SIM_OPT_DETAILED)) == NULL
+        || xm_sched_spawn(sched, d, next->warm ? next->ticks : start - warm_start, sample_window_done, next) != 0) {
+            xm_sim_destroy(d);
+            next->interval = n;
+            ret = -1;
+        }
+    }
+    xm_sched_destroy(sched);
+    xm_sim_destroy(ff);
+
+    /* Weighted per instruction rates */
+    for (unsigned c = 0; c < k; ++c) {
+        double insts, weight = w[c].weight;
+        if (w[c].interval >= n || (insts = w[c].after.insts - w[c].before.insts) == 0)
+            continue;
+        cpi += weight * (w[c].after.cycles - w[c].before.cycles) / insts;
+        ia += weight * (w[c].after.icache_accesses - w[c].before.icache_accesses) / insts;
+        im += weight * (w[c].after.icache_misses - w[c].before.icache_misses) / insts;
+        da += weight * (w[c].after.dcache_accesses - w[c].before.dcache_accesses) / insts;
+        dm += weight * (w[c].after.dcache_misses - w[c].before.dcache_misses) / insts;
+        br += weight * (w[c].after.branches - w[c].before.branches) / insts;
+        bm += weight * (w[c].after.b_mispredicts - w[c].before.b_mispredicts) / insts;
+        ++n_samples;
+    }
+    result->ticks = sim->perf.ticks - t0;
+    result->n_intervals = n;
+    result->n_samples = n_samples;
+    result->cpi = cpi;
+    result->cycles = (unsigned long)(cpi * result->ticks + 0.5);
+    result->icache_miss_rate = ia != 0. ? im / ia : 0.;
+    result->dcache_miss_rate = da != 0. ? dm / da : 0.;
+    result->b_mispredict_rate = br != 0. ? bm / br : 0.;
+    free(w);
+    free(iv);
+    return ret;
+}
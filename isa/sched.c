@@ -0,0 +1,262 @@
+#include <stdbool.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+#include "xmsim.h"
+#include "xmsched.h"
+
+#define SCHED_DEFAULT_SLICE 10000
+
+struct sched_ctx {
+    xm_sim_t *sim;
+    unsigned long ticks_left;
+    xm_sched_done_fn done;
+    void *user;
+};
+
+/* Ring of runnable contexts, the owner pops from the head and requeues at
+    the tail, thieves take from the tail */
+struct sched_queue {
+    pthread_mutex_t lock;
+    struct sched_ctx **ring;
+    size_t head;
+    size_t count;
+    size_t cap;
+};
+
+struct sched_worker {
+    pthread_t thread;
+    struct sched_queue q;
+    struct xm_sched *sched;
+    unsigned id;
+    unsigned seed;
+};
+
+struct xm_sched {
+    struct sched_worker *workers;
+    unsigned n_workers;
+    unsigned long slice;
+    atomic_uint next; /* Worker receiving the next spawn */
+    atomic_size_t queued; /* Contexts sitting in any queue */
+    atomic_uint sleepers;
+    /* Protects live and stop, idle workers and waiters sleep on it */
+    pthread_mutex_t lock;
+    pthread_cond_t work;
+    pthread_cond_t idle;
+    size_t live; /* Spawned and not done yet */
+    bool stop;
+};
+
+static bool sched_queue_push(struct sched_queue *q, struct sched_ctx *ctx) {
+    pthread_mutex_lock(&q->lock);
+    if (q->count == q->cap) {
+        size_t cap = q->cap ? q->cap * 2 : 64;
+        struct sched_ctx **ring = malloc(cap * sizeof(*ring));
+        if (ring == NULL) {
+            pthread_mutex_unlock(&q->lock);
+            return false;
+        }
+        for (size_t i = 0; i < q->count; ++i)
+            ring[i] = q->ring[(q->head + i) % q->cap];
+        free(q->ring);
+        q->ring = ring;
+        q->head = 0;
+        q->cap = cap;
+    }
+    q->ring[(q->head + q->count) % q->cap] = ctx;
+    ++q->count;
+    pthread_mutex_unlock(&q->lock);
+    return true;
+}
+
+static struct sched_ctx *sched_queue_pop(struct sched_queue *q) {
+    struct sched_ctx *ctx = NULL;
+    pthread_mutex_lock(&q->lock);
+    if (q->count != 0) {
+        ctx = q->ring[q->head];
+        q->head = (q->head + 1) % q->cap;
+        --q->count;
+    }
+    pthread_mutex_unlock(&q->lock);
+    return ctx;
+}
+
+static struct sched_ctx *sched_queue_steal(struct sched_queue *q) {
+    struct sched_ctx *ctx = NULL;
+    pthread_mutex_lock(&q->lock);
+    if (q->count != 0) {
+        --q->count;
+        ctx = q->ring[(q->head + q->count) % q->cap];
+    }
+    pthread_mutex_unlock(&q->lock);
+    return ctx;
+}
+
+/* Makes ctx runnable on w, wakes an idle worker when there is more work than
+    the one pushing it can take */
+static void sched_enqueue(struct xm_sched *sched, struct sched_worker *w, struct sched_ctx *ctx, bool external) {
+    size_t prev;
+    /* Runs out of memory only while growing, keep it on our hands then */
+    while (!sched_queue_push(&w->q, ctx))
+        w = &sched->workers[(w->id + 1) % sched->n_workers];
+    prev = atomic_fetch_add(&sched->queued, 1);
+    if ((external || prev != 0) && atomic_load(&sched->sleepers) != 0) {
+        pthread_mutex_lock(&sched->lock);
+        pthread_cond_signal(&sched->work);
+        pthread_mutex_unlock(&sched->lock);
+    }
+}
+
+static struct sched_ctx *sched_dequeue(struct sched_worker *w) {
+    struct xm_sched *sched = w->sched;
+    struct sched_ctx *ctx;
+    if ((ctx = sched_queue_pop(&w->q)) == NULL && sched->n_workers > 1) {
+        /* Steal half of the first non empty victim, starting somewhere random */
+        unsigned start = (w->seed = w->seed * 1103515245 + 12345) % sched->n_workers;
+        for (unsigned i = 0; i < sched->n_workers && ctx == NULL; ++i) {
+            struct sched_worker *v = &sched->workers[(start + i) % sched->n_workers];
+            size_t n;
+            if (v == w)
+                continue;
+            pthread_mutex_lock(&v->q.lock);
+            n = v->q.count / 2;
+            pthread_mutex_unlock(&v->q.lock);
+            ctx = sched_queue_steal(&v->q);
+            for (size_t j = 0; ctx != NULL && j < n; ++j) {
+                struct sched_ctx *more = sched_queue_steal(&v->q);
+                if (more == NULL || !sched_queue_push(&w->q, more)) {
+                    if (more != NULL)
+                        sched_queue_push(&v->q, more);
+                    break;
+                }
+            }
+        }
+    }
+    if (ctx != NULL)
+        atomic_fetch_sub(&sched->queued, 1);
+    return ctx;
+}
+
+static void sched_finish(struct xm_sched *sched, struct sched_ctx *ctx, xm_sim_result_t r) {
+    if (ctx->done != NULL)
+        ctx->done(ctx->sim, r, ctx->user);
+    free(ctx);
+    pthread_mutex_lock(&sched->lock);
+    if (--sched->live == 0)
+        pthread_cond_broadcast(&sched->idle);
+    pthread_mutex_unlock(&sched->lock);
+}
+
+static void *sched_worker_main(void *arg) {
+    struct sched_worker *w = arg;
+    struct xm_sched *sched = w->sched;
+    for (;;) {
+        struct sched_ctx *ctx = sched_dequeue(w);
+        xm_sim_perf_t before, after;
+        unsigned long n;
+        xm_sim_result_t r;
+        if (ctx == NULL) {
+            bool stop;
+            pthread_mutex_lock(&sched->lock);
+            atomic_fetch_add(&sched->sleepers, 1);
+            while (!sched->stop && atomic_load(&sched->queued) == 0)
+                pthread_cond_wait(&sched->work, &sched->lock);
+            atomic_fetch_sub(&sched->sleepers, 1);
+            stop = sched->stop && atomic_load(&sched->queued) == 0;
+            pthread_mutex_unlock(&sched->lock);
+            if (stop)
+                break;
+            continue;
+        }
+        n = ctx->ticks_left < sched->slice ? ctx->ticks_left : sched->slice;
+        xm_sim_get_perf(ctx->sim, &before);
+        r = xm_sim_run(ctx->sim, n);
+        xm_sim_get_perf(ctx->sim, &after);
+        if (ctx->ticks_left != ULONG_MAX)
+            ctx->ticks_left -= after.ticks - before.ticks;
+        if (r == XM_SIM_HALT || r == XM_SIM_FAULT || ctx->ticks_left == 0)
+            sched_finish(sched, ctx, r);
+        else
+            sched_enqueue(sched, w, ctx, false);
+    }
+    return NULL;
+}
+
+xm_sched_t *xm_sched_create(unsigned n_workers, unsigned long slice) {
+    struct xm_sched *sched = calloc(1, sizeof(*sched));
+    unsigned started = 0;
+    if (sched == NULL)
+        return NULL;
+    sched->n_workers = n_workers != 0 ? n_workers : 1;
+    sched->slice = slice != 0 ? slice : SCHED_DEFAULT_SLICE;
+    pthread_mutex_init(&sched->lock, NULL);
+    pthread_cond_init(&sched->work, NULL);
+    pthread_cond_init(&sched->idle, NULL);
+    if ((sched->workers = calloc(sched->n_workers, sizeof(*sched->workers))) == NULL) {
+        free(sched);
+        return NULL;
+    }
+    for (unsigned i = 0; i < sched->n_workers; ++i) {
+        struct sched_worker *w = &sched->workers[i];
+        pthread_mutex_init(&w->q.lock, NULL);
+        w->sched = sched;
+        w->id = i;
+        w->seed = i + 1;
+    }
+    for (; started < sched->n_workers; ++started)
+        if (pthread_create(&sched->workers[started].thread, NULL, sched_worker_main, &sched->workers[started]) != 0)
+            break;
+    if (started < sched->n_workers) {
+        sched->n_workers = started;
+        xm_sched_destroy(sched);
+        return NULL;
+    }
+    return sched;
+}
+
+void xm_sched_destroy(xm_sched_t *sched) {
+    xm_sched_wait(sched);
+    pthread_mutex_lock(&sched->lock);
+    sched->stop = true;
+    pthread_cond_broadcast(&sched->work);
+    pthread_mutex_unlock(&sched->lock);
+    for (unsigned i = 0; i < sched->n_workers; ++i) {
+        pthread_join(sched->workers[i].thread, NULL);
+        pthread_mutex_destroy(&sched->workers[i].q.lock);
+        free(sched->workers[i].q.ring);
+    }
+    pthread_cond_destroy(&sched->idle);
+    pthread_cond_destroy(&sched->work);
+    pthread_mutex_destroy(&sched->lock);
+    free(sched->workers);
+    free(sched);
+}
+
+int xm_sched_spawn(xm_sched_t *sched, xm_sim_t *sim, unsigned long max_ticks,
+    xm_sched_done_fn done, void *user)
+{
+    struct sched_ctx *ctx;
+    if (sched->n_workers == 0 || (ctx = malloc(sizeof(*ctx))) == NULL)
+        return -1;
+    ctx->sim = sim;
+    ctx->ticks_left = max_ticks != 0 ? max_ticks : ULONG_MAX;
+    ctx->done = done;
+    ctx->user = user;
+    pthread_mutex_lock(&sched->lock);
+    ++sched->live;
+    pthread_mutex_unlock(&sched->lock);
+    sched_enqueue(sched, &sched->workers[atomic_fetch_add(&sched->next, 1) % sched->n_workers], ctx, true);
+    return 0;
+}
+
+void xm_sched_wait(xm_sched_t *sched) {
+    pthread_mutex_lock(&sched->lock);
+    while (sched->live != 0)
+        pthread_cond_wait(&sched->idle, &sched->lock);
+    pthread_mutex_unlock(&sched->lock);
+}
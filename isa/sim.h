@@ -0,0 +1,369 @@
+#pragma once
+
+/* libxmsim internals, shared by the translation units of the library */
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stddef.h>
+
+#include "isa.h"
+#include "xmsim.h"
+#include "xmdev.h"
+
+#define SIM_RAM_BASE XM_SIM_RAM_BASE
+#define SIM_ROM_BASE XM_SIM_ROM_BASE
+
+#define SIM_RAM_SIZE (PAGE_SIZE * 512)
+#define SIM_ROM_SIZE (PAGE_SIZE * 16)
+
+#define SIM_LOG(SIM, ...) \
+    do if ((SIM)->log != NULL) \
+        (void)fprintf((SIM)->log, __VA_ARGS__); \
+    while (0)
+
+typedef enum {
+    CPUE_CONTINUE,
+    CPUE_HALT,
+    CPUE_BREAK,
+    CPUE_FAULT,
+} cpu_execute_result_t;
+typedef enum {
+    SIM_OPT_QUIET = XM_SIM_OPT_QUIET,
+    SIM_OPT_TEST = XM_SIM_OPT_TEST,
+    SIM_OPT_TRACE_MEM = XM_SIM_OPT_TRACE_MEM,
+    SIM_OPT_NO_IDIOM = XM_SIM_OPT_NO_IDIOM,
+    SIM_OPT_DETAILED = XM_SIM_OPT_DETAILED,
+    SIM_OPT_SYSCALL = XM_SIM_OPT_SYSCALL,
+    SIM_OPT_HEATMAP = XM_SIM_OPT_HEATMAP,
+    SIM_OPT_BARE = XM_SIM_OPT_BARE,
+    SIM_OPT_EXEC_PROFILE = XM_SIM_OPT_EXEC_PROFILE,
+    SIM_OPT_YIELD = XM_SIM_OPT_YIELD,
+} sim_options_t;
+
+#define SIM_IDIOM_CACHE_SIZE 64
+#define SIM_IDIOM_MAX_LEN 8
+/* A recognised counted copy/fill/scan loop, the body runs from head up to
+    and including the backwards branch into head */
+typedef struct {
+    uint32_t head;
+    uint32_t n; /* Instructions in the body, 0 for an empty slot */
+    uint8_t code[SIM_IDIOM_MAX_LEN * 4]; /* Body as decoded, to revalidate */
+    bool valid;
+    /* Registers updated by `add/sub $rX,$rX,imm8` and their step */
+    uint16_t written;
+    uint32_t stride[16];
+    int8_t alu; /* Last ALU destination, updates the flags */
+    int8_t val; /* Destination of the ldb */
+    int8_t ld_base, st_base, st_src; /* -1 if absent */
+    uint8_t ld_phase, st_phase; /* Base incremented before the access */
+    uint32_t ld_off, st_off;
+    uint8_t n_branches;
+    /* The loop leaves once a tested register equals its key */
+    struct cpu_idiom_test {
+        uint8_t reg;
+        int8_t key; /* Key register, -1 for zero */
+        uint8_t phase;
+    } test[SIM_IDIOM_MAX_LEN];
+    uint8_t n_tests;
+} cpu_idiom_t;
+
+#define SIM_BBV_BITS 5
+#define SIM_BBV_SIZE (1 << SIM_BBV_BITS)
+
+/* Device map: guest page -> device, two levels so it stays small */
+#define SIM_MMIO_L2_BITS 10
+#define SIM_MMIO_L1_SIZE ((UINT32_MAX / PAGE_SIZE + 1) >> SIM_MMIO_L2_BITS)
+
+struct sim_device {
+    uint32_t base;
+    uint32_t size;
+    xm_dev_ops_t ops;
+    void *dev;
+    struct sim_device *next;
+};
+
+struct sim_event {
+    unsigned long tick;
+    unsigned long seq; /* Keeps events of the same tick in order */
+    xm_dev_event_fn fn;
+    void *dev;
+};
+
+/* Asynchronous DMA engine, a FIFO of transfers queued by memcpy, memmov and
+    memset. A transfer moves its bytes at once on the tick it finishes at. */
+#define SIM_DMA_QUEUE 16
+
+enum sim_dma_op {
+    SIM_DMA_COPY,
+    SIM_DMA_MOVE,
+    SIM_DMA_FILL,
+};
+
+struct sim_dma {
+    struct sim_dma_xfer {
+        uint32_t op;
+        uint32_t dst;
+        uint32_t src; /* Fill value for SIM_DMA_FILL */
+        uint32_t len;
+        unsigned long done; /* Tick the engine finishes it at */
+    } queue[SIM_DMA_QUEUE];
+    unsigned head;
+    unsigned n;
+    /* Tokens are handed out in order, so one counter each tells which are done */
+    uint32_t issued;
+    uint32_t retired;
+    unsigned long idle; /* Tick the engine runs dry at */
+    /* A stall that had to give xm_sim_run back, the next step carries on
+        with the instruction at cpu.pc without fetching it again */
+    bool stalled;
+    uint8_t stall_id[4];
+};
+
+#define SIM_PAGES ((uint64_t)UINT32_MAX / PAGE_SIZE + 1)
+
+struct sim_watch {
+    uint32_t addr;
+    uint32_t len;
+    unsigned access;
+};
+
+#define SIM_SYS_FDS 32
+#define SIM_SYS_FD_NULL (-2) /* Reads as end of file, drops writes */
+
+/* What the host is doing for the guest, sampled by prof.c */
+enum sim_prof_where {
+    SIM_PROF_RUN, /* Run loop, logging, record/replay */
+    SIM_PROF_DECODE,
+    SIM_PROF_EXECUTE,
+    SIM_PROF_MEMORY, /* Address translation and the access itself */
+    SIM_PROF_TIMING,
+    SIM_PROF_IDIOM,
+    SIM_PROF_DMA, /* Asynchronous transfers, not the instructions */
+    SIM_PROF_DEVICE,
+    SIM_PROF_COUNT,
+};
+
+#define SIM_PROF_STACK 64
+
+struct sim_rr;
+struct sim_timing;
+struct sim_heat;
+struct sim_exec;
+struct xm_map;
+
+typedef struct xm_sim {
+    struct cpu_state {
+        /* Instruction pointer / Program counter */
+        uint32_t pc;
+        uint32_t flags;
+        /* Control registers */
+        uint32_t cr[16];
+        /* 16 32-bit integer registers */
+        uint32_t r[16];
+        /* 16 32-bit floating point registers */
+        float f[16];
+        /* 16 128-bit vector registers */
+        uint64_t v[16][2];
+        /* 16 matrix tile registers */
+        float tile[16][4 * 4];
+    } cpu;
+
+    sim_options_t opt;
+    FILE *log;
+
+    /* Perf counters */
+    xm_sim_perf_t perf;
+    unsigned long max_ticks;
+    /* Guest view of the perf counters: bias while counting, value while
+        stopped, indexed by control register */
+    unsigned long perf_guest[XM_CR_PERF_COUNT];
+
+    /* Body length of a loop just closed by a backwards branch, 0 if none */
+    uint32_t idiom_len;
+    cpu_idiom_t idiom[SIM_IDIOM_CACHE_SIZE];
+
+    /* Emulated memory */
+    uint8_t trap_page[PAGE_SIZE];
+    uint8_t fill_page[PAGE_SIZE]; /* All 0xff, ROM past the image */
+    uint8_t *ram;
+    size_t ram_size;
+    /* Borrowed from the embedder, never written to */
+    uint8_t const *rom;
+    size_t rom_size;
+
+    /* Devices, only looked up for addresses outside ROM and RAM */
+    struct sim_device **mmio[SIM_MMIO_L1_SIZE];
+    struct sim_device *devices;
+    /* Pending device events, binary min-heap on (tick, seq) */
+    struct sim_event *events;
+    size_t n_events;
+    size_t cap_events;
+    unsigned long event_seq;
+
+    /* Bytes per tick, 0 runs the DMA instructions synchronously */
+    unsigned dma_bandwidth;
+    struct sim_dma dma;
+
+    /* Guest file descriptors to host ones, -1 when free */
+    int sys_fd[SIM_SYS_FDS];
+    /* Offset into RAM mmap hands out regions below */
+    size_t sys_mmap_top;
+    int exit_status; /* -1 until the guest calls exit */
+
+    /* Breakpoints and watchpoints, the page maps stay NULL while there are
+        none so the checks only cost a NULL test */
+    uint8_t *bp_pages; /* Bit per page holding a breakpoint */
+    uint32_t *bps;
+    size_t n_bps;
+    uint8_t *wp_pages; /* Watched XM_SIM_WATCH_* accesses per page */
+    struct sim_watch *wps;
+    size_t n_wps;
+    xm_sim_break_t brk;
+    bool brk_hit; /* A watchpoint stopped the current xm_sim_run */
+    bool brk_resume; /* Stopped at brk.pc, run it next time */
+    xm_sim_fault_t fault;
+    bool fault_hit; /* Sticky, xm_sim_run won't run it any more */
+    bool wait_hit; /* A device asked the current xm_sim_run to yield */
+    bool perf_used; /* The guest touched the perf counters, no bare core from then on */
+
+    /* Kept up to date for the profiler's signal handler, whether it runs or not */
+    volatile uint8_t prof_where; /* SIM_PROF_*, decode means execute once prof_inst is set */
+    volatile uint16_t prof_inst; /* Index into xm_inst_table while its handler runs */
+    /* Entry of the guest function being run, the callers' ones below it.
+        Calls nested deeper than the stack only count depth. */
+    volatile uint32_t prof_func;
+    uint32_t prof_stack[SIM_PROF_STACK];
+    uint32_t prof_depth;
+
+    /* Record/replay log, NULL when neither */
+    struct sim_rr *rr;
+    /* Cache, predictor and cycle models, only with SIM_OPT_DETAILED */
+    struct sim_timing *timing;
+    /* Access counts, only with SIM_OPT_HEATMAP */
+    struct sim_heat *heat;
+    /* Executions per ROM word, only with SIM_OPT_EXEC_PROFILE */
+    struct sim_exec *exec;
+    /* Symbols and source lines of the image, NULL without a map */
+    struct xm_map *map;
+    /* Ticks spent per hashed pc, collected by xm_sim_run when not NULL */
+    unsigned long *bbv;
+    /* Pages stored to, only for the reference side of xm_lock_run */
+    struct sim_lock *lock;
+} sim_state_t;
+
+/* sim.c */
+/* Independent copy of the whole machine sharing the image, without log,
+    record/replay, heatmap, execution profile, map or host files, options
+    replaced by opt */
+sim_state_t *sim_clone(sim_state_t const* sim, unsigned opt);
+/* Host pointer for a guest range inside the ROM image or RAM, clamps len to
+    the end of the region, NULL for anything else (devices, trap page, ROM
+    writes) */
+uint8_t *cpu_translate_range(sim_state_t* sim, uint32_t a, uint64_t *len, int p);
+/* Instruction log line of the one at pc, with where it is if there's a map */
+void sim_log_inst(sim_state_t* sim, const char *name);
+/* Interpreter variants by SIM_CPU_* */
+struct sim_cpu {
+    cpu_execute_result_t (*run)(sim_state_t* sim);
+    cpu_execute_result_t (*block)(sim_state_t* sim);
+    void (*dma_retire)(sim_state_t* sim);
+};
+extern struct sim_cpu const sim_cpus[];
+/* Shared by every core, filled in by the first xm_sim_create */
+extern xm_inst_decoder_t sim_decoder;
+/* The cheapest variant that still does everything asked for */
+struct sim_cpu const* sim_cpu_select(sim_state_t const* sim);
+
+/* cpu.c, built once per variant, xm_sim_run picks one per call */
+#define SIM_CPU_BARE 0 /* Ticks only */
+#define SIM_CPU_COUNTERS 1 /* Perf counters, basic block vectors, profiler */
+#define SIM_CPU_TRACE 2 /* Everything else that watches the guest */
+/* Steps until something other than CPUE_CONTINUE or max_ticks */
+cpu_execute_result_t cpu_run_bare(sim_state_t* sim);
+cpu_execute_result_t cpu_run_counters(sim_state_t* sim);
+cpu_execute_result_t cpu_run_trace(sim_state_t* sim);
+/* Same up to and including the next control transfer, a batched loop counts
+    as one */
+cpu_execute_result_t cpu_block_bare(sim_state_t* sim);
+cpu_execute_result_t cpu_block_counters(sim_state_t* sim);
+cpu_execute_result_t cpu_block_trace(sim_state_t* sim);
+/* Completes the queued DMA transfers that are due */
+void cpu_dma_retire_bare(sim_state_t* sim);
+void cpu_dma_retire_counters(sim_state_t* sim);
+void cpu_dma_retire_trace(sim_state_t* sim);
+
+/* bus.c */
+static inline struct sim_device *sim_bus_lookup(sim_state_t const* sim, uint32_t a) {
+    struct sim_device **l2 = sim->mmio[(a / PAGE_SIZE) >> SIM_MMIO_L2_BITS];
+    return l2 != NULL ? l2[(a / PAGE_SIZE) & ((1 << SIM_MMIO_L2_BITS) - 1)] : NULL;
+}
+uint8_t sim_bus_read(sim_state_t* sim, uint32_t a);
+void sim_bus_write(sim_state_t* sim, uint32_t a, uint8_t v);
+/* Tick of the earliest pending event, ULONG_MAX if none */
+unsigned long sim_bus_next_event(sim_state_t const* sim);
+/* Runs the events that are due */
+void sim_bus_run_events(sim_state_t* sim);
+void sim_bus_destroy(sim_state_t* sim);
+
+/* rr.c */
+/* Last tick xm_sim_run may reach before sim_rr_boundary wants to run */
+unsigned long sim_rr_next_tick(sim_state_t* sim, unsigned long end);
+/* Snapshots (record) or checks against one (replay) when one is due */
+void sim_rr_boundary(sim_state_t* sim);
+/* Every value coming from outside the guest (device/MMIO reads) must pass
+    through here: it is logged when recording and replaced by the logged
+    value when replaying */
+uint32_t sim_rr_input(sim_state_t* sim, uint32_t v);
+/* Same for bulk data, buf is overwritten when replaying */
+void sim_rr_input_buf(sim_state_t* sim, void *buf, size_t len);
+/* Devices should leave the host alone then, their inputs come from the log */
+bool sim_rr_replaying(sim_state_t* sim);
+void sim_rr_close(sim_state_t* sim);
+
+/* dbg.c */
+/* true when the instruction at pc has to wait for a breakpoint, only call
+    with bp_pages set */
+bool sim_dbg_break(sim_state_t* sim);
+/* Slow path for accesses to pages with watchpoints */
+void sim_dbg_watch(sim_state_t* sim, uint32_t addr, unsigned access);
+static inline bool sim_dbg_watched(sim_state_t const* sim, uint32_t addr, unsigned access) {
+    return sim->wp_pages != NULL && (sim->wp_pages[addr / PAGE_SIZE] & access) != 0;
+}
+void sim_dbg_destroy(sim_state_t* sim);
+
+/* sys.c */
+void sim_sys_init(sim_state_t* sim);
+/* Clones keep the descriptors as SIM_SYS_FD_NULL, the host files stay with
+    the original */
+void sim_sys_detach(sim_state_t* sim);
+void sim_sys_close(sim_state_t* sim);
+/* Services the call in $t0, HALT on exit */
+cpu_execute_result_t sim_sys_call(sim_state_t* sim);
+
+/* lock.c */
+/* Every store into RAM by the trace core */
+void sim_lock_store(sim_state_t* sim, uint32_t a);
+
+/* heat.c */
+struct sim_heat *sim_heat_create(sim_state_t const* sim, unsigned long interval);
+void sim_heat_destroy(struct sim_heat *h);
+/* Every translated guest access, p as for cpu_translate */
+void sim_heat_access(sim_state_t* sim, uint32_t a, int p);
+
+/* exec.c */
+struct sim_exec *sim_exec_create(void);
+/* After every instruction the trace core executed at pc */
+void sim_exec_step(sim_state_t* sim, uint32_t pc);
+
+/* timing.c */
+struct sim_timing *sim_timing_create(void);
+struct sim_timing *sim_timing_clone(struct sim_timing const *t);
+void sim_timing_fetch(sim_state_t* sim, uint32_t pc);
+void sim_timing_data(sim_state_t* sim, uint32_t addr);
+void sim_timing_branch(sim_state_t* sim, uint32_t pc, bool taken);
+unsigned long sim_timing_cycles(sim_state_t const* sim);
+/* Cycles the core sits idle for */
+void sim_timing_stall(sim_state_t* sim, unsigned long cycles);
+/* Drops the data cache line holding addr, written behind the core's back */
+void sim_timing_invalidate(sim_state_t* sim, uint32_t addr);
@@ -0,0 +1,366 @@
+#include <stdbool.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <limits.h>
+
+#include "isa.h"
+#include "xmsim.h"
+#include "xmsched.h"
+#include "xmdev.h"
+#include "xmsample.h"
+#include "xmprof.h"
+#include "xmlock.h"
+
+#define SIM_MAIN_MAX_POINTS 16
+
+struct sim_main_ctx {
+    xm_sim_t *sim;
+    xm_sim_result_t result;
+};
+
+static void sim_main_done(xm_sim_t *sim, xm_sim_result_t result, void *user) {
+    (void)sim;
+    ((struct sim_main_ctx *)user)->result = result;
+}
+
+/* Final state, diffed across engines and options by make test */
+static void sim_main_dump(xm_sim_t *sim, uint32_t addr, uint32_t len) {
+    xm_sim_perf_t perf;
+    uint8_t line[32];
+    xm_sim_get_perf(sim, &perf);
+    printf("dump pc=%08x flags=%08x ticks=%lu b_misses=%lu b_taken=%lu jumps=%lu reads=%lu writes=%lu stalls=%lu\n",
+        xm_sim_get_pc(sim), xm_sim_get_flags(sim), perf.ticks, perf.b_misses, perf.b_taken, perf.jumps,
+        perf.reads, perf.writes, perf.stalls);
+    for (unsigned i = 0; i < 16; ++i)
+        printf("dump r%u=%08x\n", i, xm_sim_get_reg(sim, i));
+    for (uint32_t at = 0; at < len; at += sizeof(line)) {
+        size_t n = xm_sim_read_mem(sim, addr + at, line, len - at < sizeof(line) ? len - at : sizeof(line));
+        printf("dump %08x:", addr + at);
+        for (size_t j = 0; j < n; ++j)
+            printf(" %02x", line[j]);
+        printf("\n");
+    }
+}
+
+/* Runs n_ctx copies of the image across a pool of workers, each with its own
+    timer and DMA engine if asked for. Contexts polling those yield their
+    worker until the device is ready. */
+static int sim_main_sched(xm_sim_config_t const *config, uint32_t const r[],
+    uint8_t const *image, size_t image_len, unsigned long max_ticks,
+    unsigned n_workers, unsigned n_ctx, unsigned long slice, bool timer, unsigned dma)
+{
+    struct sim_main_ctx *ctx = calloc(n_ctx, sizeof(*ctx));
+    xm_sim_config_t ctx_config = *config;
+    xm_sched_t *sched = xm_sched_create(n_workers, slice);
+    int ret = EXIT_SUCCESS;
+    if (ctx == NULL || sched == NULL) {
+        fprintf(stderr, "can't create scheduler\n");
+        free(ctx);
+        return EXIT_FAILURE;
+    }
+    /* Interleaved logs from several threads are useless */
+    ctx_config.log = NULL;
+    ctx_config.opt |= XM_SIM_OPT_YIELD;
+    for (unsigned i = 0; i < n_ctx; ++i) {
+        if ((ctx[i].sim = xm_sim_create(&ctx_config)) == NULL) {
+            fprintf(stderr, "can't create context %u\n", i);
+            ret = EXIT_FAILURE;
+            break;
+        }
+        xm_sim_load_image(ctx[i].sim, image, image_len);
+        for (unsigned j = 0; j < 16; ++j)
+            xm_sim_set_reg(ctx[i].sim, j, r[j]);
+        if ((timer && xm_dev_add_timer(ctx[i].sim, XM_DEV_TIMER_BASE) != 0)
+        || (dma != 0 && xm_dev_add_dma(ctx[i].sim, XM_DEV_DMA_BASE, dma) != 0)) {
+            fprintf(stderr, "can't attach devices to context %u\n", i);
+            xm_sim_destroy(ctx[i].sim);
+            ctx[i].sim = NULL;
+            ret = EXIT_FAILURE;
+            break;
+        }
+        if (xm_sched_spawn(sched, ctx[i].sim, max_ticks, sim_main_done, &ctx[i]) != 0) {
+            fprintf(stderr, "can't spawn context %u\n", i);
+            xm_sim_destroy(ctx[i].sim);
+            ctx[i].sim = NULL;
+            ret = EXIT_FAILURE;
+            break;
+        }
+    }
+    xm_sched_destroy(sched);
+    for (unsigned i = 0; i < n_ctx && ctx[i].sim != NULL; ++i) {
+        xm_sim_perf_t perf;
+        xm_sim_get_perf(ctx[i].sim, &perf);
+        printf("ctx#%u: %s pc=%08x tick#%lu a0=%08x\n", i,
+            ctx[i].result == XM_SIM_HALT ? "halted" : ctx[i].result == XM_SIM_FAULT ? "faulted" : "stopped",
+            xm_sim_get_pc(ctx[i].sim), perf.ticks, xm_sim_get_reg(ctx[i].sim, XM_ABI_A0));
+        xm_sim_destroy(ctx[i].sim);
+    }
+    free(ctx);
+    return ret;
+}
+
+int main(int argc, char *argv[]) {
+    xm_sim_config_t config = {0};
+    xm_sim_t *sim;
+    uint32_t r[16] = {0};
+    unsigned long max_ticks = 25, slice = 0, interval = 0, seek = 0;
+    const char *record = NULL, *replay = NULL, *blk = NULL, *exec_profile = NULL, *map = NULL, *image_path = NULL;
+    char where[128];
+    bool uart = false, timer = false, lockstep = false;
+    unsigned dma = 0, prof_hz = 0;
+    xm_sample_config_t sample = {0};
+    unsigned n_workers = 0, n_ctx = 1;
+    int status;
+    const char *breaks[SIM_MAIN_MAX_POINTS]; /* Addresses or labels */
+    uint32_t watches[SIM_MAIN_MAX_POINTS][3];
+    uint32_t dump[2] = {0};
+    bool dumped = false;
+    unsigned n_breaks = 0, n_watches = 0;
+    xm_sim_perf_t perf;
+    xm_sim_fault_t fault;
+    unsigned long end;
+    uint8_t const *image = NULL;
+    size_t image_len = 0;
+    config.log = stdout;
+    for (int i = 1; i < argc; ++i) {
+        if (!strcmp(argv[i], "-quiet")) {
+            config.opt |= XM_SIM_OPT_QUIET;
+        } else if (!strcmp(argv[i], "-test")) {
+            config.opt |= XM_SIM_OPT_TEST;
+        } else if (!strcmp(argv[i], "-trace-mem")) {
+            config.opt |= XM_SIM_OPT_TRACE_MEM;
+        } else if (!strcmp(argv[i], "-no-idiom")) {
+            config.opt |= XM_SIM_OPT_NO_IDIOM;
+        } else if (!strcmp(argv[i], "-detailed")) {
+            config.opt |= XM_SIM_OPT_DETAILED;
+        } else if (!strcmp(argv[i], "-bare")) {
+            config.opt |= XM_SIM_OPT_BARE;
+        } else if (!strcmp(argv[i], "-lockstep")) {
+            lockstep = true;
+        } else if (i + 1 < argc && !strcmp(argv[i], "-break") && n_breaks < SIM_MAIN_MAX_POINTS) {
+            breaks[n_breaks++] = argv[i + 1]; ++i;
+        } else if (i + 1 < argc && !strcmp(argv[i], "-watch") && n_watches < SIM_MAIN_MAX_POINTS) {
+            /* addr[:len[:r|w|rw]] */
+            char *p = argv[i + 1];
+            watches[n_watches][0] = strtoul(p, &p, 0);
+            watches[n_watches][1] = *p == ':' ? strtoul(p + 1, &p, 0) : 1;
+            watches[n_watches][2] = *p != ':' ? XM_SIM_WATCH_R | XM_SIM_WATCH_W
+                : (strchr(p, 'r') != NULL ? XM_SIM_WATCH_R : 0) | (strchr(p, 'w') != NULL ? XM_SIM_WATCH_W : 0);
+            ++n_watches; ++i;
+        } else if (i + 1 < argc && !strcmp(argv[i], "-dump")) {
+            /* addr:len of memory to dump along with the registers */
+            char *p = argv[i + 1];
+            dump[0] = strtoul(p, &p, 0);
+            dump[1] = *p == ':' ? strtoul(p + 1, &p, 0) : 0;
+            dumped = true; ++i;
+        } else if (i + 1 < argc && !strcmp(argv[i], "-prof-sample")) {
+            prof_hz = atoi(argv[i + 1]); ++i;
+        } else if (!strcmp(argv[i], "-heatmap")) {
+            config.opt |= XM_SIM_OPT_HEATMAP;
+        } else if (i + 1 < argc && !strcmp(argv[i], "-heat-interval")) {
+            config.heat_interval = atoll(argv[i + 1]); ++i;
+        } else if (i + 1 < argc && !strcmp(argv[i], "-exec-profile")) {
+            config.opt |= XM_SIM_OPT_EXEC_PROFILE;
+            exec_profile = argv[i + 1]; ++i;
+        } else if (i + 1 < argc && !strcmp(argv[i], "-map")) {
+            map = argv[i + 1]; ++i;
+        } else if (!strcmp(argv[i], "-syscall")) {
+            config.opt |= XM_SIM_OPT_SYSCALL;
+        } else if (!strcmp(argv[i], "-bbv")) {
+            sample.select = XM_SAMPLE_BBV;
+        } else if (i + 1 < argc && !strcmp(argv[i], "-sample")) {
+            sample.n_samples = atoi(argv[i + 1]); ++i;
+        } else if (i + 1 < argc && !strcmp(argv[i], "-interval")) {
+            sample.interval = atoll(argv[i + 1]); ++i;
+        } else if (i + 1 < argc && !strcmp(argv[i], "-warmup")) {
+            sample.warmup = atoll(argv[i + 1]); ++i;
+        } else if (!strcmp(argv[i], "-uart")) {
+            uart = true;
+        } else if (!strcmp(argv[i], "-timer")) {
+            timer = true;
+        } else if (i + 1 < argc && !strcmp(argv[i], "-dma")) {
+            dma = atoi(argv[i + 1]); ++i;
+        } else if (i + 1 < argc && !strcmp(argv[i], "-async-dma")) {
+            config.dma_bandwidth = atoi(argv[i + 1]); ++i;
+        } else if (i + 1 < argc && !strcmp(argv[i], "-blk")) {
+            blk = argv[i + 1]; ++i;
+        } else if (!strcmp(argv[i], "-t0")) {
+            r[XM_ABI_T0] = XM_SIM_RAM_BASE;
+        } else if (!strcmp(argv[i], "-ra")) {
+            r[XM_ABI_RA] = XM_SIM_ROM_BASE;
+        } else if (i + 1 < argc && !strcmp(argv[i], "-ticks")) {
+            max_ticks = atoll(argv[i + 1]); ++i;
+        } else if (i + 1 < argc && !strcmp(argv[i], "-workers")) {
+            n_workers = atoi(argv[i + 1]); ++i;
+        } else if (i + 1 < argc && !strcmp(argv[i], "-contexts")) {
+            n_ctx = atoi(argv[i + 1]); ++i;
+        } else if (i + 1 < argc && !strcmp(argv[i], "-slice")) {
+            slice = atoll(argv[i + 1]); ++i;
+        } else if (i + 1 < argc && !strcmp(argv[i], "-record")) {
+            record = argv[i + 1]; ++i;
+        } else if (i + 1 < argc && !strcmp(argv[i], "-replay")) {
+            replay = argv[i + 1]; ++i;
+        } else if (i + 1 < argc && !strcmp(argv[i], "-snapshot-interval")) {
+            interval = atoll(argv[i + 1]); ++i;
+        } else if (i + 1 < argc && !strcmp(argv[i], "-seek")) {
+            seek = atoll(argv[i + 1]); ++i;
+        } else if (i + 1 < argc && !strcmp(argv[i], "-a0")) {
+            r[XM_ABI_A0] = atoll(argv[i + 1]); ++i;
+        } else if (i + 1 < argc && !strcmp(argv[i], "-a1")) {
+            r[XM_ABI_A1] = atoll(argv[i + 1]); ++i;
+        } else if (i + 1 < argc && !strcmp(argv[i], "-a2")) {
+            r[XM_ABI_A2] = atoll(argv[i + 1]); ++i;
+        } else if (i + 1 < argc && !strcmp(argv[i], "-a3")) {
+            r[XM_ABI_A3] = atoll(argv[i + 1]); ++i;
+        } else {
+            uint8_t const *p;
+            size_t len;
+            if ((p = xm_sim_map_image(argv[i], &len)) != NULL) {
+                xm_sim_unmap_image(image, image_len);
+                image = p;
+                image_len = len;
+                image_path = argv[i];
+                printf("%s: rom mapped %lu bytes\n", argv[i], (unsigned long)image_len);
+            }
+        }
+    }
+
+    if (n_workers != 0 && sample.n_samples == 0) {
+        /* Contexts only get the timer and DMA engine, refuse what they'd drop */
+        char const *dropped = uart ? "-uart" : blk != NULL ? "-blk"
+            : record != NULL ? "-record" : replay != NULL ? "-replay" : lockstep ? "-lockstep"
+            : n_breaks != 0 ? "-break" : n_watches != 0 ? "-watch"
+            : prof_hz != 0 ? "-prof-sample" : exec_profile != NULL ? "-exec-profile" : NULL;
+        if (dropped != NULL) {
+            fprintf(stderr, "%s: -workers can't be combined with %s\n", argv[0], dropped);
+            xm_sim_unmap_image(image, image_len);
+            return EXIT_FAILURE;
+        }
+        int ret = sim_main_sched(&config, r, image, image_len, max_ticks, n_workers, n_ctx, slice, timer, dma);
+        xm_sim_unmap_image(image, image_len);
+        return ret;
+    }
+
+    if ((sim = xm_sim_create(&config)) == NULL) {
+        fprintf(stderr, "%s: can't create simulator\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+    xm_sim_load_image(sim, image, image_len);
+    if (map != NULL && xm_sim_load_map(sim, map) != 0)
+        fprintf(stderr, "%s: %s isn't a map of the image\n", argv[0], map);
+    else if (map == NULL && image_path != NULL) {
+        /* The one xm_asm or xm_ld wrote next to it, if any */
+        char *path = malloc(strlen(image_path) + sizeof(".map"));
+        if (path != NULL)
+            xm_sim_load_map(sim, strcat(strcpy(path, image_path), ".map"));
+        free(path);
+    }
+    for (unsigned i = 0; i < 16; ++i)
+        xm_sim_set_reg(sim, i, r[i]);
+    if ((uart && xm_dev_add_uart(sim, XM_DEV_UART_BASE, stdin, stdout) != 0)
+    || (timer && xm_dev_add_timer(sim, XM_DEV_TIMER_BASE) != 0)
+    || (dma != 0 && xm_dev_add_dma(sim, XM_DEV_DMA_BASE, dma) != 0)
+    || (blk != NULL && xm_dev_add_blk(sim, XM_DEV_BLK_BASE, blk) != 0)) {
+        fprintf(stderr, "%s: can't attach devices\n", argv[0]);
+        xm_sim_destroy(sim);
+        xm_sim_unmap_image(image, image_len);
+        return EXIT_FAILURE;
+    }
+    if (record != NULL && xm_sim_record(sim, record, interval) != 0) {
+        fprintf(stderr, "%s: can't record to %s\n", argv[0], record);
+        xm_sim_destroy(sim);
+        xm_sim_unmap_image(image, image_len);
+        return EXIT_FAILURE;
+    }
+    if (replay != NULL && (xm_sim_replay(sim, replay) != 0 || (seek != 0 && xm_sim_seek(sim, seek) != 0))) {
+        fprintf(stderr, "%s: can't replay %s\n", argv[0], replay);
+        xm_sim_destroy(sim);
+        xm_sim_unmap_image(image, image_len);
+        return EXIT_FAILURE;
+    }
+
+    if (sample.n_samples != 0) {
+        xm_sample_result_t res;
+        sample.max_ticks = max_ticks;
+        sample.n_workers = n_workers;
+        if (xm_sample_run(sim, &sample, &res) != 0)
+            fprintf(stderr, "%s: sampling failed\n", argv[0]);
+        printf("sampled %u/%u intervals of %lu ticks: cycles=%lu cpi=%.3f i$miss=%.4f d$miss=%.4f bmiss=%.4f\n",
+            res.n_samples, res.n_intervals, res.ticks, res.cycles, res.cpi,
+            res.icache_miss_rate, res.dcache_miss_rate, res.b_mispredict_rate);
+        xm_sim_destroy(sim);
+        xm_sim_unmap_image(image, image_len);
+        return EXIT_SUCCESS;
+    }
+
+    for (unsigned i = 0; i < n_breaks; ++i) {
+        char *e;
+        uint32_t pc = strtoul(breaks[i], &e, 0);
+        if ((*e != '\0' && xm_sim_lookup(sim, breaks[i], &pc) != 0) || xm_sim_break_set(sim, pc) != 0)
+            fprintf(stderr, "%s: can't set breakpoint at %s\n", argv[0], breaks[i]);
+    }
+    for (unsigned i = 0; i < n_watches; ++i)
+        if (xm_sim_watch_set(sim, watches[i][0], watches[i][1], watches[i][2]) != 0)
+            fprintf(stderr, "%s: can't watch %x\n", argv[0], watches[i][0]);
+
+    if (lockstep) {
+        int diverged = xm_lock_run(sim, max_ticks, stdout);
+        if (diverged < 0)
+            fprintf(stderr, "%s: can't run in lockstep\n", argv[0]);
+        xm_sim_destroy(sim);
+        xm_sim_unmap_image(image, image_len);
+        return diverged == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+
+    xm_sim_debug_print(sim);
+    if (prof_hz != 0 && xm_prof_start(sim, prof_hz) != 0)
+        fprintf(stderr, "%s: can't start the profiler\n", argv[0]);
+    /* Report every stop and carry on */
+    xm_sim_get_perf(sim, &perf);
+    end = max_ticks > ULONG_MAX - perf.ticks ? ULONG_MAX : perf.ticks + max_ticks;
+    while (perf.ticks < end && xm_sim_run(sim, end - perf.ticks) == XM_SIM_BREAK) {
+        xm_sim_break_t b;
+        xm_sim_get_break(sim, &b);
+        xm_sim_get_perf(sim, &perf);
+        xm_sim_symbolize(sim, b.pc, where, sizeof(where));
+        if (b.access == 0)
+            printf("break at %8x tick#%lu%s%s\n", b.pc, perf.ticks, where[0] != '\0' ? " " : "", where);
+        else
+            printf("watch %c %8x at %8x tick#%lu%s%s\n", b.access == XM_SIM_WATCH_R ? 'r' : 'w', b.addr, b.pc,
+                perf.ticks, where[0] != '\0' ? " " : "", where);
+    }
+    if (xm_sim_get_fault(sim, &fault) == 0) {
+        xm_sim_get_perf(sim, &perf);
+        xm_sim_symbolize(sim, fault.pc, where, sizeof(where));
+        printf("fault: store to rom %8x at %8x tick#%lu%s%s\n", fault.addr, fault.pc, perf.ticks,
+            where[0] != '\0' ? " " : "", where);
+    }
+    xm_prof_stop(sim, stdout);
+    xm_sim_heat_report(sim, stdout);
+    if (exec_profile != NULL) {
+        FILE *f = fopen(exec_profile, "w");
+        bool failed = f == NULL || xm_sim_exec_profile_write(sim, f) != 0;
+        if ((f != NULL && fclose(f) != 0) || failed)
+            fprintf(stderr, "%s: can't write %s\n", argv[0], exec_profile);
+    }
+    if ((config.opt & XM_SIM_OPT_DETAILED) != 0) {
+        xm_sim_timing_t t;
+        xm_sim_get_timing(sim, &t);
+        printf("detailed %lu ticks: cycles=%lu cpi=%.3f i$miss=%.4f d$miss=%.4f bmiss=%.4f\n",
+            t.insts, t.cycles, t.insts ? (double)t.cycles / t.insts : 0.,
+            t.icache_accesses ? (double)t.icache_misses / t.icache_accesses : 0.,
+            t.dcache_accesses ? (double)t.dcache_misses / t.dcache_accesses : 0.,
+            t.branches ? (double)t.b_mispredicts / t.branches : 0.);
+    }
+    if (dumped)
+        sim_main_dump(sim, dump[0], dump[1]);
+
+    /* Programs that exit through the syscall decide the status */
+    status = xm_sim_get_fault(sim, &fault) == 0 ? EXIT_FAILURE : xm_sim_get_exit_status(sim);
+    xm_sim_destroy(sim);
+    xm_sim_unmap_image(image, image_len);
+    return status != -1 ? status : EXIT_SUCCESS;
+}
@@ -0,0 +1,214 @@
+#include <stdbool.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <limits.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "isa.h"
+#include "xmsim.h"
+#include "sim.h"
+
+/* Syscall passthrough
+    Calls go straight to the host, reads and writes between host files and
+    guest RAM through the translated pointers. Guest file descriptors index
+    sys_fd, so the guest only reaches what it opened itself plus stdio.
+    Results and read data are inputs for record/replay, which replays them
+    without touching the host besides stdout and stderr. */
+
+static int32_t sys_error(int e) {
+    switch (e) {
+    case EPERM: return -XM_SYS_EPERM;
+    case ENOENT: return -XM_SYS_ENOENT;
+    case EBADF: return -XM_SYS_EBADF;
+    case ENOMEM: return -XM_SYS_ENOMEM;
+    case EACCES: return -XM_SYS_EACCES;
+    case EFAULT: return -XM_SYS_EFAULT;
+    case EEXIST: return -XM_SYS_EEXIST;
+    case EISDIR: return -XM_SYS_EISDIR;
+    case EINVAL: return -XM_SYS_EINVAL;
+    case EMFILE: case ENFILE: return -XM_SYS_EMFILE;
+    case ENOSPC: return -XM_SYS_ENOSPC;
+    default: return -XM_SYS_EIO;
+    }
+}
+
+static int sys_open_flags(uint32_t f) {
+    int flags = (f & 3) == XM_SYS_O_WRONLY ? O_WRONLY : (f & 3) == XM_SYS_O_RDWR ? O_RDWR : O_RDONLY;
+    flags |= (f & XM_SYS_O_CREAT) != 0 ? O_CREAT : 0;
+    flags |= (f & XM_SYS_O_TRUNC) != 0 ? O_TRUNC : 0;
+    flags |= (f & XM_SYS_O_APPEND) != 0 ? O_APPEND : 0;
+    return flags;
+}
+
+/* Host fd behind a guest one, -1 if it isn't open */
+static int sys_fd(sim_state_t* sim, uint32_t fd) {
+    return fd < SIM_SYS_FDS ? sim->sys_fd[fd] : -1;
+}
+
+static int32_t sys_read(sim_state_t* sim, uint32_t fd, uint32_t buf, uint32_t len) {
+    int hfd = sys_fd(sim, fd);
+    uint64_t n = len;
+    uint8_t *p = len != 0 ? cpu_translate_range(sim, buf, &n, XM_PAGE_W) : NULL;
+    ssize_t r = 0;
+    if (hfd == -1)
+        return -XM_SYS_EBADF;
+    if (len != 0 && p == NULL)
+        return -XM_SYS_EFAULT;
+    if (!sim_rr_replaying(sim) && hfd != SIM_SYS_FD_NULL && n != 0)
+        r = read(hfd, p, n);
+    r = (int32_t)sim_rr_input(sim, r < 0 ? (uint32_t)sys_error(errno) : (uint32_t)r);
+    if (r > 0)
+        sim_rr_input_buf(sim, p, r);
+    return r;
+}
+
+static int32_t sys_write(sim_state_t* sim, uint32_t fd, uint32_t buf, uint32_t len) {
+    int hfd = sys_fd(sim, fd);
+    uint64_t n = len;
+    uint8_t const *p = len != 0 ? cpu_translate_range(sim, buf, &n, XM_PAGE_R) : NULL;
+    ssize_t r = n;
+    if (hfd == -1)
+        return -XM_SYS_EBADF;
+    if (len != 0 && p == NULL)
+        return -XM_SYS_EFAULT;
+    /* Output still shows up when replaying, after what stdio buffered */
+    if (hfd == STDOUT_FILENO || hfd == STDERR_FILENO)
+        fflush(hfd == STDOUT_FILENO ? stdout : stderr);
+    if ((!sim_rr_replaying(sim) || hfd == STDOUT_FILENO || hfd == STDERR_FILENO)
+    && hfd != SIM_SYS_FD_NULL && n != 0)
+        r = write(hfd, p, n);
+    return (int32_t)sim_rr_input(sim, r < 0 ? (uint32_t)sys_error(errno) : (uint32_t)r);
+}
+
+static int32_t sys_open(sim_state_t* sim, uint32_t path, uint32_t flags, uint32_t mode) {
+    uint64_t n = PATH_MAX;
+    char const *p = (char const *)cpu_translate_range(sim, path, &n, XM_PAGE_R);
+    uint32_t fd = 0;
+    int hfd = SIM_SYS_FD_NULL;
+    int32_t r;
+    /* The path must be terminated inside the region */
+    if (p == NULL || memchr(p, '\0', n) == NULL)
+        return -XM_SYS_EFAULT;
+    while (fd < SIM_SYS_FDS && sim->sys_fd[fd] != -1)
+        ++fd;
+    if (fd == SIM_SYS_FDS)
+        return -XM_SYS_EMFILE;
+    if (!sim_rr_replaying(sim) && (hfd = open(p, sys_open_flags(flags), (mode_t)mode)) == -1)
+        r = sys_error(errno);
+    else
+        r = (int32_t)fd;
+    if ((r = (int32_t)sim_rr_input(sim, (uint32_t)r)) < 0 || (uint32_t)r >= SIM_SYS_FDS) {
+        if (hfd >= 0)
+            close(hfd);
+        return r < 0 ? r : -XM_SYS_EMFILE;
+    }
+    sim->sys_fd[r] = hfd;
+    return r;
+}
+
+static int32_t sys_close(sim_state_t* sim, uint32_t fd) {
+    int hfd = sys_fd(sim, fd);
+    if (hfd == -1)
+        return -XM_SYS_EBADF;
+    /* stdio stays open on the host */
+    if (hfd > STDERR_FILENO && !sim_rr_replaying(sim))
+        close(hfd);
+    sim->sys_fd[fd] = -1;
+    return 0;
+}
+
+/* Regions are handed out downwards from the end of RAM, never reclaimed.
+    With a file they hold a private copy of it. */
+static int32_t sys_mmap(sim_state_t* sim, uint32_t len, uint32_t fd, uint32_t offset) {
+    uint64_t size = ((uint64_t)len + PAGE_SIZE - 1) / PAGE_SIZE * PAGE_SIZE;
+    int hfd = fd != UINT32_MAX ? sys_fd(sim, fd) : SIM_SYS_FD_NULL;
+    uint8_t *p;
+    ssize_t r = 0;
+    if (len == 0)
+        return -XM_SYS_EINVAL;
+    if (hfd == -1)
+        return -XM_SYS_EBADF;
+    if (size > sim->sys_mmap_top)
+        return -XM_SYS_ENOMEM;
+    sim->sys_mmap_top -= size;
+    p = sim->ram + sim->sys_mmap_top;
+    memset(p, 0, size);
+    if (fd != UINT32_MAX) {
+        if (!sim_rr_replaying(sim) && hfd != SIM_SYS_FD_NULL)
+            r = pread(hfd, p, len, offset);
+        if ((r = (int32_t)sim_rr_input(sim, r < 0 ? (uint32_t)sys_error(errno) : (uint32_t)r)) < 0) {
+            sim->sys_mmap_top += size;
+            return r;
+        }
+        sim_rr_input_buf(sim, p, r);
+    }
+    return (int32_t)(SIM_RAM_BASE + sim->sys_mmap_top);
+}
+
+static int32_t sys_clock_gettime(sim_state_t* sim, uint32_t clock, uint32_t ts) {
+    struct timespec t = {0};
+    uint8_t buf[8];
+    uint32_t sec, nsec;
+    if (clock != XM_SYS_CLOCK_REALTIME && clock != XM_SYS_CLOCK_MONOTONIC)
+        return -XM_SYS_EINVAL;
+    if (!sim_rr_replaying(sim))
+        clock_gettime(clock == XM_SYS_CLOCK_REALTIME ? CLOCK_REALTIME : CLOCK_MONOTONIC, &t);
+    sec = sim_rr_input(sim, (uint32_t)t.tv_sec);
+    nsec = sim_rr_input(sim, (uint32_t)t.tv_nsec);
+    /* Least significant byte first, as stl stores them */
+    for (unsigned i = 0; i < 4; ++i) {
+        buf[i] = sec >> (i * 8);
+        buf[4 + i] = nsec >> (i * 8);
+    }
+    return xm_sim_write_mem(sim, ts, buf, sizeof(buf)) == sizeof(buf) ? 0 : -XM_SYS_EFAULT;
+}
+
+void sim_sys_init(sim_state_t* sim) {
+    for (unsigned i = 0; i < SIM_SYS_FDS; ++i)
+        sim->sys_fd[i] = i <= STDERR_FILENO ? (int)i : -1;
+    sim->sys_mmap_top = sim->ram_size;
+    sim->exit_status = -1;
+}
+
+void sim_sys_detach(sim_state_t* sim) {
+    for (unsigned i = 0; i < SIM_SYS_FDS; ++i)
+        if (sim->sys_fd[i] != -1)
+            sim->sys_fd[i] = SIM_SYS_FD_NULL;
+}
+
+void sim_sys_close(sim_state_t* sim) {
+    for (unsigned i = 0; i < SIM_SYS_FDS; ++i)
+        if (sim->sys_fd[i] > STDERR_FILENO)
+            close(sim->sys_fd[i]);
+}
+
+cpu_execute_result_t sim_sys_call(sim_state_t* sim) {
+    uint32_t *r = sim->cpu.r;
+    uint32_t a0 = r[XM_ABI_A0], a1 = r[XM_ABI_A1], a2 = r[XM_ABI_A2];
+    int32_t ret;
+    if ((sim->opt & SIM_OPT_SYSCALL) == 0) {
+        r[XM_ABI_A0] = (uint32_t)-XM_SYS_ENOSYS;
+        return CPUE_CONTINUE;
+    }
+    switch (r[XM_ABI_T0]) {
+    case XM_SYS_EXIT:
+        sim->exit_status = (int)(a0 & 0xff);
+        SIM_LOG(sim, "exited with %d\n", sim->exit_status);
+        return CPUE_HALT;
+    case XM_SYS_READ: ret = sys_read(sim, a0, a1, a2); break;
+    case XM_SYS_WRITE: ret = sys_write(sim, a0, a1, a2); break;
+    case XM_SYS_OPEN: ret = sys_open(sim, a0, a1, a2); break;
+    case XM_SYS_CLOSE: ret = sys_close(sim, a0); break;
+    case XM_SYS_MMAP: ret = sys_mmap(sim, a0, a1, a2); break;
+    case XM_SYS_CLOCK_GETTIME: ret = sys_clock_gettime(sim, a0, a1); break;
+    default: ret = -XM_SYS_ENOSYS; break;
+    }
+    r[XM_ABI_A0] = (uint32_t)ret;
+    return CPUE_CONTINUE;
+}
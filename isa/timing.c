@@ -0,0 +1,125 @@
+#include <stdbool.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+
+#include "isa.h"
+#include "xmsim.h"
+#include "sim.h"
+
+/* Detailed mode timing model
+    Split 16KB 4-way L1 caches with 64 byte lines and LRU replacement, a
+    bimodal predictor for conditional branches, and an in-order core retiring
+    one instruction per cycle plus the stalls below. */
+
+#define TIMING_LINE_BITS 6
+#define TIMING_SETS 64
+#define TIMING_WAYS 4
+#define TIMING_VALID 0x80000000
+#define TIMING_MISS_PENALTY 20
+#define TIMING_BPRED_SIZE 1024
+#define TIMING_MISPREDICT_PENALTY 8
+
+struct timing_cache {
+    uint32_t tag[TIMING_SETS][TIMING_WAYS]; /* Line address | TIMING_VALID */
+    uint32_t age[TIMING_SETS][TIMING_WAYS];
+    uint32_t clock;
+};
+
+struct sim_timing {
+    struct timing_cache icache;
+    struct timing_cache dcache;
+    uint8_t bpred[TIMING_BPRED_SIZE]; /* 2-bit saturating, taken when >= 2 */
+    xm_sim_timing_t stats;
+};
+
+/* true on a hit, fills the line otherwise */
+static bool timing_cache_access(struct timing_cache *c, uint32_t addr) {
+    uint32_t line = addr >> TIMING_LINE_BITS;
+    uint32_t set = line % TIMING_SETS, tag = line | TIMING_VALID;
+    unsigned victim = 0;
+    ++c->clock;
+    for (unsigned i = 0; i < TIMING_WAYS; ++i) {
+        if (c->tag[set][i] == tag) {
+            c->age[set][i] = c->clock;
+            return true;
+        }
+        if (c->age[set][i] < c->age[set][victim])
+            victim = i;
+    }
+    c->tag[set][victim] = tag;
+    c->age[set][victim] = c->clock;
+    return false;
+}
+
+struct sim_timing *sim_timing_create(void) {
+    struct sim_timing *t = calloc(1, sizeof(*t));
+    if (t != NULL)
+        memset(t->bpred, 1, sizeof(t->bpred)); /* Weakly not taken */
+    return t;
+}
+
+struct sim_timing *sim_timing_clone(struct sim_timing const *t) {
+    struct sim_timing *c = malloc(sizeof(*c));
+    if (c != NULL)
+        *c = *t;
+    return c;
+}
+
+void sim_timing_fetch(sim_state_t* sim, uint32_t pc) {
+    struct sim_timing *t = sim->timing;
+    ++t->stats.insts;
+    ++t->stats.cycles;
+    ++t->stats.icache_accesses;
+    if (!timing_cache_access(&t->icache, pc)) {
+        ++t->stats.icache_misses;
+        t->stats.cycles += TIMING_MISS_PENALTY;
+    }
+}
+
+void sim_timing_data(sim_state_t* sim, uint32_t addr) {
+    struct sim_timing *t = sim->timing;
+    ++t->stats.dcache_accesses;
+    if (!timing_cache_access(&t->dcache, addr)) {
+        ++t->stats.dcache_misses;
+        t->stats.cycles += TIMING_MISS_PENALTY;
+    }
+}
+
+void sim_timing_branch(sim_state_t* sim, uint32_t pc, bool taken) {
+    struct sim_timing *t = sim->timing;
+    uint8_t *ctr = &t->bpred[(pc >> 2) % TIMING_BPRED_SIZE];
+    ++t->stats.branches;
+    if ((*ctr >= 2) != taken) {
+        ++t->stats.b_mispredicts;
+        t->stats.cycles += TIMING_MISPREDICT_PENALTY;
+    }
+    if (taken && *ctr < 3)
+        ++*ctr;
+    else if (!taken && *ctr > 0)
+        --*ctr;
+}
+
+unsigned long sim_timing_cycles(sim_state_t const* sim) {
+    return sim->timing->stats.cycles;
+}
+
+void sim_timing_stall(sim_state_t* sim, unsigned long cycles) {
+    sim->timing->stats.cycles += cycles;
+}
+
+void sim_timing_invalidate(sim_state_t* sim, uint32_t addr) {
+    struct timing_cache *c = &sim->timing->dcache;
+    uint32_t line = addr >> TIMING_LINE_BITS;
+    for (unsigned i = 0; i < TIMING_WAYS; ++i)
+        if (c->tag[line % TIMING_SETS][i] == (line | TIMING_VALID))
+            c->tag[line % TIMING_SETS][i] = 0;
+}
+
+void xm_sim_get_timing(const xm_sim_t *sim, xm_sim_timing_t *timing) {
+    if (sim->timing != NULL)
+        *timing = sim->timing->stats;
+    else
+        memset(timing, 0, sizeof(*timing));
+}
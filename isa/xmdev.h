@@ -0,0 +1,58 @@
+#pragma once
+
+/* Memory mapped devices for libxmsim
+    Devices own whole pages outside ROM and RAM, only accesses that miss both
+    look them up. Registers are byte wide since the core splits every access
+    into bytes, wider fields span consecutive bytes, least significant first
+    as stl stores them. Devices never get polled: they schedule an event for
+    the tick they next need to do something at. */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stddef.h>
+
+#include "xmsim.h"
+
+#define XM_DEV_BASE 0xE0000000
+#define XM_DEV_UART_BASE (XM_DEV_BASE + 0x0000)
+#define XM_DEV_TIMER_BASE (XM_DEV_BASE + 0x2000)
+#define XM_DEV_BLK_BASE (XM_DEV_BASE + 0x4000)
+#define XM_DEV_DMA_BASE (XM_DEV_BASE + 0x6000)
+
+typedef struct xm_dev_ops {
+    /* off is relative to the base the device was mapped at */
+    uint8_t (*read)(xm_sim_t *sim, void *dev, uint32_t off);
+    void (*write)(xm_sim_t *sim, void *dev, uint32_t off, uint8_t v);
+    void (*destroy)(void *dev); /* May be NULL */
+} xm_dev_ops_t;
+
+/* Maps [base, base + size) rounded out to whole pages, fails if any of it is
+    ROM, RAM or another device. sim owns dev from then on, even on failure. */
+int xm_dev_map(xm_sim_t *sim, uint32_t base, uint32_t size, const xm_dev_ops_t *ops, void *dev);
+
+typedef void (*xm_dev_event_fn)(xm_sim_t *sim, void *dev);
+/* Calls fn between two instructions once the guest reaches tick, right away
+    for ticks already past. Events of the same tick run in scheduling order. */
+int xm_dev_schedule(xm_sim_t *sim, unsigned long tick, xm_dev_event_fn fn, void *dev);
+unsigned long xm_dev_now(const xm_sim_t *sim);
+
+/* Everything a device takes from the host must pass through these so record
+    and replay see it, the value/buffer is replaced by the logged one when
+    replaying */
+uint32_t xm_dev_input(xm_sim_t *sim, uint32_t v);
+void xm_dev_input_buf(xm_sim_t *sim, void *buf, size_t len);
+
+/* For register reads that find nothing ready yet (no input, timer not
+    expired): under XM_SIM_OPT_YIELD the current xm_sim_run returns once the
+    instruction finishes, so a scheduler can run another context meanwhile */
+void xm_dev_wait(xm_sim_t *sim);
+
+/* Built in devices, see the register maps in README.md. in may be NULL,
+    the UART polls and reads it through its descriptor so the simulator
+    never waits on the host for input. */
+int xm_dev_add_uart(xm_sim_t *sim, uint32_t base, FILE *in, FILE *out);
+int xm_dev_add_timer(xm_sim_t *sim, uint32_t base);
+/* Backed by the host file at path, opened read/write */
+int xm_dev_add_blk(xm_sim_t *sim, uint32_t base, const char *path);
+/* Copies bytes_per_tick bytes every tick in the background */
+int xm_dev_add_dma(xm_sim_t *sim, uint32_t base, unsigned bytes_per_tick);
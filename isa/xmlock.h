@@ -0,0 +1,23 @@
+#pragma once
+
+/* Lockstep differential execution for libxmsim
+    Runs sim on the engine its options pick (loop batching, the bare core)
+    next to a copy on the reference interpreter, every check compiled in and
+    no batching. At every block boundary of sim, after a control transfer or
+    a batched loop, the copy catches up to the same tick and pc, registers,
+    flags, halt and ROM faults are compared, as are the RAM pages the
+    reference stored to meanwhile. The whole RAM is compared every
+    XM_LOCK_FULL_BLOCKS blocks and at the end, catching stores only the
+    engine made. */
+
+#include <stdio.h>
+
+#include "xmsim.h"
+
+#define XM_LOCK_FULL_BLOCKS 65536
+
+/* Runs sim up to ticks or halt. Returns 0 when both sides agreed all along,
+    1 after the first divergence, which is written to out with both states,
+    -1 if sim has devices, host syscalls, breakpoints, watchpoints or
+    record/replay, or on allocation failure. sim stays where it diverged. */
+int xm_lock_run(xm_sim_t *sim, unsigned long ticks, FILE *out);
@@ -0,0 +1,87 @@
+#pragma once
+
+/* Symbol and source line maps, written next to an image as <image>.map by
+    xm_asm and xm_ld
+    Laid out like xmobj.h: a header, then the tables it points at, every one
+    4 byte aligned and made of 32 bit little endian fields, so a mapped file
+    is searched in place. Both tables are sorted by address. Names are
+    (offset, length) into the string table, not NUL terminated. */
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define XM_MAP_MAGIC 0x314d4d58 /* "XMM1" */
+
+/* Symbol flags */
+#define XM_MAP_GLOBAL (1 << 0)
+
+/* Line flags */
+#define XM_MAP_DATA (1 << 0) /* Data put in with the code, not instructions */
+
+struct xm_map_header {
+    uint32_t magic;
+    uint32_t base; /* Address the image is loaded at */
+    uint32_t size; /* Of the image */
+    uint32_t n_symbols;
+    uint32_t symbols; /* File offsets */
+    uint32_t n_lines;
+    uint32_t lines;
+    uint32_t n_files;
+    uint32_t files;
+    uint32_t strings;
+    uint32_t strings_len;
+};
+
+/* Covers [addr, addr + size), up to the next symbol or the end of the image.
+    Labels at the same address come globals first. */
+struct xm_map_symbol {
+    uint32_t name;
+    uint32_t name_len;
+    uint32_t addr;
+    uint32_t size;
+    uint32_t flags;
+};
+
+/* Covers from addr up to the next one or the end of the image. Line 0 is
+    none, padding, literal pools and jumps the assembler added. */
+struct xm_map_line {
+    uint32_t addr;
+    uint32_t file;
+    uint32_t line;
+    uint32_t flags;
+};
+
+struct xm_map_file {
+    uint32_t name;
+    uint32_t name_len;
+};
+
+typedef struct xm_map {
+    const uint8_t *p;
+    size_t len;
+    struct xm_map_header h;
+    const struct xm_map_symbol *symbols;
+    const struct xm_map_line *lines;
+    const struct xm_map_file *files;
+    const char *strings;
+} xm_map_t;
+
+/* Writes the map of an image of size bytes at base, sorting the symbols and
+    working out their sizes. lines come sorted, names of symbols and files
+    are into strings. 0 on success, -1 otherwise. */
+int xm_map_write(const char *path, uint32_t base, uint32_t size,
+    struct xm_map_symbol *symbols, size_t n_symbols, struct xm_map_line const* lines, size_t n_lines,
+    struct xm_map_file const* files, size_t n_files, const char *strings, size_t strings_len);
+
+/* Maps the file at path read-only, NULL unless it's a well formed map */
+xm_map_t *xm_map_open(const char *path);
+void xm_map_close(xm_map_t *map);
+
+/* Of addr, NULL if it's outside of any */
+const struct xm_map_symbol *xm_map_symbol_at(xm_map_t const* map, uint32_t addr);
+const struct xm_map_line *xm_map_line_at(xm_map_t const* map, uint32_t addr);
+/* The symbol called name, NULL if there's none */
+const struct xm_map_symbol *xm_map_find(xm_map_t const* map, const char *name, size_t len);
+/* addr as "label+0x10 file.S:12", whichever parts are known, like snprintf.
+    Nothing if addr is in neither a symbol nor a line. */
+int xm_map_format(xm_map_t const* map, uint32_t addr, char *buf, size_t len);
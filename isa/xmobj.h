@@ -0,0 +1,63 @@
+#pragma once
+
+/* Relocatable objects, written by xm_asm -c and linked by xm_ld
+    A header, then the tables it points at, every one 4 byte aligned and made
+    of 32 bit little endian fields, so a mapped object is used in place.
+    Names are (offset, length) into the string table, not NUL terminated. */
+
+#include <stdint.h>
+
+#define XM_OBJ_MAGIC 0x314f4d58 /* "XMO1" */
+
+/* Symbol section of an undefined symbol */
+#define XM_OBJ_UNDEF 0xffffffffu
+
+/* Symbol flags */
+#define XM_OBJ_GLOBAL (1 << 0) /* Visible to, or looked up in, other objects */
+
+/* The relocated field is found from the offset of the instruction, P is
+    the address of the instruction, S the one of the symbol plus addend */
+enum xm_obj_reloc_type {
+    XM_RELOC_REL8, /* Byte 2, S - P, bz/b... */
+    XM_RELOC_REL16, /* Bytes 1-2 big endian, S - P, jmprel */
+    XM_RELOC_ABS16, /* Bytes 1-2 big endian, S, jmp */
+    XM_RELOC_ABS32, /* Bytes 0-3 big endian, S, data */
+    XM_RELOC_ADDR, /* Byte 6 S >> 10, byte 14 (S & 0x3ff) / 4, ldl =label */
+};
+
+struct xm_obj_header {
+    uint32_t magic;
+    uint32_t n_sections;
+    uint32_t sections; /* File offsets */
+    uint32_t n_symbols;
+    uint32_t symbols;
+    uint32_t n_relocs;
+    uint32_t relocs;
+    uint32_t strings;
+    uint32_t strings_len;
+};
+
+struct xm_obj_section {
+    uint32_t name;
+    uint32_t name_len;
+    uint32_t offset; /* Of the contents in the file */
+    uint32_t size;
+    uint32_t align; /* Power of two */
+};
+
+struct xm_obj_symbol {
+    uint32_t name;
+    uint32_t name_len;
+    uint32_t hash; /* FNV-1a of the name */
+    uint32_t section; /* XM_OBJ_UNDEF if it's defined elsewhere */
+    uint32_t value; /* Offset into the section */
+    uint32_t flags;
+};
+
+struct xm_obj_reloc {
+    uint32_t section;
+    uint32_t offset;
+    uint32_t symbol;
+    uint32_t type;
+    int32_t addend;
+};
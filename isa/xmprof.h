@@ -0,0 +1,19 @@
+#pragma once
+
+/* Sampling profiler for libxmsim
+    A host interval timer (SIGPROF) interrupts the simulator hz times per
+    second of host CPU time and notes the guest pc, guest function, the
+    instruction handler running and the simulator subsystem it is in. The
+    report splits host time by each of them, nothing is counted in between
+    samples. Process wide, one sim at a time. */
+
+#include <stdio.h>
+
+#include "xmsim.h"
+
+/* hz 0 uses a default. Returns 0 on success, -1 if a profile is already
+    running or the timer can't be set up. */
+int xm_prof_start(xm_sim_t *sim, unsigned hz);
+/* Stops sampling and writes the report to out unless it is NULL, call
+    before destroying sim */
+void xm_prof_stop(xm_sim_t *sim, FILE *out);
@@ -0,0 +1,39 @@
+#pragma once
+
+/* Sampled simulation for libxmsim
+    Fast-forwards the whole run once, splitting it into fixed intervals, picks
+    a few representative intervals and simulates them in detailed mode
+    (XM_SIM_OPT_DETAILED) in parallel, then extrapolates the whole run from
+    them. */
+
+#include "xmsim.h"
+
+typedef enum {
+    XM_SAMPLE_UNIFORM, /* Evenly spread over the run */
+    XM_SAMPLE_BBV, /* k-means clusters of the intervals' basic block vectors */
+} xm_sample_select_t;
+
+typedef struct xm_sample_config {
+    unsigned long interval; /* Ticks per interval, 0 for a default */
+    unsigned long max_ticks; /* Length of the run, 0 until halt */
+    unsigned long warmup; /* Detailed ticks before each sample, not counted */
+    unsigned n_samples; /* At most this many detailed intervals, 0 for a default */
+    unsigned n_workers; /* Host threads, 0 for one */
+    xm_sample_select_t select;
+} xm_sample_config_t;
+
+typedef struct xm_sample_result {
+    unsigned long ticks; /* Length of the run */
+    unsigned n_intervals;
+    unsigned n_samples;
+    /* Whole run estimates */
+    unsigned long cycles;
+    double cpi;
+    double icache_miss_rate;
+    double dcache_miss_rate;
+    double b_mispredict_rate;
+} xm_sample_result_t;
+
+/* Runs sim to the end as xm_sim_run(sim, max_ticks) would, the log stays
+    silent meanwhile. Returns 0 on success, -1 otherwise. */
+int xm_sample_run(xm_sim_t *sim, const xm_sample_config_t *config, xm_sample_result_t *result);
@@ -0,0 +1,29 @@
+#pragma once
+
+/* M:N scheduler for libxmsim
+    Multiplexes any number of simulator instances (contexts) over a fixed pool
+    of worker threads. A context runs for a slice of guest ticks, then goes to
+    the back of its worker's queue; idle workers steal from the others.
+    Contexts created with XM_SIM_OPT_YIELD go to the back early whenever they
+    poll a device that has nothing for them yet. */
+
+#include "xmsim.h"
+
+typedef struct xm_sched xm_sched_t;
+
+/* Called on a worker thread once a context halts or runs out of ticks
+    (result is XM_SIM_CONTINUE then), the scheduler forgets about sim after,
+    so it may be spawned again from here */
+typedef void (*xm_sched_done_fn)(xm_sim_t *sim, xm_sim_result_t result, void *user);
+
+/* NULL on failure, n_workers 0 uses one, slice 0 uses a default */
+xm_sched_t *xm_sched_create(unsigned n_workers, unsigned long slice);
+/* Waits for every context, then stops the workers */
+void xm_sched_destroy(xm_sched_t *sched);
+
+/* Queues sim for execution for at most max_ticks ticks, 0 for no limit.
+    sim must not be touched by the caller until done is called. */
+int xm_sched_spawn(xm_sched_t *sched, xm_sim_t *sim, unsigned long max_ticks,
+    xm_sched_done_fn done, void *user);
+/* Blocks until all spawned contexts are done */
+void xm_sched_wait(xm_sched_t *sched);
@@ -0,0 +1,187 @@
+#pragma once
+
+/* libxmsim: embeddable XM simulator
+    Every instance is independent, so any number of them may live in the same
+    process, a single instance must only be driven from one thread at a time. */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stddef.h>
+
+#define XM_SIM_API_VERSION 8
+
+#define XM_SIM_RAM_BASE 0xF0000000
+#define XM_SIM_ROM_BASE 0x8000
+
+typedef struct xm_sim xm_sim_t;
+
+/* Options */
+#define XM_SIM_OPT_QUIET (1 << 0) /* No register dump after every step */
+#define XM_SIM_OPT_TEST (1 << 1)
+#define XM_SIM_OPT_TRACE_MEM (1 << 2) /* Log every memory access */
+#define XM_SIM_OPT_NO_IDIOM (1 << 3) /* Never batch copy/fill/scan loops */
+#define XM_SIM_OPT_DETAILED (1 << 4) /* Cache, branch predictor and cycle models */
+#define XM_SIM_OPT_SYSCALL (1 << 5) /* Service the syscall instruction on the host */
+#define XM_SIM_OPT_HEATMAP (1 << 6) /* Count accesses per page and cache line */
+/* Only count ticks, the other perf counters stay 0 and there's no
+    instruction log. Ignored with any of the tracing options, record/replay
+    or basic block vectors, and from the first time the guest touches a perf
+    control register on, so what it reads there is always right. */
+#define XM_SIM_OPT_BARE (1 << 7)
+#define XM_SIM_OPT_EXEC_PROFILE (1 << 8) /* Count executions per ROM word */
+/* xm_sim_run returns XM_SIM_CONTINUE early, right after an instruction that
+    polled a device with nothing ready yet, see xm_dev_wait */
+#define XM_SIM_OPT_YIELD (1 << 9)
+
+typedef struct xm_sim_config {
+    unsigned opt;
+    /* Bytes of RAM at XM_SIM_RAM_BASE, 0 for the default */
+    size_t ram_size;
+    /* Instruction log, memory traces and dumps, NULL to stay silent */
+    FILE *log;
+    /* Bytes per tick of the asynchronous DMA engine behind memcpy, memmov
+        and memset, 0 to run them synchronously */
+    unsigned dma_bandwidth;
+    /* Ticks per working set sample of XM_SIM_OPT_HEATMAP, 0 for a default */
+    unsigned long heat_interval;
+} xm_sim_config_t;
+
+typedef enum {
+    XM_SIM_CONTINUE,
+    XM_SIM_HALT,
+    XM_SIM_BREAK, /* Stopped by a breakpoint or watchpoint */
+    XM_SIM_FAULT, /* Stopped for good after a store into ROM */
+} xm_sim_result_t;
+
+typedef struct xm_sim_perf {
+    unsigned long ticks;
+    unsigned long b_misses;
+    unsigned long b_taken;
+    unsigned long jumps;
+    unsigned long reads;
+    unsigned long writes;
+    unsigned long stalls; /* Ticks spent waiting on DMA, included in ticks */
+} xm_sim_perf_t;
+
+/* Detailed mode statistics, cache accesses are per byte like the perf reads */
+typedef struct xm_sim_timing {
+    unsigned long insts;
+    unsigned long cycles;
+    unsigned long icache_accesses;
+    unsigned long icache_misses;
+    unsigned long dcache_accesses;
+    unsigned long dcache_misses;
+    unsigned long branches;
+    unsigned long b_mispredicts;
+} xm_sim_timing_t;
+
+/* NULL on allocation failure, config may be NULL for the defaults */
+xm_sim_t *xm_sim_create(const xm_sim_config_t *config);
+void xm_sim_destroy(xm_sim_t *sim);
+
+/* Maps the image at XM_SIM_ROM_BASE without copying it, the memory must stay
+    valid and unchanged for the lifetime of sim. ROM past the image reads as
+    0xff (halt), images larger than the ROM window are truncated. */
+void xm_sim_load_image(xm_sim_t *sim, const void *ptr, size_t len);
+/* Maps the file at path read-only and shared, for xm_sim_load_image. Sims
+    and processes loading the same file share one copy in the page cache and
+    nothing is read up front. NULL on failure. */
+const void *xm_sim_map_image(const char *path, size_t *len);
+void xm_sim_unmap_image(const void *image, size_t len);
+/* Symbols and source lines from the map xm_asm and xm_ld write next to an
+    image (<image>.map), for the instruction log, the reports and the two
+    below. Load the image first, a map of another image is refused. 0 on
+    success, -1 otherwise. */
+int xm_sim_load_map(xm_sim_t *sim, const char *path);
+/* addr as "label+0x10 file.S:12" like snprintf, whatever the map knows of
+    it, empty without one */
+int xm_sim_symbolize(const xm_sim_t *sim, uint32_t addr, char *buf, size_t len);
+/* Address of the label called name, 0 on success, -1 if there's none */
+int xm_sim_lookup(const xm_sim_t *sim, const char *name, uint32_t *addr);
+
+/* Executes up to ticks instructions, stops early on halt, breakpoints and
+    watchpoints */
+xm_sim_result_t xm_sim_run(xm_sim_t *sim, unsigned long ticks);
+/* Executes exactly one instruction */
+xm_sim_result_t xm_sim_step(xm_sim_t *sim);
+
+uint32_t xm_sim_get_pc(const xm_sim_t *sim);
+void xm_sim_set_pc(xm_sim_t *sim, uint32_t pc);
+uint32_t xm_sim_get_flags(const xm_sim_t *sim);
+uint32_t xm_sim_get_reg(const xm_sim_t *sim, unsigned r);
+void xm_sim_set_reg(xm_sim_t *sim, unsigned r, uint32_t v);
+float xm_sim_get_freg(const xm_sim_t *sim, unsigned r);
+void xm_sim_set_freg(xm_sim_t *sim, unsigned r, float v);
+
+/* Host side memory access, not counted in the perf counters. Returns the
+    number of bytes transferred, which is short when the range leaves ROM or
+    RAM. Writes into ROM are refused. */
+size_t xm_sim_read_mem(xm_sim_t *sim, uint32_t addr, void *buf, size_t len);
+size_t xm_sim_write_mem(xm_sim_t *sim, uint32_t addr, const void *buf, size_t len);
+
+void xm_sim_get_perf(const xm_sim_t *sim, xm_sim_perf_t *perf);
+/* Status the guest passed to the exit syscall, -1 if it didn't */
+int xm_sim_get_exit_status(const xm_sim_t *sim);
+/* All zero unless created with XM_SIM_OPT_DETAILED */
+void xm_sim_get_timing(const xm_sim_t *sim, xm_sim_timing_t *timing);
+/* Access heatmap of ROM and RAM, working set per interval and the hottest
+    cache lines, nothing unless created with XM_SIM_OPT_HEATMAP. Counts the
+    core's and the DMA engine's accesses byte by byte, loops aren't batched
+    meanwhile. */
+void xm_sim_heat_report(const xm_sim_t *sim, FILE *out);
+/* Execution profile for xm_asm -profile, nothing unless created with
+    XM_SIM_OPT_EXEC_PROFILE. A header line with the image length, then
+    "pc count taken" in hex and decimal for every ROM word executed, taken
+    being how often the next pc wasn't pc + 4. Loops aren't batched
+    meanwhile. 0 on success, -1 otherwise. */
+int xm_sim_exec_profile_write(const xm_sim_t *sim, FILE *out);
+/* Register dump into the log, unless XM_SIM_OPT_QUIET */
+void xm_sim_debug_print(xm_sim_t *sim);
+
+/* Record/replay
+    Recording logs a snapshot of the machine every interval ticks (0 for a
+    default) starting with the current state, plus every external input the
+    guest consumes. Replaying restores the first snapshot and feeds the logged
+    inputs back, reporting in the log if execution diverges. The log is tied to
+    the image and RAM size it was recorded with. Host side register and memory
+    writes aren't recorded, do them before xm_sim_record. All return 0 on
+    success, -1 otherwise. */
+int xm_sim_record(xm_sim_t *sim, const char *path, unsigned long interval);
+int xm_sim_replay(xm_sim_t *sim, const char *path);
+/* Replay only: restores the closest snapshot and runs up to tick */
+int xm_sim_seek(xm_sim_t *sim, unsigned long tick);
+/* Flushes and closes the log, also done by xm_sim_destroy */
+void xm_sim_rr_stop(xm_sim_t *sim);
+
+/* Breakpoints and watchpoints
+    xm_sim_run stops before executing the instruction at a breakpoint, and
+    after one that read or wrote a watched byte. Running again resumes past
+    the breakpoint. Only the core's own loads and stores are watched, not
+    DMA engine transfers, syscalls or host side accesses. Nothing is checked
+    while none is set. All return 0 on success, -1 otherwise. */
+#define XM_SIM_WATCH_R (1 << 0)
+#define XM_SIM_WATCH_W (1 << 1)
+int xm_sim_break_set(xm_sim_t *sim, uint32_t pc);
+int xm_sim_break_clear(xm_sim_t *sim, uint32_t pc);
+/* access is XM_SIM_WATCH_R, XM_SIM_WATCH_W or both */
+int xm_sim_watch_set(xm_sim_t *sim, uint32_t addr, uint32_t len, unsigned access);
+/* Removes the watchpoint set with the same addr and len */
+int xm_sim_watch_clear(xm_sim_t *sim, uint32_t addr, uint32_t len);
+
+typedef struct xm_sim_break {
+    uint32_t pc;
+    uint32_t addr; /* First watched byte accessed */
+    unsigned access; /* XM_SIM_WATCH_*, 0 for a breakpoint */
+} xm_sim_break_t;
+/* What made the last xm_sim_run return XM_SIM_BREAK */
+void xm_sim_get_break(const xm_sim_t *sim, xm_sim_break_t *brk);
+
+/* Store into ROM by the core or the DMA engine. The byte is dropped, the
+    instruction finishes and every xm_sim_run returns XM_SIM_FAULT from then
+    on. */
+typedef struct xm_sim_fault {
+    uint32_t pc;
+    uint32_t addr;
+} xm_sim_fault_t;
+/* 0 and fills fault once sim faulted, -1 before */
+int xm_sim_get_fault(const xm_sim_t *sim, xm_sim_fault_t *fault);